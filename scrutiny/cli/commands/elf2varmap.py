@@ -29,12 +29,15 @@ class Elf2VarMap(BaseCommand):
         self.parser.add_argument('file', help='The ELF file to read')
         self.parser.add_argument('--cppfilt', default=None, help='The path to the c++filt used demangler when parsing a binary produced by GCC')
         self.parser.add_argument('--output', default=None, help='The varmap output file. Will go to STDOUT if not set')
+        self.parser.add_argument('--jobs', type=int, default=1, help='Number of processes used to parse the debug symbols. 0 uses all CPUs. Default: 1')
+        self.parser.add_argument('--cache-dir', default=None, help='Folder where the variables of each compile unit are kept to speed up the next run')
 
     def run(self) -> Optional[int]:
         from scrutiny.core.bintools.elf_dwarf_var_extractor import ElfDwarfVarExtractor
 
         args = self.parser.parse_args(self.args)
-        extractor = ElfDwarfVarExtractor(args.file, cppfilt=args.cppfilt)
+        jobs = args.jobs if args.jobs > 0 else (os.cpu_count() or 1)
+        extractor = ElfDwarfVarExtractor(args.file, cppfilt=args.cppfilt, jobs=jobs, cache_dir=args.cache_dir)
         varmap = extractor.get_varmap()
 
         if args.output is None:
@@ -13,6 +13,7 @@ import hashlib
 import mmap
 import os
 import logging
+import concurrent.futures
 from binascii import hexlify
 
 from .base_command import BaseCommand
@@ -25,7 +26,6 @@ class GetFirmwareId(BaseCommand):
     _group_ = 'Build Toochain'
 
     DEFAULT_NAME = 'firmwareid'
-    BUF_SIZE = 0x10000
 
     args: List[str]
     parser: argparse.ArgumentParser
@@ -33,41 +33,61 @@ class GetFirmwareId(BaseCommand):
     def __init__(self, args: List[str], requested_log_level: Optional[str] = None):
         self.args = args
         self.parser = argparse.ArgumentParser(prog=self.get_prog())
-        self.parser.add_argument('filename', help='The binary fimware to read')
-        self.parser.add_argument('--output', default=None, help='The output path of the firmwareid file')
+        self.parser.add_argument('filename', nargs='+', help='The binary fimware to read. Many files can be given to process them in batch')
+        self.parser.add_argument('--output', default=None,
+                                 help='The output path of the firmwareid file. With many files, a folder where <filename>.firmwareid files are written')
         self.parser.add_argument('--apply', action='store_true',
                                  help='When set, tag the firmware binary file with the new firmware-id hash by replacing the compiled placeholder.')
+        self.parser.add_argument('--jobs', type=int, default=0, help='Number of files processed at the same time in batch mode. 0 uses all CPUs')
 
     def run(self) -> Optional[int]:
-        import scrutiny.core.firmware_id as firmware_id
-
         args = self.parser.parse_args(self.args)
-        filename = os.path.normpath(args.filename)
+        filenames = [os.path.normpath(filename) for filename in args.filename]
+
+        if len(filenames) == 1:
+            self.process_single_file(filenames[0], args.output, args.apply)
+            return 0
+
+        if args.output is not None:
+            if not os.path.isdir(args.output):
+                raise Exception('--output must be an existing folder when many files are given')
+
+            # Output files are named after the input file name. Two inputs with the same name would write the same file
+            basenames = [os.path.basename(filename) for filename in filenames]
+            duplicates = sorted(set([basename for basename in basenames if basenames.count(basename) > 1]))
+            if len(duplicates) > 0:
+                raise Exception('Many input files have the same name. Their output files would collide: %s' % ', '.join(duplicates))
+
+        jobs = args.jobs if args.jobs > 0 else (os.cpu_count() or 1)
+        error_count = 0
+        # Threads are enough. hashlib releases the GIL while hashing and the files are memory mapped
+        with concurrent.futures.ThreadPoolExecutor(max_workers=min(jobs, len(filenames))) as executor:
+            futures = [executor.submit(self.compute_firmware_id, filename, args.apply) for filename in filenames]
+            for filename, future in zip(filenames, futures):
+                try:
+                    thehash_str = hexlify(future.result()).decode('ascii')
+                except Exception as e:
+                    logging.error('%s: %s' % (filename, str(e)))
+                    error_count += 1
+                    continue
+
+                if args.output is None:
+                    print('%s  %s' % (thehash_str, filename), flush=True)
+                else:
+                    with open(os.path.join(args.output, '%s.%s' % (os.path.basename(filename), self.DEFAULT_NAME)), 'w') as f:
+                        f.write(thehash_str)
 
-        if args.output is None:
+        return 0 if error_count == 0 else 1
+
+    def process_single_file(self, filename: str, output: Optional[str], apply: bool) -> None:
+        if output is None:
             output_file = None
-        elif os.path.isdir(args.output):
-            output_file = os.path.join(args.output, self.DEFAULT_NAME)
+        elif os.path.isdir(output):
+            output_file = os.path.join(output, self.DEFAULT_NAME)
         else:
-            output_file = args.output
-
-        with open(filename, "rb") as f:
-            s = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
-            pos = s.find(firmware_id.PLACEHOLDER);
-            if pos == -1:
-                raise Exception(
-                    "Binary file does not contains Scrutiny placeholder. Either it is already tagged or the file hasn't been compiled with a full scrutiny-lib")
-
-            logging.debug('Found scrutiny placeholder at address 0x%08x' % pos)
-            sha256 = hashlib.sha256()
-            while True:
-                data = f.read(self.BUF_SIZE)
-                if not data:
-                    break
-                sha256.update(data)
-            hash256 = bytes.fromhex(sha256.hexdigest())
-            thehash_bin = bytes([a ^ b for a, b in zip(hash256[0:16], hash256[16:32])])    # Reduces from 256 to 128 bits
-            thehash_str = hexlify(thehash_bin).decode('ascii')
+            output_file = output
+
+        thehash_str = hexlify(self.compute_firmware_id(filename, apply)).decode('ascii')
 
         if output_file is None:
             print(thehash_str, flush=True, end='')
@@ -75,10 +95,28 @@ class GetFirmwareId(BaseCommand):
             with open(output_file, 'w') as f:
                 f.write(thehash_str)
 
-        if args.apply:
-            with open(filename, "rb+") as f:
-                f.seek(pos)
-                f.write(thehash_bin)
-                logging.debug('Wrote new hash %s at address 0x%08x' % (thehash_str, pos))
+    @classmethod
+    def compute_firmware_id(cls, filename: str, apply: bool) -> bytes:
+        """
+        Hash the binary and optionally write the hash in place of the placeholder.
+        The file is opened and memory mapped once. The hash is computed on the mapping directly without copy.
+        """
+        import scrutiny.core.firmware_id as firmware_id
+
+        with open(filename, "rb+" if apply else "rb") as f:
+            with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_WRITE if apply else mmap.ACCESS_READ) as s:
+                pos = s.find(firmware_id.PLACEHOLDER)
+                if pos == -1:
+                    raise Exception(
+                        "Binary file does not contains Scrutiny placeholder. Either it is already tagged or the file hasn't been compiled with a full scrutiny-lib")
+
+                logging.debug('Found scrutiny placeholder at address 0x%08x' % pos)
+                hash256 = hashlib.sha256(s).digest()
+                thehash_bin = bytes([a ^ b for a, b in zip(hash256[0:16], hash256[16:32])])    # Reduces from 256 to 128 bits
+
+                if apply:
+                    s[pos:pos + len(thehash_bin)] = thehash_bin
+                    s.flush()
+                    logging.debug('Wrote new hash %s at address 0x%08x' % (hexlify(thehash_bin).decode('ascii'), pos))
 
-        return 0
+        return thehash_bin
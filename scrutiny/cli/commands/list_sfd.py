@@ -56,10 +56,10 @@ class ListSFD(BaseCommand):
 
         sfd_list: List[PrintableSFDEntry] = []
         args = self.parser.parse_args(self.args)
-        firmware_id_list = SFDStorage.list()
-        for firmware_id in firmware_id_list:
+        metadata_dict = SFDStorage.list_metadata()
+        for firmware_id in metadata_dict:
             try:
-                metadata = SFDStorage.get_metadata(firmware_id)
+                metadata = metadata_dict[firmware_id]
                 entry = PrintableSFDEntry()
                 entry.firmware_id = firmware_id
                 entry.create_time = metadata['generation_info']['time']
@@ -25,12 +25,15 @@ class MakeSFD(BaseCommand):
         self.parser.add_argument('folder', help='Folder containing the firmware description files.')
         self.parser.add_argument('output', help='Destination file')
         self.parser.add_argument('--install', action="store_true", help='Install the firmwre info file after making it')
+        self.parser.add_argument('--binary-varmap', action="store_true",
+                                 help='Include a binary varmap in the SFD for faster loading of firmwares with a large number of variables')
 
     def run(self) -> Optional[int]:
         from scrutiny.core.firmware_description import FirmwareDescription
         from scrutiny.core.sfd_storage import SFDStorage
         args = self.parser.parse_args(self.args)
         sfd = FirmwareDescription(args.folder)
+        sfd.set_binary_varmap(args.binary_varmap)
         sfd.write(args.output)
 
         if args.install:
@@ -0,0 +1,292 @@
+#    binary_varmap.py
+#        Compact binary representation of a VarMap. Path segments are interned in a string
+#        table and variables are stored in a fixed-width table sorted by name so that the
+#        content can be used directly from a memory mapped file without parsing it first.
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import struct
+import json
+import bisect
+from collections.abc import Mapping
+
+from scrutiny.core.variable import Endianness, VariableType, VariableEnumDef
+
+from typing import Dict, List, Tuple, Any, Iterator, Union, TYPE_CHECKING
+
+if TYPE_CHECKING:
+    from scrutiny.core.varmap import VariableEntry, TypeEntry
+
+BufferType = Union[bytes, bytearray, memoryview, Any]   # Any: mmap.mmap
+
+
+class BinaryVarMapFormat:
+    """
+    Layout of a binary varmap. Everything is little endian, all tables are fixed width.
+
+    [Header]
+    [String table]      : (offset, length) of each string in the string data
+    [String data]       : utf-8 encoded strings, not null terminated
+    [Path table]        : (start, count) in the segment array for each unique path
+    [Segment array]     : String index of each path segment
+    [Type table]        : (type_id, name string index, VariableType value)
+    [Variable table]    : One record per variable, sorted by fullname
+    [Enums]             : JSON encoded enums. There is usually only a few of them.
+    """
+    MAGIC = b'SVMB'
+    VERSION = 1
+
+    HEADER = struct.Struct('<4sHBB' + 'L' * 16)
+    STRING_ENTRY = struct.Struct('<LL')
+    PATH_ENTRY = struct.Struct('<LL')
+    SEGMENT_ENTRY = struct.Struct('<L')
+    TYPE_ENTRY = struct.Struct('<LLB3x')
+    VAR_ENTRY = struct.Struct('<LLLLQBB6x')
+
+    NONE_U8 = 0xFF
+    NONE_U32 = 0xFFFFFFFF
+
+    ENDIANNESS_TO_INT: Dict[Endianness, int] = {
+        Endianness.Little: 0,
+        Endianness.Big: 1
+    }
+
+    INT_TO_ENDIANNESS: Dict[int, Endianness] = {
+        0: Endianness.Little,
+        1: Endianness.Big
+    }
+
+
+def is_binary_varmap(data: BufferType) -> bool:
+    return len(data) >= len(BinaryVarMapFormat.MAGIC) and bytes(data[0:len(BinaryVarMapFormat.MAGIC)]) == BinaryVarMapFormat.MAGIC
+
+
+def encode_binary_varmap(endianness: Endianness, typemap: Dict[str, "TypeEntry"], variables: "Mapping[str, VariableEntry]", enums: Dict[str, VariableEnumDef]) -> bytes:
+    fmt = BinaryVarMapFormat
+    strings: List[bytes] = []
+    string_index_map: Dict[str, int] = {}
+    paths: List[Tuple[int, ...]] = []
+    path_index_map: Dict[Tuple[str, ...], int] = {}
+
+    def intern_string(s: str) -> int:
+        if s not in string_index_map:
+            string_index_map[s] = len(strings)
+            strings.append(s.encode('utf8'))
+        return string_index_map[s]
+
+    def intern_path(segments: Tuple[str, ...]) -> int:
+        if segments not in path_index_map:
+            path_index_map[segments] = len(paths)
+            paths.append(tuple([intern_string(segment) for segment in segments]))
+        return path_index_map[segments]
+
+    # Variables are sorted by name so that a lookup can be done with a binary search directly in the file.
+    var_records: List[bytes] = []
+    for fullname in sorted(variables.keys()):
+        vardef = variables[fullname]
+        pieces = fullname.split('/')
+        var_records.append(fmt.VAR_ENTRY.pack(
+            intern_path(tuple(pieces[0:-1])),
+            intern_string(pieces[-1]),
+            int(vardef['type_id']),
+            int(vardef['enum_id']) if 'enum_id' in vardef else fmt.NONE_U32,
+            vardef['addr'],
+            vardef['bitoffset'] if 'bitoffset' in vardef else fmt.NONE_U8,
+            vardef['bitsize'] if 'bitsize' in vardef else fmt.NONE_U8
+        ))
+
+    type_records: List[bytes] = []
+    for type_id in typemap:
+        type_records.append(fmt.TYPE_ENTRY.pack(int(type_id), intern_string(typemap[type_id]['name']), VariableType[typemap[type_id]['type']].value))
+
+    string_table = bytearray()
+    string_data = bytearray()
+    for encoded_string in strings:
+        string_table += fmt.STRING_ENTRY.pack(len(string_data), len(encoded_string))
+        string_data += encoded_string
+
+    path_table = bytearray()
+    segment_array = bytearray()
+    segment_count = 0
+    for path in paths:
+        path_table += fmt.PATH_ENTRY.pack(segment_count, len(path))
+        for string_index in path:
+            segment_array += fmt.SEGMENT_ENTRY.pack(string_index)
+        segment_count += len(path)
+
+    enums_data = json.dumps(enums).encode('utf8')
+
+    string_table_offset = fmt.HEADER.size
+    string_data_offset = string_table_offset + len(string_table)
+    path_table_offset = string_data_offset + len(string_data)
+    segment_array_offset = path_table_offset + len(path_table)
+    type_table_offset = segment_array_offset + len(segment_array)
+    var_table_offset = type_table_offset + len(type_records) * fmt.TYPE_ENTRY.size
+    enums_offset = var_table_offset + len(var_records) * fmt.VAR_ENTRY.size
+
+    header = fmt.HEADER.pack(
+        fmt.MAGIC, fmt.VERSION, fmt.ENDIANNESS_TO_INT[endianness], 0,
+        len(strings), string_table_offset, string_data_offset, len(string_data),
+        len(paths), path_table_offset, segment_array_offset, segment_count,
+        len(type_records), type_table_offset,
+        len(var_records), var_table_offset,
+        enums_offset, len(enums_data),
+        0, 0    # Reserved
+    )
+
+    return b''.join([header, string_table, string_data, path_table, segment_array, b''.join(type_records), b''.join(var_records), enums_data])
+
+
+class BinaryVariableTable(Mapping):
+    """
+    Read-only dict-like access to the variable table of a binary varmap.
+    Nothing is decoded in advance. Lookups by name are done with a binary search in the sorted table.
+    """
+
+    buffer: BufferType
+    var_count: int
+    var_table_offset: int
+    string_cache: Dict[int, str]
+    path_cache: Dict[int, str]
+
+    def __init__(self, buffer: BufferType, header: Tuple[Any, ...]):
+        self.buffer = buffer
+        (_, _, _, _,
+         self.string_count, self.string_table_offset, self.string_data_offset, self.string_data_size,
+         self.path_count, self.path_table_offset, self.segment_array_offset, self.segment_count,
+         self.type_count, self.type_table_offset,
+         self.var_count, self.var_table_offset,
+         self.enums_offset, self.enums_size, _, _) = header
+        self.string_cache = {}
+        self.path_cache = {}
+
+    def get_string(self, index: int) -> str:
+        if index not in self.string_cache:
+            if index >= self.string_count:
+                raise IndexError('String index %d out of range' % index)
+            offset, length = BinaryVarMapFormat.STRING_ENTRY.unpack_from(
+                self.buffer, self.string_table_offset + index * BinaryVarMapFormat.STRING_ENTRY.size)
+            start = self.string_data_offset + offset
+            self.string_cache[index] = bytes(self.buffer[start:start + length]).decode('utf8')
+        return self.string_cache[index]
+
+    def get_path_prefix(self, path_index: int) -> str:
+        # Returns the path part of a fullname, including the trailing slash.
+        if path_index not in self.path_cache:
+            if path_index >= self.path_count:
+                raise IndexError('Path index %d out of range' % path_index)
+            start, count = BinaryVarMapFormat.PATH_ENTRY.unpack_from(
+                self.buffer, self.path_table_offset + path_index * BinaryVarMapFormat.PATH_ENTRY.size)
+            segments = []
+            for i in range(count):
+                string_index, = BinaryVarMapFormat.SEGMENT_ENTRY.unpack_from(
+                    self.buffer, self.segment_array_offset + (start + i) * BinaryVarMapFormat.SEGMENT_ENTRY.size)
+                segments.append(self.get_string(string_index))
+            self.path_cache[path_index] = ''.join([segment + '/' for segment in segments])
+        return self.path_cache[path_index]
+
+    def read_record(self, index: int) -> Tuple[int, ...]:
+        return BinaryVarMapFormat.VAR_ENTRY.unpack_from(self.buffer, self.var_table_offset + index * BinaryVarMapFormat.VAR_ENTRY.size)
+
+    def get_fullname(self, index: int) -> str:
+        path_index, name_index, _, _, _, _, _ = self.read_record(index)
+        return self.get_path_prefix(path_index) + self.get_string(name_index)
+
+    def find(self, fullname: str) -> int:
+        lo = 0
+        hi = self.var_count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.get_fullname(mid) < fullname:
+                lo = mid + 1
+            else:
+                hi = mid
+
+        if lo < self.var_count and self.get_fullname(lo) == fullname:
+            return lo
+        return -1
+
+    def make_entry(self, index: int) -> "VariableEntry":
+        fmt = BinaryVarMapFormat
+        _, _, type_id, enum_id, addr, bitoffset, bitsize = self.read_record(index)
+        entry: "VariableEntry" = {
+            'type_id': str(type_id),
+            'addr': addr
+        }
+
+        if bitoffset != fmt.NONE_U8:
+            entry['bitoffset'] = bitoffset
+
+        if bitsize != fmt.NONE_U8:
+            entry['bitsize'] = bitsize
+
+        if enum_id != fmt.NONE_U32:
+            entry['enum_id'] = enum_id
+
+        return entry
+
+    def __getitem__(self, fullname: str) -> "VariableEntry":
+        index = self.find(fullname)
+        if index < 0:
+            raise KeyError(fullname)
+        return self.make_entry(index)
+
+    def __contains__(self, fullname: object) -> bool:
+        if not isinstance(fullname, str):
+            return False
+        return self.find(fullname) >= 0
+
+    def __iter__(self) -> Iterator[str]:
+        for i in range(self.var_count):
+            yield self.get_fullname(i)
+
+    def __len__(self) -> int:
+        return self.var_count
+
+
+class BinaryVarMapReader:
+    """
+    Parse the header of a binary varmap and gives access to its content.
+    Only the type map and the enums are decoded right away. They are small.
+    """
+
+    endianness: Endianness
+    typemap: Dict[str, "TypeEntry"]
+    enums: Dict[str, VariableEnumDef]
+    variables: BinaryVariableTable
+
+    def __init__(self, buffer: BufferType):
+        fmt = BinaryVarMapFormat
+        if len(buffer) < fmt.HEADER.size:
+            raise ValueError('Binary varmap is too small')
+
+        header = fmt.HEADER.unpack_from(buffer, 0)
+        magic, version, endianness = header[0:3]
+        if magic != fmt.MAGIC:
+            raise ValueError('Not a binary varmap')
+
+        if version != fmt.VERSION:
+            raise ValueError('Unsupported binary varmap version %d' % version)
+
+        if endianness not in fmt.INT_TO_ENDIANNESS:
+            raise ValueError('Unknown endianness %d' % endianness)
+
+        self.endianness = fmt.INT_TO_ENDIANNESS[endianness]
+        self.variables = BinaryVariableTable(buffer, header)
+
+        if self.variables.enums_offset + self.variables.enums_size > len(buffer):
+            raise ValueError('Binary varmap is truncated')
+
+        self.typemap = {}
+        for i in range(self.variables.type_count):
+            type_id, name_index, vartype = fmt.TYPE_ENTRY.unpack_from(buffer, self.variables.type_table_offset + i * fmt.TYPE_ENTRY.size)
+            self.typemap[str(type_id)] = {
+                'name': self.variables.get_string(name_index),
+                'type': VariableType(vartype).name
+            }
+
+        enums_start = self.variables.enums_offset
+        self.enums = json.loads(bytes(buffer[enums_start:enums_start + self.variables.enums_size]).decode('utf8'))
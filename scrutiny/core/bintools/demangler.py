@@ -8,7 +8,12 @@
 
 import subprocess
 import shutil
+import os
 import abc
+import re
+import logging
+
+from typing import Dict, List, Optional
 
 
 class BaseDemangler(abc.ABC):
@@ -18,38 +23,103 @@ class BaseDemangler(abc.ABC):
     def get_error(self) -> str:
         return "virtual class"
 
+    def get_identity(self) -> str:
+        """Identifies what produces the demangled names. Used to invalidate cached results"""
+        return self.__class__.__name__
+
     def demangle(self, mangler: str) -> str:
         raise NotImplementedError('Trying to demangle with base class')
 
 
 class GccDemangler(BaseDemangler):
+    """
+    Demangle with GCC c++filt. A single c++filt process is started on the first call and
+    names are streamed through it, one per line. Results are cached.
+    """
 
     _default_binary_name: str = "c++filt"
 
     binary_name: str
     error_details: str
+    process: Optional["subprocess.Popen[str]"]
+    cache: Dict[str, str]
+    _can_run: Optional[bool]
 
     def __init__(self, binary_name=_default_binary_name):
         if binary_name is None:
             binary_name = self._default_binary_name
         self.binary_name = binary_name
         self.error_details = ""
+        self.process = None
+        self.cache = {}
+        self._can_run = None
+        self.logger = logging.getLogger(self.__class__.__name__)
 
     def can_run(self) -> bool:
-        can_run = True
-        if shutil.which(self.binary_name) is None:
-            can_run = False
-            self.error_details = 'Demangler binary "%s" is not in the path' % self.binary_name
+        if self._can_run is None:
+            self._can_run = True
+            if shutil.which(self.binary_name) is None:
+                self._can_run = False
+                self.error_details = 'Demangler binary "%s" is not in the path' % self.binary_name
 
-        return can_run
+        return self._can_run
 
     def get_error(self) -> str:
         return self.error_details
 
+    def get_identity(self) -> str:
+        binary_path = shutil.which(self.binary_name)
+        return '%s:%s' % (self.__class__.__name__, os.path.realpath(binary_path) if binary_path is not None else self.binary_name)
+
+    def get_args(self) -> List[str]:
+        return [self.binary_name, '--format', 'gnu-v3', '-n']
+
     def demangle(self, mangled: str) -> str:
+        if mangled in self.cache:
+            return self.cache[mangled]
+
         if not self.can_run():
             raise Exception('Cannot run demangler. %s' % self.get_error())
 
-        self.process = subprocess.Popen([self.binary_name, '--format', 'gnu-v3', '-n'],
-                                        stdout=subprocess.PIPE, stdin=subprocess.PIPE, universal_newlines=True)
-        return self.process.communicate(input=mangled)[0]
+        demangled = None
+        if re.search(r'\s', mangled) is None:    # c++filt works line by line and splits words.
+            demangled = self.demangle_streamed(mangled)
+
+        if demangled is None:
+            demangled = self.demangle_single(mangled)
+
+        self.cache[mangled] = demangled
+        return demangled
+
+    def demangle_streamed(self, mangled: str) -> Optional[str]:
+        try:
+            if self.process is None:
+                self.process = subprocess.Popen(self.get_args(), stdout=subprocess.PIPE, stdin=subprocess.PIPE, universal_newlines=True)
+
+            assert self.process.stdin is not None
+            assert self.process.stdout is not None
+            self.process.stdin.write(mangled + '\n')
+            self.process.stdin.flush()
+            line = self.process.stdout.readline()
+            if not line.endswith('\n'):
+                raise Exception('Demangler process stopped responding')
+            return line[:-1]
+        except Exception as e:
+            self.logger.warning('Cannot use the persistent demangler process. %s' % str(e))
+            self.close()
+            return None
+
+    def demangle_single(self, mangled: str) -> str:
+        process = subprocess.Popen(self.get_args(), stdout=subprocess.PIPE, stdin=subprocess.PIPE, universal_newlines=True)
+        return process.communicate(input=mangled)[0]
+
+    def close(self) -> None:
+        if self.process is not None:
+            try:
+                self.process.communicate(timeout=1)   # Closes stdin. c++filt exits on end of file
+            except Exception:
+                self.process.kill()
+            self.process = None
+
+    def __del__(self) -> None:
+        self.close()
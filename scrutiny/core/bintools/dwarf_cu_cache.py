@@ -0,0 +1,174 @@
+#    dwarf_cu_cache.py
+#        Keeps the variables extracted from each compile unit of a binary so that they can be
+#        reused when the same compile unit is found in a later build.
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import os
+import time
+import bisect
+import hashlib
+import logging
+
+import scrutiny
+from scrutiny.core import VarMap, Endianness
+
+from typing import Dict, Optional, Any, List, Tuple, Set
+
+
+class DwarfCuCache:
+    """
+    Stores the partial VarMap extracted from a single compile unit, indexed by a hash of the DWARF
+    data of that compile unit: its bytes in .debug_info, its abbreviation table and its display name.
+    The demangler is part of the key too, as it produces the variable names.
+
+    Addresses are part of .debug_info, so a compile unit is reused only if its variables did not move.
+    Names are mostly stored in other sections (.debug_str, .debug_line_str) and referenced by offset, so the same
+    bytes can mean different names. The content of every string referenced by the compile unit is hashed as well.
+    Same goes for the compile units it references with DW_FORM_ref_addr: their content is part of the key.
+
+    Every build adds entries for the compile units that changed. prune() deletes the entries not used for
+    max_age seconds, then the least recently used ones until the cache fits in max_size bytes.
+    """
+
+    VERSION = 2     # Increase when the extraction logic changes the content of the partial VarMaps
+
+    # Forms that give a string stored outside of .debug_info. pyelftools resolves them to the string itself.
+    STRING_FORMS = set([
+        'DW_FORM_strp', 'DW_FORM_line_strp', 'DW_FORM_strp_sup', 'DW_FORM_GNU_strp_alt', 'DW_FORM_GNU_str_index',
+        'DW_FORM_strx', 'DW_FORM_strx1', 'DW_FORM_strx2', 'DW_FORM_strx3', 'DW_FORM_strx4'
+    ])
+    CROSS_CU_REF_FORMS = set(['DW_FORM_ref_addr'])
+    EXTENSION = '.varmap'
+    DEFAULT_MAX_SIZE = 256 * 1024 * 1024
+    DEFAULT_MAX_AGE = 30 * 24 * 3600
+
+    folder: str
+    logger: logging.Logger
+    max_size: int
+    max_age: float
+
+    def __init__(self, folder: str, max_size: int = DEFAULT_MAX_SIZE, max_age: float = DEFAULT_MAX_AGE):
+        self.folder = folder
+        self.logger = logging.getLogger(self.__class__.__name__)
+        self.max_size = max_size
+        self.max_age = max_age
+        os.makedirs(self.folder, exist_ok=True)
+
+    def make_keys(self, dwarfinfo: Any, cu_name_map: Dict[int, str], endianness: Endianness, demangler_id: str) -> Dict[int, str]:
+        """
+        Returns a key for each compile unit, indexed by the compile unit offset.
+        """
+        cu_list = list(dwarfinfo.iter_CUs())
+
+        # Abbreviation tables have no size field. Each one ends where the next one starts.
+        abbrev_offsets = sorted(set([cu['debug_abbrev_offset'] for cu in cu_list]))
+        abbrev_end: Dict[int, int] = {}
+        for i in range(len(abbrev_offsets)):
+            abbrev_end[abbrev_offsets[i]] = abbrev_offsets[i + 1] if i + 1 < len(abbrev_offsets) else dwarfinfo.debug_abbrev_sec.size
+
+        cu_offsets = sorted([cu.cu_offset for cu in cu_list])
+
+        # Content of each compile unit on its own, then combined with the content of every compile unit it depends on.
+        content_hashes: Dict[int, bytes] = {}
+        references: Dict[int, Set[int]] = {}
+        for cu in cu_list:
+            abbrev_offset = cu['debug_abbrev_offset']
+            h = hashlib.sha256()
+            header = '%s|%d|%s|%s|%s|' % (scrutiny.__version__, self.VERSION, endianness.name, demangler_id, cu_name_map[cu.cu_offset])
+            h.update(header.encode('utf8'))
+            h.update(self.read_section(dwarfinfo.debug_info_sec, cu.cu_offset, cu.size))
+            h.update(self.read_section(dwarfinfo.debug_abbrev_sec, abbrev_offset, abbrev_end[abbrev_offset] - abbrev_offset))
+            references[cu.cu_offset] = set()
+            for die in cu.iter_DIEs():
+                for attr in die.attributes.values():
+                    if attr.form in self.STRING_FORMS:
+                        value = attr.value.encode('utf8') if isinstance(attr.value, str) else bytes(attr.value)
+                        h.update(b'%d|' % len(value))
+                        h.update(value)
+                    elif attr.form in self.CROSS_CU_REF_FORMS:
+                        index = bisect.bisect_right(cu_offsets, attr.value) - 1
+                        if index >= 0 and cu_offsets[index] != cu.cu_offset:
+                            references[cu.cu_offset].add(cu_offsets[index])
+            content_hashes[cu.cu_offset] = h.digest()
+
+        keys: Dict[int, str] = {}
+        for cu in cu_list:
+            h = hashlib.sha256(content_hashes[cu.cu_offset])
+            for cu_offset in sorted(self.get_dependencies(cu.cu_offset, references)):
+                h.update(content_hashes[cu_offset])
+            keys[cu.cu_offset] = h.hexdigest()
+
+        return keys
+
+    def get_dependencies(self, cu_offset: int, references: Dict[int, Set[int]]) -> Set[int]:
+        # All compile units reachable through references, without the compile unit itself.
+        dependencies: Set[int] = set()
+        to_visit = list(references[cu_offset])
+        while len(to_visit) > 0:
+            offset = to_visit.pop()
+            if offset not in dependencies and offset != cu_offset:
+                dependencies.add(offset)
+                to_visit.extend(references.get(offset, set()))
+        return dependencies
+
+    def read_section(self, section: Any, offset: int, size: int) -> bytes:
+        section.stream.seek(offset)
+        return section.stream.read(size)
+
+    def get_filename(self, key: str) -> str:
+        return os.path.join(self.folder, key + self.EXTENSION)
+
+    def get(self, key: str) -> Optional[VarMap]:
+        filename = self.get_filename(key)
+        if not os.path.isfile(filename):
+            return None
+
+        try:
+            varmap = VarMap(filename)
+            os.utime(filename)  # Modification time tells when the entry was last used. Access time is often not updated
+            return varmap
+        except Exception as e:
+            self.logger.warning('Ignoring bad cache entry %s. %s' % (filename, str(e)))
+            return None
+
+    def put(self, key: str, varmap: VarMap) -> None:
+        # JSON keeps the variables in extraction order, which the merge relies on to give the same ids as a full extraction.
+        # Atomic replace so that a concurrent build never reads a partial file.
+        filename = self.get_filename(key)
+        tempname = filename + '.tmp%d' % os.getpid()
+        varmap.write(tempname)
+        os.replace(tempname, filename)
+
+    def prune(self) -> None:
+        now = time.time()
+        entries: List[Tuple[float, int, str]] = []  # (mtime, size, filename)
+        with os.scandir(self.folder) as it:
+            for direntry in it:
+                # Temporary files are left behind by interrupted builds
+                if not direntry.is_file() or not (direntry.name.endswith(self.EXTENSION) or (self.EXTENSION + '.tmp') in direntry.name):
+                    continue
+                try:
+                    stat = direntry.stat()
+                except OSError:
+                    continue    # Removed by a concurrent build
+                entries.append((stat.st_mtime, stat.st_size, direntry.path))
+
+        entries.sort()  # Oldest first
+        total_size = sum([size for mtime, size, filename in entries])
+        removed = 0
+        for mtime, size, filename in entries:
+            if now - mtime <= self.max_age and total_size <= self.max_size:
+                break
+            try:
+                os.remove(filename)
+                removed += 1
+            except OSError as e:
+                self.logger.debug('Cannot remove %s. %s' % (filename, str(e)))
+            total_size -= size
+
+        if removed > 0:
+            self.logger.debug('Removed %d entries from the cache' % removed)
@@ -12,13 +12,27 @@ import os
 import sys
 from enum import Enum
 from .demangler import GccDemangler
+from .dwarf_cu_cache import DwarfCuCache
 import logging
 import re
 import json
+import multiprocessing
 
 from scrutiny.core import *
 from scrutiny.exceptions import EnvionmentNotSetUpException
 
+from typing import NamedTuple, Tuple, Optional
+
+
+class StructLayoutEntry(NamedTuple):
+    """A leaf member of a struct, with its offset relative to the beginning of the outermost struct"""
+    path_suffix: Tuple[str, ...]    # Names of the nested structs between the outermost struct and the member
+    name: str
+    byte_offset: int
+    original_type_name: str
+    bitoffset: Optional[int]
+    bitsize: Optional[int]
+
 
 class CuName:
     """
@@ -68,6 +82,7 @@ class ElfDwarfVarExtractor:
     GLOBAL = 'global'
     MAX_CU_DISPLAY_NAME_LENGTH = 40
     DW_OP_ADDR = 3
+    CHUNKS_PER_JOB = 4  # More chunks than workers so that a slow chunk does not leave the other workers idle
 
     class DwarfEncoding(Enum):
         DW_ATE_address = 0x1
@@ -89,24 +104,31 @@ class ElfDwarfVarExtractor:
         DW_ATE_lo_user = 0x80
         DW_ATE_hi_user = 0xff
 
-    def __init__(self, filename=None, cppfilt=None):
-        self.varmap = VarMap()    # This is what we want to generate.
-        self.die2typeid_map = {}
-        self.die2vartype_map = {}
-        self.cu_name_map = {}   # maps a CompileUnit object to it's unique display name
-        self.enum_die_map = {}
-        self.struct_die_map = {}
+    def __init__(self, filename=None, cppfilt=None, jobs=1, cache_dir=None):
+        self.cu_name_map = {}   # maps a CompileUnit offset to it's unique display name
         self.hierarchical_name_2_memberlist_map = {}
         self.endianness = Endianness.Little
         self.cppfilt = cppfilt
+        self.jobs = jobs    # Number of worker processes. 1 means everything is done in this process
+        self.cache = DwarfCuCache(cache_dir) if cache_dir is not None else None
+        self.reset_extracted_data()
 
         if filename is not None:
             self.load_from_elf_file(filename)
 
+    def reset_extracted_data(self):
+        self.varmap = VarMap()    # This is what we want to generate.
+        self.die2typeid_map = {}
+        self.die2vartype_map = {}
+        self.enum_die_map = {}
+        self.struct_die_map = {}        # Struct definition, indexed by DIE offset
+        self.struct_layout_map = {}     # Flattened list of StructLayoutEntry, indexed by DIE offset
+
     def get_varmap(self):
         return self.varmap
 
-    # Builds a dictionary that maps a CompuleUnit object to a unique displayable name
+    # Builds a dictionary that maps a CompuleUnit offset to a unique displayable name.
+    # pyelftools may give a new CompileUnit object for the same compile unit (get_CU_at), so the offset is the key
     def make_cu_name_map(self, dwarfinfo):
 
         fullpath_cu_tuple_list = []
@@ -132,7 +154,7 @@ class ElfDwarfVarExtractor:
         displayname_cu_tuple_list = self.make_unique_display_name(fullpath_cu_tuple_list)
 
         for item in displayname_cu_tuple_list:
-            self.cu_name_map[item[1]] = item[0]
+            self.cu_name_map[item[1].cu_offset] = item[0]
 
     @classmethod
     def make_unique_display_name(cls, fullpath_cu_tuple_list):
@@ -180,7 +202,7 @@ class ElfDwarfVarExtractor:
         return displayname_cu_tuple_list
 
     def get_cu_name(self, die):
-        return self.cu_name_map[die.cu]
+        return self.cu_name_map[die.cu.cu_offset]
 
     def get_die_at_spec(self, die):
         refaddr = die.attributes['DW_AT_specification'].value + die.cu.cu_offset
@@ -282,25 +304,125 @@ class ElfDwarfVarExtractor:
         return encoding_map[encoding][bytesize]
 
     def load_from_elf_file(self, filename):
-        varmap = []
+        if self.cache is not None:
+            self.load_from_elf_file_with_cache(filename)
+            return
+
+        if self.jobs > 1:
+            self.load_from_elf_file_parallel(filename)
+            return
+
         with open(filename, 'rb') as f:
-            elffile = ELFFile(f)
+            self.open_elf(f)
+            try:
+                for cu in self.dwarfinfo.iter_CUs():
+                    self.extract_cu(cu)
+            finally:
+                self.demangler.close()  # Stops the c++filt process
+
+    # Split the compile units in contiguous chunks and process each chunk in a worker process.
+    # Each worker produces a partial VarMap. Partial VarMaps are merged in compile unit order so that
+    # types and enums get their ids in the same order as a serial extraction.
+    def load_from_elf_file_parallel(self, filename):
+        with open(filename, 'rb') as f:
+            self.open_elf(f)    # Fails early if the file or the environment is not good
+            cu_list = [(cu.cu_offset, cu.size) for cu in self.dwarfinfo.iter_CUs()]
+
+        chunks = self.partition_cus(cu_list, self.jobs * self.CHUNKS_PER_JOB)
+        if len(chunks) == 0:
+            return
+
+        processes = min(self.jobs, len(chunks))
+        with multiprocessing.Pool(processes=processes, initializer=_parallel_worker_init, initargs=(filename, self.cppfilt)) as pool:
+            for partial_varmap in pool.imap(_parallel_worker_extract, chunks):   # imap keeps the order of the chunks
+                self.varmap.merge(partial_varmap)
+
+    # Each compile unit is extracted on its own into a partial VarMap that is kept in the cache.
+    # Compile units found in the cache are not parsed at all. Partial VarMaps are then merged in compile unit order.
+    def load_from_elf_file_with_cache(self, filename):
+        cu_list = []
+        partials = {}
+        missing_cus = []
+        with open(filename, 'rb') as f:
+            self.open_elf(f)
+            keys = self.cache.make_keys(self.dwarfinfo, self.cu_name_map, self.endianness, self.demangler.get_identity())
+            for cu in self.dwarfinfo.iter_CUs():
+                cu_list.append(cu.cu_offset)
+                partial_varmap = self.cache.get(keys[cu.cu_offset])
+                if partial_varmap is not None:
+                    partials[cu.cu_offset] = partial_varmap
+                else:
+                    missing_cus.append((cu.cu_offset, cu.size))
+
+            if self.jobs <= 1:
+                try:
+                    for cu in self.dwarfinfo.iter_CUs():
+                        if cu.cu_offset not in partials:
+                            self.reset_extracted_data()
+                            self.extract_cu(cu)
+                            partials[cu.cu_offset] = self.varmap
+                            self.cache.put(keys[cu.cu_offset], self.varmap)
+                finally:
+                    self.demangler.close()
+
+        if self.jobs > 1 and len(missing_cus) > 0:
+            chunks = self.partition_cus(missing_cus, self.jobs * self.CHUNKS_PER_JOB)
+            processes = min(self.jobs, len(chunks))
+            with multiprocessing.Pool(processes=processes, initializer=_parallel_worker_init, initargs=(filename, self.cppfilt)) as pool:
+                for partial_list in pool.imap_unordered(_parallel_worker_extract_per_cu, chunks):
+                    for cu_offset, partial_varmap in partial_list:
+                        partials[cu_offset] = partial_varmap
+                        self.cache.put(keys[cu_offset], partial_varmap)
+
+        logging.info('%d/%d compile units reused from cache' % (len(cu_list) - len(missing_cus), len(cu_list)))
+        self.cache.prune()
+
+        self.reset_extracted_data()
+        for cu_offset in cu_list:
+            self.varmap.merge(partials[cu_offset])
+
+    # Split a list of (cu_offset, cu_size) in at most chunk_count contiguous chunks of similar size.
+    @classmethod
+    def partition_cus(cls, cu_list, chunk_count):
+        if chunk_count < 1:
+            raise ValueError('Need at least one chunk')
 
-            if not elffile.has_dwarf_info():
-                raise Exception('File has no DWARF info')
+        total_size = sum([cu_size for cu_offset, cu_size in cu_list])
+        target_size = total_size / chunk_count
+        chunks = []
+        chunk = []
+        chunk_size = 0
+        for cu_offset, cu_size in cu_list:
+            chunk.append(cu_offset)
+            chunk_size += cu_size
+            if chunk_size >= target_size and len(chunks) < chunk_count - 1:
+                chunks.append(chunk)
+                chunk = []
+                chunk_size = 0
 
-            self.dwarfinfo = elffile.get_dwarf_info()
-            self.endianness = Endianness.Little if elffile.little_endian else Endianness.Big
+        if len(chunk) > 0:
+            chunks.append(chunk)
 
-            self.make_cu_name_map(self.dwarfinfo)
-            self.demangler = GccDemangler(self.cppfilt)  # todo : adapt according to compile unit producer
+        return chunks
 
-            if not self.demangler.can_run():
-                raise EnvionmentNotSetUpException("Demangler cannot be used. %s" % self.demangler.get_error())
+    def open_elf(self, f):
+        elffile = ELFFile(f)
 
-            for cu in self.dwarfinfo.iter_CUs():
-                die = cu.get_top_DIE()
-                self.extract_var_recursive(die)
+        if not elffile.has_dwarf_info():
+            raise Exception('File has no DWARF info')
+
+        self.dwarfinfo = elffile.get_dwarf_info()
+        self.endianness = Endianness.Little if elffile.little_endian else Endianness.Big
+
+        self.make_cu_name_map(self.dwarfinfo)
+        self.demangler = GccDemangler(self.cppfilt)  # todo : adapt according to compile unit producer
+
+        if not self.demangler.can_run():
+            raise EnvionmentNotSetUpException("Demangler cannot be used. %s" % self.demangler.get_error())
+
+    def extract_cu(self, cu):
+        die = cu.get_top_DIE()
+        self.extract_var_recursive(die)
 
     # Process each die recursively and call the right handler based on the die Tag
     def extract_var_recursive(self, die):
@@ -404,8 +526,8 @@ class ElfDwarfVarExtractor:
     # each time we will encounter a instance of this struct, we will generate a variable for each sub member
 
     def die_process_struct(self, die):
-        if die not in self.struct_die_map:
-            self.struct_die_map[die] = self.get_struct_or_class_def(die)
+        if die.offset not in self.struct_die_map:
+            self.struct_die_map[die.offset] = self.get_struct_or_class_def(die)
 
     # Go down the hierarchy to get the whole struct def in a recursive way
     def get_struct_or_class_def(self, die):
@@ -434,7 +556,8 @@ class ElfDwarfVarExtractor:
         name = self.get_name(die)
         if self.is_type_struct_or_class(die):
             struct_die = self.get_struct_or_class_type(die)
-            substruct = self.get_struct_or_class_def(struct_die)  # recursion
+            self.die_process_struct(struct_die)  # recursion
+            substruct = self.struct_die_map[struct_die.offset]
             vartype = VariableType.struct
             typename = None
         else:
@@ -479,49 +602,56 @@ class ElfDwarfVarExtractor:
             substruct=substruct
         )
 
-    # We have an instance of a struct. Use the location and go down the structure recursively
-    # using the members offsets to find the final address that we will apply to the output var
+    # We have an instance of a struct. Each leaf member becomes a variable located at the instance location
+    # plus the member offset. The member list is computed once per struct type, see get_struct_layout()
     def register_struct_var(self, die, location):
         path_segments = self.make_varpath(die)
         path_segments.append(self.get_name(die))
         struct_die = self.get_struct_or_class_type(die)
-        struct = self.struct_die_map[struct_die]
-        startpoint = Struct.Member(struct.name, is_substruct=True, bitoffset=None, bitsize=None, substruct=struct)
-
-        # Start the recursion
-        self.register_member_as_var_recursive(path_segments, startpoint, location, offset=0)
-
-    # Recursive function to dig into a structure and register all possible variables.
-    def register_member_as_var_recursive(self, path_segments, member, location, offset):
-        if member.is_substruct:
-            struct = member.substruct
-            for name in struct.members:
-                member = struct.members[name]
-                new_path_segments = path_segments.copy()
-                if member.is_substruct:
-                    new_path_segments.append(name)
-                    location = location.copy()  # When we go ina substruct, the member byte_offset is reset to 0
-                    location.add_offset(member.byte_offset)
-
-                elif member.byte_offset is not None:
-                    offset = member.byte_offset
-
-                self.register_member_as_var_recursive(new_path_segments, member, location, offset)
-        else:
-            location = location.copy()
-            location.add_offset(member.byte_offset)
+
+        for entry in self.get_struct_layout(struct_die):
+            member_location = location.copy()
+            member_location.add_offset(entry.byte_offset)
 
             self.varmap.add_variable(
-                path_segments=path_segments,
-                name=member.name,
-                original_type_name=member.original_type_name,
-                location=location,
-                bitoffset=member.bitoffset,
-                bitsize=member.bitsize,
+                path_segments=path_segments + list(entry.path_suffix),
+                name=entry.name,
+                original_type_name=entry.original_type_name,
+                location=member_location,
+                bitoffset=entry.bitoffset,
+                bitsize=entry.bitsize,
                 # enum                = member.enum # TODO
             )
 
-            # context.varmap.append(varentry)
+    # Returns all the leaf members of a struct, nested structs included, with their offset from the start of the struct.
+    # Computed once per struct DIE, every instance of the struct reuses it.
+    def get_struct_layout(self, struct_die):
+        if struct_die.offset not in self.struct_layout_map:
+            self.die_process_struct(struct_die)
+            layout = []
+            self.flatten_struct(self.struct_die_map[struct_die.offset], (), 0, layout)
+            self.struct_layout_map[struct_die.offset] = layout
+
+        return self.struct_layout_map[struct_die.offset]
+
+    def flatten_struct(self, struct, path_suffix, base_offset, layout):
+        for name in struct.members:
+            member = struct.members[name]
+            byte_offset = base_offset
+            if member.byte_offset is not None:
+                byte_offset += member.byte_offset
+
+            if member.is_substruct:
+                self.flatten_struct(member.substruct, path_suffix + (name,), byte_offset, layout)
+            else:
+                layout.append(StructLayoutEntry(
+                    path_suffix=path_suffix,
+                    name=member.name,
+                    byte_offset=byte_offset,
+                    original_type_name=member.original_type_name,
+                    bitoffset=member.bitoffset,
+                    bitsize=member.bitsize
+                ))
 
     # Try to extract a location from a die.
 
@@ -623,3 +753,37 @@ class ElfDwarfVarExtractor:
             segments.insert(1, self.get_cu_name(die))
 
         return segments
+
+
+# Worker side of ElfDwarfVarExtractor.load_from_elf_file_parallel.
+# Each worker process opens the file once and is then given chunks of compile units to process.
+_worker_file = None
+_worker_extractor = None
+
+
+def _parallel_worker_init(filename, cppfilt):
+    global _worker_file, _worker_extractor
+    _worker_file = open(filename, 'rb')   # Stays open for the lifetime of the worker. pyelftools reads it lazily
+    _worker_extractor = ElfDwarfVarExtractor(cppfilt=cppfilt)
+    _worker_extractor.open_elf(_worker_file)
+
+
+# Compile units are reached directly by their offset. Walking the whole .debug_info from every worker
+# for every chunk would cost as much as a serial extraction.
+def _parallel_worker_extract_per_cu(cu_offsets):
+    # Gives a partial VarMap for each compile unit instead of one for the whole chunk
+    partials = []
+    for cu_offset in cu_offsets:
+        _worker_extractor.reset_extracted_data()
+        _worker_extractor.extract_cu(_worker_extractor.dwarfinfo.get_CU_at(cu_offset))
+        partials.append((cu_offset, _worker_extractor.get_varmap()))
+    return partials
+
+
+def _parallel_worker_extract(cu_offsets):
+    # Start from scratch for each chunk so that the result does not depend on which worker got which chunk.
+    # Offsets are in file order, so types and enums are registered like a serial extraction would.
+    _worker_extractor.reset_extracted_data()
+    for cu_offset in cu_offsets:
+        _worker_extractor.extract_cu(_worker_extractor.dwarfinfo.get_CU_at(cu_offset))
+    return _worker_extractor.get_varmap()
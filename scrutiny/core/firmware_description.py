@@ -12,12 +12,14 @@ import zipfile
 import os
 import json
 import logging
+import mmap
+import struct
 
 import scrutiny.core.firmware_id as firmware_id
 from scrutiny.core.varmap import VarMap
 from scrutiny.core import Variable
 
-from typing import List, Union, Dict, Any, Tuple, Generator, TypedDict
+from typing import List, Union, Dict, Any, Tuple, Generator, TypedDict, Optional
 
 
 class GenerationInfoType(TypedDict, total=False):
@@ -40,8 +42,12 @@ class FirmwareDescription:
     varmap: VarMap
     metadata: MetadataType
     firmwareid: bytes
+    binary_varmap: bool     # When True, a binary varmap is written next to the JSON varmap in the .sfd
+    mapping: Optional[mmap.mmap]    # Memory mapping of the .sfd file, owned by this object. Released by close()
+    mapped_view: Optional[memoryview]
 
     varmap_filename: str = 'varmap.json'
+    varmap_bin_filename: str = 'varmap.bin'
     metadata_filename: str = 'metadata.json'
     firmwareid_filename: str = 'firmwareid'
 
@@ -52,6 +58,9 @@ class FirmwareDescription:
     ]
 
     def __init__(self, file_folder: str):
+        self.binary_varmap = False
+        self.mapping = None
+        self.mapped_view = None
         if os.path.isdir(file_folder):
             self.load_from_folder(file_folder)
         elif os.path.isfile(file_folder):
@@ -92,14 +101,71 @@ class FirmwareDescription:
             with sfd.open(self.metadata_filename) as f:
                 self.metadata = json.loads(f.read())
 
-            with sfd.open(self.varmap_filename) as f:
-                self.varmap = VarMap(f.read())
+            if self.varmap_bin_filename in sfd.namelist():
+                self.varmap = VarMap(self.read_binary_member(filename, sfd, self.varmap_bin_filename))
+                self.binary_varmap = True
+            else:
+                with sfd.open(self.varmap_filename) as f:
+                    self.varmap = VarMap(f.read())
+
+    def read_binary_member(self, filename: str, sfd: zipfile.ZipFile, member_name: str) -> Union[bytes, memoryview]:
+        """
+        Returns the content of a file inside the .sfd. If the file is stored without compression,
+        the returned data is a view on a memory mapping of the .sfd. Nothing is copied.
+        The mapping keeps the file open until close() is called.
+        """
+        info = sfd.getinfo(member_name)
+        if info.compress_type == zipfile.ZIP_STORED and self.mapping is None:
+            try:
+                with open(filename, 'rb') as f:
+                    f.seek(info.header_offset)
+                    local_header = f.read(30)
+                    signature, name_length, extra_length = struct.unpack('<4s22xHH', local_header)
+                    if signature != b'PK\x03\x04':
+                        raise ValueError('Bad local file header')
+                    start = info.header_offset + len(local_header) + name_length + extra_length
+                    self.mapping = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+                self.mapped_view = memoryview(self.mapping)[start:start + info.file_size]
+                return self.mapped_view
+            except Exception as e:
+                logging.debug('Cannot memory map %s. Reading it instead. %s' % (member_name, str(e)))
+
+        with sfd.open(member_name) as f:
+            return f.read()
+
+    def close(self) -> None:
+        """
+        Releases the memory mapping of the .sfd so that the file can be deleted or replaced, which Windows
+        forbids while it is mapped. The object stays usable. The mapped varmap is copied in memory first.
+        """
+        self.varmap.close()
+        if self.mapping is None:
+            return
+
+        try:
+            if self.mapped_view is not None:
+                self.mapped_view.release()
+            self.mapping.close()
+        except BufferError as e:
+            # A view on the mapping is still alive somewhere. The mapping will be closed when garbage collected.
+            logging.debug('Cannot close the memory mapping of the Firmware Description. %s' % str(e))
+        self.mapped_view = None
+        self.mapping = None
 
     def write(self, filename: str) -> None:
         with zipfile.ZipFile(filename, mode='w', compression=self.COMPRESSION_TYPE) as outzip:
             outzip.writestr(self.firmwareid_filename, self.firmwareid.hex())
             outzip.writestr(self.metadata_filename, json.dumps(self.metadata, indent=4))
             outzip.writestr(self.varmap_filename, self.varmap.get_json())
+            if self.binary_varmap:
+                # Not compressed so that it can be memory mapped when loaded
+                outzip.writestr(self.varmap_bin_filename, self.varmap.get_binary(), compress_type=zipfile.ZIP_STORED)
+
+    def set_binary_varmap(self, val: bool) -> None:
+        self.binary_varmap = val
+
+    def has_binary_varmap(self) -> bool:
+        return self.binary_varmap
 
     def get_firmware_id(self, ascii: bool = True) -> Union[bytes, str]:
         if ascii:
@@ -134,6 +200,13 @@ class FirmwareDescription:
         for fullname, vardef in self.varmap.iterate_vars():
             yield (fullname, vardef)
 
+    def get_vars_fullname_for_datastore(self) -> Generator[str, None, None]:
+        for fullname in self.varmap.iterate_vars_fullname():
+            yield fullname
+
+    def get_varmap(self) -> VarMap:
+        return self.varmap
+
     def get_metadata(self):
         return self.metadata
 
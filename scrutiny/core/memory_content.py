@@ -8,11 +8,27 @@
 #   Copyright (c) 2021-2022 Scrutiny Debugger
 
 import re
+import mmap
+import struct
 from bisect import bisect, bisect_left
-from typing import Dict, List, Union, Optional
+from typing import Dict, List, Union, Optional, Iterable, Tuple
 import copy
 
 
+class BinaryMemdumpFormat:
+    """
+    Layout of a binary memdump. Everything is little endian.
+
+    [Header]    : magic, version
+    [Records]   : (address, length) followed by length bytes of data. Repeated until the end of the file
+    """
+    MAGIC = b'SMDB'
+    VERSION = 1
+
+    HEADER = struct.Struct('<4sH2x')
+    RECORD = struct.Struct('<QL')
+
+
 class Cluster:
     """
     Represent a chunk of data with a location in memory.
@@ -28,6 +44,10 @@ class Cluster:
     def data(self):
         return self.read(0, self.size)
 
+    @property
+    def data_view(self) -> memoryview:
+        return self.view(0, self.size)
+
     def __init__(self, start_addr: int, size: int = 0, has_data: bool = True, data=bytearray()):
         self.start_addr = start_addr
         self.size = size
@@ -57,6 +77,40 @@ class Cluster:
 
         return data_out
 
+    def view(self, offset: int, size: int) -> memoryview:
+        """
+        Same as read(), but returns a view on the internal buffer instead of a copy.
+        The cluster cannot be resized while a view is held. Release it once the data has been consumed.
+        """
+        if size < 0:
+            raise ValueError('Cannot read a negative size')
+
+        if offset < 0:
+            raise IndexError('Offset cannot be negative %d' % offset)
+
+        if offset + size > self.size:
+            raise IndexError('Index out of range %d to %d' % (offset, offset + size))
+
+        if not self.has_data:
+            return memoryview(bytes(size))
+
+        assert self.internal_data is not None
+        return memoryview(self.internal_data)[offset:offset + size]
+
+    def merge(self, other: "Cluster") -> None:
+        """
+        Appends the content of another cluster at the end of this one, in place.
+        The bytearray over-allocates when it grows, so successive merges have an amortized linear cost.
+        """
+        if self.has_data:
+            assert self.internal_data is not None
+            if other.has_data:
+                assert other.internal_data is not None
+                self.internal_data += memoryview(other.internal_data)[0:other.size]
+            else:
+                self.internal_data += bytes(other.size)
+        self.size += other.size
+
     def write(self, data: Union[bytearray, bytes], offset: int = 0) -> None:
         if offset < 0:
             raise ValueError('Offset cannot be negative %d' % offset)
@@ -74,7 +128,7 @@ class Cluster:
             assert self.internal_data is not None
             self.internal_data = self.internal_data[0:new_size]
 
-    def extend(self, new_size: int, delta_data: Union[bytearray, bytes] = None) -> None:
+    def extend(self, new_size: int, delta_data: Optional[Union[bytearray, bytes, memoryview]] = None) -> None:
         delta_size = new_size - self.size
         if delta_size < 0:
             raise Exception('Cannot shrink cluster with extend() method')
@@ -118,6 +172,16 @@ class Cluster:
 
         return new_cluster
 
+    def __iadd__(self, other):
+        if isinstance(other, Cluster):
+            self.merge(other)
+        elif isinstance(other, (bytes, bytearray, memoryview)):
+            self.extend(self.size + len(other), delta_data=other)
+        else:
+            raise ValueError('Cannot add %s with %s' % (self.__class__.__name__, other.__class__.__name__))
+
+        return self
+
     def __getitem__(self, key) -> bytearray:
         if isinstance(key, slice):
             stop = key.stop
@@ -160,7 +224,8 @@ class MemoryContent:
 
     def load(self, filename: str) -> None:
         """
-        Load a memdump file formatted this way
+        Load a memdump file. Binary memdumps are detected with their magic number,
+        otherwise the file is expected to be a text memdump formatted this way
 
         0x00401060:    31ED4989D15E4889E24883E4F0505449
         0x00401070:    C7C0E017400048C7C18017400048C7C7
@@ -169,26 +234,115 @@ class MemoryContent:
         0x004010A0:    B870404000483D704040007413B80000
         0x004010B0:    00004885C07409BF70404000FFE06690
         """
+        with open(filename, 'rb') as f:
+            is_binary = f.read(len(BinaryMemdumpFormat.MAGIC)) == BinaryMemdumpFormat.MAGIC
 
+        if is_binary:
+            self.load_binary(filename)
+        else:
+            self.load_text(filename)
+
+    def load_text(self, filename: str) -> None:
         line_regex = re.compile(r'0x([0-9a-fA-F]+)\s*:\s*([0-9a-fA-F]+)')
-        with open(filename, 'r') as f:
-            lines = f.readlines()
-            for line in lines:
-                m = line_regex.match(line.strip())
-                if m:
-                    addr = int(m.group(1), 16)
-
-                    if self.retain_data:
-                        data = bytes.fromhex(m.group(2))
-                        cluster = Cluster(start_addr=addr, size=len(data), data=data, has_data=True)
-                    else:
-                        size = len(m.group(2)) / 2
-                        if size % 2 != 0:
-                            raise Exception('Odd number of character')
-                        size = int(size)
-                        cluster = Cluster(start_addr=addr, size=size, has_data=False)
-
-                    self.write_cluster(cluster)
+
+        def read_lines() -> Iterable[Tuple[int, Union[bytes, int]]]:
+            with open(filename, 'r') as f:
+                for line in f:  # Streamed, the file is never fully loaded.
+                    m = line_regex.match(line.strip())
+                    if m:
+                        addr = int(m.group(1), 16)
+                        if self.retain_data:
+                            yield (addr, bytes.fromhex(m.group(2)))
+                        else:
+                            if len(m.group(2)) % 2 != 0:
+                                raise Exception('Odd number of character')
+                            yield (addr, len(m.group(2)) // 2)
+
+        self.write_chunks(read_lines())
+
+    def load_binary(self, filename: str) -> None:
+        fmt = BinaryMemdumpFormat
+        with open(filename, 'rb') as f:
+            with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as mm:
+                if len(mm) < fmt.HEADER.size:
+                    raise ValueError('Binary memdump is too small')
+                magic, version = fmt.HEADER.unpack_from(mm, 0)
+                if magic != fmt.MAGIC:
+                    raise ValueError('Not a binary memdump')
+                if version != fmt.VERSION:
+                    raise ValueError('Unsupported binary memdump version %d' % version)
+
+                view = memoryview(mm)
+                try:
+                    def read_records() -> Iterable[Tuple[int, Union[memoryview, int]]]:
+                        cursor = fmt.HEADER.size
+                        while cursor < len(mm):
+                            if cursor + fmt.RECORD.size > len(mm):
+                                raise ValueError('Binary memdump is truncated')
+                            addr, length = fmt.RECORD.unpack_from(mm, cursor)
+                            cursor += fmt.RECORD.size
+                            if cursor + length > len(mm):
+                                raise ValueError('Binary memdump is truncated')
+                            yield (addr, view[cursor:cursor + length] if self.retain_data else length)
+                            cursor += length
+
+                    self.write_chunks(read_records())
+                finally:
+                    view.release()
+
+    def write_chunks(self, chunks: Iterable[Tuple[int, Union[bytes, memoryview, int]]]) -> None:
+        """
+        Writes a sequence of (address, data) chunks. When data is not retained, the data can be replaced by its size.
+        Contiguous chunks are accumulated in a single buffer so that only one cluster is written for them.
+        """
+        pending_addr = 0
+        pending_size = 0
+        pending_data = bytearray()
+
+        def flush() -> None:
+            if pending_size > 0:
+                cluster = Cluster(start_addr=pending_addr, size=pending_size, has_data=self.retain_data)
+                if self.retain_data:
+                    cluster.internal_data = pending_data    # Avoid a copy of the buffer by the constructor
+                self.write_cluster(cluster)
+
+        for addr, data in chunks:
+            size = data if isinstance(data, int) else len(data)
+            if pending_size == 0 or addr != pending_addr + pending_size:
+                flush()
+                pending_addr = addr
+                pending_size = 0
+                pending_data = bytearray()
+
+            if self.retain_data and not isinstance(data, int):
+                pending_data += data
+            pending_size += size
+        flush()
+
+    def write_memdump(self, filename: str, line_size: int = 16) -> None:
+        """
+        Writes the content in the text memdump format that load() can read.
+        """
+        with open(filename, 'w') as f:
+            for addr in sorted(self.clusters.keys()):
+                cluster = self.clusters[addr]
+                for offset in range(0, cluster.size, line_size):
+                    size = min(line_size, cluster.size - offset)
+                    with cluster.view(offset, size) as view:
+                        f.write('0x%08X:    %s\n' % (addr + offset, view.hex().upper()))
+
+    def write_binary_memdump(self, filename: str) -> None:
+        """
+        Writes the content in the binary memdump format. One record per cluster.
+        """
+        fmt = BinaryMemdumpFormat
+        with open(filename, 'wb') as f:
+            f.write(fmt.HEADER.pack(fmt.MAGIC, fmt.VERSION))
+            for addr in sorted(self.clusters.keys()):
+                cluster = self.clusters[addr]
+                f.write(fmt.RECORD.pack(addr, cluster.size))
+                with cluster.data_view as view:
+                    f.write(view)
 
     def read(self, addr: int, length: int) -> bytes:
         """
@@ -205,6 +359,18 @@ class MemoryContent:
 
         return self.clusters[addr_start].read(offset, length)
 
+    def read_view(self, addr: int, length: int) -> memoryview:
+        """
+        Same as read(), but returns a view on the data without copy.
+        The view must be released before the memory is written again.
+        """
+        x = bisect(self.sorted_keys, addr)
+        if x <= 0:
+            raise ValueError('Address out of range')
+
+        addr_start = self.sorted_keys[x - 1]
+        return self.clusters[addr_start].view(addr - addr_start, length)
+
     def write(self, addr: int, data: Union[bytearray, bytes]) -> None:
         cluster = Cluster(start_addr=addr, size=len(data), data=data, has_data=self.retain_data)
         self.write_cluster(cluster)
@@ -340,8 +506,7 @@ class MemoryContent:
                 size2 = len(self.clusters[start_addr2])
 
                 if start_addr1 + size1 >= start_addr2:    # Need to agglomerate
-                    new_size = size1 + size2
-                    self.clusters[start_addr1] += self.clusters[start_addr2]
+                    self.clusters[start_addr1].merge(self.clusters[start_addr2])
                     del self.clusters[start_addr2]
                     del self.sorted_keys[i + 1]
                     merge_done += 1
@@ -355,3 +520,102 @@ class MemoryContent:
                     i += 1
             else:
                 i += 1
+
+
+class SortedMemoryContent(MemoryContent):
+    """
+    Same as MemoryContent, but writes and deletes only touch the clusters next to the modified range.
+    Contiguous data is merged directly when written, in place in the cluster bytearray, so no agglomeration pass is needed.
+    Uses the same dict and sorted list of addresses, so reads are the same as MemoryContent.
+    A list insert is a memmove done in C. It stays far cheaper than the Python code around it even with many clusters.
+    """
+
+    def write_cluster(self, cluster: Cluster) -> None:
+        start = cluster.start_addr
+        end = start + cluster.size
+
+        # Every cluster starting inside the written range or right after it is merged in.
+        first = bisect_left(self.sorted_keys, start)
+        last = bisect(self.sorted_keys, end)
+        tail: Optional[Cluster] = None
+        for addr in self.sorted_keys[first:last]:
+            absorbed = self.clusters.pop(addr)
+            if addr + absorbed.size > end:
+                tail = absorbed
+        del self.sorted_keys[first:last]
+
+        previous = None
+        if first > 0:
+            previous = self.clusters[self.sorted_keys[first - 1]]
+            if previous.start_addr + previous.size < start:
+                previous = None
+
+        if previous is not None:
+            offset = start - previous.start_addr
+            if previous.start_addr + previous.size > end:    # Written range is fully inside the previous cluster
+                if previous.has_data and cluster.has_data:
+                    assert cluster.internal_data is not None
+                    previous.write(cluster.internal_data, offset)
+                return
+            self.truncate(previous, offset)
+            self.append(previous, cluster, 0)
+            target = previous
+        else:
+            target = cluster
+            self.clusters[start] = cluster
+            self.sorted_keys.insert(first, start)
+
+        if tail is not None:
+            self.append(target, tail, end - tail.start_addr)
+
+    def delete(self, addr: int, size: int) -> None:
+        if size <= 0:
+            return
+
+        end = addr + size
+        index = bisect_left(self.sorted_keys, addr) - 1
+        if index >= 0:
+            previous = self.clusters[self.sorted_keys[index]]
+            previous_end = previous.start_addr + previous.size
+            if previous_end > addr:
+                if previous_end > end:   # Deleted range is inside the cluster. Split it
+                    self.clusters[end] = Cluster(start_addr=end, size=previous_end - end, has_data=previous.has_data,
+                                                 data=previous.read(end - previous.start_addr, previous_end - end) if previous.has_data else bytearray())
+                    self.sorted_keys.insert(index + 1, end)
+                self.truncate(previous, addr - previous.start_addr)
+
+        first = bisect_left(self.sorted_keys, addr)
+        last = bisect_left(self.sorted_keys, end)
+        remainder: Optional[Cluster] = None
+        for cluster_addr in self.sorted_keys[first:last]:
+            cluster = self.clusters.pop(cluster_addr)
+            cluster_end = cluster_addr + cluster.size
+            if cluster_end > end:   # Keep the part after the deleted range. Only the last cluster can go past it
+                remainder = Cluster(start_addr=end, size=cluster_end - end, has_data=cluster.has_data,
+                                    data=cluster.read(end - cluster_addr, cluster_end - end) if cluster.has_data else bytearray())
+        del self.sorted_keys[first:last]
+        if remainder is not None:
+            self.clusters[end] = remainder
+            self.sorted_keys.insert(first, end)
+
+    def agglomerate(self, written_key_index: Optional[int] = None) -> None:
+        # Clusters are merged when written. Nothing to do.
+        pass
+
+    def truncate(self, cluster: Cluster, new_size: int) -> None:
+        # In place, no copy of the remaining data.
+        cluster.size = new_size
+        if cluster.has_data:
+            assert cluster.internal_data is not None
+            del cluster.internal_data[new_size:]
+
+    def append(self, cluster: Cluster, other: Cluster, offset: int) -> None:
+        # Add the data of other, starting from offset, at the end of cluster. bytearray grows in place with an amortized cost.
+        cluster.size += other.size - offset
+        if cluster.has_data:
+            assert cluster.internal_data is not None
+            if other.has_data:
+                assert other.internal_data is not None
+                cluster.internal_data += memoryview(other.internal_data)[offset:]
+            else:
+                cluster.internal_data += bytes(other.size - offset)
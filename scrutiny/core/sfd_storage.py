@@ -13,8 +13,20 @@ import logging
 import os
 import re
 import tempfile
+import json
+import threading
+from collections import OrderedDict
 
-from typing import List
+from typing import List, Dict, Tuple, Optional, TypedDict, cast
+
+
+class IndexEntryType(TypedDict):
+    mtime_ns: int
+    size: int
+    metadata: MetadataType
+
+
+FileSignature = Tuple[int, int]  # (mtime_ns, size)
 
 
 class TempStorageWithAutoRestore:
@@ -29,18 +41,52 @@ class TempStorageWithAutoRestore:
 
 
 class SFDStorageManager():
+    """
+    Keeps the installed .sfd files in a folder, one file per firmware ID.
+
+    The metadata of every installed file is kept in an index file inside the storage folder so that
+    listing the installed SFDs does not require to open each zip file. Recently loaded FirmwareDescription
+    are also kept in memory. Both caches are validated against the modification time and size of the
+    file, so a file modified by another process is reloaded.
+    The caches are shared by all threads and protected by a lock.
+    """
+
+    INDEX_FILENAME = 'sfd_index.json'
+    SFD_CACHE_SIZE = 4
+
+    index: Optional[Dict[str, IndexEntryType]]
+    sfd_cache: "OrderedDict[str, Tuple[FileSignature, FirmwareDescription]]"
+    lock: threading.RLock
 
     def __init__(self, folder):
         self.folder = folder
         self.temporary_dir = None
+        self.logger = logging.getLogger(self.__class__.__name__)
+        self.lock = threading.RLock()   # Reentrant. Index functions call each other
+        self.sfd_cache = OrderedDict()
         os.makedirs(self.folder, exist_ok=True)
+        self.clear_cache()
 
     def use_temp_folder(self):
         self.temporary_dir = tempfile.TemporaryDirectory()
+        self.clear_cache()
         return TempStorageWithAutoRestore(self)
 
     def restore_storage(self):
         self.temporary_dir = None
+        self.clear_cache()
+
+    def clear_cache(self) -> None:
+        with self.lock:
+            self.index = None   # Lazy loaded
+            for firmwareid in list(self.sfd_cache.keys()):
+                self.release_cached_sfd(firmwareid)
+
+    def release_cached_sfd(self, firmwareid: str) -> None:
+        # Closing releases the memory mapping of the file. The object stays usable by whoever still holds it.
+        cached = self.sfd_cache.pop(firmwareid, None)
+        if cached is not None:
+            cached[1].close()
 
     def get_storage_dir(self) -> str:
         if self.temporary_dir is not None:
@@ -60,7 +106,11 @@ class SFDStorageManager():
         if os.path.isfile(output_file) and ignore_exist == False:
             logging.warning('A Scrutiny Firmware Description file with the same firmware ID was already installed. Overwriting.')
 
-        sfd.write(output_file)  # Write the Firmware Description file in storage folder with firmware ID as name
+        with self.lock:
+            sfd.write(output_file)  # Write the Firmware Description file in storage folder with firmware ID as name
+            self.release_cached_sfd(firmware_id_ascii)
+            self.update_index_entry(firmware_id_ascii, sfd.get_metadata())
+        sfd.close()     # Do not keep the source file mapped
         return sfd
 
     def uninstall(self, firmwareid: str, ignore_not_exist: bool = False) -> None:
@@ -68,12 +118,15 @@ class SFDStorageManager():
             raise ValueError('Invalid firmware ID')
 
         target_file = os.path.join(self.get_storage_dir(), firmwareid)
+        with self.lock:
+            self.release_cached_sfd(firmwareid)    # Release the file before deleting it. It may be memory mapped.
 
-        if os.path.isfile(target_file):
-            os.remove(target_file)
-        else:
-            if not ignore_not_exist:
-                raise ValueError('SFD file with firmware ID %s not found' % (firmwareid))
+            if os.path.isfile(target_file):
+                os.remove(target_file)
+                self.remove_index_entry(firmwareid)
+            else:
+                if not ignore_not_exist:
+                    raise ValueError('SFD file with firmware ID %s not found' % (firmwareid))
 
     def is_installed(self, firmwareid: str) -> bool:
         if not self.is_valid_firmware_id(firmwareid):
@@ -89,22 +142,143 @@ class SFDStorageManager():
 
         storage = self.get_storage_dir()
         filename = os.path.join(storage, firmwareid)
-        if not os.path.isfile(filename):
+        try:
+            signature = self.get_file_signature(filename)
+        except OSError:
             raise Exception('Scrutiny Firmware description with firmware ID %s not installed on this system' % (firmwareid))
 
-        return FirmwareDescription(filename)
+        # The returned object is shared between callers and must be considered read-only.
+        with self.lock:
+            if firmwareid in self.sfd_cache:
+                cached_signature, sfd = self.sfd_cache[firmwareid]
+                if cached_signature == signature:
+                    self.sfd_cache.move_to_end(firmwareid)
+                    return sfd
+                self.release_cached_sfd(firmwareid)
+
+            sfd = FirmwareDescription(filename)
+            self.sfd_cache[firmwareid] = (signature, sfd)
+            while len(self.sfd_cache) > self.SFD_CACHE_SIZE:
+                self.release_cached_sfd(next(iter(self.sfd_cache)))
+
+            return sfd
 
     def get_metadata(self, firmwareid: str) -> MetadataType:
         storage = self.get_storage_dir()
         filename = os.path.join(storage, firmwareid)
-        return FirmwareDescription.read_metadata_from_file(filename)
+        with self.lock:
+            index = self.get_index()
+            signature = self.get_file_signature(filename)
+            if firmwareid in index and (index[firmwareid]['mtime_ns'], index[firmwareid]['size']) == signature:
+                return index[firmwareid]['metadata']
+
+            metadata = FirmwareDescription.read_metadata_from_file(filename)
+            index[firmwareid] = self.make_index_entry(signature, metadata)
+            self.write_index()
+            return metadata
 
     def list(self) -> List[str]:
-        thelist = []
-        for filename in os.listdir(self.get_storage_dir()):   # file name is firmware ID
-            if os.path.isfile(os.path.join(self.get_storage_dir(), filename)) and self.is_valid_firmware_id(filename):
-                thelist.append(filename)
-        return thelist
+        return list(self.list_metadata().keys())
+
+    def list_metadata(self) -> Dict[str, MetadataType]:
+        """
+        Returns the metadata of every installed SFD, indexed by firmware ID.
+        Only the files that changed since the index was last written are opened.
+        """
+        with self.lock:
+            return self._list_metadata()
+
+    def _list_metadata(self) -> Dict[str, MetadataType]:
+        index = self.get_index()
+        metadata_dict: Dict[str, MetadataType] = {}
+        index_modified = False
+        with os.scandir(self.get_storage_dir()) as it:
+            for direntry in it:     # file name is firmware ID
+                if not direntry.is_file() or not self.is_valid_firmware_id(direntry.name):
+                    continue
+                firmwareid = direntry.name
+                stat = direntry.stat()
+                signature = (stat.st_mtime_ns, stat.st_size)
+                if firmwareid not in index or (index[firmwareid]['mtime_ns'], index[firmwareid]['size']) != signature:
+                    try:
+                        index[firmwareid] = self.make_index_entry(signature, FirmwareDescription.read_metadata_from_file(direntry.path))
+                    except Exception as e:
+                        self.logger.warning('Cannot read metadata of %s. %s' % (direntry.path, str(e)))
+                        continue
+                    index_modified = True
+                metadata_dict[firmwareid] = index[firmwareid]['metadata']
+
+        # Forget files removed by someone else.
+        for firmwareid in [x for x in index if x not in metadata_dict]:
+            del index[firmwareid]
+            index_modified = True
+
+        if index_modified:
+            self.write_index()
+
+        return metadata_dict
+
+    def get_file_signature(self, filename: str) -> FileSignature:
+        stat = os.stat(filename)
+        return (stat.st_mtime_ns, stat.st_size)
+
+    def make_index_entry(self, signature: FileSignature, metadata: MetadataType) -> IndexEntryType:
+        return {
+            'mtime_ns': signature[0],
+            'size': signature[1],
+            'metadata': metadata
+        }
+
+    def get_index_filename(self) -> str:
+        return os.path.join(self.get_storage_dir(), self.INDEX_FILENAME)
+
+    def get_index(self) -> Dict[str, IndexEntryType]:
+        # Must be called with the lock held. The returned dict is modified in place
+        if self.index is None:
+            self.index = {}
+            filename = self.get_index_filename()
+            if os.path.isfile(filename):
+                try:
+                    with open(filename, 'r') as f:
+                        index = json.loads(f.read())
+                    if not isinstance(index, dict):
+                        raise ValueError('Index is not a dict')
+                    for firmwareid in index:
+                        entry = index[firmwareid]
+                        if isinstance(entry, dict) and isinstance(entry.get('mtime_ns'), int) and isinstance(entry.get('size'), int) and isinstance(entry.get('metadata'), dict):
+                            self.index[firmwareid] = cast(IndexEntryType, entry)
+                except Exception as e:
+                    self.logger.warning('SFD storage index is corrupted and will be rebuilt. %s' % str(e))
+        return self.index
+
+    def write_index(self) -> None:
+        # Written to a temporary file first, then replaced so that a concurrent reader never sees a partial file.
+        # The temporary file name is unique so that 2 processes writing the index at the same time do not clobber each other.
+        filename = self.get_index_filename()
+        tempname: Optional[str] = None
+        with self.lock:
+            try:
+                fd, tempname = tempfile.mkstemp(dir=self.get_storage_dir(), prefix=self.INDEX_FILENAME + '.', suffix='.tmp')
+                with os.fdopen(fd, 'w') as f:
+                    f.write(json.dumps(self.get_index()))
+                os.replace(tempname, filename)
+            except Exception as e:
+                self.logger.warning('Cannot write SFD storage index. %s' % str(e))
+                if tempname is not None and os.path.isfile(tempname):
+                    os.remove(tempname)
+
+    def update_index_entry(self, firmwareid: str, metadata: MetadataType) -> None:
+        filename = os.path.join(self.get_storage_dir(), firmwareid)
+        with self.lock:
+            self.get_index()[firmwareid] = self.make_index_entry(self.get_file_signature(filename), metadata)
+            self.write_index()
+
+    def remove_index_entry(self, firmwareid: str) -> None:
+        with self.lock:
+            index = self.get_index()
+            if firmwareid in index:
+                del index[firmwareid]
+                self.write_index()
 
     def is_valid_firmware_id(self, firmware_id: str) -> bool:
         retval = False
@@ -259,7 +259,7 @@ class Variable:
             pass
 
         @abstractmethod
-        def decode(self, data: Union[bytes, bytearray], endianness: Endianness) -> Union[int, float, bool, None]:
+        def decode(self, data: Union[bytes, bytearray, memoryview], endianness: Endianness) -> Union[int, float, bool, None]:
             pass
 
         @abstractmethod
@@ -280,7 +280,7 @@ class Variable:
                 raise NotImplementedError('Does not support signed int of %d bytes', size)
             self.str = self.str_map[size]
 
-        def decode(self, data: Union[bytes, bytearray], endianness: Endianness) -> int:
+        def decode(self, data: Union[bytes, bytearray, memoryview], endianness: Endianness) -> int:
             endianness_char = '<' if endianness == Endianness.Little else '>'
             return struct.unpack(endianness_char + self.str, data)[0]
 
@@ -302,7 +302,7 @@ class Variable:
                 raise NotImplementedError('Does not support signed int of %d bytes', size)
             self.str = self.str_map[size]
 
-        def decode(self, data: Union[bytes, bytearray], endianness: Endianness) -> int:
+        def decode(self, data: Union[bytes, bytearray, memoryview], endianness: Endianness) -> int:
             endianness_char = '<' if endianness == Endianness.Little else '>'
             return struct.unpack(endianness_char + self.str, data)[0]
 
@@ -322,7 +322,7 @@ class Variable:
                 raise NotImplementedError('Does not support float of %d bytes', size)
             self.str = self.str_map[size]
 
-        def decode(self, data: Union[bytes, bytearray], endianness: Endianness) -> float:
+        def decode(self, data: Union[bytes, bytearray, memoryview], endianness: Endianness) -> float:
             endianness_char = '<' if endianness == Endianness.Little else '>'
             return struct.unpack(endianness_char + self.str, data)[0]
 
@@ -335,7 +335,7 @@ class Variable:
         def __init__(self):
             super().__init__()
 
-        def decode(self, data: Union[bytes, bytearray], endianness: Endianness) -> bool:
+        def decode(self, data: Union[bytes, bytearray, memoryview], endianness: Endianness) -> bool:
             return True if data[0] != 0 else False
 
         def encode(self, value: Union[int, float, bool], endianness: Endianness) -> bytes:
@@ -346,7 +346,7 @@ class Variable:
         def __init__(self, type_name: str):
             self.type_name = type_name
 
-        def decode(self, data: Union[bytes, bytearray], endianness: Endianness) -> None:
+        def decode(self, data: Union[bytes, bytearray, memoryview], endianness: Endianness) -> None:
             raise NotImplementedError('Decoding data for type %s is not supported yet' % self.type_name)
 
         def encode(self, value: Union[int, float, bool], endianness: Endianness) -> bytes:
@@ -417,39 +417,45 @@ class Variable:
         self.bitoffset = bitoffset
         self.enum = enum
 
-    def decode(self, data: Union[bytes, bytearray]) -> Union[int, float, bool, None]:
-        decoded = self.TYPE_TO_CODEC_MAP[self.vartype].decode(data, self.endianness)
-
+    def decode(self, data: Union[bytes, bytearray, memoryview]) -> Union[int, float, bool, None]:
         if self.bitfield:
-            # todo improve this with bit array maybe.
+            # Works directly on the buffer, data can be a memoryview. No padding copy required.
             assert self.bitsize is not None
+            assert self.bitoffset is not None
             if len(data) > 8:
                 raise NotImplementedError('Does not support bitfield bigger than %dbits' % (8 * 8))
             initial_len = len(data)
-
-            if self.endianness == Endianness.Little:
-                padded_data = bytearray(data + b'\x00' * (8 - initial_len))
-                uint_data = struct.unpack('<q', padded_data)[0]
-                uint_data >>= self.bitoffset
-                uint_data &= MASK_MAP[self.bitsize]
-                data = struct.pack('<q', uint_data)
-                data = data[0:initial_len]
-            else:
-                padded_data = bytearray(b'\x00' * (8 - initial_len) + data)
-                uint_data = struct.unpack('>q', padded_data)[0]
-                uint_data >>= self.bitoffset
-                uint_data &= MASK_MAP[self.bitsize]
-                data = struct.pack('>q', uint_data)
-                data = data[-initial_len:]
+            byteorder: Literal['little', 'big'] = 'little' if self.endianness == Endianness.Little else 'big'
+            uint_data = int.from_bytes(data, byteorder)
+            uint_data >>= self.bitoffset
+            uint_data &= MASK_MAP[self.bitsize] & ((1 << (initial_len * 8)) - 1)
+            data = uint_data.to_bytes(initial_len, byteorder)
 
         decoded = self.TYPE_TO_CODEC_MAP[self.vartype].decode(data, self.endianness)
         return decoded
 
     def encode(self, value: Union[int, float, bool]) -> Tuple[bytes, Optional[bytes]]:
+        """
+        Returns the data to write and a write mask. The mask is given for bitfields only so that the device
+        changes only the bits of the bitfield, without the need to read the memory first.
+        """
         write_mask = None
-        data = self.TYPE_TO_CODEC_MAP[self.vartype].encode(value, self.endianness)
+        if self.bitfield:
+            assert self.bitsize is not None
+            assert self.bitoffset is not None
+            size = self.get_size()
+            if size is None or size > 8:
+                raise NotImplementedError('Does not support bitfield bigger than %dbits' % (8 * 8))
+            if not isinstance(self.TYPE_TO_CODEC_MAP[self.vartype], (self.SIntCodec, self.UIntCodec, self.BoolCodec)):
+                raise NotImplementedError('Does not support bitfield of type %s' % self.vartype.name)
+            byteorder: Literal['little', 'big'] = 'little' if self.endianness == Endianness.Little else 'big'
+            mask_int = MASK_MAP[self.bitsize] << self.bitoffset
+            uint_data = (int(value) << self.bitoffset) & mask_int    # Also converts negative values to 2's complement
+            data = uint_data.to_bytes(size, byteorder)
+            write_mask = mask_int.to_bytes(size, byteorder)
+        else:
+            data = self.TYPE_TO_CODEC_MAP[self.vartype].encode(value, self.endianness)
 
-        # todo bitfield set write_mask
         return data, write_mask
 
     def get_fullname(self) -> str:
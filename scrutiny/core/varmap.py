@@ -11,9 +11,11 @@
 import json
 import os
 import logging
+import mmap
 
 from scrutiny.core import Variable, VariableType, VariableEnum, VariableLocation, Endianness
-from typing import Dict, TypedDict, List, Tuple, Optional, Any, Union, Literal, Generator
+from scrutiny.core.binary_varmap import BinaryVarMapReader, BinaryVariableTable, encode_binary_varmap, is_binary_varmap
+from typing import Dict, TypedDict, List, Tuple, Optional, Any, Union, Literal, Generator, Mapping
 from scrutiny.core.variable import VariableEnumDef
 
 
@@ -35,43 +37,41 @@ class VarMap:
     logger: logging.Logger
     endianness: Endianness
     typemap: Dict[str, TypeEntry]
-    variables: Dict[str, VariableEntry]
+    variables: Mapping[str, VariableEntry]     # A dict, or a read-only table when loaded from a binary varmap
     enums: Dict[str, VariableEnumDef]
 
     next_type_id: int
     next_enum_id: int
     typename2typeid_map: Dict[str, str]      # name to numeric id as string
     enums_to_id_map: Dict[VariableEnum, int]
+    enum_cache: Dict[str, VariableEnum]      # enum id (as string) to a single shared VariableEnum instance
+    mapping: Optional[mmap.mmap]             # Memory mapping of a binary varmap given by filename. Released by close()
 
-    def __init__(self, file: Union[str, bytes] = None):
+    def __init__(self, file: Union[str, bytes, memoryview, mmap.mmap] = None):
         self.logger = logging.getLogger(self.__class__.__name__)
+        self.mapping = None
         error = None
         if file is not None:
             try:
-                if os.path.isfile(file):
-                    with open(file, 'r') as f:
-                        content = json.loads(f.read())
+                if isinstance(file, (str, bytes)) and os.path.isfile(file):
+                    with open(file, 'rb') as f:
+                        if is_binary_varmap(f.read(4)):
+                            self.mapping = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+                            file = self.mapping
+                        else:
+                            f.seek(0)
+                            file = f.read()
+
+                if not isinstance(file, str) and is_binary_varmap(file):
+                    self.load_binary(file)
                 else:
-                    if isinstance(file, bytes):
-                        file = file.decode('utf8')
-                    content = json.loads(file)
-
-                self.validate_json(content)
-
-                if content['endianness'].lower().strip() == 'little':
-                    self.endianness = Endianness.Little
-                elif content['endianness'].lower().strip() == 'big':
-                    self.endianness = Endianness.Big
-                else:
-                    raise Exception('Unknown endianness %s' % content['endianness'])
-
-                self.typemap = content['type_map']
-                self.variables = content['variables']
-                self.enums = content['enums']
+                    self.load_json(file)
             except Exception as e:
                 error = e
 
             if error is not None:
+                if self.mapping is not None:
+                    self.mapping.close()
                 raise Exception('Error loading VarMap - %s: %s' % (type(error).__name__, str(error)))
 
         else:
@@ -83,11 +83,59 @@ class VarMap:
         self.validate()  # Validate only if loaded. Otherwise, we may be building a new varmap file (from CLI)
         self.init_all()
 
+    def load_json(self, file: Union[str, bytes, memoryview, mmap.mmap]) -> None:
+        if not isinstance(file, str):
+            file = bytes(file).decode('utf8')
+        content = json.loads(file)
+
+        self.validate_json(content)
+
+        if content['endianness'].lower().strip() == 'little':
+            self.endianness = Endianness.Little
+        elif content['endianness'].lower().strip() == 'big':
+            self.endianness = Endianness.Big
+        else:
+            raise Exception('Unknown endianness %s' % content['endianness'])
+
+        self.typemap = content['type_map']
+        self.variables = content['variables']
+        self.enums = content['enums']
+
+    def load_binary(self, data: Union[bytes, memoryview, mmap.mmap]) -> None:
+        """
+        Load a binary varmap. The variables are not decoded, they are read from the given buffer when accessed.
+        """
+        reader = BinaryVarMapReader(data)
+        self.endianness = reader.endianness
+        self.typemap = reader.typemap
+        self.variables = reader.variables
+        self.enums = reader.enums
+
+    def detach_buffer(self) -> None:
+        """Copies the binary varmap in memory so that the buffer it was loaded from can be released."""
+        if isinstance(self.variables, BinaryVariableTable) and not isinstance(self.variables.buffer, bytes):
+            self.variables.buffer = bytes(self.variables.buffer)
+
+    def close(self) -> None:
+        """
+        Releases the memory mapping of a binary varmap opened by filename, so that the file can be deleted or replaced,
+        which Windows forbids while it is mapped. The variables are copied in memory first. The VarMap stays usable.
+        """
+        self.detach_buffer()
+        if self.mapping is not None:
+            try:
+                self.mapping.close()
+            except BufferError as e:
+                # A view on the mapping is still alive somewhere. The mapping will be closed when garbage collected.
+                self.logger.debug('Cannot close the memory mapping of the VarMap. %s' % str(e))
+            self.mapping = None
+
     def init_all(self):
         self.next_type_id = 0
         self.next_enum_id = 0
         self.typename2typeid_map = {}   # Maps the type id of this VarMap to the original name inside the binary.
         self.enums_to_id_map = {}       # Maps a VariableEnum object to it's internal id
+        self.enum_cache = {}            # Parse each enum once. All variables using an enum share the same object
 
         # Build typename2typeid_map
         for typeid in self.typemap:
@@ -106,6 +154,7 @@ class VarMap:
 
             enum = VariableEnum.from_def(self.enums[str(enum_id)])
             self.enums_to_id_map[enum] = enum_id
+            self.enum_cache[str(enum_id)] = enum
 
     def set_endianness(self, endianness: Endianness) -> None:
         if endianness not in [Endianness.Little, Endianness.Big]:
@@ -116,6 +165,10 @@ class VarMap:
         with open(filename, 'w') as f:
             f.write(self.get_json())
 
+    def write_binary(self, filename: str) -> None:
+        with open(filename, 'wb') as f:
+            f.write(self.get_binary())
+
     def get_json(self) -> str:
         if self.endianness == Endianness.Little:
             endianness_str = 'little'
@@ -127,11 +180,20 @@ class VarMap:
         content = {
             'endianness': endianness_str,
             'type_map': self.typemap,
-            'variables': self.variables,
+            'variables': dict(self.variables),
             'enums': self.enums,
         }
         return json.dumps(content, indent=4)
 
+    def get_binary(self) -> bytes:
+        return encode_binary_varmap(self.endianness, self.typemap, self.variables, self.enums)
+
+    def get_writable_variables(self) -> Dict[str, VariableEntry]:
+        # A varmap loaded from a binary file is read-only. Convert to a dict if we need to modify it.
+        if not isinstance(self.variables, dict):
+            self.variables = dict(self.variables)
+        return self.variables
+
     def validate(self) -> None:
         pass
 
@@ -170,11 +232,37 @@ class VarMap:
             if enum not in self.enums_to_id_map:
                 self.enums[str(self.next_enum_id)] = enum.get_def()
                 self.enums_to_id_map[enum] = self.next_enum_id
+                self.enum_cache[str(self.next_enum_id)] = enum
                 self.next_enum_id += 1
 
             entry['enum_id'] = self.enums_to_id_map[enum]
 
-        self.variables[fullname] = entry
+        self.get_writable_variables()[fullname] = entry
+
+    def merge(self, other: "VarMap") -> None:
+        """
+        Add the content of another VarMap to this one. Types and enums of the other VarMap
+        get new ids, assigned in the same order they have in the other VarMap.
+        """
+        if other.endianness != self.endianness:
+            raise ValueError('Cannot merge VarMaps with different endianness')
+
+        for type_id in sorted(other.typemap.keys(), key=int):
+            type_entry = other.typemap[type_id]
+            self.register_base_type(type_entry['name'], VariableType[type_entry['type']])
+
+        for fullname in other.variables:
+            vardef = other.variables[fullname]
+            segments, name = self.make_segments(fullname)
+            self.add_variable(
+                path_segments=segments,
+                name=name,
+                location=VariableLocation(other.get_addr(vardef)),
+                original_type_name=other.typemap[str(vardef['type_id'])]['name'],
+                bitsize=other.get_bitsize(vardef),
+                bitoffset=other.get_bitoffset(vardef),
+                enum=other.get_enum(vardef)     # Same object for all variables using this enum. Keeps a single enum id
+            )
 
     def register_base_type(self, original_name: str, vartype: VariableType) -> None:
         if not isinstance(vartype, VariableType):
@@ -265,10 +353,19 @@ class VarMap:
             enum_id = str(vardef['enum_id'])
             if enum_id not in self.enums:
                 raise Exception("Unknown enum_id %s" % enum_id)
-            enum_def = self.enums[enum_id]
-            return VariableEnum.from_def(enum_def)
+            if enum_id not in self.enum_cache:
+                self.enum_cache[enum_id] = VariableEnum.from_def(self.enums[enum_id])
+            return self.enum_cache[enum_id]
         return None
 
     def iterate_vars(self) -> Generator[Tuple[str, Variable], None, None]:
         for fullname in self.variables:
             yield (fullname, self.get_var(fullname))
+
+    def iterate_vars_fullname(self) -> Generator[str, None, None]:
+        """
+        Iterate the variable names without building a Variable object for each of them.
+        Use get_var() to materialize a variable when it is actually needed.
+        """
+        for fullname in self.variables:
+            yield fullname
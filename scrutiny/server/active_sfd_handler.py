@@ -106,9 +106,10 @@ class ActiveSFDHandler:
             self.logger.info('Loading firmware description file (SFD) for firmware ID %s' % firmware_id)
             self.sfd = SFDStorage.get(firmware_id)
 
-            # populate datastore
-            for fullname, vardef in self.sfd.get_vars_for_datastore():
-                entry = DatastoreEntry(entry_type=DatastoreEntry.EntryType.Var, display_path=fullname, variable_def=vardef)
+            # populate datastore. Variables definitions are loaded from the varmap only when needed
+            varmap = self.sfd.get_varmap()
+            for fullname in self.sfd.get_vars_fullname_for_datastore():
+                entry = DatastoreEntry(entry_type=DatastoreEntry.EntryType.Var, display_path=fullname, varmap=varmap)
                 try:
                     self.datastore.add_entry(entry)
                 except Exception as e:
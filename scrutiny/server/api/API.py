@@ -11,11 +11,20 @@ import os
 import sys
 import logging
 import traceback
+import threading
+import time
+import uuid
+import appdirs  # type: ignore
+from collections import deque
 
 from scrutiny.server.datastore import Datastore, DatastoreEntry
 from scrutiny.server.tools import Timer
 from scrutiny.server.device.device_handler import DeviceHandler
+from scrutiny.server.device.request_generator.datalog_manager import DatalogAcquisition, AcquisitionCompletedCallback
+from scrutiny.server.protocol.datalog import DatalogConfiguration
 from scrutiny.server.active_sfd_handler import ActiveSFDHandler, SFDLoadedCallback, SFDUnloadedCallback
+from scrutiny.server.device_instance import DeviceInstance, DeviceSnapshot, ValueUpdateCallback, PublishPolicy
+from scrutiny.server.value_recorder import ValueRecorder
 from scrutiny.server.device.links import AbstractLink, LinkConfig
 from scrutiny.core.sfd_storage import SFDStorage
 from scrutiny.core import Variable, VariableType
@@ -29,16 +38,13 @@ from .message_definitions import *
 from .abstract_client_handler import AbstractClientHandler, ClientHandlerConfig, ClientHandlerMessage
 
 from scrutiny.core.typehints import GenericCallback
-from typing import Callable, Dict, List, Set, Any, TypedDict, cast
+from typing import Callable, Dict, List, Set, Any, TypedDict, Tuple, Deque, cast
 
 
 class APIConfig(TypedDict, total=False):
     client_interface_type: str
     client_interface_config: Any
-
-
-class UpdateVarCallback(GenericCallback):
-    callback: Callable[[str, DatastoreEntry], None]
+    recording_dir: str      # Where the capture files of start_recording are written
 
 
 class InvalidRequestException(Exception):
@@ -47,6 +53,45 @@ class InvalidRequestException(Exception):
         self.req = req
 
 
+class WriteBatch:
+    """
+    A group of values to write, requested by a client with a single request. Tracks the write request made
+    on each datastore entry so that a single response can be sent once all of them are completed.
+    A batch is not atomic : each value succeeds or fails on its own and nothing is rolled back. The response gives the status of each.
+    """
+    conn_id: str
+    reqid: Any
+    items: List[Tuple[DeviceInstance, DatastoreEntry, Any]]
+    update_requests: Dict[str, DatastoreEntry.UpdateTargetRequest]
+    creation_timestamp: float
+    cancelled: bool
+
+    def __init__(self, conn_id: str, reqid: Any, items: List[Tuple[DeviceInstance, DatastoreEntry, Any]]):
+        self.conn_id = conn_id
+        self.reqid = reqid
+        self.items = items
+        self.update_requests = {}   # Filled by the device threads
+        self.creation_timestamp = time.time()
+        self.cancelled = False  # Set when timed out. The device threads must not start the writes anymore
+
+    def get_status(self, entry: DatastoreEntry) -> Optional[str]:
+        # None means the write is still in progress
+        update_request = self.update_requests.get(entry.get_id(), None)
+        if update_request is None:
+            return None
+
+        if update_request.is_success():
+            return 'success'
+        if update_request.is_failed():
+            return 'failed'
+        if entry.pending_target_update is not update_request:
+            return 'superseded'     # Someone requested another value before this one could be written
+        return None
+
+    def is_complete(self) -> bool:
+        return all([self.get_status(entry) is not None for device, entry, value in self.items])
+
+
 class API:
 
     # List of commands that can be shared with the clients
@@ -63,6 +108,12 @@ class API:
             GET_SERVER_STATUS = 'get_server_status'
             SET_LINK_CONFIG = "set_link_config"
             GET_POSSIBLE_LINK_CONFIG = "get_possible_link_config"   # todo
+            GET_DEVICE_LIST = 'get_device_list'
+            WRITE_WATCHABLE = 'write_watchable'
+            DATALOG_ACQUIRE = 'datalog_acquire'
+            DATALOG_CANCEL = 'datalog_cancel'
+            START_RECORDING = 'start_recording'
+            STOP_RECORDING = 'stop_recording'
             DEBUG = 'debug'
 
         class Api2Client:
@@ -76,10 +127,19 @@ class API:
             GET_LOADED_SFD_RESPONSE = 'response_get_loaded_sfd'
             GET_POSSIBLE_LINK_CONFIG_RESPONSE = "response_get_possible_link_config"
             SET_LINK_CONFIG_RESPONSE = 'set_link_config_response'
+            GET_DEVICE_LIST_RESPONSE = 'response_get_device_list'
+            WRITE_WATCHABLE_RESPONSE = 'response_write_watchable'
+            DATALOG_ACQUIRE_RESPONSE = 'response_datalog_acquire'
+            DATALOG_CANCEL_RESPONSE = 'response_datalog_cancel'
+            START_RECORDING_RESPONSE = 'response_start_recording'
+            STOP_RECORDING_RESPONSE = 'response_stop_recording'
             INFORM_SERVER_STATUS = 'inform_server_status'
             ERROR_RESPONSE = 'error'
 
     FLUSH_VARS_TIMEOUT: float = 0.1
+    DEFAULT_RECORDING_DIR: str = appdirs.user_data_dir('recordings', 'scrutiny')
+    WRITE_TIMEOUT: float = 5.0    # A write batch not completed after this delay is answered with the remaining writes timed out
+    DATALOG_DEFAULT_TIMEOUT: float = 60.0  # An acquisition not triggered after this delay is disarmed and answered with a failure
 
     entry_type_to_str: Dict[DatastoreEntry.EntryType, str] = {
         DatastoreEntry.EntryType.Var: 'var',
@@ -123,6 +183,17 @@ class API:
         DeviceHandler.ConnectionStatus.CONNECTED_READY: 'connected_ready'
     }
 
+    str_to_trigger_condition: Dict[str, DatalogConfiguration.TriggerCondition] = {
+        'eq': DatalogConfiguration.TriggerCondition.EQUAL,
+        'lt': DatalogConfiguration.TriggerCondition.LESS_THAN,
+        'gt': DatalogConfiguration.TriggerCondition.GREATER_THAN,
+        'let': DatalogConfiguration.TriggerCondition.LESS_OR_EQUAL_THAN,
+        'get': DatalogConfiguration.TriggerCondition.GREATER_OR_EQUAL_THAN,
+        'change': DatalogConfiguration.TriggerCondition.CHANGE,
+        'change_gt': DatalogConfiguration.TriggerCondition.CHANGE_GREATER,
+        'change_lt': DatalogConfiguration.TriggerCondition.CHANGE_LESS
+    }
+
     str_to_entry_type: Dict[str, DatastoreEntry.EntryType] = {
         'var': DatastoreEntry.EntryType.Var,
         'alias': DatastoreEntry.EntryType.Alias
@@ -136,6 +207,14 @@ class API:
     req_count: int
     client_handler: AbstractClientHandler
     sfd_handler: ActiveSFDHandler
+    devices: Dict[str, DeviceInstance]
+    default_device: DeviceInstance
+    stream_lock: threading.Lock
+    write_batches: List[WriteBatch]
+    datalog_completions: Deque[Tuple[str, Any, DatalogAcquisition]]
+    datalog_acquisitions: Dict[DatalogAcquisition, Tuple[str, Any, DeviceInstance]]   # acquisition -> (conn_id, reqid, device)
+    recorders: Dict[str, ValueRecorder]
+    recording_dir: str
 
     # The method to call for each command
     ApiRequestCallbacks: Dict[str, str] = {
@@ -149,8 +228,13 @@ class API:
         Command.Client2Api.GET_LOADED_SFD: 'process_get_loaded_sfd',
         Command.Client2Api.GET_SERVER_STATUS: 'process_get_server_status',
         Command.Client2Api.SET_LINK_CONFIG: 'process_set_link_config',
-        Command.Client2Api.GET_POSSIBLE_LINK_CONFIG: 'process_get_possible_link_config'
-
+        Command.Client2Api.GET_POSSIBLE_LINK_CONFIG: 'process_get_possible_link_config',
+        Command.Client2Api.GET_DEVICE_LIST: 'process_get_device_list',
+        Command.Client2Api.WRITE_WATCHABLE: 'process_write_watchable',
+        Command.Client2Api.DATALOG_ACQUIRE: 'process_datalog_acquire',
+        Command.Client2Api.DATALOG_CANCEL: 'process_datalog_cancel',
+        Command.Client2Api.START_RECORDING: 'process_start_recording',
+        Command.Client2Api.STOP_RECORDING: 'process_stop_recording'
     }
 
     def __init__(self, config: APIConfig, datastore: Datastore, device_handler: DeviceHandler, sfd_handler: ActiveSFDHandler, enable_debug: bool = False):
@@ -169,7 +253,13 @@ class API:
         self.logger = logging.getLogger('scrutiny.' + self.__class__.__name__)
         self.connections = set()            # Keep a list of all clients connections
         self.streamer = ValueStreamer()     # The value streamer takes cares of publishing values to the client without polling.
+        self.stream_lock = threading.Lock()  # Values can be published from outside the API thread when a device has no thread
         self.req_count = 0
+        self.write_batches = []
+        self.datalog_completions = deque()   # Appended by the device threads
+        self.datalog_acquisitions = {}
+        self.recorders = {}     # Not tied to a connection. Keeps recording until stopped or the server closes
+        self.recording_dir = config.get('recording_dir', self.DEFAULT_RECORDING_DIR)
 
         self.enable_debug = enable_debug
 
@@ -178,42 +268,72 @@ class API:
             API.Command.Client2Api.DEBUG = 'debug'
             self.ApiRequestCallbacks[API.Command.Client2Api.DEBUG] = 'process_debug'
 
-        self.sfd_handler.register_sfd_loaded_callback(SFDLoadedCallback(self.sfd_loaded_callback))
-        self.sfd_handler.register_sfd_unloaded_callback(SFDUnloadedCallback(self.sfd_unloaded_callback))
+        # The components given to the constructor are the default device. Requests without a "device" field goes to it.
+        self.devices = {}
+        self.default_device = DeviceInstance(DeviceInstance.DEFAULT_NAME, datastore=datastore, device_handler=device_handler, sfd_handler=sfd_handler)
+        self.add_device(self.default_device)
+
+    def add_device(self, device: DeviceInstance) -> None:
+        if device.name in self.devices:
+            raise ValueError('A device named "%s" already exists' % device.name)
+
+        self.devices[device.name] = device
+        device.set_value_update_callback(ValueUpdateCallback(self.value_update_callback))
+        device.sfd_handler.register_sfd_loaded_callback(SFDLoadedCallback(lambda sfd: self.sfd_loaded_callback(device, sfd)))
+        device.sfd_handler.register_sfd_unloaded_callback(SFDUnloadedCallback(lambda: self.sfd_unloaded_callback(device)))
 
-    def sfd_loaded_callback(self, sfd: FirmwareDescription):
-        for conn_id in self.connections:
-            self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=self.craft_inform_server_status_response()))
+    def get_devices(self) -> List[DeviceInstance]:
+        return list(self.devices.values())
 
-    def sfd_unloaded_callback(self):
-        for conn_id in self.connections:
-            self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=self.craft_inform_server_status_response()))
+    def sfd_loaded_callback(self, device: DeviceInstance, sfd: FirmwareDescription):
+        for conn_id in list(self.connections):
+            self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=self.craft_inform_server_status_response(device=device)))
+
+    def sfd_unloaded_callback(self, device: DeviceInstance):
+        for conn_id in list(self.connections):
+            self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=self.craft_inform_server_status_response(device=device)))
 
     def get_client_handler(self) -> AbstractClientHandler:
         return self.client_handler
 
     def open_connection(self, conn_id: str) -> None:
         self.connections.add(conn_id)
-        self.streamer.new_connection(conn_id)
+        with self.stream_lock:
+            self.streamer.new_connection(conn_id)
 
     def close_connection(self, conn_id: str) -> None:
         self.connections.remove(conn_id)
-        self.streamer.clear_connection(conn_id)
+        self.write_batches = [batch for batch in self.write_batches if batch.conn_id != conn_id]
+        # Nobody is left to receive the recording. Free the datalogger for the other clients
+        for acquisition, (acquisition_conn_id, reqid, device) in list(self.datalog_acquisitions.items()):
+            if acquisition_conn_id == conn_id:
+                del self.datalog_acquisitions[acquisition]
+                self.cancel_datalog_acquisition(device, acquisition)
+        with self.stream_lock:
+            self.streamer.clear_connection(conn_id)
 
     def is_new_connection(self, conn_id: str) -> bool:
         return True if conn_id not in self.connections else False
 
     # Extract a chunk of data from the value streamer and send it to the clients.
     def stream_all_we_can(self) -> None:
-        for conn_id in self.connections:
-            chunk = self.streamer.get_stream_chunk(conn_id)     # get a list of entry to send to this connection
+        for conn_id in list(self.connections):
+            with self.stream_lock:
+                chunk = self.streamer.get_stream_chunk(conn_id)     # get a list of entry to send to this connection
 
             if len(chunk) == 0:
                 continue
 
+            updates = []
+            for entry, value, timestamp in chunk:
+                if timestamp is None:
+                    updates.append(dict(id=entry.get_id(), value=value))
+                else:   # Decimated streams sends many points per entry
+                    updates.append(dict(id=entry.get_id(), value=value, timestamp=timestamp))
+
             msg = {
                 'cmd': self.Command.Api2Client.WATCHABLE_UPDATE,
-                'updates': [dict(id=x.get_id(), value=x.get_value()) for x in chunk]
+                'updates': updates
             }
 
             self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=msg))
@@ -250,8 +370,17 @@ class API:
             self.logger.debug('Closing connection %s' % conn_id)
             self.close_connection(conn_id)
 
-        self.streamer.process()
+        # Values changed by the device threads since last time. Handed off through their snapshot buffers
+        for device in self.get_devices():
+            for conn_id, entry, value, timestamp in device.pop_value_updates():
+                with self.stream_lock:
+                    self.streamer.publish(entry, conn_id, value, timestamp)
+
+        with self.stream_lock:
+            self.streamer.process()
         self.stream_all_we_can()
+        self.process_write_batches()
+        self.process_datalog_completions()
 
     # Process a request gotten from the Client Handler
 
@@ -320,8 +449,9 @@ class API:
         if len(type_to_include) == 0:
             type_to_include = [DatastoreEntry.EntryType.Var, DatastoreEntry.EntryType.Alias]
 
-        variables = self.datastore.get_entries_list_by_type(DatastoreEntry.EntryType.Var) if DatastoreEntry.EntryType.Var in type_to_include else []
-        alias = self.datastore.get_entries_list_by_type(DatastoreEntry.EntryType.Alias) if DatastoreEntry.EntryType.Alias in type_to_include else []
+        snapshot = self.get_device(req).get_snapshot()
+        variables = snapshot.get_entries_list_by_type(DatastoreEntry.EntryType.Var) if DatastoreEntry.EntryType.Var in type_to_include else []
+        alias = snapshot.get_entries_list_by_type(DatastoreEntry.EntryType.Alias) if DatastoreEntry.EntryType.Alias in type_to_include else []
 
         done = False
         while not done:
@@ -358,12 +488,13 @@ class API:
 
     #  ===  GET_WATCHABLE_COUNT ===
     def process_get_watchable_count(self, conn_id: str, req: Dict[Any, Any]) -> None:
+        snapshot = self.get_device(req).get_snapshot()
         response = {
             'cmd': self.Command.Api2Client.GET_WATCHABLE_COUNT_RESPONSE,
             'reqid': self.get_req_id(req),
             'qty': {
-                'var': self.datastore.get_entries_count(DatastoreEntry.EntryType.Var),
-                'alias': self.datastore.get_entries_count(DatastoreEntry.EntryType.Alias)
+                'var': snapshot.get_entries_count(DatastoreEntry.EntryType.Var),
+                'alias': snapshot.get_entries_count(DatastoreEntry.EntryType.Alias)
             }
         }
 
@@ -374,14 +505,32 @@ class API:
         if 'watchables' not in req and not isinstance(req['watchables'], list):
             raise InvalidRequestException(req, 'Invalid or missing watchables list')
 
-        for watchable in req['watchables']:
+        decimation = None
+        if 'decimation' in req and req['decimation'] is not None:
+            decimation = req['decimation']
+            if not self.is_dict_with_key(decimation, 'mode') or decimation['mode'] not in ValueStreamer.DECIMATION_MODES:
+                raise InvalidRequestException(req, 'Invalid decimation mode')
+            if 'max_rate' not in decimation or not isinstance(decimation['max_rate'], (int, float)) or decimation['max_rate'] <= 0:
+                raise InvalidRequestException(req, 'Invalid decimation max_rate')
+
+        publish_policy = None
+        if 'publish_policy' in req and req['publish_policy'] is not None:
+            publish_policy = req['publish_policy']
             try:
-                entry = self.datastore.get_entry(watchable)
-            except KeyError as e:
-                raise InvalidRequestException(req, 'Unknown watchable ID : %s' % str(watchable))
+                PublishPolicy.validate_config(publish_policy)
+            except ValueError as e:
+                raise InvalidRequestException(req, 'Invalid publish policy. %s' % str(e))
 
+        devices = self.find_watchables_device(req)
         for watchable in req['watchables']:
-            self.datastore.start_watching(watchable, watcher=conn_id, callback=UpdateVarCallback(self.var_update_callback))
+            with self.stream_lock:
+                if decimation is not None:
+                    self.streamer.set_decimation(conn_id, watchable, decimation['mode'], decimation['max_rate'])
+                else:
+                    self.streamer.clear_decimation(conn_id, watchable)
+            # Each watchable tracks its own last published value
+            policy = PublishPolicy(publish_policy) if publish_policy is not None else None
+            devices[watchable].start_watching(watchable, watcher=conn_id, publish_policy=policy)
 
         response = {
             'cmd': self.Command.Api2Client.SUBSCRIBE_WATCHABLE_RESPONSE,
@@ -396,14 +545,11 @@ class API:
         if 'watchables' not in req and not isinstance(req['watchables'], list):
             raise InvalidRequestException(req, 'Invalid or missing watchables list')
 
+        devices = self.find_watchables_device(req)
         for watchable in req['watchables']:
-            try:
-                entry = self.datastore.get_entry(watchable)
-            except KeyError as e:
-                raise InvalidRequestException(req, 'Unknown watchable ID : %s' % str(watchable))
-
-        for watchable in req['watchables']:
-            self.datastore.stop_watching(watchable, watcher=conn_id)
+            devices[watchable].stop_watching(watchable, watcher=conn_id)
+            with self.stream_lock:
+                self.streamer.clear_decimation(conn_id, watchable)
 
         response = {
             'cmd': self.Command.Api2Client.SUBSCRIBE_WATCHABLE_RESPONSE,
@@ -414,10 +560,7 @@ class API:
         self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=response))
 
     def process_get_installed_sfd(self, conn_id: str, req: Dict[Any, Any]):
-        firmware_id_list = SFDStorage.list()
-        metadata_dict = {}
-        for firmware_id in firmware_id_list:
-            metadata_dict[firmware_id] = SFDStorage.get_metadata(firmware_id)
+        metadata_dict = SFDStorage.list_metadata()
 
         response = {
             'cmd': self.Command.Api2Client.GET_INSTALLED_SFD_RESPONSE,
@@ -428,7 +571,7 @@ class API:
         self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=response))
 
     def process_get_loaded_sfd(self, conn_id: str, req: Dict[Any, Any]):
-        sfd = self.sfd_handler.get_loaded_sfd()
+        sfd = self.get_device(req).get_snapshot().loaded_sfd
 
         response = {
             'cmd': self.Command.Api2Client.GET_LOADED_SFD_RESPONSE,
@@ -442,15 +585,17 @@ class API:
         if 'firmware_id' not in req and not isinstance(req['firmware_id'], str):
             raise InvalidRequestException(req, 'Invalid firmware_id')
 
+        device = self.get_device(req)
+        firmware_id = req['firmware_id']
         try:
-            self.sfd_handler.request_load_sfd(req['firmware_id'])
+            device.run_command(lambda: device.sfd_handler.request_load_sfd(firmware_id))
         except Exception as e:
             self.logger.error('Cannot load SFD %s. %s' % (req['firmware_id'], str(e)))
 
         # Do not send a response. There's a callback on SFD Loading that will notfy everyone.
 
     def process_get_server_status(self, conn_id: str, req: Dict[Any, Any]):
-        obj = self.craft_inform_server_status_response(reqid=self.get_req_id(req))
+        obj = self.craft_inform_server_status_response(reqid=self.get_req_id(req), device=self.get_device(req))
         self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=obj))
 
     def process_set_link_config(self, conn_id: str, req: Dict[Any, Any]):
@@ -460,16 +605,19 @@ class API:
         if 'link_config' not in req and not isinstance(req['link_config'], dict):
             raise InvalidRequestException(req, 'Invalid link_config')
 
+        device = self.get_device(req)
         link_config_err: Optional[Exception] = None
         try:
-            self.device_handler.validate_link_config(req['link_type'], req['link_config'])
+            device.device_handler.validate_link_config(req['link_type'], req['link_config'])
         except Exception as e:
             link_config_err = e
 
         if link_config_err:
             raise InvalidRequestException(req, "Link configuration is not good for given link type. " + str(link_config_err))
 
-        self.device_handler.configure_comm(req['link_type'], cast(LinkConfig, req['link_config']))
+        link_type = req['link_type']
+        link_config = cast(LinkConfig, req['link_config'])
+        device.run_command(lambda: device.device_handler.configure_comm(link_type, link_config))
 
         response = {
             'cmd': self.Command.Api2Client.SET_LINK_CONFIG_RESPONSE,
@@ -500,6 +648,30 @@ class API:
 
         configs.append(udp_config)
 
+        replay_config = {
+            'name': 'replay',
+            'params': {
+                'filename': {
+                    'description': 'Recorded session file',
+                    'type': 'string'
+                },
+                'speed': {
+                    'description': 'Playback speed. 1 is real time',
+                    'default': 1.0,
+                    'type': 'select',
+                    'text-edit': True,
+                    'values': [1, 10, 100]
+                },
+                'loop': {
+                    'description': 'Start over at the end of the session',
+                    'default': False,
+                    'type': 'bool'
+                }
+            }
+        }
+
+        configs.append(replay_config)
+
         try:
             import serial.tools.list_ports  # type: ignore
             ports = serial.tools.list_ports.comports()
@@ -565,12 +737,267 @@ class API:
 
         self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=response))
 
-    def craft_inform_server_status_response(self, reqid=None) -> ApiMsg_S2C_InformServerStatus:
+    def process_get_device_list(self, conn_id: str, req: Dict[Any, Any]):
+        device_list = []
+        for device in self.get_devices():
+            snapshot = device.get_snapshot()
+            device_list.append({
+                'name': device.name,
+                'device_status': self.device_conn_status_to_str[snapshot.connection_status],
+                'link_type': snapshot.link_type
+            })
+
+        response = {
+            'cmd': self.Command.Api2Client.GET_DEVICE_LIST_RESPONSE,
+            'reqid': self.get_req_id(req),
+            'default': self.default_device.name,
+            'devices': device_list
+        }
+
+        self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=response))
+
+    #  ===  WRITE_WATCHABLE ===
+    def process_write_watchable(self, conn_id: str, req: Dict[Any, Any]) -> None:
+        if 'updates' not in req or not isinstance(req['updates'], list) or len(req['updates']) == 0:
+            raise InvalidRequestException(req, 'Invalid or missing updates list')
+
+        watchables = []
+        for update in req['updates']:
+            if not isinstance(update, dict) or 'watchable' not in update or 'value' not in update:
+                raise InvalidRequestException(req, 'Updates must have a watchable and a value')
+            if not isinstance(update['value'], (int, float, bool)):
+                raise InvalidRequestException(req, 'Invalid value for watchable %s' % str(update['watchable']))
+            if update['watchable'] in watchables:
+                raise InvalidRequestException(req, 'Watchable %s is written more than once' % str(update['watchable']))
+            watchables.append(update['watchable'])
+
+        devices = self.find_watchables_device({'watchables': watchables})
+        items: List[Tuple[DeviceInstance, DatastoreEntry, Any]] = []
+        for update in req['updates']:
+            device = devices[update['watchable']]
+            entry = device.get_snapshot().get_entry(update['watchable'])
+            items.append((device, entry, update['value']))
+
+        batch = WriteBatch(conn_id, self.get_req_id(req), items)
+        self.write_batches.append(batch)
+
+        # All the values of a device are given in a single command so the MemoryWriter can pack them in as few requests as possible.
+        for device in set([item[0] for item in items]):
+            device.run_command(self.make_write_command(batch, device))
+
+    def make_write_command(self, batch: WriteBatch, device: DeviceInstance) -> Callable[[], None]:
+        def command() -> None:
+            if batch.cancelled:
+                return  # Timed out while waiting in the command queue. Client has been told it will not be written
+            for item_device, entry, value in batch.items:
+                if item_device is device:
+                    entry.update_target_value(value)
+                    assert entry.pending_target_update is not None
+                    batch.update_requests[entry.get_id()] = entry.pending_target_update
+        return command
+
+    def process_write_batches(self) -> None:
+        completed_batches = []
+        for batch in self.write_batches:
+            timed_out = time.time() - batch.creation_timestamp > self.WRITE_TIMEOUT
+            if not timed_out and not batch.is_complete():
+                continue
+
+            # Writes already requested to the device thread are discarded below. A write already sent to the device may still land.
+            batch.cancelled = timed_out
+            results = []
+            for device, entry, value in batch.items:
+                status = batch.get_status(entry)
+                update_request = batch.update_requests.get(entry.get_id(), None)
+                if status is None:
+                    status = 'timeout'
+                    if update_request is not None:
+                        device.run_command(self.make_discard_command(entry, update_request))
+
+                completion_timestamp = update_request.get_completion_timestamp() if update_request is not None else None
+                results.append({
+                    'watchable': entry.get_id(),
+                    'success': status == 'success',
+                    'status': status,
+                    'timestamp': completion_timestamp,
+                    'duration': completion_timestamp - batch.creation_timestamp if completion_timestamp is not None else None
+                })
+
+            response = {
+                'cmd': self.Command.Api2Client.WRITE_WATCHABLE_RESPONSE,
+                'reqid': batch.reqid,
+                'results': results
+            }
+            self.client_handler.send(ClientHandlerMessage(conn_id=batch.conn_id, obj=response))
+            completed_batches.append(batch)
+
+        if len(completed_batches) > 0:
+            self.write_batches = [batch for batch in self.write_batches if batch not in completed_batches]
+
+    def make_discard_command(self, entry: DatastoreEntry, update_request: DatastoreEntry.UpdateTargetRequest) -> Callable[[], None]:
+        def command() -> None:
+            # Do not write a value that the client has been told has timed out, unless another write request replaced it.
+            if entry.pending_target_update is update_request and not update_request.is_complete():
+                entry.discard_target_update_request()
+        return command
+
+    #  ===  DATALOG_ACQUIRE ===
+    def process_datalog_acquire(self, conn_id: str, req: Dict[Any, Any]) -> None:
+        if 'watchables' not in req or not isinstance(req['watchables'], list) or len(req['watchables']) == 0:
+            raise InvalidRequestException(req, 'Invalid or missing watchables list')
+
+        if 'sample_rate' not in req or not isinstance(req['sample_rate'], (int, float)) or req['sample_rate'] <= 0:
+            raise InvalidRequestException(req, 'Invalid or missing sample rate')
+
+        decimation = req.get('decimation', 1)
+        if not isinstance(decimation, int) or decimation < 1:
+            raise InvalidRequestException(req, 'Invalid decimation')
+
+        if not self.is_dict_with_key(req, 'trigger') or not self.is_dict_with_key(req['trigger'], 'condition') or not self.is_dict_with_key(req['trigger'], 'operands'):
+            raise InvalidRequestException(req, 'Invalid or missing trigger')
+
+        timeout = req.get('timeout', self.DATALOG_DEFAULT_TIMEOUT)
+        if not isinstance(timeout, (int, float)) or isinstance(timeout, bool) or timeout <= 0:
+            raise InvalidRequestException(req, 'Invalid timeout')
+
+        if req['trigger']['condition'] not in self.str_to_trigger_condition:
+            raise InvalidRequestException(req, 'Unknown trigger condition %s' % str(req['trigger']['condition']))
+
+        operands = req['trigger']['operands']
+        if not isinstance(operands, list) or len(operands) != 2:
+            raise InvalidRequestException(req, 'Trigger needs 2 operands')
+
+        operand_watchables = [operand['watchable'] for operand in operands if self.is_dict_with_key(operand, 'watchable')]
+        devices = self.find_watchables_device({'watchables': req['watchables'] + operand_watchables})
+        if len(set(devices.values())) != 1:
+            raise InvalidRequestException(req, 'All watchables must be on the same device')
+        device = devices[req['watchables'][0]]
+
+        reqid = self.get_req_id(req)
+        # Called from the device thread. The deque hands the acquisition over to the API thread.
+        callback = AcquisitionCompletedCallback(lambda acquisition: self.datalog_completions.append((conn_id, reqid, acquisition)))
+        snapshot = device.get_snapshot()
+        entries = [snapshot.get_entry(watchable) for watchable in req['watchables']]
+        trigger = DatalogConfiguration.Trigger()
+        trigger.condition = self.str_to_trigger_condition[req['trigger']['condition']]
+        trigger.operand1 = self.make_trigger_operand(req, snapshot, operands[0])
+        trigger.operand2 = self.make_trigger_operand(req, snapshot, operands[1])
+        try:
+            acquisition = DatalogAcquisition(entries, sample_rate=req['sample_rate'], trigger=trigger, decimation=decimation,
+                                             completion_callback=callback, timeout=timeout)
+        except ValueError as e:
+            raise InvalidRequestException(req, str(e))
+
+        self.datalog_acquisitions[acquisition] = (conn_id, reqid, device)
+        device.run_command(lambda: device.device_handler.request_datalog_acquisition(acquisition))
 
-        sfd = self.sfd_handler.get_loaded_sfd()
-        device_link_type = self.device_handler.get_link_type()
-        device_comm_link = self.device_handler.get_comm_link()
-        device_info_input = self.device_handler.get_device_info()
+    #  ===  DATALOG_CANCEL ===
+    def process_datalog_cancel(self, conn_id: str, req: Dict[Any, Any]) -> None:
+        # The acquisition is identified by the reqid of the datalog_acquire request. Its response comes with a "Cancelled" error.
+        if 'acquire_reqid' not in req:
+            raise InvalidRequestException(req, 'Missing acquire_reqid')
+
+        to_cancel = [(acquisition, device) for acquisition, (acquisition_conn_id, reqid, device) in self.datalog_acquisitions.items()
+                     if acquisition_conn_id == conn_id and reqid == req['acquire_reqid']]
+        if len(to_cancel) == 0:
+            raise InvalidRequestException(req, 'No acquisition in progress for request ID %s' % str(req['acquire_reqid']))
+
+        for acquisition, device in to_cancel:
+            self.cancel_datalog_acquisition(device, acquisition)
+
+        response = {
+            'cmd': self.Command.Api2Client.DATALOG_CANCEL_RESPONSE,
+            'reqid': self.get_req_id(req)
+        }
+        self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=response))
+
+    def cancel_datalog_acquisition(self, device: DeviceInstance, acquisition: DatalogAcquisition) -> None:
+        device.run_command(lambda: device.device_handler.cancel_datalog_acquisition(acquisition))
+
+    def make_trigger_operand(self, req: Dict[Any, Any], snapshot: DeviceSnapshot, operand: Any) -> DatalogConfiguration.Operand:
+        if self.is_dict_with_key(operand, 'value') and isinstance(operand['value'], (int, float)):
+            return DatalogConfiguration.ConstOperand(operand['value'])
+
+        if self.is_dict_with_key(operand, 'watchable'):
+            entry = snapshot.get_entry(operand['watchable'])
+            return DatalogConfiguration.WatchOperand(address=entry.get_address(), length=entry.get_size(), interpret_as=entry.get_data_type())
+
+        raise InvalidRequestException(req, 'Trigger operands must have a value or a watchable')
+
+    def process_datalog_completions(self) -> None:
+        while True:
+            try:
+                conn_id, reqid, acquisition = self.datalog_completions.popleft()
+            except IndexError:
+                break
+
+            self.datalog_acquisitions.pop(acquisition, None)
+
+            if conn_id not in self.connections:
+                continue
+
+            response = {
+                'cmd': self.Command.Api2Client.DATALOG_ACQUIRE_RESPONSE,
+                'reqid': reqid,
+                'success': acquisition.success,
+                'error': acquisition.error,
+                'data': dict([(entry_id, list(column)) for entry_id, column in acquisition.data.items()])
+            }
+            self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=response))
+
+    #  ===  START_RECORDING ===
+    def process_start_recording(self, conn_id: str, req: Dict[Any, Any]) -> None:
+        if 'watchables' not in req or not isinstance(req['watchables'], list) or len(req['watchables']) == 0:
+            raise InvalidRequestException(req, 'Invalid or missing watchables list')
+
+        devices = self.find_watchables_device(req)
+        if len(set(devices.values())) != 1:
+            raise InvalidRequestException(req, 'All watchables must be on the same device')
+        device = devices[req['watchables'][0]]
+
+        snapshot = device.get_snapshot()
+        entries = [snapshot.get_entry(watchable) for watchable in req['watchables']]
+
+        recording_id = uuid.uuid4().hex
+        os.makedirs(self.recording_dir, exist_ok=True)
+        filename = os.path.join(self.recording_dir, '%s_%s.scap' % (time.strftime('%Y%m%d_%H%M%S'), recording_id[0:8]))
+        recorder = ValueRecorder(recording_id, device, entries, filename)
+        recorder.start()
+        self.recorders[recording_id] = recorder
+
+        response = {
+            'cmd': self.Command.Api2Client.START_RECORDING_RESPONSE,
+            'reqid': self.get_req_id(req),
+            'recording_id': recording_id,
+            'filename': filename
+        }
+        self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=response))
+
+    #  ===  STOP_RECORDING ===
+    def process_stop_recording(self, conn_id: str, req: Dict[Any, Any]) -> None:
+        if 'recording_id' not in req or req['recording_id'] not in self.recorders:
+            raise InvalidRequestException(req, 'Unknown recording')
+
+        recorder = self.recorders[req['recording_id']]
+        del self.recorders[req['recording_id']]
+        recorder.stop()
+
+        response = {
+            'cmd': self.Command.Api2Client.STOP_RECORDING_RESPONSE,
+            'reqid': self.get_req_id(req),
+            'recording_id': req['recording_id'],
+            'filename': recorder.filename,
+            'sample_count': recorder.get_sample_count()
+        }
+        self.client_handler.send(ClientHandlerMessage(conn_id=conn_id, obj=response))
+
+    def craft_inform_server_status_response(self, reqid=None, device: Optional[DeviceInstance] = None) -> ApiMsg_S2C_InformServerStatus:
+        if device is None:
+            device = self.default_device
+
+        snapshot = device.get_snapshot()
+        sfd = snapshot.loaded_sfd
+        device_info_input = snapshot.device_info
 
         loaded_sfd: Optional[ApiMsgComp_SFDEntry] = None
         if sfd is not None:
@@ -600,21 +1027,50 @@ class API:
         response: ApiMsg_S2C_InformServerStatus = {
             'cmd': self.Command.Api2Client.INFORM_SERVER_STATUS,
             'reqid': reqid,
-            'device_status': self.device_conn_status_to_str[self.device_handler.get_connection_status()],
+            'device': device.name,
+            'device_status': self.device_conn_status_to_str[snapshot.connection_status],
             'device_info': device_info,
             'loaded_sfd': loaded_sfd,
             'device_comm_link': {
-                'link_type': device_link_type,
-                'config': {} if device_comm_link is None else device_comm_link.get_config()     # Possibly null
+                'link_type': snapshot.link_type,
+                'config': {} if snapshot.link_config is None else snapshot.link_config     # Possibly null
             }
         }
 
         return response
 
-    def var_update_callback(self, conn_id: str, datastore_entry: DatastoreEntry) -> None:
-        self.streamer.publish(datastore_entry, conn_id)
+    def value_update_callback(self, conn_id: str, datastore_entry: DatastoreEntry, value: Any, timestamp: float) -> None:
+        with self.stream_lock:
+            self.streamer.publish(datastore_entry, conn_id, value, timestamp)
         self.stream_all_we_can()
 
+    def get_device(self, req: Dict[Any, Any]) -> DeviceInstance:
+        # Requests without a device name go to the default device
+        if 'device' not in req or req['device'] is None:
+            return self.default_device
+
+        if not isinstance(req['device'], str) or req['device'] not in self.devices:
+            raise InvalidRequestException(req, 'Unknown device : %s' % str(req['device']))
+
+        return self.devices[req['device']]
+
+    def find_watchables_device(self, req: Dict[Any, Any]) -> Dict[str, DeviceInstance]:
+        # Entry IDs are unique across all datastores. Finds the device that owns each watchable of the request
+        devices: Dict[str, DeviceInstance] = {}
+        remaining = list(req['watchables'])
+        for device in self.get_devices():
+            if len(remaining) == 0:
+                break
+            snapshot = device.get_snapshot()
+            found = [watchable for watchable in remaining if snapshot.has_entry(watchable)]
+            for watchable in found:
+                devices[watchable] = device
+            remaining = [watchable for watchable in remaining if watchable not in found]
+
+        if len(remaining) > 0:
+            raise InvalidRequestException(req, 'Unknown watchable ID : %s' % str(remaining[0]))
+        return devices
+
     def make_datastore_entry_definition(self, entry: DatastoreEntry, include_entry_type=False) -> DatastoreEntryDefinition:
         core_variable = entry.get_core_variable()
         definition: DatastoreEntryDefinition = {
@@ -656,4 +1112,7 @@ class API:
         return isinstance(d, dict) and k in d
 
     def close(self) -> None:
+        for recorder in self.recorders.values():
+            recorder.stop()
+        self.recorders = {}
         self.client_handler.stop()
@@ -52,6 +52,7 @@ class ApiMsgComp_DeviceCommLinkDef(TypedDict):
 class ApiMsg_S2C_InformServerStatus(TypedDict):
     cmd: str
     reqid: str
+    device: str
     device_status: str
     device_info: Optional[ApiMsgComp_DeviceInfo]
     loaded_sfd: Optional[ApiMsgComp_SFDEntry]
@@ -7,14 +7,164 @@
 #
 #   Copyright (c) 2021-2022 Scrutiny Debugger
 
+import time
+
 from scrutiny.server.datastore import DatastoreEntry
 
-from typing import List
+from typing import List, Dict, Set, Tuple, Any, Optional
+
+# (timestamp, value)
+Sample = Tuple[float, Any]
+
+# (entry, value, timestamp). Timestamp is None when only the latest value is streamed
+StreamItem = Tuple[DatastoreEntry, Any, Optional[float]]
+
+
+class Decimator:
+    """
+    Reduces the samples of a signal to at most max_rate points per second, computed as the samples arrive.
+    Time is split in fixed size buckets. A bucket is reduced when the first sample of the next bucket arrives,
+    or when flushed after its end.
+    """
+
+    entry: Optional[DatastoreEntry]
+    period: float
+    bucket_start: Optional[float]
+    output: List[Sample]
+
+    def __init__(self, period: float):
+        self.entry = None
+        self.period = period
+        self.bucket_start = None
+        self.output = []
+
+    def add(self, timestamp: float, value: Any) -> None:
+        if self.bucket_start is not None and timestamp >= self.bucket_start + self.period:
+            self.close_bucket()
+            self.bucket_start = None
+
+        if self.bucket_start is None:
+            self.bucket_start = timestamp
+        self.add_to_bucket(timestamp, value)
+
+    def flush(self, now: float) -> None:
+        if self.bucket_start is not None and now >= self.bucket_start + self.period:
+            self.close_bucket()
+            self.bucket_start = None
+
+    def pop(self) -> List[Sample]:
+        output = self.output
+        self.output = []
+        return output
+
+    def add_to_bucket(self, timestamp: float, value: Any) -> None:
+        raise NotImplementedError()
+
+    def close_bucket(self) -> None:
+        raise NotImplementedError()
+
+
+class MinMaxDecimator(Decimator):
+    """Outputs the minimum and the maximum of each bucket, in time order. Every extreme is kept."""
+
+    min_sample: Optional[Sample]
+    max_sample: Optional[Sample]
+
+    def __init__(self, max_rate: float):
+        super().__init__(period=2.0 / max_rate)   # 2 points per bucket
+        self.min_sample = None
+        self.max_sample = None
+
+    def add_to_bucket(self, timestamp: float, value: Any) -> None:
+        sample = (timestamp, value)
+        if self.min_sample is None or value < self.min_sample[1]:
+            self.min_sample = sample
+        if self.max_sample is None or value > self.max_sample[1]:
+            self.max_sample = sample
+
+    def close_bucket(self) -> None:
+        if self.min_sample is None or self.max_sample is None:
+            return
+        if self.min_sample is self.max_sample:
+            self.output.append(self.min_sample)
+        else:
+            self.output.extend(sorted([self.min_sample, self.max_sample], key=lambda sample: sample[0]))
+        self.min_sample = None
+        self.max_sample = None
+
+
+class LttbDecimator(Decimator):
+    """
+    Largest Triangle Three Buckets, done incrementally.
+    A bucket is reduced to the sample that makes the largest triangle with the previously selected point and the
+    average of the next bucket. Points are therefore sent one bucket late. Each bucket gives a single point.
+    """
+
+    anchor: Optional[Sample]
+    pending: List[Sample]
+    current: List[Sample]
+
+    def __init__(self, max_rate: float):
+        super().__init__(period=1.0 / max_rate)
+        self.anchor = None
+        self.pending = []
+        self.current = []
+
+    def add_to_bucket(self, timestamp: float, value: Any) -> None:
+        self.current.append((timestamp, value))
+
+    def close_bucket(self) -> None:
+        if len(self.current) == 0:
+            return
+
+        if self.anchor is None:
+            # First bucket is reduced to its first point. It has no previous point to make a triangle with.
+            self.select(self.current[0])
+        else:
+            if len(self.pending) > 0:
+                avg_t = sum(sample[0] for sample in self.current) / len(self.current)
+                avg_v = sum(float(sample[1]) for sample in self.current) / len(self.current)
+                self.select_largest_triangle(avg_t, avg_v)
+            self.pending = self.current
+        self.current = []
+
+    def flush(self, now: float) -> None:
+        super().flush(now)
+        # No next bucket came. Reduce the pending one against its own last point
+        if self.bucket_start is None and len(self.pending) > 0 and now >= self.pending[-1][0] + 2 * self.period:
+            self.select_largest_triangle(self.pending[-1][0], float(self.pending[-1][1]))
+            self.pending = []
+
+    def select_largest_triangle(self, next_t: float, next_v: float) -> None:
+        assert self.anchor is not None
+        anchor_t, anchor_v = self.anchor[0], float(self.anchor[1])
+        best = self.pending[0]
+        best_area = -1.0
+        for sample in self.pending:
+            area = abs((anchor_t - next_t) * (float(sample[1]) - anchor_v) - (anchor_t - sample[0]) * (next_v - anchor_v))
+            if area > best_area:
+                best = sample
+                best_area = area
+        self.select(best)
+
+    def select(self, sample: Sample) -> None:
+        self.anchor = sample
+        self.output.append(sample)
 
 
 class ValueStreamer:
+    DECIMATION_MODES = {
+        'minmax': MinMaxDecimator,
+        'lttb': LttbDecimator
+    }
+
+    entry_to_publish: Dict[str, Dict[DatastoreEntry, Any]]     # conn_id -> {entry: value}
+    decimators: Dict[str, Dict[str, Decimator]]     # conn_id -> {entry_id: decimator}
+    frozen_connections: Set[str]
+
     def __init__(self):
         self.entry_to_publish = {}
+        self.decimators = {}
         self.frozen_connections = set()
 
     def freeze_connection(self, conn_id: str) -> None:
@@ -23,25 +173,46 @@ class ValueStreamer:
     def unfreeze_connection(self, conn_id: str) -> None:
         self.frozen_connections.remove(conn_id)
 
-    def publish(self, entry: DatastoreEntry, conn_id: str) -> None:
+    def set_decimation(self, conn_id: str, entry_id: str, mode: str, max_rate: float) -> None:
+        """Streams a decimated history of the entry to this connection instead of its latest value"""
+        if mode not in self.DECIMATION_MODES:
+            raise ValueError('Unknown decimation mode %s' % mode)
+        if max_rate <= 0:
+            raise ValueError('Decimation rate must be a positive value')
+        if conn_id in self.decimators:
+            self.decimators[conn_id][entry_id] = self.DECIMATION_MODES[mode](max_rate)
+
+    def clear_decimation(self, conn_id: str, entry_id: str) -> None:
+        if conn_id in self.decimators and entry_id in self.decimators[conn_id]:
+            del self.decimators[conn_id][entry_id]
+
+    def publish(self, entry: DatastoreEntry, conn_id: str, value: Any = None, timestamp: Optional[float] = None) -> None:
+        # The value is the one seen by the device thread when it changed. Latest one wins if not streamed yet.
+        value = entry.get_value() if value is None else value
         try:
-            self.entry_to_publish[conn_id].add(entry)
+            decimator = self.decimators[conn_id].get(entry.get_id(), None)
+            if decimator is not None:
+                decimator.entry = entry
+                decimator.add(entry.get_update_time() if timestamp is None else timestamp, value)
+            else:
+                self.entry_to_publish[conn_id][entry] = value
         except:
             pass
 
-    def get_stream_chunk(self, conn_id: str) -> List[DatastoreEntry]:
-        chunk: List[DatastoreEntry] = []
+    def get_stream_chunk(self, conn_id: str) -> List[StreamItem]:
+        chunk: List[StreamItem] = []
         if conn_id not in self.entry_to_publish:
             return chunk
 
         if conn_id in self.frozen_connections:
             return chunk
 
-        for entry in self.entry_to_publish[conn_id]:
-            chunk.append(entry)
+        chunk = [(entry, value, None) for entry, value in self.entry_to_publish[conn_id].items()]
+        self.entry_to_publish[conn_id] = {}
 
-        for entry in chunk:
-            self.entry_to_publish[conn_id].remove(entry)
+        for decimator in self.decimators[conn_id].values():
+            if decimator.entry is not None:
+                chunk.extend([(decimator.entry, value, timestamp) for timestamp, value in decimator.pop()])
 
         return chunk
 
@@ -49,15 +220,24 @@ class ValueStreamer:
         for conn_id in self.entry_to_publish:
             if entry in self.entry_to_publish[conn_id]:
                 return True
+            decimator = self.decimators[conn_id].get(entry.get_id(), None)
+            if decimator is not None and len(decimator.output) > 0:
+                return True
         return False
 
     def new_connection(self, conn_id: str) -> None:
         if conn_id not in self.entry_to_publish:
-            self.entry_to_publish[conn_id] = set()
+            self.entry_to_publish[conn_id] = {}
+            self.decimators[conn_id] = {}
 
     def clear_connection(self, conn_id: str) -> None:
         if conn_id in self.entry_to_publish:
             del self.entry_to_publish[conn_id]
+            del self.decimators[conn_id]
 
     def process(self) -> None:
-        pass
+        # Buckets of signals that stopped changing are closed with time
+        now = time.time()
+        for decimators in self.decimators.values():
+            for decimator in decimators.values():
+                decimator.flush(now)
@@ -25,7 +25,9 @@ class Datastore:
     entries_list_by_type: Dict[DatastoreEntry.EntryType, List[DatastoreEntry]]
     global_watch_callbacks: List[WatchCallback]
     global_unwatch_callbacks: List[WatchCallback]
+    global_target_update_callbacks: List[WatchCallback]
     watcher_map: Dict[str, Set[str]]
+    revision: int   # Changes each time an entry is added or removed
 
     MAX_ENTRY: int = 1000000
 
@@ -33,11 +35,14 @@ class Datastore:
         self.logger = logging.getLogger(self.__class__.__name__)
         self.global_watch_callbacks = []
         self.global_unwatch_callbacks = []
+        self.global_target_update_callbacks = []
+        self.revision = 0
         self.clear()
 
     def clear(self) -> None:
         self.entries = {}
         self.watcher_map = {}
+        self.revision += 1
 
         self.entries_list_by_type = {}
         for entry_type in DatastoreEntry.EntryType:
@@ -66,16 +71,29 @@ class Datastore:
 
         self.entries[entry.get_id()] = entry;
         self.entries_list_by_type[entry.get_type()].append(entry)
+        self.revision += 1
+        entry.set_target_update_callback(self.target_update_requested)
 
     def get_entry(self, entry_id: str) -> DatastoreEntry:
         return self.entries[entry_id]
 
+    def has_entry(self, entry_id: str) -> bool:
+        return isinstance(entry_id, str) and entry_id in self.entries
+
     def add_watch_callback(self, callback: WatchCallback):
         self.global_watch_callbacks.append(callback)
 
     def add_unwatch_callback(self, callback: WatchCallback):
         self.global_unwatch_callbacks.append(callback)
 
+    def add_target_update_callback(self, callback: WatchCallback):
+        """Callback called with the entry ID each time a new value must be written to the device"""
+        self.global_target_update_callbacks.append(callback)
+
+    def target_update_requested(self, entry: DatastoreEntry) -> None:
+        for callback in self.global_target_update_callbacks:
+            callback(entry.get_id())
+
     def start_watching(self, entry_id: Union[DatastoreEntry, str], watcher: str, callback: GenericCallback, args: Any = None) -> None:
         entry_id = self.interpret_entry_id(entry_id)
         entry = self.get_entry(entry_id)
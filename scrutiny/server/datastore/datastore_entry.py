@@ -7,10 +7,12 @@
 #   Copyright (c) 2021-2022 Scrutiny Debugger
 
 import uuid
+import threading
+import itertools
 from enum import Enum
 import time
 
-from scrutiny.core import Variable, VariableType
+from scrutiny.core import Variable, VariableType, VarMap
 
 from typing import Any, Optional, Dict, Callable, Tuple
 from scrutiny.core.typehints import GenericCallback
@@ -40,6 +42,18 @@ class Callback():
 
 
 class DatastoreEntry:
+    """
+    An entry in the datastore. The core Variable behind it can be given directly or
+    loaded lazily from a VarMap (using the display path as the variable fullname) the first
+    time it is needed. Loading a firmware with a huge amount of variables then only costs a
+    small object per variable until a client actually lists or subscribes to it.
+    """
+    __slots__ = ('entry_type', 'display_path', 'entry_id', 'value_change_callback', 'pending_target_update', 'callback_pending',
+                 'last_value_update_timestamp', 'last_target_update_timestamp', '_variable_def', 'varmap', 'value', 'target_update_callback')
+
+    _materialize_lock = threading.Lock()
+    ID_PREFIX: str = uuid.uuid4().hex[0:16]   # Unique per server instance. Avoids generating a full UUID per entry
+    _id_counter = itertools.count()
 
     class EntryType(Enum):
         Var = 0
@@ -84,10 +98,12 @@ class DatastoreEntry:
     callback_pending: bool
     last_value_update_timestamp: float
     last_target_update_timestamp: Optional[float]
-    variable_def: Variable
+    _variable_def: Optional[Variable]
+    varmap: Optional[VarMap]
     value: Any
+    target_update_callback: Optional[Callable[["DatastoreEntry"], None]]
 
-    def __init__(self, entry_type: "DatastoreEntry.EntryType", display_path: str, variable_def: Variable):
+    def __init__(self, entry_type: "DatastoreEntry.EntryType", display_path: str, variable_def: Optional[Variable] = None, varmap: Optional[VarMap] = None):
 
         if entry_type not in [DatastoreEntry.EntryType.Var, DatastoreEntry.EntryType.Alias]:
             raise ValueError('Invalid watchable type')
@@ -95,16 +111,37 @@ class DatastoreEntry:
         if not isinstance(display_path, str):
             raise ValueError('Invalid display path')
 
+        if (variable_def is None) == (varmap is None):
+            raise ValueError('Either a variable definition or a VarMap must be given')
+
         self.entry_type = entry_type
         self.display_path = display_path
-        self.entry_id = uuid.uuid4().hex
+        self.entry_id = '%s%x' % (self.ID_PREFIX, next(self._id_counter))
         self.value_change_callback = {}
         self.pending_target_update = None
         self.callback_pending = False
         self.last_value_update_timestamp = time.time()
         self.last_target_update_timestamp = None
-        self.variable_def = variable_def
+        self._variable_def = variable_def
+        self.varmap = varmap
         self.value = 0
+        self.target_update_callback = None
+
+    @property
+    def variable_def(self) -> Variable:
+        variable_def = self._variable_def
+        if variable_def is None:
+            # Read from the API thread and the device thread. Lock only taken the first time, so a single Variable is made
+            with self._materialize_lock:
+                if self._variable_def is None:
+                    assert self.varmap is not None
+                    self._variable_def = self.varmap.get_var(self.display_path)
+                variable_def = self._variable_def
+        assert variable_def is not None
+        return variable_def
+
+    def is_variable_loaded(self) -> bool:
+        return self._variable_def is not None
 
     def get_type(self) -> "DatastoreEntry.EntryType":
         return self.entry_type
@@ -169,8 +206,20 @@ class DatastoreEntry:
     def get_last_update_timestamp(self) -> Optional[float]:
         return self.last_target_update_timestamp
 
+    def set_target_update_callback(self, callback: Optional[Callable[["DatastoreEntry"], None]]) -> None:
+        # Called each time a new value is requested to be written to the device. Set by the datastore.
+        self.target_update_callback = callback
+
     def update_target_value(self, value: Any) -> None:
+        # Replaces any update not written yet. Only the latest value gets written.
         self.pending_target_update = self.UpdateTargetRequest(value)
+        if self.target_update_callback is not None:
+            self.target_update_callback(self)
+
+    def get_pending_target_update(self) -> Optional["DatastoreEntry.UpdateTargetRequest"]:
+        if self.has_pending_target_update():
+            return self.pending_target_update
+        return None
 
     def has_pending_target_update(self) -> bool:
         if self.pending_target_update is None:
@@ -28,6 +28,7 @@ from scrutiny.server.device.request_generator.info_poller import InfoPoller, Pro
 from scrutiny.server.device.request_generator.session_initializer import SessionInitializer
 from scrutiny.server.device.request_generator.memory_reader import MemoryReader
 from scrutiny.server.device.request_generator.memory_writer import MemoryWriter
+from scrutiny.server.device.request_generator.datalog_manager import DatalogManager, DatalogAcquisition
 from scrutiny.server.device.device_info import DeviceInfo
 
 from scrutiny.server.tools import Timer
@@ -54,6 +55,9 @@ class DeviceHandlerConfig(TypedDict, total=False):
     max_request_size: int
     max_response_size: int
     max_bitrate_bps: int
+    throttling_mode: str
+    throttling_burst_bits: int
+    wire_trace_size: int
     link_type: str
     link_config: LinkConfig
 
@@ -67,6 +71,7 @@ class DeviceHandler:
     heartbeat_generator: HeartbeatGenerator
     memory_reader: MemoryReader
     memory_writer: MemoryWriter
+    datalog_manager: DatalogManager
     info_poller: InfoPoller
     comm_handler: CommHandler
     protocol: Protocol
@@ -93,15 +98,19 @@ class DeviceHandler:
         'default_protocol_version': '1.0',
         'max_request_size': 1024,
         'max_response_size': 1024,
-        'max_bitrate_bps': 0
+        'max_bitrate_bps': 0,
+        'throttling_mode': 'token_bucket',   # "token_bucket" or "estimation"
+        'throttling_burst_bits': 0,         # 0 = automatic
+        'wire_trace_size': 1000             # Number of frames kept in memory for debugging. 0 = disabled
     }
 
     # Low number = Low priority
     class RequestPriority:
-        Disconnect = 6
-        Connect = 5
-        Heatbeat = 4
-        WriteMemory = 3
+        Disconnect = 7
+        Connect = 6
+        Heatbeat = 5
+        WriteMemory = 4
+        Datalog = 3
         ReadMemory = 2
         PollInfo = 1
         Discover = 0
@@ -151,6 +160,8 @@ class DeviceHandler:
         self.memory_writer = MemoryWriter(self.protocol, self.dispatcher, self.datastore,
                                           request_priority=self.RequestPriority.WriteMemory)
 
+        self.datalog_manager = DatalogManager(self.protocol, self.dispatcher, priority=self.RequestPriority.Datalog)
+
         self.comm_handler = CommHandler(self.config)
         self.comm_handler_open_restart_timer = Timer(1.0)
 
@@ -185,6 +196,17 @@ class DeviceHandler:
     def get_throttling_bitrate(self) -> float:
         return self.comm_handler.get_throttling_bitrate()
 
+    def get_tx_wait_time(self) -> Optional[float]:
+        """Seconds before the throttler lets the next request go. None when nothing is waiting."""
+        return self.comm_handler.get_tx_wait_time()
+
+    def request_datalog_acquisition(self, acquisition: DatalogAcquisition) -> None:
+        """Queue an acquisition. Its completion callback is called with the decoded data or an error."""
+        self.datalog_manager.request_acquisition(acquisition)
+
+    def cancel_datalog_acquisition(self, acquisition: DatalogAcquisition) -> None:
+        self.datalog_manager.cancel_acquisition(acquisition)
+
     def get_comm_params_callback(self, partial_device_info: DeviceInfo):
         # In the POLLING_INFO stage, there is a point where we will have gotten the communication params.
         # This callback is called right after it so we can adapt.
@@ -221,7 +243,7 @@ class DeviceHandler:
                 if partial_device_info.max_bitrate_bps > 0:
                     max_bitrate_bps = partial_device_info.max_bitrate_bps
                 elif self.config['max_bitrate_bps'] > 0:
-                    max_bitrate_bps = self.config['max_bitrate_bps'] > 0
+                    max_bitrate_bps = self.config['max_bitrate_bps']
                 else:
                     raise Exception('Internal error. Missing case hadnling for throttling')
 
@@ -236,6 +258,7 @@ class DeviceHandler:
         # Will do a safety check before emitting a request
         self.memory_reader.set_size_limits(max_request_size=max_request_size, max_response_size=max_response_size)
         self.memory_writer.set_size_limits(max_request_size=max_request_size, max_response_size=max_response_size)
+        self.datalog_manager.set_size_limits(max_request_size=max_request_size, max_response_size=max_response_size)
         self.dispatcher.set_size_limits(max_request_size=max_request_size, max_response_size=max_response_size)
         self.protocol.set_address_size_bits(partial_device_info.address_size_bits)
         self.heartbeat_generator.set_interval(max(0.5, float(partial_device_info.heartbeat_timeout_us) / 1000000.0 * 0.75))
@@ -275,6 +298,9 @@ class DeviceHandler:
 
         return self.ConnectionStatus.UNKNOWN
 
+    def dump_wire_trace(self, filename: str) -> int:
+        return self.comm_handler.dump_wire_trace(filename)
+
     def get_comm_link(self) -> Optional[AbstractLink]:
         return self.comm_handler.get_link()
 
@@ -300,6 +326,7 @@ class DeviceHandler:
         self.dispatcher.reset()
         self.memory_reader.stop()
         self.memory_writer.stop()
+        self.datalog_manager.stop()
         self.session_id = None
         self.disconnection_requested = False
         self.disconnect_callback = None
@@ -320,6 +347,7 @@ class DeviceHandler:
         max_response_size = self.config['max_response_size']
         self.memory_reader.set_size_limits(max_request_size=max_request_size, max_response_size=max_response_size)
         self.memory_writer.set_size_limits(max_request_size=max_request_size, max_response_size=max_response_size)
+        self.datalog_manager.set_size_limits(max_request_size=max_request_size, max_response_size=max_response_size)
         self.dispatcher.set_size_limits(max_request_size=max_request_size, max_response_size=max_response_size)
 
     # Open communication channel based on config
@@ -350,6 +378,7 @@ class DeviceHandler:
         self.session_initializer.process()
         self.memory_reader.process()
         self.memory_writer.process()
+        self.datalog_manager.process()
         self.dispatcher.process()
 
         self.handle_comm()      # Make sure request and response are being exchanged with the device
@@ -366,6 +395,11 @@ class DeviceHandler:
             if state_entry:
                 self.memory_reader.start()
                 self.memory_writer.start()
+                if self.device_info is not None and self.device_info.supported_feature_map['datalog_acquire']:
+                    self.datalog_manager.set_partial_read_supported(self.device_info.supported_feature_map['datalog_partial_read'])
+                    self.datalog_manager.start()
+                else:
+                    self.datalog_manager.fail_all('Device does not support datalogging')
             # Nothing else to do
         elif self.operating_mode == self.OperatingMode.Test_CheckThrottling:
             if self.dispatcher.peek_next() is None:
@@ -486,6 +520,7 @@ class DeviceHandler:
                 self.fully_connected_ready = False
                 self.memory_reader.stop()
                 self.memory_writer.stop()
+                self.datalog_manager.stop()
                 next_state = self.FsmState.DISCONNECTING
 
             if self.dispatcher.is_in_error():
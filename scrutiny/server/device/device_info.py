@@ -18,6 +18,7 @@ class SupportedFeatureMap(TypedDict):
     memory_write: bool
     datalog_acquire: bool
     user_command: bool
+    datalog_partial_read: bool
 
 
 class DeviceInfo:
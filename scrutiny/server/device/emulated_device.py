@@ -9,15 +9,19 @@
 
 import threading
 import time
+import math
 import logging
 import random
 import traceback
+from collections import deque
 import scrutiny.server.protocol.commands as cmd
 from scrutiny.server.device.links.dummy_link import DummyLink, ThreadSafeDummyLink
 from scrutiny.server.protocol import Protocol, Request, Response, ResponseCode, RequestData, ResponseData
+from scrutiny.server.protocol.datalog import DatalogConfiguration, DatalogLocation, LogStatus, RecordInfo
 from scrutiny.core.memory_content import MemoryContent
+from scrutiny.core.variable import Variable, VariableType, Endianness
 
-from typing import List, Dict, Optional, Union
+from typing import List, Dict, Optional, Union, Callable, Deque
 
 
 class RequestLogRecord:
@@ -31,11 +35,263 @@ class RequestLogRecord:
         self.response = response
 
 
+class FlatMemory:
+    """
+    Contiguous memory region backed by a single bytearray. Much faster than a MemoryContent
+    for read and write, but can only represent a single range of addresses.
+    """
+    start_addr: int
+    data: bytearray
+
+    def __init__(self, start_addr: int, size: int):
+        self.start_addr = start_addr
+        self.data = bytearray(size)
+
+    def read(self, addr: int, length: int) -> bytes:
+        offset = addr - self.start_addr
+        if offset < 0 or length < 0 or offset + length > len(self.data):
+            raise IndexError('Read out of range 0x%08x - %d bytes' % (addr, length))
+        return bytes(self.data[offset:offset + length])
+
+    def write(self, addr: int, data: Union[bytes, bytearray]) -> None:
+        offset = addr - self.start_addr
+        if offset < 0 or offset + len(data) > len(self.data):
+            raise IndexError('Write out of range 0x%08x - %d bytes' % (addr, len(data)))
+        self.data[offset:offset + len(data)] = data
+
+
+class Waveform:
+    """
+    Synthetic signal written periodically in the memory of the emulated device.
+    The function receives the time in seconds and returns the value of the variable.
+    """
+    __slots__ = ('variable', 'function')
+
+    variable: Variable
+    function: Callable[[float], Union[int, float, bool]]
+
+    def __init__(self, address: int, vartype: VariableType, function: Callable[[float], Union[int, float, bool]], endianness: Endianness = Endianness.Little):
+        self.variable = Variable('waveform', vartype=vartype, path_segments=[], location=address, endianness=endianness)
+        self.function = function
+
+    def encode(self, t: float) -> bytes:
+        value = self.function(t)
+        vartype = self.variable.get_type()
+        if vartype == VariableType.boolean:
+            value = bool(value)
+        elif vartype.name.startswith('sint') or vartype.name.startswith('uint'):
+            value = int(value)
+        return self.variable.encode(value)[0]
+
+    @classmethod
+    def sine(cls, amplitude: float = 1.0, frequency: float = 1.0, offset: float = 0) -> Callable[[float], float]:
+        return lambda t: offset + amplitude * math.sin(2 * math.pi * frequency * t)
+
+    @classmethod
+    def square(cls, amplitude: float = 1.0, frequency: float = 1.0, offset: float = 0) -> Callable[[float], float]:
+        return lambda t: offset + (amplitude if math.fmod(t * frequency, 1.0) < 0.5 else -amplitude)
+
+    @classmethod
+    def sawtooth(cls, amplitude: float = 1.0, frequency: float = 1.0, offset: float = 0) -> Callable[[float], float]:
+        return lambda t: offset + amplitude * (2 * math.fmod(t * frequency, 1.0) - 1)
+
+
+class EmulatedDatalogger:
+    """
+    Device side datalogger. Samples the watches in the device memory at the configured rate.
+    While waiting for the trigger, samples are kept in a circular buffer. Once the trigger condition is met,
+    sampling continues until the post-trigger part of the buffer is filled, then the recording can be downloaded.
+    """
+    DEFAULT_BUFFER_SIZE: int = 4096
+    DEFAULT_SAMPLING_RATES: List[float] = [1000.0, 100.0, 10.0]
+    MAX_RECORDINGS: int = 8
+
+    logger: logging.Logger
+    device: "EmulatedDevice"
+    buffer_size: int
+    sampling_rates: List[float]
+    post_trigger_ratio: float
+    status: LogStatus
+    config: Optional[DatalogConfiguration]
+    next_record_id: int
+    record_id: Optional[int]
+    recordings: Dict[int, bytes]
+    samples: Deque[bytes]
+    post_trigger_remaining: int
+    next_sample_time: float
+    tick_count: int
+    previous_trigger_value: Optional[float]
+    sample_time: float
+
+    def __init__(self, device: "EmulatedDevice", buffer_size: int = DEFAULT_BUFFER_SIZE, sampling_rates: Optional[List[float]] = None):
+        self.logger = logging.getLogger(self.__class__.__name__)
+        self.device = device
+        self.buffer_size = buffer_size
+        self.sampling_rates = sampling_rates if sampling_rates is not None else list(self.DEFAULT_SAMPLING_RATES)
+        self.post_trigger_ratio = 0.5
+        self.status = LogStatus.Disabled
+        self.config = None
+        self.next_record_id = 1
+        self.record_id = None
+        self.recordings = {}
+        self.samples = deque()
+        self.post_trigger_remaining = 0
+        self.next_sample_time = 0
+        self.tick_count = 0
+        self.previous_trigger_value = None
+        self.sample_time = 0
+
+    def get_sample_size(self) -> int:
+        if self.config is None:
+            return 0
+        return sum([watch.length for watch in self.config.watches])
+
+    def get_capacity(self) -> int:
+        # Number of samples that fit in the buffer
+        sample_size = self.get_sample_size()
+        return self.buffer_size // sample_size if sample_size > 0 else 0
+
+    def configure(self, config: DatalogConfiguration) -> int:
+        if config.destination != 0:
+            raise ValueError('Unknown destination %d' % config.destination)
+
+        if config.sample_rate > max(self.sampling_rates):
+            raise ValueError('Sample rate %0.1fHz is too high' % config.sample_rate)
+
+        self.disarm()
+        self.config = config
+        if self.get_capacity() < 2:
+            self.config = None
+            raise ValueError('Buffer too small for this configuration')
+
+        return self.next_record_id
+
+    def arm(self) -> int:
+        if self.config is None:
+            raise ValueError('Datalogger is not configured')
+
+        self.record_id = self.next_record_id
+        self.next_record_id = (self.next_record_id + 1) & 0xFFFF
+        self.samples = deque(maxlen=self.get_capacity())
+        self.post_trigger_remaining = max(1, int(self.get_capacity() * self.post_trigger_ratio))
+        self.next_sample_time = time.perf_counter()
+        self.tick_count = 0
+        self.previous_trigger_value = None
+        self.status = LogStatus.WaitForTrigger
+        return self.record_id
+
+    def disarm(self) -> None:
+        self.status = LogStatus.Disabled
+        self.samples.clear()
+
+    def get_recording_list(self) -> List[RecordInfo]:
+        return [RecordInfo(record_id, DatalogLocation.LocationType.RAM, len(data)) for record_id, data in self.recordings.items()]
+
+    def read_recording(self, record_id: int, offset: int = 0, length: Optional[int] = None) -> bytes:
+        if record_id not in self.recordings:
+            raise KeyError('Recording #%d does not exist' % record_id)
+        data = self.recordings[record_id]
+        end = len(data) if length is None else offset + length
+        return data[offset:end]
+
+    def read_operand(self, operand: DatalogConfiguration.Operand) -> float:
+        if isinstance(operand, DatalogConfiguration.ConstOperand):
+            return operand.value
+        elif isinstance(operand, DatalogConfiguration.WatchOperand):
+            var = Variable('operand', vartype=operand.interpret_as, path_segments=[], location=operand.address, endianness=Endianness.Little)
+            value = var.decode(self.read_memory(operand.address, operand.length))
+            assert value is not None
+            return float(value)
+        raise ValueError('Unsupported operand')
+
+    def is_triggered(self) -> bool:
+        assert self.config is not None
+        trigger = self.config.trigger
+        condition = trigger.condition
+        value1 = self.read_operand(trigger.operand1)
+        value2 = self.read_operand(trigger.operand2)
+        previous_value = self.previous_trigger_value
+        self.previous_trigger_value = value1
+
+        if condition == DatalogConfiguration.TriggerCondition.EQUAL:
+            return value1 == value2
+        elif condition == DatalogConfiguration.TriggerCondition.LESS_THAN:
+            return value1 < value2
+        elif condition == DatalogConfiguration.TriggerCondition.GREATER_THAN:
+            return value1 > value2
+        elif condition == DatalogConfiguration.TriggerCondition.LESS_OR_EQUAL_THAN:
+            return value1 <= value2
+        elif condition == DatalogConfiguration.TriggerCondition.GREATER_OR_EQUAL_THAN:
+            return value1 >= value2
+
+        # Change conditions compare operand1 with its value at the previous sample
+        if previous_value is None:
+            return False
+        if condition == DatalogConfiguration.TriggerCondition.CHANGE:
+            return value1 != previous_value
+        elif condition == DatalogConfiguration.TriggerCondition.CHANGE_GREATER:
+            return value1 - previous_value > value2
+        elif condition == DatalogConfiguration.TriggerCondition.CHANGE_LESS:
+            return value1 - previous_value < value2
+
+        raise ValueError('Unsupported trigger condition %s' % condition)
+
+    def read_memory(self, address: int, length: int) -> bytes:
+        # Catching up with late samples must not write old waveform values in the device memory
+        return self.device.read_memory_at_time(address, length, self.sample_time)
+
+    def take_sample(self) -> None:
+        assert self.config is not None
+        self.samples.append(b''.join([self.read_memory(watch.address, watch.length) for watch in self.config.watches]))
+
+    def tick(self, t: float) -> None:
+        assert self.config is not None
+        self.sample_time = t
+
+        if self.status == LogStatus.WaitForTrigger and self.is_triggered():
+            self.status = LogStatus.Recording
+
+        if self.tick_count % self.config.decimation == 0:
+            self.take_sample()
+            if self.status == LogStatus.Recording:
+                self.post_trigger_remaining -= 1
+                if self.post_trigger_remaining <= 0:
+                    self.complete_recording()
+        self.tick_count += 1
+
+    def complete_recording(self) -> None:
+        assert self.record_id is not None
+        self.recordings[self.record_id] = b''.join(self.samples)
+        while len(self.recordings) > self.MAX_RECORDINGS:
+            del self.recordings[next(iter(self.recordings))]
+        self.samples.clear()
+        self.status = LogStatus.Triggered
+
+    def process(self) -> None:
+        if self.status not in [LogStatus.WaitForTrigger, LogStatus.Recording] or self.config is None:
+            return
+
+        now = time.perf_counter()
+        period = 1.0 / self.config.sample_rate
+        # If the thread has been late for too long, samples that would be overwritten anyway are skipped.
+        max_ticks = (self.get_capacity() + 1) * self.config.decimation
+        if (now - self.next_sample_time) / period > max_ticks:
+            self.next_sample_time = now - max_ticks * period
+
+        try:
+            while self.next_sample_time <= now and self.status in [LogStatus.WaitForTrigger, LogStatus.Recording]:
+                self.tick(self.next_sample_time - self.device.start_time)
+                self.next_sample_time += period
+        except Exception as e:
+            self.logger.error('Datalogger disabled. Error while sampling. %s' % str(e))
+            self.disarm()
+
+
 class EmulatedDevice:
     logger: logging.Logger
     link: Union[DummyLink, ThreadSafeDummyLink]
     firmware_id: bytes
-    request_history: List[RequestLogRecord]
+    request_history: Deque[RequestLogRecord]
     protocol: Protocol
     comm_enabled: bool
     connected: bool
@@ -52,8 +308,15 @@ class EmulatedDevice:
     forbidden_regions: List[Dict[str, int]]
     readonly_regions: List[Dict[str, int]]
     session_id: Optional[int]
-    memory: MemoryContent
+    memory: Union[MemoryContent, FlatMemory]
     memory_lock: threading.Lock
+    performance_mode: bool
+    latency: float
+    bandwidth_bps: Optional[int]
+    link_busy_until: float
+    waveforms: List[Waveform]
+    start_time: float
+    datalogger: EmulatedDatalogger
 
     def __init__(self, link):
         if not isinstance(link, DummyLink) and not isinstance(link, ThreadSafeDummyLink):
@@ -61,7 +324,7 @@ class EmulatedDevice:
         self.logger = logging.getLogger(self.__class__.__name__)
         self.link = link    # Preopened link.
         self.firmware_id = bytes(range(16))
-        self.request_history = []
+        self.request_history = deque()
         self.protocol = Protocol(1, 0)
 
         self.comm_enabled = True
@@ -81,10 +344,19 @@ class EmulatedDevice:
         self.memory = MemoryContent()
         self.memory_lock = threading.Lock()
 
+        self.performance_mode = False
+        self.latency = 0
+        self.bandwidth_bps = None
+        self.link_busy_until = 0
+        self.waveforms = []
+        self.start_time = time.perf_counter()
+        self.datalogger = EmulatedDatalogger(self)
+
         self.supported_features = {
             'memory_write': False,
-            'datalog_acquire': False,
-            'user_command': False
+            'datalog_acquire': True,
+            'user_command': False,
+            'datalog_partial_read': True
         }
 
         self.forbidden_regions = [
@@ -96,6 +368,56 @@ class EmulatedDevice:
             {'start': 0x800, 'end': 0x8FF},
             {'start': 0x900, 'end': 0x9FF}]
 
+    def enable_performance_mode(self, memory_start: int, memory_size: int, latency: float = 0,
+                                bandwidth_bps: Optional[int] = None, history_size: Optional[int] = 1000) -> None:
+        """
+        Switch the device to a mode suited for load testing. Must be called before start().
+        - The memory becomes a flat bytearray covering [memory_start, memory_start+memory_size[
+        - Each response is delayed by latency (seconds) + the time it takes to transfer the request and the response at bandwidth_bps.
+          Transfers are serialized, like on a real link.
+        - The device does not sleep between requests
+        - Only the last history_size requests are kept in the history. None keeps everything
+        """
+        self.performance_mode = True
+        self.memory = FlatMemory(memory_start, memory_size)
+        self.latency = latency
+        self.bandwidth_bps = bandwidth_bps
+        self.request_history = deque(maxlen=history_size)
+
+    def add_waveform(self, waveform: Waveform) -> None:
+        self.waveforms.append(waveform)
+
+    def update_waveforms(self, t: Optional[float] = None) -> None:
+        if t is None:
+            t = time.perf_counter() - self.start_time
+        for waveform in self.waveforms:
+            self.write_memory(waveform.variable.get_address(), waveform.encode(t))
+
+    def read_memory_at_time(self, address: int, length: int, t: float) -> bytes:
+        """Reads the memory as it would be at time t. Waveform values are computed, not written in memory."""
+        data = bytearray(self.read_memory(address, length))
+        for waveform in self.waveforms:
+            waveform_address = waveform.variable.get_address()
+            waveform_size = waveform.variable.get_size()
+            assert waveform_size is not None
+            start = max(address, waveform_address)
+            end = min(address + length, waveform_address + waveform_size)
+            if start < end:
+                data[start - address:end - address] = waveform.encode(t)[start - waveform_address:end - waveform_address]
+        return bytes(data)
+
+    def simulate_link_delay(self, request: Request, response: Optional[Response]) -> None:
+        delay = self.latency
+        if self.bandwidth_bps is not None and self.bandwidth_bps > 0:
+            nbytes = request.size() + (response.size() if response is not None else 0)
+            delay += nbytes * 8 / self.bandwidth_bps
+
+        now = time.perf_counter()
+        self.link_busy_until = max(now, self.link_busy_until) + delay
+        wait_time = self.link_busy_until - now
+        if wait_time > 0:
+            time.sleep(wait_time)
+
     def thread_task(self) -> None:
         self.thread_started_event.set()
         while not self.request_shutdown:
@@ -109,7 +431,11 @@ class EmulatedDevice:
                 response = None
                 self.logger.debug('Received a request : %s' % request)
                 try:
+                    if self.performance_mode:
+                        self.update_waveforms()
                     response = self.process_request(request)
+                    if self.performance_mode:
+                        self.simulate_link_delay(request, response)
                     if response is not None:
                         self.logger.debug('Responding %s' % response)
                         self.send(response)
@@ -119,7 +445,13 @@ class EmulatedDevice:
 
                 self.request_history.append(RequestLogRecord(request=request, response=response))
 
-            time.sleep(0.01)
+            self.datalogger.process()
+
+            if self.performance_mode:
+                if request is None:
+                    time.sleep(0.0005)  # Keep a low reaction time without hogging the GIL
+            else:
+                time.sleep(0.01)
 
     def process_request(self, req: Request) -> Optional[Response]:
         response = None
@@ -146,6 +478,8 @@ class EmulatedDevice:
             response = self.process_get_info(req, data)
         elif req.command == cmd.MemoryControl:
             response = self.process_memory_control(req, data)
+        elif req.command == cmd.DatalogControl:
+            response = self.process_datalog_control(req, data)
         elif req.command == cmd.DummyCommand:
             response = self.process_dummy_cmd(req, data)
 
@@ -261,8 +595,71 @@ class EmulatedDevice:
 
             response = self.protocol.respond_write_memory_blocks(response_blocks_write)
 
-        # elif subfunction == cmd.MemoryControl.Subfunction.WriteMasked:
-        #    pass
+        elif subfunction == cmd.MemoryControl.Subfunction.WriteMasked:
+            response_blocks_write = []
+            for block_to_write in data['blocks_to_write']:
+                assert block_to_write['write_mask'] is not None  # Always set by the protocol parser for WriteMasked
+                self.write_memory_masked(block_to_write['address'], block_to_write['data'], block_to_write['write_mask'])
+                response_blocks_write.append((block_to_write['address'], len(block_to_write['data'])))
+
+            response = self.protocol.respond_write_memory_blocks_masked(response_blocks_write)
+
+        else:
+            self.logger.error('Unsupported subfunction "%s" for command : "%s"' % (subfunction, req.command.__name__))
+
+        return response
+
+    # ===== [DatalogControl] ======
+    def process_datalog_control(self, req: Request, data: RequestData) -> Optional[Response]:
+        response = None
+        subfunction = cmd.DatalogControl.Subfunction(req.subfn)
+        if not self.supported_features['datalog_acquire']:
+            return Response(req.command, subfunction, ResponseCode.UnsupportedFeature)
+
+        if subfunction == cmd.DatalogControl.Subfunction.GetAvailableTarget:
+            response = self.protocol.respond_data_get_targets([DatalogLocation(0, DatalogLocation.LocationType.RAM, 'ram')])
+
+        elif subfunction == cmd.DatalogControl.Subfunction.GetBufferSize:
+            response = self.protocol.respond_datalog_get_bufsize(self.datalogger.buffer_size)
+
+        elif subfunction == cmd.DatalogControl.Subfunction.GetSamplingRates:
+            response = self.protocol.respond_datalog_get_sampling_rates(self.datalogger.sampling_rates)
+
+        elif subfunction == cmd.DatalogControl.Subfunction.ConfigureDatalog:
+            try:
+                record_id = self.datalogger.configure(data['configuration'])
+            except ValueError as e:
+                self.logger.error('Invalid datalog configuration. %s' % str(e))
+                return Response(req.command, subfunction, ResponseCode.InvalidRequest)
+            response = self.protocol.respond_configure_log(record_id)
+
+        elif subfunction == cmd.DatalogControl.Subfunction.ArmLog:
+            try:
+                record_id = self.datalogger.arm()
+            except ValueError as e:
+                self.logger.error('Cannot arm datalogger. %s' % str(e))
+                return Response(req.command, subfunction, ResponseCode.FailureToProceed)
+            response = self.protocol.respond_datalog_arm(record_id)
+
+        elif subfunction == cmd.DatalogControl.Subfunction.DisarmLog:
+            self.datalogger.disarm()
+            response = self.protocol.respond_datalog_disarm()
+
+        elif subfunction == cmd.DatalogControl.Subfunction.GetLogStatus:
+            response = self.protocol.respond_datalog_status(self.datalogger.status)
+
+        elif subfunction == cmd.DatalogControl.Subfunction.ListRecordings:
+            response = self.protocol.respond_datalog_list_recordings(self.datalogger.get_recording_list())
+
+        elif subfunction == cmd.DatalogControl.Subfunction.ReadRecordings:
+            try:
+                recording_data = self.datalogger.read_recording(data['record_id'], offset=data.get('offset', 0), length=data.get('length', None))
+            except KeyError as e:
+                self.logger.error(str(e))
+                return Response(req.command, subfunction, ResponseCode.InvalidRequest)
+            response = self.protocol.respond_read_recording(data['record_id'], recording_data)
+            if response.size() > self.max_tx_data_size:
+                return Response(req.command, subfunction, ResponseCode.Overflow)
 
         else:
             self.logger.error('Unsupported subfunction "%s" for command : "%s"' % (subfunction, req.command.__name__))
@@ -318,10 +715,10 @@ class EmulatedDevice:
         self.comm_enabled = True
 
     def clear_request_history(self) -> None:
-        self.request_history = []
+        self.request_history.clear()
 
     def get_request_history(self) -> List[RequestLogRecord]:
-        return self.request_history
+        return list(self.request_history)
 
     def send(self, response: Response) -> None:
         if self.comm_enabled:
@@ -334,12 +731,16 @@ class EmulatedDevice:
         return None
 
     def write_memory(self, address: int, data: Union[bytes, bytearray]) -> None:
-        self.memory_lock.acquire()
-        self.memory.write(address, data)
-        self.memory_lock.release()
+        with self.memory_lock:
+            self.memory.write(address, data)
+
+    def write_memory_masked(self, address: int, data: Union[bytes, bytearray], mask: Union[bytes, bytearray]) -> None:
+        # Only the bits set in the mask are changed. Done under the lock, like the device would do it atomically.
+        with self.memory_lock:
+            current = self.memory.read(address, len(data))
+            newdata = bytes([(current[i] & ~mask[i]) | (data[i] & mask[i]) for i in range(len(data))])
+            self.memory.write(address, newdata)
 
     def read_memory(self, address: int, length: int) -> bytes:
-        self.memory_lock.acquire()
-        data = self.memory.read(address, length)
-        self.memory_lock.release()
-        return data
+        with self.memory_lock:
+            return self.memory.read(address, length)
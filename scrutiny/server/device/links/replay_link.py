@@ -0,0 +1,193 @@
+#    replay_link.py
+#        Virtual device link that plays back a recorded session. Each request sent by the server
+#        is answered with the response recorded for the same request, after the recorded latency.
+#        Can be played faster than real time.
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import os
+import time
+import bisect
+import logging
+
+from .abstract_link import AbstractLink, LinkConfig
+from scrutiny.server.tools.session_file import SessionFileFormat, SessionRecord, read_session_file
+from typing import List, Dict, Tuple, Optional
+
+
+class RecordedExchange:
+    __slots__ = ('timestamp', 'request', 'response', 'latency')
+
+    timestamp: float
+    request: bytes
+    response: bytes
+    latency: float
+
+    def __init__(self, timestamp: float, request: bytes, response: bytes, latency: float):
+        self.timestamp = timestamp
+        self.request = request
+        self.response = response
+        self.latency = latency
+
+
+class ReplayLink(AbstractLink):
+    """
+    Plays back a recorded session as if the device was there.
+
+    The session advances with time, at the configured speed. When the server sends a request, the same request
+    is searched in the recording, starting at the current position of the session, and its response is given back
+    after the recorded latency, also scaled by the speed. Polled values therefore evolve like they did during the recording.
+    A request that was never recorded gets no response, like a device that stays silent.
+    """
+
+    logger: logging.Logger
+    config: LinkConfig
+    filename: str
+    speed: float
+    loop: bool
+    exchanges: List[RecordedExchange]
+    exchange_timestamps: List[float]
+    request_map: Dict[bytes, List[int]]
+    cursor: int
+    start_time: float
+    pending_responses: List[Tuple[float, bytes]]
+    _initialized: bool
+
+    @classmethod
+    def make(cls, config: LinkConfig) -> "ReplayLink":
+        return cls(config)
+
+    def __init__(self, config: LinkConfig):
+        self.validate_config(config)
+        self.logger = logging.getLogger(self.__class__.__name__)
+        self.config = config
+        self.filename = config['filename']
+        self.speed = float(config.get('speed', 1.0))
+        self.loop = bool(config.get('loop', False))
+        self.exchanges = []
+        self.exchange_timestamps = []
+        self.request_map = {}
+        self.cursor = 0
+        self.start_time = 0
+        self.pending_responses = []
+        self._initialized = False
+
+    def initialize(self) -> None:
+        self.load_exchanges(read_session_file(self.filename))
+        self.cursor = 0
+        self.start_time = time.perf_counter()
+        self.pending_responses = []
+        self._initialized = True
+        self.logger.info('Replaying %d exchanges from %s at %0.1fx speed' % (len(self.exchanges), self.filename, self.speed))
+
+    def load_exchanges(self, records: List[SessionRecord]) -> None:
+        # A request is paired with the data received from the device until the next request.
+        self.exchanges = []
+        request: Optional[Tuple[float, bytes]] = None
+        response = bytearray()
+        response_time = 0.0
+        for timestamp, direction, data in records + [(0, SessionFileFormat.Direction.ToDevice, b'')]:
+            if direction == SessionFileFormat.Direction.ToDevice:
+                if request is not None and len(response) > 0:
+                    self.exchanges.append(RecordedExchange(request[0], request[1], bytes(response), max(0, response_time - request[0])))
+                request = (timestamp, data)
+                response = bytearray()
+            elif request is not None:
+                if len(response) == 0:
+                    response_time = timestamp
+                response += data
+
+        if len(self.exchanges) > 0:
+            t0 = self.exchanges[0].timestamp
+            for exchange in self.exchanges:
+                exchange.timestamp -= t0
+
+        self.exchange_timestamps = [exchange.timestamp for exchange in self.exchanges]
+        self.request_map = {}
+        for i, exchange in enumerate(self.exchanges):
+            if exchange.request not in self.request_map:
+                self.request_map[exchange.request] = []
+            self.request_map[exchange.request].append(i)
+
+    def get_session_time(self) -> float:
+        session_time = (time.perf_counter() - self.start_time) * self.speed
+        if self.loop and len(self.exchanges) > 0 and session_time > self.exchange_timestamps[-1]:
+            # Start over. Exchanges are searched from the beginning again
+            self.start_time = time.perf_counter()
+            self.cursor = 0
+            session_time = 0
+        return session_time
+
+    def find_exchange(self, request: bytes) -> Optional[RecordedExchange]:
+        if request not in self.request_map:
+            return None
+        indexes = self.request_map[request]
+
+        # Never go back in the session. Skip what should have been played already if the server is slower than the recording
+        start = max(self.cursor, bisect.bisect_right(self.exchange_timestamps, self.get_session_time()) - 1)
+        pos = bisect.bisect_left(indexes, start)
+        if pos < len(indexes):
+            index = indexes[pos]
+        elif pos > 0:
+            index = indexes[pos - 1]    # Not anymore in the rest of the session. Use the latest one
+        else:
+            return None
+
+        self.cursor = max(self.cursor, index + 1)
+        return self.exchanges[index]
+
+    def destroy(self) -> None:
+        self.pending_responses = []
+        self._initialized = False
+
+    def write(self, data: bytes) -> None:
+        if not self._initialized:
+            return
+        exchange = self.find_exchange(bytes(data))
+        if exchange is None:
+            self.logger.debug('Request not found in recorded session. No response will be given')
+            return
+        self.pending_responses.append((time.perf_counter() + exchange.latency / self.speed, exchange.response))
+
+    def read(self) -> Optional[bytes]:
+        if not self._initialized:
+            return None
+        now = time.perf_counter()
+        data = bytearray()
+        while len(self.pending_responses) > 0 and self.pending_responses[0][0] <= now:
+            data += self.pending_responses.pop(0)[1]
+        return bytes(data)
+
+    def process(self) -> None:
+        pass
+
+    def operational(self) -> bool:
+        return self._initialized
+
+    def initialized(self) -> bool:
+        return self._initialized
+
+    def get_config(self) -> LinkConfig:
+        return {
+            'filename': self.filename,
+            'speed': self.speed,
+            'loop': self.loop
+        }
+
+    @staticmethod
+    def validate_config(config: LinkConfig) -> None:
+        if not isinstance(config, dict):
+            raise ValueError('Config is not a valid dict')
+
+        if 'filename' not in config or not isinstance(config['filename'], str):
+            raise ValueError('Missing session filename')
+
+        if not os.path.isfile(config['filename']):
+            raise ValueError('Session file %s does not exist' % config['filename'])
+
+        if 'speed' in config:
+            if not isinstance(config['speed'], (int, float)) or config['speed'] <= 0:
+                raise ValueError('Speed must be a positive number')
@@ -0,0 +1,442 @@
+#    datalog_manager.py
+#        Drives a datalogging acquisition on the device. Configures and arms the datalogger,
+#        polls its status until the acquisition is completed, downloads the recording in chunks
+#        and decodes it into one typed array per logged entry.
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import logging
+import enum
+import time
+import struct
+import array
+from collections import deque
+
+from scrutiny.server.protocol import *
+from scrutiny.server.protocol.datalog import DatalogConfiguration, LogStatus
+from scrutiny.server.device.request_dispatcher import RequestDispatcher, SuccessCallback, FailureCallback
+from scrutiny.server.datastore import DatastoreEntry
+from scrutiny.server.tools import Timer
+from scrutiny.core import Variable, VariableType, Endianness
+from scrutiny.core.typehints import GenericCallback
+
+from typing import Optional, Callable, Any, List, Dict, Deque, Union, Sequence
+
+
+class AcquisitionCompletedCallback(GenericCallback):
+    callback: Callable[["DatalogAcquisition"], None]
+
+
+class DatalogAcquisition:
+    """
+    A request for a datalogging acquisition. Holds the data once completed.
+    Each sample of a recording is the data of each logged entry, one after the other.
+    The timeout counts from the request. An acquisition still queued or waiting for its trigger when it expires is failed.
+    A download in progress is not interrupted.
+    """
+
+    entries: List[DatastoreEntry]
+    sample_rate: float
+    decimation: int
+    destination: int
+    trigger: DatalogConfiguration.Trigger
+    completion_callback: Optional[AcquisitionCompletedCallback]
+    completed: bool
+    success: bool
+    error: str
+    record_id: Optional[int]
+    data: Dict[str, Sequence[Any]]
+    timeout: float
+    request_timestamp: float
+    cancel_requested: bool
+
+    def __init__(self, entries: List[DatastoreEntry], sample_rate: float, trigger: DatalogConfiguration.Trigger,
+                 decimation: int = 1, destination: int = 0, completion_callback: Optional[AcquisitionCompletedCallback] = None,
+                 timeout: float = 0):
+        if len(entries) == 0:
+            raise ValueError('At least one entry must be logged')
+
+        for entry in entries:
+            if entry.get_size() is None:
+                raise ValueError('Cannot log entry %s. Size is unknown' % entry.get_display_path())
+
+        self.entries = entries
+        self.sample_rate = sample_rate
+        self.decimation = decimation
+        self.destination = destination
+        self.trigger = trigger
+        self.completion_callback = completion_callback
+        self.completed = False
+        self.success = False
+        self.error = ''
+        self.record_id = None
+        self.data = {}
+        self.timeout = timeout  # 0 = no timeout
+        self.request_timestamp = time.time()
+        self.cancel_requested = False
+
+    def is_expired(self) -> bool:
+        return self.timeout > 0 and time.time() - self.request_timestamp > self.timeout
+
+    def get_abort_reason(self) -> Optional[str]:
+        if self.cancel_requested:
+            return 'Cancelled'
+        if self.is_expired():
+            return 'Timed out after %0.1f sec' % self.timeout
+        return None
+
+    def make_configuration(self) -> DatalogConfiguration:
+        config = DatalogConfiguration()
+        config.destination = self.destination
+        config.sample_rate = self.sample_rate
+        config.decimation = self.decimation
+        config.trigger = self.trigger
+        for entry in self.entries:
+            config.add_watch(entry.get_address(), entry.get_size())
+        return config
+
+    def get_sample_size(self) -> int:
+        return sum([entry.get_size() for entry in self.entries])
+
+    def complete(self, success: bool, error: str = '') -> None:
+        self.completed = True
+        self.success = success
+        self.error = error
+        if self.completion_callback is not None:
+            self.completion_callback(self)
+
+    def decode(self, data: Union[bytes, bytearray]) -> None:
+        """Fills self.data with one column of values per logged entry"""
+        columns = decode_recording([entry.get_core_variable() for entry in self.entries], data)
+        self.data = dict(zip([entry.get_id() for entry in self.entries], columns))
+
+
+def get_array_typecode(var: Variable) -> Optional[str]:
+    # Type code of an array.array that can hold this variable as is. None if the variable must be decoded by the Variable itself.
+    if var.bitfield:
+        return None
+
+    size = var.get_size()
+    codec = Variable.TYPE_TO_CODEC_MAP[var.get_type()]
+    if isinstance(codec, Variable.SIntCodec):
+        candidates = 'bhilq'
+    elif isinstance(codec, Variable.UIntCodec) or isinstance(codec, Variable.BoolCodec):
+        candidates = 'BHILQ'
+    elif isinstance(codec, Variable.FloatCodec):
+        candidates = 'fd'
+    else:
+        return None
+
+    for typecode in candidates:
+        if array.array(typecode).itemsize == size:
+            return typecode
+    return None
+
+
+def decode_recording(variables: List[Variable], data: Union[bytes, bytearray]) -> List[Sequence[Any]]:
+    """
+    Decode a recording made of samples of the given variables, in order. Returns a column of values per variable.
+    Columns are array.array when possible, lists otherwise (booleans, bitfields).
+    """
+    sizes: List[int] = []
+    for var in variables:
+        size = var.get_size()
+        if size is None:
+            raise ValueError('Size of variable %s is unknown' % var.get_fullname())
+        sizes.append(size)
+    sample_size = sum(sizes)
+    if sample_size == 0 or len(data) % sample_size != 0:
+        raise ValueError('Recording size (%d bytes) is not a multiple of the sample size (%d bytes)' % (len(data), sample_size))
+    nsamples = len(data) // sample_size
+
+    columns: List[Sequence[Any]] = []
+    view = memoryview(data)
+    offset = 0
+    for var, size in zip(variables, sizes):
+        typecode = get_array_typecode(var)
+        if typecode is not None:
+            # Unpack the whole column in one pass, skipping the other variables of each sample with pad bytes.
+            endianness_char = '<' if var.endianness == Endianness.Little else '>'
+            codec = Variable.TYPE_TO_CODEC_MAP[var.get_type()]
+            struct_char = 'B' if isinstance(codec, Variable.BoolCodec) else getattr(codec, 'str')
+            sample_format = struct.Struct(endianness_char + '%dx%s%dx' % (offset, struct_char, sample_size - offset - size))
+            values = [x[0] for x in sample_format.iter_unpack(view)]
+            if isinstance(codec, Variable.BoolCodec):
+                columns.append([x != 0 for x in values])
+            else:
+                columns.append(array.array(typecode, values))
+        else:
+            columns.append([var.decode(view[i * sample_size + offset:i * sample_size + offset + size]) for i in range(nsamples)])
+        offset += size
+
+    return columns
+
+
+class DatalogManager:
+    """
+    Request generator that runs the datalogging acquisitions requested to the device, one at a time.
+    """
+
+    DEFAULT_MAX_REQUEST_SIZE: int = 1024
+    DEFAULT_MAX_RESPONSE_SIZE: int = 1024
+    STATUS_POLL_INTERVAL: float = 0.05
+
+    class FsmState(enum.Enum):
+        Idle = 0
+        Configuring = 1
+        Arming = 2
+        WaitingForData = 3
+        GettingRecordingSize = 4
+        Downloading = 5
+        Disarming = 6
+
+    logger: logging.Logger
+    dispatcher: RequestDispatcher
+    protocol: Protocol
+    priority: int
+    started: bool
+    stop_requested: bool
+    request_pending: bool
+    max_request_size: int
+    max_response_size: int
+    partial_read_supported: bool
+    fsm_state: "DatalogManager.FsmState"
+    acquisition: Optional[DatalogAcquisition]
+    acquisition_queue: Deque[DatalogAcquisition]
+    recording_size: int
+    recording_data: bytearray
+    status_poll_timer: Timer
+    abort_reason: str
+
+    def __init__(self, protocol: Protocol, dispatcher: RequestDispatcher, priority: int):
+        self.logger = logging.getLogger(self.__class__.__name__)
+        self.dispatcher = dispatcher
+        self.protocol = protocol
+        self.priority = priority
+        self.acquisition = None
+        self.acquisition_queue = deque()
+        self.status_poll_timer = Timer(self.STATUS_POLL_INTERVAL)
+        self.started = False
+        self.max_request_size = self.DEFAULT_MAX_REQUEST_SIZE
+        self.max_response_size = self.DEFAULT_MAX_RESPONSE_SIZE
+        self.partial_read_supported = False
+        self.reset()
+
+    def set_size_limits(self, max_request_size: int, max_response_size: int) -> None:
+        self.max_request_size = max_request_size
+        self.max_response_size = max_response_size
+
+    def set_partial_read_supported(self, supported: bool) -> None:
+        # Devices without this feature can only send a recording in a single response.
+        self.partial_read_supported = supported
+
+    def start(self) -> None:
+        self.started = True
+
+    def stop(self) -> None:
+        self.stop_requested = True
+
+    def is_busy(self) -> bool:
+        return self.acquisition is not None or len(self.acquisition_queue) > 0
+
+    def request_acquisition(self, acquisition: DatalogAcquisition) -> None:
+        self.acquisition_queue.append(acquisition)
+
+    def cancel_acquisition(self, acquisition: DatalogAcquisition) -> None:
+        """Fails the acquisition. If it is waiting for its trigger, the datalogger is disarmed first"""
+        acquisition.cancel_requested = True
+        self.fail_aborted_in_queue()
+
+    def fail_aborted_in_queue(self) -> None:
+        for acquisition in list(self.acquisition_queue):
+            reason = acquisition.get_abort_reason()
+            if reason is not None:
+                self.acquisition_queue.remove(acquisition)
+                acquisition.complete(success=False, error=reason)
+
+    def reset(self) -> None:
+        # Acquisitions cannot survive a reset. The device may have been disconnected.
+        self.fail_all('Datalogging stopped')
+        self.fsm_state = self.FsmState.Idle
+        self.stop_requested = False
+        self.request_pending = False
+        self.recording_size = 0
+        self.recording_data = bytearray()
+        self.status_poll_timer.stop()
+        self.abort_reason = ''
+
+    def fail_all(self, error: str) -> None:
+        if self.acquisition is not None:
+            self.fail_acquisition(error)
+        while len(self.acquisition_queue) > 0:
+            self.acquisition_queue.popleft().complete(success=False, error=error)
+
+    def fail_acquisition(self, error: str) -> None:
+        self.logger.error('Datalog acquisition failed. %s' % error)
+        if self.acquisition is not None:
+            acquisition = self.acquisition
+            self.acquisition = None
+            acquisition.complete(success=False, error=error)
+        self.fsm_state = self.FsmState.Idle
+
+    def process(self) -> None:
+        self.fail_aborted_in_queue()
+
+        if not self.started:
+            # Queued acquisitions wait for the device to be ready
+            self.stop_requested = False
+            self.request_pending = False
+            return
+        elif self.stop_requested and not self.request_pending:
+            self.started = False
+            self.reset()
+            return
+
+        if self.request_pending:
+            return
+
+        if self.acquisition is not None:
+            reason = self.acquisition.get_abort_reason()
+            if reason is not None and self.fsm_state == self.FsmState.WaitingForData:
+                # Stop the datalogger. Otherwise it would trigger later on and overwrite the next acquisition.
+                self.abort_reason = reason
+                self.fsm_state = self.FsmState.Disarming
+                self.send_request(self.protocol.datalog_disarm())
+                return
+            elif self.acquisition.cancel_requested and self.fsm_state == self.FsmState.Downloading:
+                self.fail_acquisition('Cancelled')
+                return
+
+        if self.fsm_state == self.FsmState.Idle:
+            if len(self.acquisition_queue) > 0:
+                self.acquisition = self.acquisition_queue.popleft()
+                self.recording_size = 0
+                self.recording_data = bytearray()
+                self.fsm_state = self.FsmState.Configuring
+                try:
+                    self.send_request(self.protocol.datalog_configure_log(self.acquisition.make_configuration()))
+                except Exception as e:
+                    self.fail_acquisition('Invalid configuration. %s' % str(e))
+
+        elif self.fsm_state == self.FsmState.WaitingForData:
+            if self.status_poll_timer.is_timed_out():
+                self.send_request(self.protocol.datalog_status())
+
+        elif self.fsm_state == self.FsmState.Downloading:
+            self.send_request(self.make_next_read_request())
+
+    def get_max_read_size(self) -> int:
+        # Response has the record ID (2 bytes) then the data.
+        return self.max_response_size - Response.OVERHEAD_SIZE - 2
+
+    def make_next_read_request(self) -> Request:
+        assert self.acquisition is not None and self.acquisition.record_id is not None
+        if not self.partial_read_supported:
+            return self.protocol.datalog_read_recording(self.acquisition.record_id)
+
+        chunk_size = min(self.get_max_read_size(), 0xFFFF)
+        length = min(chunk_size, self.recording_size - len(self.recording_data))
+        return self.protocol.datalog_read_recording(self.acquisition.record_id, offset=len(self.recording_data), length=length)
+
+    def send_request(self, request: Request) -> None:
+        self.dispatcher.register_request(request=request, success_callback=SuccessCallback(self.success_callback),
+                                         failure_callback=FailureCallback(self.failure_callback), priority=self.priority)
+        self.request_pending = True
+
+    def success_callback(self, request: Request, response: Response, params: Any = None) -> None:
+        self.logger.debug("Success callback. Response=%s, Params=%s" % (response, params))
+        self.request_pending = False
+        if self.acquisition is None:
+            return  # Was reset in the meantime
+
+        if self.fsm_state == self.FsmState.Disarming:
+            if response.code != ResponseCode.OK:
+                self.logger.warning('Device refused to disarm the datalogger. Response code %s' % response.code)
+            self.fail_acquisition(self.abort_reason)
+            return
+
+        if response.code != ResponseCode.OK:
+            self.fail_acquisition('Device refused request %s with response code %s' % (request, response.code))
+            return
+
+        response_data = self.protocol.parse_response(response)
+        if not response_data['valid']:
+            self.fail_acquisition('Received a malformed response to request %s' % request)
+            return
+
+        if self.fsm_state == self.FsmState.Configuring:
+            self.fsm_state = self.FsmState.Arming
+            self.send_request(self.protocol.datalog_arm())
+
+        elif self.fsm_state == self.FsmState.Arming:
+            self.acquisition.record_id = response_data['record_id']
+            self.fsm_state = self.FsmState.WaitingForData
+            self.status_poll_timer.start()
+
+        elif self.fsm_state == self.FsmState.WaitingForData:
+            status = response_data['status']
+            if status == LogStatus.Triggered:
+                # Acquisition completed. Find out how big it is before downloading it.
+                self.fsm_state = self.FsmState.GettingRecordingSize
+                self.send_request(self.protocol.datalog_get_list_recordings())
+            elif status == LogStatus.Disabled:
+                self.fail_acquisition('Datalogger has been disabled before the acquisition was completed')
+            else:
+                self.status_poll_timer.start()
+
+        elif self.fsm_state == self.FsmState.GettingRecordingSize:
+            for record in response_data['recordings']:
+                if record.record_id == self.acquisition.record_id:
+                    self.recording_size = record.size
+                    break
+            else:
+                self.fail_acquisition('Recording #%s is not available on the device' % self.acquisition.record_id)
+                return
+
+            if not self.partial_read_supported and self.recording_size > self.get_max_read_size():
+                self.fail_acquisition('Recording #%s is %d bytes. Device sends at most %d bytes per response and does not support partial reads'
+                                      % (self.acquisition.record_id, self.recording_size, self.get_max_read_size()))
+                return
+
+            self.fsm_state = self.FsmState.Downloading
+            if self.recording_size == 0:
+                self.download_completed()
+
+        elif self.fsm_state == self.FsmState.Downloading:
+            if response_data['record_id'] != self.acquisition.record_id or len(response_data['data']) == 0:
+                self.fail_acquisition('Received unexpected data while downloading recording #%s' % self.acquisition.record_id)
+                return
+
+            self.recording_data += response_data['data']
+            if len(self.recording_data) >= self.recording_size:
+                self.download_completed()
+            elif not self.partial_read_supported:
+                self.fail_acquisition('Recording #%s is incomplete. Received %d bytes out of %d'
+                                      % (self.acquisition.record_id, len(self.recording_data), self.recording_size))
+
+    def download_completed(self) -> None:
+        assert self.acquisition is not None
+        acquisition = self.acquisition
+        try:
+            acquisition.decode(self.recording_data[0:self.recording_size])
+        except Exception as e:
+            self.fail_acquisition('Cannot decode recording. %s' % str(e))
+            return
+
+        self.logger.info('Datalog acquisition #%s completed. %d bytes downloaded' % (acquisition.record_id, self.recording_size))
+        self.acquisition = None
+        self.fsm_state = self.FsmState.Idle
+        self.recording_data = bytearray()
+        acquisition.complete(success=True)
+
+    def failure_callback(self, request: Request, params: Any = None) -> None:
+        self.logger.debug("Failure callback. Request=%s. Params=%s" % (request, params))
+        self.request_pending = False
+        if self.acquisition is not None:
+            if self.fsm_state == self.FsmState.Disarming:
+                self.fail_acquisition(self.abort_reason)
+            else:
+                self.fail_acquisition('No response to request %s' % request)
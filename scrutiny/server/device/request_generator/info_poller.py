@@ -298,7 +298,8 @@ class InfoPoller:
                 self.info.supported_feature_map = {
                     'memory_write': response_data['memory_write'],
                     'datalog_acquire': response_data['datalog_acquire'],
-                    'user_command': response_data['user_command']
+                    'user_command': response_data['user_command'],
+                    'datalog_partial_read': response_data['datalog_partial_read']
                 }
 
             elif self.fsm_state == self.FsmState.GetSpecialMemoryRegionCount:
@@ -218,13 +218,18 @@ class MemoryReader:
             response_data = self.protocol.parse_response(response)
             if response_data['valid']:
                 try:
-                    temp_memory = MemoryContent()
-                    for block in response_data['read_blocks']:
-                        temp_memory.write(block['address'], block['data'])
-
+                    # Values are decoded from views on the blocks given by the protocol parser. Blocks are not copied again.
+                    blocks = sorted([(block['address'], block['data']) for block in response_data['read_blocks']], key=lambda block: block[0])
+                    block_addresses = [address for address, data in blocks]
                     for entry in self.entries_in_pending_read_request:
-                        raw_data = temp_memory.read(entry.get_address(), entry.get_size())
-                        entry.set_value_from_data(raw_data)
+                        address = entry.get_address()
+                        size = entry.get_size()
+                        index = bisect.bisect_right(block_addresses, address) - 1
+                        if index < 0 or address + size > blocks[index][0] + len(blocks[index][1]):
+                            raise ValueError('Entry %s is not in the response' % entry.get_display_path())
+                        offset = address - blocks[index][0]
+                        with memoryview(blocks[index][1])[offset:offset + size] as raw_data:
+                            entry.set_value_from_data(raw_data)
                 except Exception as e:
                     self.logger.critical('Error while writing datastore. %s' % str(e))
                     self.logger.debug(traceback.format_exc())
@@ -1,7 +1,7 @@
 #    memory_writer.py
 #        Synchronize the datastore with the device
-#        Poll for entries that are watched and update the device with value change request
-#        coming from the user in the datastore.
+#        Write to the device the value change requests coming from the user in the datastore.
+#        Pending writes are queued as they are requested and packed in as few requests as possible.
 #
 #   - License : MIT - See LICENSE file.
 #   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
@@ -17,9 +17,28 @@ import traceback
 
 from scrutiny.server.protocol import *
 from scrutiny.server.device.request_dispatcher import RequestDispatcher, SuccessCallback, FailureCallback
-from scrutiny.server.datastore import Datastore, DatastoreEntry
+from scrutiny.server.datastore import Datastore, DatastoreEntry, WatchCallback
 
-from typing import Any, List, Tuple, Optional
+from typing import Any, List, Tuple, Optional, Dict
+
+
+class EntryWrite:
+    """An entry write included in a request. Remembers the exact update request so that a newer value is not marked as written."""
+    __slots__ = ('entry', 'update_request', 'data', 'mask')
+
+    entry: DatastoreEntry
+    update_request: DatastoreEntry.UpdateTargetRequest
+    data: bytes
+    mask: Optional[bytes]
+
+    def __init__(self, entry: DatastoreEntry, update_request: DatastoreEntry.UpdateTargetRequest, data: bytes, mask: Optional[bytes]):
+        self.entry = entry
+        self.update_request = update_request
+        self.data = data
+        self.mask = mask
+
+    def is_current(self) -> bool:
+        return self.entry.get_pending_target_update() is self.update_request
 
 
 class MemoryWriter:
@@ -40,10 +59,9 @@ class MemoryWriter:
     forbidden_regions: List[Tuple[int, int]]
     readonly_regions: List[Tuple[int, int]]
 
-    entry_being_updated: Optional[DatastoreEntry]
-    request_of_entry_being_updated: Optional[Request]
-    watched_entries: List[str]
-    write_cursor: int
+    pending_writes: Dict[str, DatastoreEntry]
+    writes_in_request: List[EntryWrite]
+    request_being_sent: Optional[Request]
 
     def __init__(self, protocol: Protocol, dispatcher: RequestDispatcher, datastore: Datastore, request_priority: int):
         self.logger = logging.getLogger(self.__class__.__name__)
@@ -51,6 +69,8 @@ class MemoryWriter:
         self.protocol = protocol
         self.datastore = datastore
         self.request_priority = request_priority
+        self.pending_writes = {}
+        self.datastore.add_target_update_callback(WatchCallback(self.the_target_update_callback))
 
         self.reset()
 
@@ -70,6 +90,11 @@ class MemoryWriter:
     def add_readonly_region(self, start_addr: int, size: int) -> None:
         self.readonly_regions.append((start_addr, size))
 
+    def the_target_update_callback(self, entry_id: str) -> None:
+        # Dict keeps the insertion order. An entry already queued keeps its place and its latest value will be written.
+        if entry_id not in self.pending_writes:
+            self.pending_writes[entry_id] = self.datastore.get_entry(entry_id)
+
     def start(self) -> None:
         self.started = True
 
@@ -86,10 +111,17 @@ class MemoryWriter:
         self.forbidden_regions = []
         self.readonly_regions = []
 
-        self.watched_entries = []
-        self.write_cursor = 0
-        self.entry_being_updated = None
-        self.request_of_entry_being_updated = None
+        self.writes_in_request = []
+        self.request_being_sent = None
+        self.clear_pending_writes()
+
+    def clear_pending_writes(self) -> None:
+        # Queued writes target the memory layout of the firmware that was there when they were requested.
+        # Never keep them for the next connection, the device or its firmware may have changed.
+        for entry in self.pending_writes.values():
+            if entry.has_pending_target_update():
+                entry.mark_target_update_request_failed()
+        self.pending_writes = {}
 
     def process(self) -> None:
         if not self.started:
@@ -112,80 +144,121 @@ class MemoryWriter:
                 self.request_pending = True
 
     def make_next_write_request(self) -> Optional[Request]:
-        request: Optional[Request] = None
-
-        if self.write_cursor >= len(self.watched_entries):
-            self.watched_entries = self.datastore.get_watched_entries_id()
-            self.write_cursor = 0
-
-        if self.entry_being_updated is None:
-            while self.write_cursor < len(self.watched_entries):
-                entry = self.datastore.get_entry(self.watched_entries[self.write_cursor])
-                self.write_cursor += 1
-                if entry.has_pending_target_update():
-                    self.entry_being_updated = entry
-                    break
-
-        if self.entry_being_updated is not None:
-            value_to_write = self.entry_being_updated.get_pending_target_update_val()
-            if value_to_write is None:
-                self.logger.critical('Value to write is not availble. This should never happen')
-            else:
-                encoded_value, write_mask = self.entry_being_updated.encode_pending_update_value()
-                request = self.protocol.write_single_memory_block(
-                    address=self.entry_being_updated.get_address(), data=encoded_value, write_mask=write_mask)
-                self.request_of_entry_being_updated = request
+        """
+        Pack the pending writes in a single request, in the order they were requested, until the request or the response is full.
+        Entries with a write mask and entries without one cannot be mixed, they go in different requests.
+        """
+        writes: List[EntryWrite] = []
+        masked: Optional[bool] = None
+        request_size = Request.OVERHEAD_SIZE
+        response_size = Response.OVERHEAD_SIZE
+
+        for entry_id in list(self.pending_writes.keys()):
+            entry = self.pending_writes[entry_id]
+            if not self.datastore.has_entry(entry_id) or self.datastore.get_entry(entry_id) is not entry:
+                del self.pending_writes[entry_id]   # Removed from the datastore. Its address means nothing anymore
+                continue
+
+            update_request = entry.get_pending_target_update()
+            if update_request is None:
+                del self.pending_writes[entry_id]   # Discarded or already completed
+                continue
+
+            try:
+                data, mask = entry.encode_value(update_request.value)
+            except Exception as e:
+                self.logger.error('Cannot encode value to write for entry %s. %s' % (entry.get_display_path(), str(e)))
+                self.logger.debug(traceback.format_exc())
+                entry.mark_target_update_request_failed()
+                del self.pending_writes[entry_id]
+                continue
+
+            if masked is not None and masked != (mask is not None):
+                continue    # Will go in the next request
+
+            block_request_size = self.protocol.write_memory_request_overhead_size_per_block() + len(data)
+            if mask is not None:
+                block_request_size += len(mask)
+            block_response_size = self.protocol.write_memory_response_size_per_block()
+
+            if request_size + block_request_size > self.max_request_size or response_size + block_response_size > self.max_response_size:
+                if len(writes) == 0:
+                    self.logger.error('Value of entry %s is too big to be written with the device size limits' % entry.get_display_path())
+                    entry.mark_target_update_request_failed()
+                    del self.pending_writes[entry_id]
+                    continue
+                break   # Request is full
+
+            request_size += block_request_size
+            response_size += block_response_size
+            masked = mask is not None
+            writes.append(EntryWrite(entry, update_request, data, mask))
+            del self.pending_writes[entry_id]
+
+        if len(writes) == 0:
+            return None
+
+        request: Request
+        if masked:
+            request = self.protocol.write_memory_blocks_masked([(write.entry.get_address(), write.data, write.mask) for write in writes if write.mask is not None])
+        else:
+            request = self.protocol.write_memory_blocks([(write.entry.get_address(), write.data) for write in writes])
+
+        self.writes_in_request = writes
+        self.request_being_sent = request
         return request
 
     def success_callback(self, request: Request, response: Response, params: Any = None) -> None:
         self.logger.debug("Success callback. Response=%s, Params=%s" % (response, params))
 
+        success = False
         if response.code == ResponseCode.OK:
-            if request == self.request_of_entry_being_updated:
-                request_data = self.protocol.parse_request(request)
-                if request_data['valid']:
-                    response_data = self.protocol.parse_response(response)
-                    if response_data['valid']:
-                        if self.entry_being_updated is not None and self.entry_being_updated.has_pending_target_update():
-                            response_match_request = True
-                            if len(request_data['blocks_to_write']) != 1 or len(response_data['written_blocks']) != 1:
+            if request == self.request_being_sent:
+                response_data = self.protocol.parse_response(response)
+                if response_data['valid']:
+                    response_match_request = True
+                    if len(response_data['written_blocks']) != len(self.writes_in_request):
+                        response_match_request = False
+                    else:
+                        for write, written_block in zip(self.writes_in_request, response_data['written_blocks']):
+                            if write.entry.get_address() != written_block['address'] or len(write.data) != written_block['length']:
                                 response_match_request = False
-                            else:
-                                if request_data['blocks_to_write'][0]['address'] != response_data['written_blocks'][0]['address']:
-                                    response_match_request = False
-
-                                if len(request_data['blocks_to_write'][0]['data']) != response_data['written_blocks'][0]['length']:
-                                    response_match_request = False
-
-                            if response_match_request:
-                                newval, mask = self.entry_being_updated.encode_pending_update_value()
-                                self.entry_being_updated.set_value_from_data(newval)
-                                self.entry_being_updated.mark_target_update_request_complete()
-                            else:
-                                self.logger.error('Received a WriteMemory response that does not match the request')
-                        else:
-                            self.logger.warning('Received a WriteMemory response but no datastore entry was being updated.')
+                                break
+
+                    if response_match_request:
+                        success = True
+                        for write in self.writes_in_request:
+                            # If a new value has been requested in the meantime, it is queued and will be written next.
+                            if write.is_current():
+                                write.entry.set_value_from_data(write.data)
+                                write.entry.mark_target_update_request_complete()
                     else:
-                        self.logger.error('Response for WriteMemory request is malformed and must be discared.')
+                        self.logger.error('Received a WriteMemory response that does not match the request')
                 else:
-                    self.logger.error('Request associated with WriteMemory response is malformed. Response must be discared.')
+                    self.logger.error('Response for WriteMemory request is malformed and must be discared.')
             else:
                 self.logger.critical('Received a WriteMemory response for the wrong request. This should not happen')
         else:
             self.logger.warning('Response for WriteMemory has been refused with response code %s.' % response.code)
 
+        if not success:
+            self.mark_writes_failed()
+
         self.completed()
 
     def failure_callback(self, request: Request, params: Any = None) -> None:
         self.logger.debug("Failure callback. Request=%s. Params=%s" % (request, params))
         self.logger.error('Failed to get a response for WriteMemory request.')
 
-        if self.entry_being_updated is not None:
-            self.entry_being_updated.mark_target_update_request_failed()
-
+        self.mark_writes_failed()
         self.completed()
 
+    def mark_writes_failed(self) -> None:
+        for write in self.writes_in_request:
+            if write.is_current():
+                write.entry.mark_target_update_request_failed()
+
     def completed(self) -> None:
         self.request_pending = False
-        self.entry_being_updated = None
-        self.request_of_entry_being_updated = None
+        self.writes_in_request = []
+        self.request_being_sent = None
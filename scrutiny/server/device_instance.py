@@ -0,0 +1,373 @@
+#    device_instance.py
+#        Group everything the server needs to talk with a single device : its DeviceHandler,
+#        its Datastore and its loaded SFD. Processed in its own thread so that a slow device
+#        does not stall the others
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import threading
+import logging
+import traceback
+import queue
+from collections import deque
+
+from scrutiny.server.datastore import Datastore, DatastoreEntry
+from scrutiny.server.device.device_handler import DeviceHandler, DeviceHandlerConfig
+from scrutiny.server.device.device_info import DeviceInfo
+from scrutiny.server.device.links import LinkConfig
+from scrutiny.server.active_sfd_handler import ActiveSFDHandler
+from scrutiny.core.firmware_description import FirmwareDescription
+from scrutiny.core.typehints import GenericCallback
+
+from typing import TypedDict, Optional, Callable, Dict, Tuple, List, Any, Deque
+
+
+class DeviceInstanceConfig(TypedDict, total=False):
+    name: str
+    autoload_sfd: bool
+    device_config: DeviceHandlerConfig
+
+
+class ValueUpdateCallback(GenericCallback):
+    callback: Callable[[str, DatastoreEntry, Any, float], None]
+
+
+# (watcher, entry, value, timestamp) for each entry that changed during a processing cycle
+ValueUpdate = Tuple[str, DatastoreEntry, Any, float]
+
+
+class PublishPolicyConfig(TypedDict, total=False):
+    on_change: bool             # Only publish when the value differs from the last one published
+    deadband: float             # Minimum absolute change to publish
+    relative_deadband: float    # Minimum change to publish, as a fraction of the last value published
+    min_interval: float         # Never publish more often than this. In seconds
+    max_interval: float         # Publish at least this often, even if nothing changed. In seconds
+
+
+class PublishPolicy:
+    """
+    Decides if a new value of an entry is sent to a watcher. Evaluated in the device thread when the value is set,
+    so a value that does not need to be published never reaches the API.
+    Values are compared against the last value published, not the last value set. A slow drift is therefore
+    published once it goes beyond the deadband and a change held back by min_interval is published on the next poll.
+    """
+    __slots__ = ('on_change', 'deadband', 'relative_deadband', 'min_interval', 'max_interval', 'last_value', 'last_timestamp')
+
+    on_change: bool
+    deadband: float
+    relative_deadband: float
+    min_interval: float
+    max_interval: float
+    last_value: Any
+    last_timestamp: Optional[float]
+
+    def __init__(self, config: PublishPolicyConfig):
+        self.validate_config(config)
+        self.on_change = config.get('on_change', False)
+        self.deadband = float(config.get('deadband', 0))
+        self.relative_deadband = float(config.get('relative_deadband', 0))
+        self.min_interval = float(config.get('min_interval', 0))
+        self.max_interval = float(config.get('max_interval', 0))
+        self.last_value = None
+        self.last_timestamp = None
+
+    @classmethod
+    def validate_config(cls, config: PublishPolicyConfig) -> None:
+        if not isinstance(config, dict):
+            raise ValueError('Publish policy must be a dict')
+        for key in config:
+            if key not in PublishPolicyConfig.__annotations__:
+                raise ValueError('Unknown publish policy parameter %s' % key)
+        if not isinstance(config.get('on_change', False), bool):
+            raise ValueError('on_change must be a boolean')
+        for key in ['deadband', 'relative_deadband', 'min_interval', 'max_interval']:
+            value = config.get(key, 0)
+            if isinstance(value, bool) or not isinstance(value, (int, float)) or value < 0:
+                raise ValueError('%s must be a positive number' % key)
+
+    def should_publish(self, value: Any, timestamp: float) -> bool:
+        if self.last_timestamp is None:
+            return self.publish(value, timestamp)
+
+        dt = timestamp - self.last_timestamp
+        if self.max_interval > 0 and dt >= self.max_interval:
+            return self.publish(value, timestamp)
+
+        if self.min_interval > 0 and dt < self.min_interval:
+            return False
+
+        if self.deadband > 0 or self.relative_deadband > 0:
+            try:
+                delta = abs(value - self.last_value)
+                changed = delta > self.deadband and delta > self.relative_deadband * abs(self.last_value)
+            except TypeError:
+                changed = value != self.last_value
+        elif self.on_change:
+            changed = value != self.last_value
+        else:
+            changed = True
+
+        if changed:
+            return self.publish(value, timestamp)
+        return False
+
+    def publish(self, value: Any, timestamp: float) -> bool:
+        self.last_value = value
+        self.last_timestamp = timestamp
+        return True
+
+
+class DeviceSnapshot:
+    """
+    Read only state of a device, made by the device thread at the end of a cycle. Never modified once published,
+    so the API can read it without taking the device lock.
+    """
+    __slots__ = ('connection_status', 'link_type', 'link_config', 'device_info', 'loaded_sfd',
+                 'datastore_revision', 'entries', 'entries_list_by_type')
+
+    connection_status: DeviceHandler.ConnectionStatus
+    link_type: str
+    link_config: Optional[LinkConfig]     # None when there is no link
+    device_info: Optional[DeviceInfo]
+    loaded_sfd: Optional[FirmwareDescription]
+    datastore_revision: int
+    entries: Dict[str, DatastoreEntry]
+    entries_list_by_type: Dict[DatastoreEntry.EntryType, List[DatastoreEntry]]
+
+    def __init__(self, device_handler: DeviceHandler, sfd_handler: ActiveSFDHandler, datastore: Datastore,
+                 previous: Optional["DeviceSnapshot"] = None):
+        self.connection_status = device_handler.get_connection_status()
+        self.link_type = device_handler.get_link_type()
+        comm_link = device_handler.get_comm_link()
+        self.link_config = None if comm_link is None else dict(comm_link.get_config())
+        self.device_info = device_handler.get_device_info()
+        self.loaded_sfd = sfd_handler.get_loaded_sfd()
+
+        # Entries only change when a SFD is loaded or unloaded. No need to copy them every cycle
+        self.datastore_revision = datastore.revision
+        if previous is not None and previous.datastore_revision == datastore.revision:
+            self.entries = previous.entries
+            self.entries_list_by_type = previous.entries_list_by_type
+        else:
+            self.entries = dict(datastore.entries)
+            self.entries_list_by_type = dict([(entry_type, list(entries)) for entry_type, entries in datastore.entries_list_by_type.items()])
+
+    def has_entry(self, entry_id: str) -> bool:
+        return isinstance(entry_id, str) and entry_id in self.entries
+
+    def get_entry(self, entry_id: str) -> DatastoreEntry:
+        return self.entries[entry_id]
+
+    def get_entries_list_by_type(self, entry_type: DatastoreEntry.EntryType) -> List[DatastoreEntry]:
+        return self.entries_list_by_type[entry_type]
+
+    def get_entries_count(self, entry_type: DatastoreEntry.EntryType) -> int:
+        return len(self.entries_list_by_type[entry_type])
+
+
+class DeviceInstance:
+    """
+    A device monitored by the server. Each device has its own datastore and SFD, so the same
+    variable name can exist on many devices without conflict.
+
+    When the processing thread is running, the API side never waits after the device I/O :
+    - Changes (subscriptions, SFD loading, link config) are posted in a command queue executed by the device thread.
+    - Value changes are written in a back buffer by the device thread. At the end of each cycle, the buffer
+      is handed to the API side through a deque (atomic append/popleft) and a new buffer is started.
+    - Read only queries (connection status, device info, SFD, entries) use a snapshot that the device thread
+      replaces at the end of each cycle.
+    The lock is held by the device thread for a whole cycle. The API side does not take it.
+    When no thread is running, commands are executed and values forwarded immediately. The snapshot is made on demand.
+    """
+    DEFAULT_NAME = 'default'
+    PROCESS_PERIOD: float = 0.01
+    MIN_PROCESS_PERIOD: float = 0.0005
+
+    name: str
+    logger: logging.Logger
+    datastore: Datastore
+    device_handler: DeviceHandler
+    sfd_handler: ActiveSFDHandler
+    lock: threading.RLock
+    thread: Optional[threading.Thread]
+    stop_event: threading.Event
+    command_queue: "queue.Queue[Callable[[], None]]"
+    value_back_buffer: Dict[Tuple[str, str], ValueUpdate]
+    value_snapshots: Deque[Dict[Tuple[str, str], ValueUpdate]]
+    value_update_callback: Optional[ValueUpdateCallback]
+    snapshot: Optional[DeviceSnapshot]
+    publish_policies: Dict[Tuple[str, str], PublishPolicy]    # (watcher, entry_id) -> policy. Only accessed by the device thread
+
+    @classmethod
+    def make(cls, config: DeviceInstanceConfig) -> "DeviceInstance":
+        if 'name' not in config or not isinstance(config['name'], str) or len(config['name']) == 0:
+            raise ValueError('Device instance needs a name')
+
+        if 'device_config' not in config:
+            raise ValueError('Missing device_config for device %s' % config['name'])
+
+        datastore = Datastore()
+        device_handler = DeviceHandler(config['device_config'], datastore)
+        sfd_handler = ActiveSFDHandler(device_handler=device_handler, datastore=datastore, autoload=config.get('autoload_sfd', True))
+        return cls(config['name'], datastore, device_handler, sfd_handler)
+
+    def __init__(self, name: str, datastore: Datastore, device_handler: DeviceHandler, sfd_handler: ActiveSFDHandler):
+        self.name = name
+        self.logger = logging.getLogger('%s[%s]' % (self.__class__.__name__, name))
+        self.datastore = datastore
+        self.device_handler = device_handler
+        self.sfd_handler = sfd_handler
+        self.lock = threading.RLock()
+        self.thread = None
+        self.stop_event = threading.Event()
+        self.command_queue = queue.Queue()
+        self.value_back_buffer = {}
+        self.value_snapshots = deque()
+        self.value_update_callback = None
+        self.publish_policies = {}
+        self.snapshot = None
+
+    def init(self) -> None:
+        with self.lock:
+            self.sfd_handler.init()
+            self.publish_snapshot()
+
+    def set_value_update_callback(self, callback: Optional[ValueUpdateCallback]) -> None:
+        """Called for each value change of a watched entry when no thread is running."""
+        self.value_update_callback = callback
+
+    def is_device_thread(self) -> bool:
+        return self.thread is not None and threading.current_thread() is self.thread
+
+    def run_command(self, command: Callable[[], None]) -> None:
+        """
+        Execute a function that modifies the device, its datastore or its SFD.
+        Posted to the device thread if it runs. Executed right away otherwise.
+        """
+        if self.thread is None or self.is_device_thread():
+            with self.lock:
+                command()
+        else:
+            self.command_queue.put(command)
+
+    def process_commands(self) -> None:
+        while True:
+            try:
+                command = self.command_queue.get_nowait()
+            except queue.Empty:
+                break
+            try:
+                command()
+            except Exception as e:
+                self.logger.error('Error while executing command. %s' % str(e))
+                self.logger.debug(traceback.format_exc())
+
+    def start_watching(self, entry_id: str, watcher: str, publish_policy: Optional[PublishPolicy] = None) -> None:
+        def command() -> None:
+            if publish_policy is not None:
+                self.publish_policies[(watcher, entry_id)] = publish_policy
+            else:
+                self.publish_policies.pop((watcher, entry_id), None)
+            self.datastore.start_watching(entry_id, watcher=watcher, callback=GenericCallback(self.value_changed))
+        self.run_command(command)
+
+    def stop_watching(self, entry_id: str, watcher: str) -> None:
+        def command() -> None:
+            self.publish_policies.pop((watcher, entry_id), None)
+            self.datastore.stop_watching(entry_id, watcher=watcher)
+        self.run_command(command)
+
+    def value_changed(self, watcher: str, entry: DatastoreEntry) -> None:
+        policy = self.publish_policies.get((watcher, entry.get_id()), None)
+        if policy is not None and not policy.should_publish(entry.get_value(), entry.get_update_time()):
+            return
+
+        if self.is_device_thread():
+            # Only the latest value of the cycle is kept
+            self.value_back_buffer[(watcher, entry.get_id())] = (watcher, entry, entry.get_value(), entry.get_update_time())
+        elif self.value_update_callback is not None:
+            self.value_update_callback(watcher, entry, entry.get_value(), entry.get_update_time())
+
+    def swap_value_buffer(self) -> None:
+        # Called by the device thread at the end of a cycle
+        if len(self.value_back_buffer) > 0:
+            self.value_snapshots.append(self.value_back_buffer)
+            self.value_back_buffer = {}
+
+    def publish_snapshot(self) -> None:
+        # Replacing the reference is atomic. Readers get either the previous snapshot or this one
+        self.snapshot = DeviceSnapshot(self.device_handler, self.sfd_handler, self.datastore, previous=self.snapshot)
+
+    def get_snapshot(self) -> DeviceSnapshot:
+        """Read only state of the device as of the last completed cycle"""
+        if self.thread is None or self.is_device_thread():
+            with self.lock:     # Nothing runs concurrently. Always up to date
+                self.publish_snapshot()
+        assert self.snapshot is not None
+        return self.snapshot
+
+    def pop_value_updates(self) -> List[ValueUpdate]:
+        """
+        Called by the API side. Returns the value changes of all the cycles completed since the last call, oldest first.
+        Cycles are not merged so that a decimated stream gets every sample.
+        """
+        updates: List[ValueUpdate] = []
+        while True:
+            try:
+                updates.extend(self.value_snapshots.popleft().values())
+            except IndexError:
+                break
+        return updates
+
+    # To be called periodically. Called by the thread when it is running
+    def process(self) -> None:
+        with self.lock:
+            self.process_commands()
+            self.device_handler.process()
+            self.sfd_handler.process()
+            self.publish_snapshot()
+        self.swap_value_buffer()
+
+    def thread_task(self) -> None:
+        while not self.stop_event.is_set():
+            try:
+                self.process()
+            except Exception as e:
+                self.logger.error('Error while processing device. %s' % str(e))
+                self.logger.debug(traceback.format_exc())
+            self.stop_event.wait(self.get_wait_time())
+
+    def get_wait_time(self) -> float:
+        # Wake up right when the throttler allows the next request instead of waiting a full period.
+        wait_time = self.PROCESS_PERIOD
+        tx_wait_time = self.device_handler.get_tx_wait_time()
+        if tx_wait_time is not None:
+            wait_time = max(self.MIN_PROCESS_PERIOD, min(wait_time, tx_wait_time))
+        return wait_time
+
+    def start_thread(self) -> None:
+        if self.thread is not None:
+            return
+        self.stop_event.clear()
+        self.publish_snapshot()
+        self.thread = threading.Thread(target=self.thread_task, name='Device-%s' % self.name, daemon=True)
+        self.thread.start()
+
+    def stop_thread(self) -> None:
+        if self.thread is not None:
+            self.stop_event.set()
+            self.thread.join()
+            self.thread = None
+
+    def is_thread_running(self) -> bool:
+        return self.thread is not None
+
+    def close(self) -> None:
+        self.stop_thread()
+        self.process_commands()
+        with self.lock:
+            self.device_handler.stop_comm()
+            self.sfd_handler.close()
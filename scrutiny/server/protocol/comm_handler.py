@@ -21,9 +21,11 @@ from binascii import hexlify
 import time
 from scrutiny.server.tools import Throttler
 from scrutiny.server.device.links import AbstractLink, LinkConfig
+from scrutiny.server.protocol.wire_trace import WireTrace, TraceRecord
+from scrutiny.server.tools.session_file import SessionFileFormat
 import traceback
 
-from typing import Union, TypedDict, Optional, Any, Dict, Type
+from typing import Union, TypedDict, Optional, Any, Dict, Type, List
 
 
 class CommHandler:
@@ -35,8 +37,11 @@ class CommHandler:
     This class also act as a Link Factory.
     """
 
-    class Params(TypedDict):
+    class Params(TypedDict, total=False):
         response_timeout: int
+        throttling_mode: str        # "token_bucket" or "estimation"
+        throttling_burst_bits: int  # Burst size of the token bucket. 0 = automatic
+        wire_trace_size: int        # Number of frames kept in the wire trace. 0 = disabled
 
     class RxData:
         __slots__ = ('data_buffer', 'length', 'length_bytes_received')
@@ -54,7 +59,15 @@ class CommHandler:
             self.data_buffer = bytes()
 
     DEFAULT_PARAMS: "CommHandler.Params" = {
-        'response_timeout': 1
+        'response_timeout': 1,
+        'throttling_mode': 'token_bucket',
+        'throttling_burst_bits': 0,
+        'wire_trace_size': 1000
+    }
+
+    THROTTLING_MODES: Dict[str, Throttler.Mode] = {
+        'estimation': Throttler.Mode.Estimation,
+        'token_bucket': Throttler.Mode.TokenBucket
     }
 
     active_request: Optional[Request]
@@ -72,10 +85,12 @@ class CommHandler:
     timed_out: bool
     pending_request: Optional[Request]
     link_type: str
+    wire_trace: WireTrace
 
     def __init__(self, params={}):
         self.active_request = None      # Contains the request object that has been sent to the device. When None, no request sent and we are standby
         self.received_response = None   # Indicates that a response has been received.
+        self.pending_request = None     # Request waiting for the throttler to let it go
         self.link = None                # Abstracted communication channel that implements  initialize, destroy, write, read
         self.params = copy(self.DEFAULT_PARAMS)
         self.params.update(params)
@@ -85,8 +100,11 @@ class CommHandler:
         self.logger = logging.getLogger(self.__class__.__name__)
         self.opened = False     # True when communication channel is active and working.
         self.reset_bitrate_monitor()
-        self.throttler = Throttler()
+        if self.params['throttling_mode'] not in self.THROTTLING_MODES:
+            raise ValueError('Unknown throttling mode %s' % self.params['throttling_mode'])
+        self.throttler = Throttler(mode=self.THROTTLING_MODES[self.params['throttling_mode']], burst_size=self.params['throttling_burst_bits'])
         self.link_type = "none"
+        self.wire_trace = WireTrace(self.params['wire_trace_size'])
 
     def enable_throttling(self, bitrate: float) -> None:
         self.throttler.set_bitrate(bitrate)
@@ -101,11 +119,31 @@ class CommHandler:
     def get_throttling_bitrate(self) -> float:
         return self.throttler.get_bitrate()
 
+    def get_tx_wait_time(self) -> Optional[float]:
+        """
+        Number of seconds before the pending request can be sent. None if no request is pending.
+        Lets the caller sleep until the throttler allows the next request.
+        """
+        if self.pending_request is None:
+            return None
+        return self.throttler.time_until_allowed(self.get_approx_delta_bandwidth(self.pending_request))
+
+    def get_approx_delta_bandwidth(self, request: Request) -> int:
+        # Request and its response. The response is counted when sending to avoid overflowing the device.
+        return (request.size() + request.get_expected_response_size()) * 8
+
     def reset_bitrate_monitor(self) -> None:
         self.rx_bitcount = 0
         self.tx_bitcount = 0
         self.bitcount_time = time.time()
 
+    def get_wire_trace(self) -> List[TraceRecord]:
+        return self.wire_trace.get_records()
+
+    def dump_wire_trace(self, filename: str) -> int:
+        """Writes the last frames exchanged with the device in a session file that can be played with the replay link"""
+        return self.wire_trace.dump(filename)
+
     def get_link(self) -> Optional[AbstractLink]:
         return self.link
 
@@ -145,6 +183,9 @@ class CommHandler:
         elif link_type == 'thread_safe_dummy':
             from scrutiny.server.device.links.dummy_link import ThreadSafeDummyLink
             link_class = ThreadSafeDummyLink
+        elif link_type == 'replay':
+            from scrutiny.server.device.links.replay_link import ReplayLink
+            link_class = ReplayLink
         else:
             raise ValueError('Unknown link type %s' % link_type)
 
@@ -218,10 +259,13 @@ class CommHandler:
         datasize_bits = len(data) * 8
         self.throttler.consume_bandwidth(datasize_bits)
         self.rx_bitcount += datasize_bits
-        self.logger.debug('Received : %s' % (hexlify(data).decode('ascii')))
+        self.wire_trace.add(SessionFileFormat.Direction.FromDevice, data)
+        if self.logger.isEnabledFor(logging.DEBUG):
+            self.logger.debug('Received : %s', hexlify(data).decode('ascii'))
 
         if self.response_available() or not self.waiting_response():
-            self.logger.debug('Received unwanted data: ' + hexlify(data).decode('ascii'))
+            if self.logger.isEnabledFor(logging.DEBUG):
+                self.logger.debug('Received unwanted data: %s', hexlify(data).decode('ascii'))
             return  # Purposely discard data if we are not expecting any
 
         self.rx_data.data_buffer += data    # Add data to receive buffer
@@ -240,7 +284,7 @@ class CommHandler:
                     self.received_response = Response.from_bytes(self.rx_data.data_buffer)  # CRC validation is done here
 
                     # Decoding did not raised an exception, we have a valid payload!
-                    self.logger.debug("Received Response %s" % self.received_response)
+                    self.logger.debug("Received Response %s", self.received_response)
                     self.rx_data.clear()        # Empty the receive buffer
                     self.response_timer.stop()  # Timeout timer can be stop
                     if self.active_request is not None:  # Just to please mypy
@@ -262,14 +306,16 @@ class CommHandler:
         assert self.link is not None
 
         if self.pending_request is not None:
-            approx_delta_bandwidth = (self.pending_request.size() + self.pending_request.get_expected_response_size()) * 8;
+            approx_delta_bandwidth = self.get_approx_delta_bandwidth(self.pending_request)
             if self.throttler.allowed(approx_delta_bandwidth):
                 self.active_request = self.pending_request
                 self.pending_request = None
                 data = self.active_request.to_bytes()
-                self.logger.debug("Sending request %s" % self.active_request)
-                self.logger.debug("Sending : %s" % (hexlify(data).decode('ascii')))
+                if self.logger.isEnabledFor(logging.DEBUG):
+                    self.logger.debug("Sending request %s", self.active_request)
+                    self.logger.debug("Sending : %s", hexlify(data).decode('ascii'))
                 datasize_bits = len(data) * 8
+                self.wire_trace.add(SessionFileFormat.Direction.ToDevice, data)
                 try:
                     self.link.write(data)
                     err = None
@@ -287,7 +333,7 @@ class CommHandler:
                 self.pending_request = None
             else:
                 if newrequest:  # Not sent right away
-                    self.logger.debug('Received request to send. Waiting because of throttling. %s' % self.pending_request)
+                    self.logger.debug('Received request to send. Waiting because of throttling. %s', self.pending_request)
 
     def response_available(self) -> bool:
         return (self.received_response is not None)
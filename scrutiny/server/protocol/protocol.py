@@ -37,6 +37,8 @@ class RequestData(TypedDict, total=False):
     blocks_to_write: List[BlockAddressData]
     blocks_to_read: List[BlockAddressLength]
     record_id: int
+    offset: int
+    length: int
     configuration: DatalogConfiguration
     magic: bytes
     session_id: int
@@ -50,6 +52,7 @@ class ResponseData(TypedDict, total=False):
     memory_write: bool
     datalog_acquire: bool
     user_command: bool
+    datalog_partial_read: bool
     software_id: bytes
     nbr_readonly: int
     nbr_forbidden: int
@@ -189,6 +192,12 @@ class Protocol:
     def read_memory_response_overhead_size_per_block(self):
         return self.get_address_size_bytes() + 2
 
+    def write_memory_request_overhead_size_per_block(self):
+        return self.get_address_size_bytes() + 2  # Address + 16 bits length. Data (and mask) comes after
+
+    def write_memory_response_size_per_block(self):
+        return self.get_address_size_bytes() + 2
+
     def read_single_memory_block(self, address: int, length: int) -> Request:
         block_list = [(address, length)]
         return self.read_memory_blocks(block_list)
@@ -282,8 +291,16 @@ class Protocol:
     def datalog_get_list_recordings(self) -> Request:
         return Request(cmd.DatalogControl, cmd.DatalogControl.Subfunction.ListRecordings)   # todo : response_payload_size
 
-    def datalog_read_recording(self, record_id: int) -> Request:
-        return Request(cmd.DatalogControl, cmd.DatalogControl.Subfunction.ReadRecordings, struct.pack('>H', record_id))  # todo : response_payload_size
+    def datalog_read_recording(self, record_id: int, offset: Optional[int] = None, length: Optional[int] = None) -> Request:
+        if offset is None and length is None:
+            return Request(cmd.DatalogControl, cmd.DatalogControl.Subfunction.ReadRecordings, struct.pack('>H', record_id))  # todo : response_payload_size
+
+        # Partial read. Allows to download a recording bigger than what the device can send in a single response.
+        # Only for devices that report the datalog_partial_read feature.
+        offset = 0 if offset is None else offset
+        if length is None:
+            raise ValueError('Length must be given for a partial read')
+        return Request(cmd.DatalogControl, cmd.DatalogControl.Subfunction.ReadRecordings, struct.pack('>HLH', record_id, offset, length), response_payload_size=2 + length)
 
     def datalog_arm(self) -> Request:
         return Request(cmd.DatalogControl, cmd.DatalogControl.Subfunction.ArmLog)   # todo : response_payload_size
@@ -371,6 +388,8 @@ class Protocol:
 
                 if subfn == cmd.DatalogControl.Subfunction.ReadRecordings:          # DatalogControl - ReadRecordings
                     (data['record_id'],) = struct.unpack('>H', req.payload[0:2])
+                    if len(req.payload) >= 8:
+                        (data['offset'], data['length']) = struct.unpack('>LH', req.payload[2:8])
 
                 elif subfn == cmd.DatalogControl.Subfunction.ConfigureDatalog:      # DatalogControl - ConfigureDatalog
                     conf = DatalogConfiguration()
@@ -443,7 +462,8 @@ class Protocol:
     def respond_software_id(self, software_id: Union[bytes, List[int], bytearray]) -> Response:
         return Response(cmd.GetInfo, cmd.GetInfo.Subfunction.GetSoftwareId, Response.ResponseCode.OK, bytes(software_id))
 
-    def respond_supported_features(self, memory_write: bool = False, datalog_acquire: bool = False, user_command: bool = False) -> Response:
+    def respond_supported_features(self, memory_write: bool = False, datalog_acquire: bool = False, user_command: bool = False,
+                                   datalog_partial_read: bool = False) -> Response:
         bytes1 = 0
         if memory_write:
             bytes1 |= 0x80
@@ -454,6 +474,9 @@ class Protocol:
         if user_command:
             bytes1 |= 0x20
 
+        if datalog_partial_read:
+            bytes1 |= 0x10
+
         return Response(cmd.GetInfo, cmd.GetInfo.Subfunction.GetSupportedFeatures, Response.ResponseCode.OK, bytes([bytes1]))
 
     def respond_special_memory_region_count(self, readonly: int, forbidden: int) -> Response:
@@ -588,6 +611,7 @@ class Protocol:
                         data['memory_write'] = True if (byte1 & 0x80) != 0 else False
                         data['datalog_acquire'] = True if (byte1 & 0x40) != 0 else False
                         data['user_command'] = True if (byte1 & 0x20) != 0 else False
+                        data['datalog_partial_read'] = True if (byte1 & 0x10) != 0 else False
 
                     elif subfn == cmd.GetInfo.Subfunction.GetSoftwareId:
                         data['software_id'] = response.payload
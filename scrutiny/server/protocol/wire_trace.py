@@ -0,0 +1,66 @@
+#    wire_trace.py
+#        In-memory ring of the last frames exchanged with the device. Cheap enough to stay
+#        enabled all the time and can be dumped to a session file when something goes wrong.
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import time
+
+from scrutiny.server.tools.session_file import SessionFileWriter, SessionFileFormat, SessionRecord
+from typing import List, Optional
+
+TraceRecord = SessionRecord
+
+
+class WireTrace:
+    """
+    Keeps the last frames written to and read from the link, with their timestamp.
+
+    Recording is a single slot assignment, there is no lock and no formatting. The CommHandler thread is the only writer.
+    A dump can be done from another thread : the slots are copied, then sorted by time, so a frame overwritten during
+    the copy is at worst missing from the dump.
+    Dumps are session files that can be played back with the replay link.
+    """
+
+    records: List[Optional[TraceRecord]]
+    capacity: int
+    write_index: int
+
+    def __init__(self, capacity: int):
+        if capacity < 0:
+            raise ValueError('Capacity must be a positive value')
+        self.capacity = capacity
+        self.clear()
+
+    def clear(self) -> None:
+        self.records = [None] * self.capacity
+        self.write_index = 0
+
+    def is_enabled(self) -> bool:
+        return self.capacity > 0
+
+    def add(self, direction: SessionFileFormat.Direction, data: bytes) -> None:
+        if self.capacity > 0:
+            self.records[self.write_index % self.capacity] = (time.perf_counter(), direction, data)
+            self.write_index += 1
+
+    def get_records(self) -> List[TraceRecord]:
+        """Returns the recorded frames, oldest first"""
+        snapshot = self.records[:]
+        records = [record for record in snapshot if record is not None]
+        records.sort(key=lambda record: record[0])
+        return records
+
+    def dump(self, filename: str) -> int:
+        """Writes the recorded frames in a session file. Returns the number of frames written"""
+        records = self.get_records()
+        writer = SessionFileWriter(filename)
+        try:
+            for record in records:
+                writer.add(*record)
+        finally:
+            writer.close()
+        return len(records)
@@ -1,7 +1,7 @@
 #    server.py
 #        The scrutiny server. Talk with multiple clients through a websocket API and communicate
-#        with a device through a given communication link (Serial, UDP, etc)
-#        Allow the clients to interract with the device
+#        with one or many devices through a given communication link (Serial, UDP, etc)
+#        Allow the clients to interract with the devices
 #
 #   - License : MIT - See LICENSE file.
 #   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
@@ -20,8 +20,9 @@ from scrutiny.server.api import API, APIConfig
 from scrutiny.server.datastore import Datastore
 from scrutiny.server.device.device_handler import DeviceHandler, DeviceHandlerConfig
 from scrutiny.server.active_sfd_handler import ActiveSFDHandler
+from scrutiny.server.device_instance import DeviceInstance, DeviceInstanceConfig
 
-from typing import TypedDict, Optional
+from typing import TypedDict, Optional, List
 
 
 class ServerConfig(TypedDict, total=False):
@@ -30,6 +31,7 @@ class ServerConfig(TypedDict, total=False):
     debug: bool
     device_config: DeviceHandlerConfig
     api_config: APIConfig
+    devices: List[DeviceInstanceConfig]    # Additional devices, on top of the default one defined by device_config
 
 
 DEFAULT_CONFIG: ServerConfig = {
@@ -60,6 +62,7 @@ class ScrutinyServer:
     api: API
     device_handler: DeviceHandler
     sfd_handler: ActiveSFDHandler
+    devices: List[DeviceInstance]
 
     def __init__(self, config_filename: str = None):
         self.logger = logging.getLogger(self.__class__.__name__)
@@ -83,20 +86,35 @@ class ScrutinyServer:
         self.api = API(self.config['api_config'], datastore=self.datastore, device_handler=self.device_handler,
                        sfd_handler=self.sfd_handler, enable_debug=self.config['debug'])
 
+        for device_config in self.config.get('devices', []):
+            self.api.add_device(DeviceInstance.make(device_config))
+        self.devices = self.api.get_devices()
+
     def validate_config(self) -> None:
-        pass
+        if 'devices' in self.config:
+            if not isinstance(self.config['devices'], list):
+                raise ValueError('devices must be a list')
+            names = [DeviceInstance.DEFAULT_NAME]
+            for device_config in self.config['devices']:
+                if not isinstance(device_config, dict) or 'name' not in device_config:
+                    raise ValueError('Each device must have a name')
+                if device_config['name'] in names:
+                    raise ValueError('Duplicate device name "%s"' % device_config['name'])
+                names.append(device_config['name'])
 
     def run(self) -> None:
         self.logger.info('Starting server instance "%s"' % (self.server_name))
 
         try:
             self.api.start_listening()
-            self.sfd_handler.init()
+            # Each device is processed in its own thread so that a slow link does not stall the others nor the API.
+            for device in self.devices:
+                self.logger.info('Starting device "%s"' % device.name)
+                device.init()
+                device.start_thread()
+
             while True:
                 self.api.process()
-                self.device_handler.process()
-                self.sfd_handler.process()
-
                 time.sleep(0.05)
         except KeyboardInterrupt:
             self.close_all()
@@ -110,10 +128,7 @@ class ScrutinyServer:
         if self.api is not None:
             self.api.close()
 
-        if self.device_handler is not None:
-            self.device_handler.stop_comm()
-
-        if self.sfd_handler is not None:
-            self.sfd_handler.close()
+        for device in self.devices:
+            device.close()
 
         self.logger.info('Closing server instance "%s"' % self.server_name)
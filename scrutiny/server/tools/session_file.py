@@ -0,0 +1,78 @@
+#    session_file.py
+#        Format of the session files that hold the frames exchanged with a device. Written by
+#        the wire trace and played back by the replay link.
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import struct
+from enum import Enum
+
+from typing import List, Tuple, BinaryIO, Union
+
+
+class SessionFileFormat:
+    """
+    Layout of a session file. Everything is little endian.
+
+    [Header]    : Magic, version
+    [Record]*   : Timestamp (float64 seconds), direction, data length, then the data as seen on the link
+    """
+    MAGIC = b'SRPL'
+    VERSION = 1
+
+    HEADER = struct.Struct('<4sH')
+    RECORD = struct.Struct('<dBL')
+
+    class Direction(Enum):
+        ToDevice = 0
+        FromDevice = 1
+
+
+# (timestamp, direction, data)
+SessionRecord = Tuple[float, "SessionFileFormat.Direction", bytes]
+
+
+class SessionFileWriter:
+    """Writes the traffic of a link in a session file"""
+
+    file: BinaryIO
+
+    def __init__(self, filename: str):
+        fmt = SessionFileFormat
+        self.file = open(filename, 'wb')
+        self.file.write(fmt.HEADER.pack(fmt.MAGIC, fmt.VERSION))
+
+    def add(self, timestamp: float, direction: SessionFileFormat.Direction, data: Union[bytes, bytearray]) -> None:
+        self.file.write(SessionFileFormat.RECORD.pack(timestamp, direction.value, len(data)))
+        self.file.write(data)
+
+    def close(self) -> None:
+        self.file.close()
+
+
+def read_session_file(filename: str) -> List[SessionRecord]:
+    fmt = SessionFileFormat
+    records: List[SessionRecord] = []
+    with open(filename, 'rb') as f:
+        data = f.read()
+
+    if len(data) < fmt.HEADER.size:
+        raise ValueError('Session file is too small')
+    magic, version = fmt.HEADER.unpack_from(data, 0)
+    if magic != fmt.MAGIC:
+        raise ValueError('Not a session file')
+    if version != fmt.VERSION:
+        raise ValueError('Unsupported session file version %d' % version)
+
+    pos = fmt.HEADER.size
+    while pos + fmt.RECORD.size <= len(data):
+        timestamp, direction, length = fmt.RECORD.unpack_from(data, pos)
+        pos += fmt.RECORD.size
+        if pos + length > len(data):
+            break   # Truncated record. Keep what we have
+        records.append((timestamp, fmt.Direction(direction), data[pos:pos + length]))
+        pos += length
+    return records
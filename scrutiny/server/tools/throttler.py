@@ -8,13 +8,31 @@
 
 import time
 import math
+from enum import Enum
 
 
 class Throttler:
+    """
+    Limit the bitrate of a communication channel. Two modes are available.
+
+    - Estimation : The bitrate is estimated with low pass filters and data is sent when the estimation is below the target.
+    - TokenBucket : Tokens (bits) accumulate at the target bitrate up to a burst size. Data can be sent when enough tokens are
+      available. A chunk bigger than the burst size is let through when the bucket is full and puts the bucket in debt, so the
+      mean bitrate is always respected. Also gives the exact moment a chunk can be sent.
+    """
 
     MIN_BITRATE = 100
+    DEFAULT_BURST_DURATION = 0.1    # When no burst size is given, allow a burst of this many seconds at the target bitrate
+
+    class Mode(Enum):
+        Estimation = 0
+        TokenBucket = 1
 
     enabled: bool
+    mode: "Throttler.Mode"
+    burst_size: float
+    tokens: float
+    last_refill_timestamp: float
     mean_bitrate: float
     bitrate_estimation_window: float
     slow_tau: float
@@ -24,9 +42,11 @@ class Throttler:
     estimated_bitrate_fast: float
     consumed_since_last_estimation: int
 
-    def __init__(self, mean_bitrate: float = 0, bitrate_estimation_window: float = 0.1):
+    def __init__(self, mean_bitrate: float = 0, bitrate_estimation_window: float = 0.1, mode: "Throttler.Mode" = Mode.Estimation, burst_size: float = 0):
         self.enabled = False
         self.mean_bitrate = mean_bitrate
+        self.set_mode(mode)
+        self.set_burst_size(burst_size)
         self.bitrate_estimation_window = bitrate_estimation_window
         self.slow_tau = max(1.0, self.bitrate_estimation_window)
         self.fast_tau = max(0.05, self.bitrate_estimation_window)
@@ -35,6 +55,27 @@ class Throttler:
     def set_bitrate(self, mean_bitrate: float) -> None:
         self.mean_bitrate = mean_bitrate
 
+    def set_mode(self, mode: "Throttler.Mode") -> None:
+        if not isinstance(mode, self.Mode):
+            raise ValueError('mode must be an instance of Throttler.Mode')
+        self.mode = mode
+
+    def get_mode(self) -> "Throttler.Mode":
+        return self.mode
+
+    def set_burst_size(self, burst_size: float) -> None:
+        """
+        Maximum number of bits that can be sent back to back in token bucket mode. 0 means automatic
+        """
+        if burst_size < 0:
+            raise ValueError('Burst size cannot be negative')
+        self.burst_size = burst_size
+
+    def get_burst_size(self) -> float:
+        if self.burst_size > 0:
+            return self.burst_size
+        return self.mean_bitrate * self.DEFAULT_BURST_DURATION
+
     def enable(self) -> None:
         if self.mean_bitrate > self.MIN_BITRATE:
             self.enabled = True
@@ -57,6 +98,17 @@ class Throttler:
         self.estimated_bitrate_slow = 0
         self.estimated_bitrate_fast = 0
         self.consumed_since_last_estimation = 0
+        self.tokens = self.get_burst_size()   # Starts full
+        self.last_refill_timestamp = time.monotonic()
+
+    def refill(self) -> None:
+        t = time.monotonic()
+        self.tokens = min(self.get_burst_size(), self.tokens + (t - self.last_refill_timestamp) * self.mean_bitrate)
+        self.last_refill_timestamp = t
+
+    def get_needed_tokens(self, delta_bandwidth: float) -> float:
+        # A chunk bigger than the bucket is sent when the bucket is full.
+        return min(delta_bandwidth, self.get_burst_size())
 
     def process(self) -> None:
         if not self.enabled:
@@ -88,6 +140,10 @@ class Throttler:
         if not self.enabled:
             return True
 
+        if self.mode == self.Mode.TokenBucket:
+            self.refill()
+            return self.tokens >= self.get_needed_tokens(delta_bandwidth)
+
         allowed = True
         approx_bitrate = max(self.estimated_bitrate_slow, self.estimated_bitrate_fast)
 
@@ -106,6 +162,26 @@ class Throttler:
 
         return self.mean_bitrate > 0  # This was originally designed to prevent burst. It is not dneeded, but we keep the interface
 
+    def time_until_allowed(self, delta_bandwidth: int) -> float:
+        """
+        Tells how many seconds to wait before this chunk of data can be sent. 0 means right now.
+        In estimation mode, this is the time until the next estimation update.
+        """
+        if not self.enabled:
+            return 0
+
+        if self.mode == self.Mode.TokenBucket:
+            self.refill()
+            missing = self.get_needed_tokens(delta_bandwidth) - self.tokens
+            return max(0.0, missing / self.mean_bitrate)
+
+        if self.allowed(delta_bandwidth):
+            return 0
+        return max(0.0, self.last_process_timestamp + self.bitrate_estimation_window - time.time())
+
     def consume_bandwidth(self, delta_bandwidth: int) -> None:
         if self.enabled:
             self.consumed_since_last_estimation += delta_bandwidth
+            if self.mode == self.Mode.TokenBucket:
+                self.refill()
+                self.tokens -= delta_bandwidth  # Can go negative. The debt is paid before the next chunk.
@@ -0,0 +1,427 @@
+#    value_recorder.py
+#        Records the values of some watchables in a capture file for post-mortem analysis.
+#        Values are stored in compressed chunks, one timestamp and one value column per signal,
+#        with an index at the end of the file to seek by time without reading everything.
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import os
+import sys
+import struct
+import json
+import zlib
+import array
+import bisect
+import logging
+import threading
+import traceback
+from collections import deque
+
+from scrutiny.server.datastore import DatastoreEntry
+from scrutiny.core.variable import VariableType
+from scrutiny.core.typehints import GenericCallback
+
+from typing import List, Dict, Tuple, Optional, Any, Deque, BinaryIO, TypedDict, TYPE_CHECKING
+
+if TYPE_CHECKING:
+    from scrutiny.server.device_instance import DeviceInstance
+
+
+class BaseSignalDefinition(TypedDict):
+    id: str
+    display_path: str
+    datatype: str   # Name of a VariableType
+
+
+class SignalDefinition(BaseSignalDefinition, total=False):
+    typecode: str   # array typecode of the value column. Set by the writer from the datatype
+
+
+class CaptureFileFormat:
+    """
+    Layout of a capture file. Everything is little endian.
+
+    [Header]            : Magic, version, firmware ID of the loaded SFD (empty if none), size of the signal definitions
+    [Signals]           : JSON encoded list of signals. The position in the list is the signal index
+    [Chunk]*            : Chunk header followed by a zlib compressed payload. For each signal present in the chunk :
+                          (signal index, count), then count timestamps (float64), then count values stored with
+                          the typecode of the signal. Integers up to 64 bits are kept exact
+    [Index]             : One entry per chunk. (file offset, compressed size, sample count, first timestamp, last timestamp)
+    [Footer]            : Offset of the index, number of chunks, magic
+
+    Chunk headers hold everything needed to rebuild the index, so a file that was not closed properly can still be read.
+    """
+    MAGIC = b'SCAP'
+    CHUNK_MAGIC = b'CHNK'
+    VERSION = 2
+    SUPPORTED_VERSIONS = [1, 2]     # Version 1 stores all values as float64 and has no typecode
+    DEFAULT_TYPECODE = 'd'
+
+    HEADER = struct.Struct('<4sHH32sL')
+    CHUNK_HEADER = struct.Struct('<4sLLdd')
+    CHUNK_SIGNAL = struct.Struct('<LL')
+    INDEX_ENTRY = struct.Struct('<QLLdd')
+    FOOTER = struct.Struct('<QL4s')
+
+    # Other types, including integers larger than 64 bits, are stored as float64
+    TYPECODE_MAP = {
+        VariableType.sint8: 'q', VariableType.sint16: 'q', VariableType.sint32: 'q', VariableType.sint64: 'q',
+        VariableType.uint8: 'Q', VariableType.uint16: 'Q', VariableType.uint32: 'Q', VariableType.uint64: 'Q',
+        VariableType.boolean: 'B'
+    }
+
+    @classmethod
+    def get_typecode(cls, datatype: str) -> str:
+        return cls.TYPECODE_MAP.get(VariableType[datatype], cls.DEFAULT_TYPECODE)
+
+
+class ChunkIndexEntry:
+    __slots__ = ('offset', 'size', 'sample_count', 'start_time', 'end_time')
+
+    offset: int
+    size: int
+    sample_count: int
+    start_time: float
+    end_time: float
+
+    def __init__(self, offset: int, size: int, sample_count: int, start_time: float, end_time: float):
+        self.offset = offset
+        self.size = size
+        self.sample_count = sample_count
+        self.start_time = start_time
+        self.end_time = end_time
+
+
+class CaptureFileWriter:
+    """
+    Accumulates samples in memory and writes them in compressed chunks of chunk_size samples.
+    """
+    DEFAULT_CHUNK_SIZE: int = 4096
+    COMPRESSION_LEVEL: int = 6
+
+    filename: str
+    file: BinaryIO
+    signals: List[SignalDefinition]
+    chunk_size: int
+    timestamps: List["array.array[float]"]
+    values: List["array.array[Any]"]
+    pending_count: int
+    index: List[ChunkIndexEntry]
+    sample_count: int
+
+    def __init__(self, filename: str, signals: List[SignalDefinition], firmware_id: Optional[str] = None, chunk_size: int = DEFAULT_CHUNK_SIZE):
+        fmt = CaptureFileFormat
+        if len(signals) == 0:
+            raise ValueError('At least one signal is required')
+
+        encoded_firmware_id = firmware_id.encode('ascii') if firmware_id is not None else b''
+        if len(encoded_firmware_id) > 32:
+            raise ValueError('Firmware ID is too long')
+
+        self.filename = filename
+        self.signals = []
+        for signal in signals:
+            signal = signal.copy()
+            signal['typecode'] = fmt.get_typecode(signal['datatype'])
+            self.signals.append(signal)
+        self.chunk_size = chunk_size
+        self.timestamps = [array.array('d') for signal in signals]
+        self.values = [array.array(signal['typecode']) for signal in self.signals]
+        self.pending_count = 0
+        self.index = []
+        self.sample_count = 0
+
+        signals_data = json.dumps(self.signals).encode('utf8')
+        self.file = open(filename, 'wb')
+        self.file.write(fmt.HEADER.pack(fmt.MAGIC, fmt.VERSION, 0, encoded_firmware_id, len(signals_data)))
+        self.file.write(signals_data)
+
+    def add_sample(self, signal_index: int, timestamp: float, value: Any) -> None:
+        self.timestamps[signal_index].append(timestamp)
+        values = self.values[signal_index]
+        values.append(float(value) if values.typecode == 'd' else int(value))
+        self.pending_count += 1
+        if self.pending_count >= self.chunk_size:
+            self.flush()
+
+    def flush(self) -> None:
+        """Writes the pending samples in a new chunk"""
+        fmt = CaptureFileFormat
+        if self.pending_count == 0:
+            return
+
+        payload = bytearray()
+        start_time = min([timestamps[0] for timestamps in self.timestamps if len(timestamps) > 0])
+        end_time = max([timestamps[-1] for timestamps in self.timestamps if len(timestamps) > 0])
+        for signal_index in range(len(self.signals)):
+            count = len(self.timestamps[signal_index])
+            if count > 0:
+                # array.array is native endian. The file is always little endian.
+                timestamps, values = self.timestamps[signal_index], self.values[signal_index]
+                if sys.byteorder != 'little':
+                    timestamps.byteswap()
+                    values.byteswap()
+                payload += fmt.CHUNK_SIGNAL.pack(signal_index, count)
+                payload += timestamps.tobytes()
+                payload += values.tobytes()
+                self.timestamps[signal_index] = array.array('d')
+                self.values[signal_index] = array.array(values.typecode)
+
+        compressed = zlib.compress(bytes(payload), self.COMPRESSION_LEVEL)
+        offset = self.file.tell()
+        self.file.write(fmt.CHUNK_HEADER.pack(fmt.CHUNK_MAGIC, len(compressed), self.pending_count, start_time, end_time))
+        self.file.write(compressed)
+        self.file.flush()
+        self.index.append(ChunkIndexEntry(offset, len(compressed), self.pending_count, start_time, end_time))
+        self.sample_count += self.pending_count
+        self.pending_count = 0
+
+    def close(self) -> None:
+        fmt = CaptureFileFormat
+        if self.file.closed:
+            return
+        self.flush()
+        index_offset = self.file.tell()
+        for entry in self.index:
+            self.file.write(fmt.INDEX_ENTRY.pack(entry.offset, entry.size, entry.sample_count, entry.start_time, entry.end_time))
+        self.file.write(fmt.FOOTER.pack(index_offset, len(self.index), fmt.MAGIC))
+        self.file.close()
+
+
+class CaptureFileReader:
+    """
+    Reads a capture file. Only the chunks that overlap the requested time range are decompressed.
+    """
+
+    filename: str
+    firmware_id: Optional[str]
+    signals: List[SignalDefinition]
+    signal_index_map: Dict[str, int]
+    index: List[ChunkIndexEntry]
+    chunk_end_times: List[float]
+
+    def __init__(self, filename: str):
+        fmt = CaptureFileFormat
+        self.filename = filename
+        with open(filename, 'rb') as f:
+            header_data = f.read(fmt.HEADER.size)
+            if len(header_data) < fmt.HEADER.size:
+                raise ValueError('Capture file is too small')
+            magic, version, _, firmware_id, signals_size = fmt.HEADER.unpack(header_data)
+            if magic != fmt.MAGIC:
+                raise ValueError('Not a capture file')
+            if version not in fmt.SUPPORTED_VERSIONS:
+                raise ValueError('Unsupported capture file version %d' % version)
+
+            firmware_id = firmware_id.rstrip(b'\x00')
+            self.firmware_id = firmware_id.decode('ascii') if len(firmware_id) > 0 else None
+            self.signals = json.loads(f.read(signals_size).decode('utf8'))
+            for signal in self.signals:
+                signal.setdefault('typecode', fmt.DEFAULT_TYPECODE)
+            self.signal_index_map = dict([(signal['id'], i) for i, signal in enumerate(self.signals)])
+            first_chunk_offset = f.tell()
+
+            index = self.read_index(f)
+            self.index = index if index is not None else self.rebuild_index(f, first_chunk_offset)
+
+        # Chunks are written in time order. Used to find the first chunk of a time range with a binary search
+        self.chunk_end_times = [entry.end_time for entry in self.index]
+
+    def read_index(self, f: BinaryIO) -> Optional[List[ChunkIndexEntry]]:
+        fmt = CaptureFileFormat
+        f.seek(0, os.SEEK_END)
+        filesize = f.tell()
+        if filesize < fmt.FOOTER.size:
+            return None
+        f.seek(filesize - fmt.FOOTER.size)
+        index_offset, chunk_count, magic = fmt.FOOTER.unpack(f.read(fmt.FOOTER.size))
+        if magic != fmt.MAGIC or index_offset + chunk_count * fmt.INDEX_ENTRY.size + fmt.FOOTER.size != filesize:
+            return None
+
+        f.seek(index_offset)
+        index_data = f.read(chunk_count * fmt.INDEX_ENTRY.size)
+        return [ChunkIndexEntry(*entry) for entry in fmt.INDEX_ENTRY.iter_unpack(index_data)]
+
+    def rebuild_index(self, f: BinaryIO, offset: int) -> List[ChunkIndexEntry]:
+        # File was not closed properly. Walk the chunks and keep those that are complete.
+        fmt = CaptureFileFormat
+        index: List[ChunkIndexEntry] = []
+        f.seek(0, os.SEEK_END)
+        filesize = f.tell()
+        while offset + fmt.CHUNK_HEADER.size <= filesize:
+            f.seek(offset)
+            magic, size, sample_count, start_time, end_time = fmt.CHUNK_HEADER.unpack(f.read(fmt.CHUNK_HEADER.size))
+            if magic != fmt.CHUNK_MAGIC or offset + fmt.CHUNK_HEADER.size + size > filesize:
+                break
+            index.append(ChunkIndexEntry(offset, size, sample_count, start_time, end_time))
+            offset += fmt.CHUNK_HEADER.size + size
+        return index
+
+    def get_firmware_id(self) -> Optional[str]:
+        return self.firmware_id
+
+    def get_signals(self) -> List[SignalDefinition]:
+        return self.signals
+
+    def get_sample_count(self) -> int:
+        return sum([entry.sample_count for entry in self.index])
+
+    def get_time_range(self) -> Optional[Tuple[float, float]]:
+        if len(self.index) == 0:
+            return None
+        return (min([entry.start_time for entry in self.index]), max(self.chunk_end_times))
+
+    def read_signal(self, signal_id: str, start: Optional[float] = None,
+                    end: Optional[float] = None) -> Tuple["array.array[float]", "array.array[Any]"]:
+        """
+        Returns the timestamps and the values of a signal, optionally limited to [start, end].
+        Values have the typecode of the signal, so integers are given back exactly.
+        """
+        fmt = CaptureFileFormat
+        if signal_id not in self.signal_index_map:
+            raise KeyError('No signal %s in capture file' % signal_id)
+        signal_index = self.signal_index_map[signal_id]
+        value_sizes = [array.array(signal['typecode']).itemsize for signal in self.signals]
+
+        timestamps: "array.array[float]" = array.array('d')
+        values: "array.array[Any]" = array.array(self.signals[signal_index]['typecode'])
+        first_chunk = bisect.bisect_left(self.chunk_end_times, start) if start is not None else 0
+        with open(self.filename, 'rb') as f:
+            for entry in self.index[first_chunk:]:
+                if end is not None and entry.start_time > end:
+                    break
+                f.seek(entry.offset + fmt.CHUNK_HEADER.size)
+                payload = zlib.decompress(f.read(entry.size))
+                pos = 0
+                while pos < len(payload):
+                    index, count = fmt.CHUNK_SIGNAL.unpack_from(payload, pos)
+                    pos += fmt.CHUNK_SIGNAL.size
+                    timestamps_size = count * timestamps.itemsize
+                    values_size = count * value_sizes[index]
+                    if index == signal_index:
+                        chunk_timestamps = array.array('d', payload[pos:pos + timestamps_size])
+                        chunk_values = array.array(values.typecode, payload[pos + timestamps_size:pos + timestamps_size + values_size])
+                        if sys.byteorder != 'little':
+                            chunk_timestamps.byteswap()
+                            chunk_values.byteswap()
+                        for t, v in zip(chunk_timestamps, chunk_values):
+                            if (start is None or t >= start) and (end is None or t <= end):
+                                timestamps.append(t)
+                                values.append(v)
+                        break
+                    pos += timestamps_size + values_size
+
+        return (timestamps, values)
+
+
+class ValueRecorder:
+    """
+    Watches some entries of a device and writes their values in a capture file.
+
+    The device thread only appends the new values to a deque. Building the columns, compressing
+    and writing to the file is done by the recorder thread, so the polling loop is not slowed down.
+    """
+    FLUSH_PERIOD: float = 0.2
+
+    logger: logging.Logger
+    name: str
+    device: "DeviceInstance"
+    entries: List[DatastoreEntry]
+    filename: str
+    chunk_size: int
+    writer: Optional[CaptureFileWriter]
+    sample_queue: Deque[Tuple[int, float, Any]]
+    thread: Optional[threading.Thread]
+    stop_event: threading.Event
+
+    def __init__(self, name: str, device: "DeviceInstance", entries: List[DatastoreEntry], filename: str,
+                 chunk_size: int = CaptureFileWriter.DEFAULT_CHUNK_SIZE):
+        if len(entries) == 0:
+            raise ValueError('Nothing to record')
+        self.logger = logging.getLogger('%s[%s]' % (self.__class__.__name__, name))
+        self.name = name
+        self.device = device
+        self.entries = entries
+        self.filename = filename
+        self.chunk_size = chunk_size
+        self.writer = None
+        self.sample_queue = deque()
+        self.thread = None
+        self.stop_event = threading.Event()
+
+    def get_watcher_name(self) -> str:
+        return 'recorder:%s' % self.name
+
+    def get_sample_count(self) -> int:
+        return self.writer.sample_count + self.writer.pending_count if self.writer is not None else 0
+
+    def start(self) -> None:
+        if self.thread is not None:
+            return
+        sfd = self.device.get_snapshot().loaded_sfd
+        firmware_id = str(sfd.get_firmware_id(ascii=True)) if sfd is not None else None
+        signals: List[SignalDefinition] = [{
+            'id': entry.get_id(),
+            'display_path': entry.get_display_path(),
+            'datatype': entry.get_data_type().name
+        } for entry in self.entries]
+        self.writer = CaptureFileWriter(self.filename, signals, firmware_id=firmware_id, chunk_size=self.chunk_size)
+
+        self.stop_event.clear()
+        self.thread = threading.Thread(target=self.thread_task, name='Recorder-%s' % self.name, daemon=True)
+        self.thread.start()
+
+        watcher = self.get_watcher_name()
+
+        def command() -> None:
+            for i, entry in enumerate(self.entries):
+                self.device.datastore.start_watching(entry, watcher=watcher, callback=GenericCallback(self.value_changed), args=i)
+        self.device.run_command(command)
+        self.logger.info('Recording %d signals in %s' % (len(self.entries), self.filename))
+
+    def stop(self) -> None:
+        if self.thread is None:
+            return
+        watcher = self.get_watcher_name()
+
+        def command() -> None:
+            for entry in self.entries:
+                if self.device.datastore.has_entry(entry.get_id()):     # Could have been removed by an SFD unload
+                    self.device.datastore.stop_watching(entry, watcher=watcher)
+        self.device.run_command(command)
+
+        self.stop_event.set()
+        self.thread.join()
+        self.thread = None
+        self.write_pending_samples()
+        assert self.writer is not None
+        self.writer.close()
+        self.logger.info('Recording stopped. %d samples written in %s' % (self.writer.sample_count, self.filename))
+
+    def is_running(self) -> bool:
+        return self.thread is not None
+
+    def value_changed(self, watcher: str, signal_index: int, entry: DatastoreEntry) -> None:
+        # Called by the device thread. Keep it as cheap as possible
+        self.sample_queue.append((signal_index, entry.get_update_time(), entry.get_value()))
+
+    def write_pending_samples(self) -> None:
+        assert self.writer is not None
+        while True:
+            try:
+                signal_index, timestamp, value = self.sample_queue.popleft()
+            except IndexError:
+                break
+            self.writer.add_sample(signal_index, timestamp, value)
+
+    def thread_task(self) -> None:
+        while not self.stop_event.is_set():
+            try:
+                self.write_pending_samples()
+            except Exception as e:
+                self.logger.error('Error while recording. %s' % str(e))
+                self.logger.debug(traceback.format_exc())
+            self.stop_event.wait(self.FLUSH_PERIOD)
@@ -14,7 +14,7 @@ import logging
 
 dependencies = [
     'appdirs',
-    'pyelftools',
+    'pyelftools>=0.28',     # DWARFInfo.get_CU_at
     'websockets',
     'sortedcontainers',
     'pyserial'
@@ -0,0 +1,67 @@
+#    benchmark_elf_extraction.py
+#        Measure the time taken to extract a VarMap from a .elf file, serially and with worker processes.
+#        Not part of the unit tests. Run by hand : python -m test.benchmarks.benchmark_elf_extraction
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import argparse
+import multiprocessing
+import time
+
+from scrutiny.core.varmap import VarMap
+from scrutiny.core.bintools.elf_dwarf_var_extractor import ElfDwarfVarExtractor, _parallel_worker_init, _parallel_worker_extract
+from test.artifacts import get_artifact
+
+
+def time_file(filename, jobs):
+    t = time.perf_counter()
+    varmap = ElfDwarfVarExtractor(filename, jobs=jobs).get_varmap()
+    return time.perf_counter() - t, varmap
+
+
+# Gives the same compile units many times, as if the file was much bigger.
+# Goes through the same partition/merge path as ElfDwarfVarExtractor.load_from_elf_file_parallel
+def time_copies(filename, jobs, copies):
+    with open(filename, 'rb') as f:
+        extractor = ElfDwarfVarExtractor()
+        extractor.open_elf(f)
+        cu_list = [(cu.cu_offset, cu.size) for cu in extractor.dwarfinfo.iter_CUs()] * copies
+        extractor.demangler.close()
+
+    chunks = ElfDwarfVarExtractor.partition_cus(cu_list, jobs * ElfDwarfVarExtractor.CHUNKS_PER_JOB)
+    varmap = VarMap()
+    t = time.perf_counter()
+    if jobs <= 1:
+        _parallel_worker_init(filename, None)
+        for chunk in chunks:
+            varmap.merge(_parallel_worker_extract(chunk))
+    else:
+        with multiprocessing.Pool(processes=jobs, initializer=_parallel_worker_init, initargs=(filename, None)) as pool:
+            for partial_varmap in pool.imap(_parallel_worker_extract, chunks):
+                varmap.merge(partial_varmap)
+    return time.perf_counter() - t, varmap
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Time the VarMap extraction of a .elf file for different number of jobs')
+    parser.add_argument('--file', default=get_artifact('demobin.elf'), help='The .elf file. Default: demobin.elf')
+    parser.add_argument('--jobs', nargs='+', type=int, default=[1, 2, 4], help='Number of worker processes to try')
+    parser.add_argument('--copies', type=int, default=50, help='Number of times each compile unit is given for the synthetic large file')
+    args = parser.parse_args()
+
+    for name, func in [('file', lambda jobs: time_file(args.file, jobs)),
+                       ('%dx copies' % args.copies, lambda jobs: time_copies(args.file, jobs, args.copies))]:
+        reference = None
+        for jobs in args.jobs:
+            duration, varmap = func(jobs)
+            if reference is None:
+                reference = varmap.get_json()
+            same = 'same' if varmap.get_json() == reference else 'DIFFERENT'
+            print('%-12s jobs=%-3d %8.3f sec  (%s output as jobs=%d)' % (name, jobs, duration, same, args.jobs[0]))
+
+
+if __name__ == '__main__':
+    main()
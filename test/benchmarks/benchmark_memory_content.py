@@ -0,0 +1,76 @@
+#    benchmark_memory_content.py
+#        Compare the speed of MemoryContent and SortedMemoryContent on a memory made of many clusters.
+#        Not part of the unit tests. Run by hand : python -m test.benchmarks.benchmark_memory_content
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import argparse
+import random
+import time
+
+from scrutiny.core.memory_content import MemoryContent, SortedMemoryContent
+
+CLUSTER_SIZE = 16
+CLUSTER_SPACING = 32    # Gap between clusters so that they are not merged
+
+
+def fill(memory, cluster_count):
+    for i in range(cluster_count):
+        memory.write(i * CLUSTER_SPACING, bytes([i & 0xFF]) * CLUSTER_SIZE)
+
+
+def bench_contiguous_appends(memory_class, cluster_count, rng):
+    memory = memory_class()
+    t = time.perf_counter()
+    for i in range(cluster_count):
+        memory.write(i * CLUSTER_SIZE, bytes([i & 0xFF]) * CLUSTER_SIZE)   # Always merged with the previous write
+    return time.perf_counter() - t
+
+
+def bench_random_reads(memory_class, cluster_count, rng, count):
+    memory = memory_class()
+    fill(memory, cluster_count)
+    addresses = [rng.randrange(cluster_count) * CLUSTER_SPACING + rng.randrange(CLUSTER_SIZE - 4) for i in range(count)]
+    t = time.perf_counter()
+    for addr in addresses:
+        memory.read(addr, 4)
+    return time.perf_counter() - t
+
+
+def bench_delete_rewrite(memory_class, cluster_count, rng, count):
+    # Delete the end of a cluster, then write it back. The write is merged with a single cluster
+    memory = memory_class()
+    fill(memory, cluster_count)
+    addresses = [rng.randrange(cluster_count) * CLUSTER_SPACING + CLUSTER_SIZE - 8 for i in range(count)]
+    t = time.perf_counter()
+    for addr in addresses:
+        memory.delete(addr, 8)
+        memory.write(addr, b'\xAA' * 8)
+    return time.perf_counter() - t
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Time the MemoryContent operations')
+    parser.add_argument('--clusters', type=int, default=20000, help='Number of clusters in the memory')
+    parser.add_argument('--reads', type=int, default=20000, help='Number of random reads')
+    parser.add_argument('--rewrites', type=int, default=5000, help='Number of delete+rewrite. Slow with MemoryContent')
+    parser.add_argument('--seed', type=int, default=0)
+    args = parser.parse_args()
+
+    benchmarks = [
+        ('delete+rewrite x%d' % args.rewrites, lambda memory_class, rng: bench_delete_rewrite(memory_class, args.clusters, rng, args.rewrites)),
+        ('contiguous appends x%d' % args.clusters, lambda memory_class, rng: bench_contiguous_appends(memory_class, args.clusters, rng)),
+        ('random reads x%d' % args.reads, lambda memory_class, rng: bench_random_reads(memory_class, args.clusters, rng, args.reads)),
+    ]
+
+    print('%d clusters' % args.clusters)
+    for name, func in benchmarks:
+        durations = [func(memory_class, random.Random(args.seed)) for memory_class in [MemoryContent, SortedMemoryContent]]
+        print('%-28s MemoryContent: %8.3f sec   SortedMemoryContent: %8.3f sec' % (name, durations[0], durations[1]))
+
+
+if __name__ == '__main__':
+    main()
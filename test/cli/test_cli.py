@@ -104,6 +104,43 @@ class TestCLI(unittest.TestCase):
             self.assertNotEqual(tempbin_modified_content, tempbin_content)
             self.assertEqual(firmwareid, demobin_firmware_id)
 
+    # Tag many binaries in a single call
+    def test_get_firmware_id_batch(self):
+        with tempfile.TemporaryDirectory() as tempdirname:
+            cli = CLI()
+            with open(get_artifact('demobin_firmwareid')) as f:
+                demobin_firmware_id = f.read()
+            temp_bins = []
+            for i in range(3):
+                temp_bin = os.path.join(tempdirname, 'demobin%d.elf' % i)
+                shutil.copyfile(get_artifact('demobin.elf'), temp_bin)
+                temp_bins.append(temp_bin)
+
+            with RedirectStdout() as stdout:
+                cli.run(['get-firmware-id'] + temp_bins, except_failed=True)
+                lines = stdout.read().splitlines()
+            self.assertEqual(lines, ['%s  %s' % (demobin_firmware_id, os.path.normpath(temp_bin)) for temp_bin in temp_bins])
+
+            output_dir = os.path.join(tempdirname, 'output')
+            os.mkdir(output_dir)
+            cli.run(['get-firmware-id'] + temp_bins + ['--output', output_dir, '--apply', '--jobs', '2'], except_failed=True)
+            for temp_bin in temp_bins:
+                with open(os.path.join(output_dir, os.path.basename(temp_bin) + '.firmwareid')) as f:
+                    self.assertEqual(f.read(), demobin_firmware_id)
+                with open(temp_bin, 'rb') as f:
+                    self.assertIn(bytes.fromhex(demobin_firmware_id), f.read())
+
+            # Already tagged. Placeholder is not there anymore
+            self.assertNotEqual(cli.run(['get-firmware-id'] + temp_bins), 0)
+
+            # Same file name in 2 folders. Output would be overwritten. Nothing is processed
+            os.mkdir(os.path.join(tempdirname, 'other'))
+            same_name_bin = os.path.join(tempdirname, 'other', os.path.basename(temp_bins[0]))
+            shutil.copyfile(get_artifact('demobin.elf'), same_name_bin)
+            self.assertNotEqual(cli.run(['get-firmware-id', temp_bins[0], same_name_bin, '--output', output_dir, '--apply']), 0)
+            with open(same_name_bin, 'rb') as f:
+                self.assertNotIn(bytes.fromhex(demobin_firmware_id), f.read())
+
     # Read a demo firmware binary and make varmap file. We don't check the content, just that it is valid varmap.
     @SkipOnException(EnvionmentNotSetUpException)
     def test_elf2varmap(self):
@@ -0,0 +1,54 @@
+#    test_demangler.py
+#        Test the demangler used to read the linkage names of a binary
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import unittest
+
+from scrutiny.core.bintools.demangler import GccDemangler
+
+
+class TestGccDemangler(unittest.TestCase):
+
+    def setUp(self):
+        self.demangler = GccDemangler()
+        if not self.demangler.can_run():
+            raise unittest.SkipTest(self.demangler.get_error())
+
+    def tearDown(self):
+        self.demangler.close()
+
+    def test_demangle(self):
+        self.assertEqual(self.demangler.demangle('_ZN3foo3barE'), 'foo::bar')
+        self.assertEqual(self.demangler.demangle('_ZN9NamespaceL8instanceE'), 'Namespace::instance')
+        self.assertEqual(self.demangler.demangle('not_mangled'), 'not_mangled')
+        self.assertEqual(self.demangler.demangle('_ZN3foo3barE'), 'foo::bar')
+
+    def test_single_process(self):
+        self.demangler.demangle('_ZN3foo3barE')
+        process = self.demangler.process
+        self.assertIsNotNone(process)
+        for i in range(50):
+            name = 'var%d' % i
+            self.assertEqual(self.demangler.demangle('_ZN3foo%d%sE' % (len(name), name)), 'foo::%s' % name)
+        self.assertIs(self.demangler.process, process)
+        self.assertEqual(len(self.demangler.cache), 51)
+
+    def test_restart_after_close(self):
+        self.assertEqual(self.demangler.demangle('_ZN3foo3barE'), 'foo::bar')
+        self.demangler.close()
+        self.assertIsNone(self.demangler.process)
+        self.assertEqual(self.demangler.demangle('_ZN3foo3bazE'), 'foo::baz')
+
+    def test_process_died(self):
+        self.demangler.demangle('_ZN3foo3barE')
+        self.demangler.process.kill()
+        self.demangler.process.wait()
+        self.assertEqual(self.demangler.demangle('_ZN3foo3bazE'), 'foo::baz')    # Falls back on a single call
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -9,6 +9,13 @@
 import unittest
 import os
 import re
+import time
+import tempfile
+
+from scrutiny.exceptions import EnvionmentNotSetUpException
+from test import SkipOnException
+from test.artifacts import get_artifact
+from scrutiny.core import *
 
 
 class TestElf2VarMap(unittest.TestCase):
@@ -45,3 +52,169 @@ class TestElf2VarMap(unittest.TestCase):
             name = objmap[obj]
             self.assertNotIn(name, name_set, 'Duplicate name %s' % name)
             name_set.add(name)
+
+    def test_partition_cus(self):
+        from scrutiny.core.bintools.elf_dwarf_var_extractor import ElfDwarfVarExtractor
+        cu_list = [(0, 100), (100, 10), (110, 10), (120, 80), (200, 50), (250, 50)]
+
+        chunks = ElfDwarfVarExtractor.partition_cus(cu_list, 3)
+        self.assertEqual(chunks, [[0], [100, 110, 120], [200, 250]])
+
+        # Order is kept and nothing is lost
+        for chunk_count in range(1, 10):
+            chunks = ElfDwarfVarExtractor.partition_cus(cu_list, chunk_count)
+            self.assertLessEqual(len(chunks), chunk_count)
+            self.assertEqual(sum(chunks, []), [cu[0] for cu in cu_list])
+
+        self.assertEqual(ElfDwarfVarExtractor.partition_cus([], 4), [])
+
+    @SkipOnException(EnvionmentNotSetUpException)
+    def test_parallel_extraction_same_as_serial(self):
+        from scrutiny.core.bintools.elf_dwarf_var_extractor import ElfDwarfVarExtractor
+        filename = get_artifact('demobin.elf')
+        serial_varmap = ElfDwarfVarExtractor(filename).get_varmap()
+        parallel_varmap = ElfDwarfVarExtractor(filename, jobs=3).get_varmap()
+        self.assertGreater(len(serial_varmap.variables), 0)
+        self.assertEqual(serial_varmap.get_json(), parallel_varmap.get_json())
+
+    @SkipOnException(EnvionmentNotSetUpException)
+    def test_extraction_with_cache(self):
+        from scrutiny.core.bintools.elf_dwarf_var_extractor import ElfDwarfVarExtractor
+        filename = get_artifact('demobin.elf')
+        reference = ElfDwarfVarExtractor(filename).get_varmap().get_json()
+        with tempfile.TemporaryDirectory() as tempdirname:
+            self.assertEqual(ElfDwarfVarExtractor(filename, cache_dir=tempdirname).get_varmap().get_json(), reference)   # Fills the cache
+            self.assertGreater(len(os.listdir(tempdirname)), 0)
+            self.assertEqual(ElfDwarfVarExtractor(filename, cache_dir=tempdirname).get_varmap().get_json(), reference)   # Uses the cache
+            self.assertEqual(ElfDwarfVarExtractor(filename, cache_dir=tempdirname, jobs=2).get_varmap().get_json(), reference)
+
+    def test_cu_cache_entries(self):
+        from scrutiny.core.bintools.dwarf_cu_cache import DwarfCuCache
+        varmap = VarMap()
+        varmap.register_base_type('int', VariableType.sint32)
+        varmap.add_variable(['global'], 'var2', VariableLocation(0x1000), 'int')
+        varmap.add_variable(['global'], 'var1', VariableLocation(0x1004), 'int')
+
+        with tempfile.TemporaryDirectory() as tempdirname:
+            cache = DwarfCuCache(tempdirname)
+            self.assertIsNone(cache.get('abcd'))
+            cache.put('abcd', varmap)
+            varmap2 = cache.get('abcd')
+            self.assertEqual(varmap2.get_json(), varmap.get_json())
+            self.assertEqual(list(varmap2.variables.keys()), ['/global/var2', '/global/var1'])  # Order is kept
+
+            with open(cache.get_filename('abcd'), 'w') as f:
+                f.write('corrupted')
+            self.assertIsNone(cache.get('abcd'))
+
+    def test_cu_cache_pruning(self):
+        from scrutiny.core.bintools.dwarf_cu_cache import DwarfCuCache
+        varmap = VarMap()
+        varmap.register_base_type('int', VariableType.sint32)
+        varmap.add_variable(['global'], 'var1', VariableLocation(0x1000), 'int')
+
+        with tempfile.TemporaryDirectory() as tempdirname:
+            cache = DwarfCuCache(tempdirname)
+            now = time.time()
+            for i, key in enumerate(['k0', 'k1', 'k2', 'k3']):
+                cache.put(key, varmap)
+                os.utime(cache.get_filename(key), (now - 100 + i, now - 100 + i))  # k0 is the oldest
+            entry_size = os.path.getsize(cache.get_filename('k0'))
+            with open(os.path.join(tempdirname, 'not_from_cache.txt'), 'w') as f:
+                f.write('x' * 10 * entry_size)
+
+            cache.get('k0')    # Used, becomes the most recent
+            cache.max_size = 2 * entry_size
+            cache.prune()
+            self.assertEqual(sorted(os.listdir(tempdirname)), sorted([os.path.basename(cache.get_filename(key)) for key in ['k0', 'k3']]
+                                                                      + ['not_from_cache.txt']))
+
+            cache.max_size = DwarfCuCache.DEFAULT_MAX_SIZE
+            cache.max_age = 50
+            os.utime(cache.get_filename('k3'), (now - 100, now - 100))
+            cache.prune()
+            self.assertIsNotNone(cache.get('k0'))
+            self.assertIsNone(cache.get('k3'))
+
+    def test_cu_cache_key_follows_strings(self):
+        from scrutiny.core.bintools.dwarf_cu_cache import DwarfCuCache
+        import io
+
+        class FakeSection:
+            def __init__(self, data):
+                self.stream = io.BytesIO(data)
+                self.size = len(data)
+
+        class FakeAttribute:
+            def __init__(self, form, value):
+                self.form = form
+                self.value = value
+
+        class FakeDie:
+            def __init__(self, attributes):
+                self.attributes = dict([('attr%d' % i, attr) for i, attr in enumerate(attributes)])
+
+        class FakeCU:
+            def __init__(self, cu_offset, size, dies):
+                self.cu_offset = cu_offset
+                self.size = size
+                self.dies = dies
+
+            def __getitem__(self, key):
+                return 0    # debug_abbrev_offset
+
+            def iter_DIEs(self):
+                return iter(self.dies)
+
+        class FakeDwarfInfo:
+            def __init__(self, cu_list):
+                self.cu_list = cu_list
+                self.debug_info_sec = FakeSection(b'\x01' * 32)    # Same bytes in all cases, only the referenced strings change
+                self.debug_abbrev_sec = FakeSection(b'\x02' * 8)
+
+            def iter_CUs(self):
+                return iter(self.cu_list)
+
+        def make_keys(var_name, type_name):
+            cu1 = FakeCU(0, 16, [FakeDie([FakeAttribute('DW_FORM_strp', var_name), FakeAttribute('DW_FORM_data4', 1234)])])
+            cu2 = FakeCU(16, 16, [FakeDie([FakeAttribute('DW_FORM_line_strp', type_name.encode('utf8')), FakeAttribute('DW_FORM_ref_addr', 20)])])
+            cu3 = FakeCU(32, 0, [FakeDie([FakeAttribute('DW_FORM_ref_addr', 4)])])  # Refers to cu1 only
+            dwarfinfo = FakeDwarfInfo([cu1, cu2, cu3])
+            cu_name_map = {0: 'file1.cpp', 16: 'file2.cpp', 32: 'file3.cpp'}
+            with tempfile.TemporaryDirectory() as tempdirname:
+                return DwarfCuCache(tempdirname).make_keys(dwarfinfo, cu_name_map, Endianness.Little, 'demangler')
+
+        reference = make_keys(b'my_var', 'my_type')
+        self.assertEqual(make_keys(b'my_var', 'my_type'), reference)
+
+        renamed_var = make_keys(b'my_vaz', 'my_type')  # Same length, same .debug_info bytes
+        self.assertNotEqual(renamed_var[0], reference[0])
+        self.assertEqual(renamed_var[16], reference[16])
+        self.assertNotEqual(renamed_var[32], reference[32])   # Follows the DW_FORM_ref_addr to cu1
+
+        renamed_type = make_keys(b'my_var', 'my_typf')
+        self.assertEqual(renamed_type[0], reference[0])
+        self.assertNotEqual(renamed_type[16], reference[16])
+        self.assertEqual(renamed_type[32], reference[32])
+
+    def test_struct_layout(self):
+        from scrutiny.core.bintools.elf_dwarf_var_extractor import ElfDwarfVarExtractor
+        inner = Struct('Inner')
+        inner.add_member(Struct.Member('x', original_type_name='int', byte_offset=0))
+        inner.add_member(Struct.Member('y', original_type_name='int', byte_offset=4))
+
+        outer = Struct('Outer')
+        outer.add_member(Struct.Member('a', original_type_name='int', byte_offset=0))
+        outer.add_member(Struct.Member('bf', original_type_name='int', byte_offset=4, bitoffset=3, bitsize=5))
+        outer.add_member(Struct.Member('in1', is_substruct=True, byte_offset=8, substruct=inner))
+        outer.add_member(Struct.Member('after', original_type_name='float', byte_offset=16))    # Not affected by the substruct offset
+
+        layout = []
+        ElfDwarfVarExtractor().flatten_struct(outer, (), 0, layout)
+        self.assertEqual([(entry.path_suffix, entry.name, entry.byte_offset, entry.original_type_name, entry.bitoffset, entry.bitsize) for entry in layout], [
+            ((), 'a', 0, 'int', None, None),
+            ((), 'bf', 4, 'int', 3, 5),
+            (('in1',), 'x', 8, 'int', None, None),
+            (('in1',), 'y', 12, 'int', None, None),
+            ((), 'after', 16, 'float', None, None)
+        ])
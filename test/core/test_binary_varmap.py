@@ -0,0 +1,130 @@
+#    test_binary_varmap.py
+#        Test the binary representation of a VarMap
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import unittest
+import tempfile
+import os
+import json
+
+from scrutiny.core import *
+from scrutiny.core.binary_varmap import is_binary_varmap, BinaryVariableTable
+from test.artifacts import get_artifact
+
+
+class TestBinaryVarMap(unittest.TestCase):
+
+    def make_varmap(self):
+        varmap = VarMap()
+        varmap.set_endianness(Endianness.Big)
+        varmap.register_base_type('int', VariableType.sint32)
+        varmap.register_base_type('float', VariableType.float32)
+        enum = VariableEnum('SomeEnum')
+        enum.add_value(0, 'aaa')
+        enum.add_value(10, 'bbb')
+
+        varmap.add_variable(['static', 'file.cpp', 'ns'], 'var1', VariableLocation(0x1000), 'int')
+        varmap.add_variable(['static', 'file.cpp', 'ns'], 'var2', VariableLocation(0x1004), 'float')
+        varmap.add_variable(['global'], 'var3', VariableLocation(0x12345678AB), 'int', enum=enum)
+        varmap.add_variable(['global', 'some_struct'], 'bitfield', VariableLocation(0x2000), 'int', bitoffset=3, bitsize=5)
+        varmap.add_variable([], 'root_var', VariableLocation(0x3000), 'float')
+        return varmap
+
+    def assert_varmap_equal(self, varmap1, varmap2):
+        self.assertEqual(varmap1.endianness, varmap2.endianness)
+        self.assertEqual(sorted(varmap1.variables.keys()), sorted(varmap2.variables.keys()))
+        for fullname in varmap1.variables:
+            v1 = varmap1.get_var(fullname)
+            v2 = varmap2.get_var(fullname)
+            self.assertEqual(v1.get_fullname(), v2.get_fullname())
+            self.assertEqual(v1.get_type(), v2.get_type())
+            self.assertEqual(v1.get_address(), v2.get_address())
+            self.assertEqual(v1.bitoffset, v2.bitoffset)
+            self.assertEqual(v1.bitsize, v2.bitsize)
+            self.assertEqual(v1.endianness, v2.endianness)
+            self.assertEqual(v1.has_enum(), v2.has_enum())
+            if v1.has_enum():
+                self.assertEqual(v1.get_enum().name, v2.get_enum().name)
+                self.assertEqual(v1.get_enum().vals, v2.get_enum().vals)
+
+    def test_read_write(self):
+        varmap = self.make_varmap()
+        data = varmap.get_binary()
+        self.assertTrue(is_binary_varmap(data))
+        self.assertFalse(is_binary_varmap(varmap.get_json().encode('utf8')))
+
+        varmap2 = VarMap(data)
+        self.assertIsInstance(varmap2.variables, BinaryVariableTable)
+        self.assertEqual(len(varmap2.variables), 5)
+        self.assert_varmap_equal(varmap, varmap2)
+
+        self.assertIn('/global/var3', varmap2.variables)
+        self.assertNotIn('/global/var4', varmap2.variables)
+        self.assertNotIn('/global', varmap2.variables)
+        self.assertEqual(varmap2.get_var('/global/var3').get_address(), 0x12345678AB)
+        self.assertEqual(varmap2.get_var('/root_var').get_path_segments(), [])
+        with self.assertRaises(ValueError):
+            varmap2.get_var('/static/file.cpp/ns/var3')
+
+        # Converting back to JSON must give the same content
+        self.assertEqual(json.loads(varmap2.get_json()), json.loads(VarMap(varmap.get_json()).get_json()))
+
+    def test_modify_loaded_binary(self):
+        varmap = VarMap(self.make_varmap().get_binary())
+        varmap.add_variable(['global'], 'new_var', VariableLocation(0x4000), 'float')
+        self.assertEqual(len(varmap.variables), 6)
+        self.assertEqual(varmap.get_var('/global/new_var').get_address(), 0x4000)
+        self.assertEqual(varmap.get_var('/global/var3').get_address(), 0x12345678AB)
+
+    def test_file(self):
+        varmap = self.make_varmap()
+        with tempfile.TemporaryDirectory() as tempdirname:
+            filename = os.path.join(tempdirname, 'varmap.bin')
+            varmap.write_binary(filename)
+            varmap2 = VarMap(filename)
+            self.assertIsNotNone(varmap2.mapping)
+            self.assert_varmap_equal(varmap, varmap2)
+
+            # Closing releases the file. The varmap stays usable
+            varmap2.close()
+            self.assertIsNone(varmap2.mapping)
+            os.remove(filename)
+            self.assert_varmap_equal(varmap, varmap2)
+            varmap2.close()    # Closing twice is harmless
+
+    def test_sfd_with_binary_varmap(self):
+        with tempfile.TemporaryDirectory() as tempdirname:
+            sfd = FirmwareDescription(get_artifact('test_sfd_1.sfd'))
+            self.assertFalse(sfd.has_binary_varmap())
+            sfd.set_binary_varmap(True)
+            filename = os.path.join(tempdirname, 'test.sfd')
+            sfd.write(filename)
+
+            sfd2 = FirmwareDescription(filename)
+            self.assertTrue(sfd2.has_binary_varmap())
+            self.assertIsInstance(sfd2.varmap.variables, BinaryVariableTable)
+            self.assert_varmap_equal(sfd.varmap, sfd2.varmap)
+
+            # Rewriting must keep the binary varmap
+            filename2 = os.path.join(tempdirname, 'test2.sfd')
+            sfd2.write(filename2)
+            sfd3 = FirmwareDescription(filename2)
+            self.assertTrue(sfd3.has_binary_varmap())
+            self.assert_varmap_equal(sfd.varmap, sfd3.varmap)
+
+            # Closing releases the file. The object stays usable
+            self.assertIsNotNone(sfd3.mapping)
+            sfd2.close()
+            sfd3.close()
+            self.assertIsNone(sfd3.mapping)
+            os.remove(filename2)
+            self.assert_varmap_equal(sfd.varmap, sfd3.varmap)
+            sfd3.close()    # Closing twice is harmless
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -8,8 +8,9 @@
 #   Copyright (c) 2021-2022 Scrutiny Debugger
 
 import unittest
-from scrutiny.core.memory_content import MemoryContent, Cluster
+from scrutiny.core.memory_content import MemoryContent, SortedMemoryContent, Cluster, BinaryMemdumpFormat
 import tempfile
+import random
 import os
 
 
@@ -79,8 +80,40 @@ class TestCluster(unittest.TestCase):
         with self.assertRaises(Exception):
             cluster.extend(101, bytes([1, 2]))  # One extra byte
 
+    def test_view(self):
+        cluster = Cluster(start_addr=0x1000, size=10, data=bytes(range(10)), has_data=True)
+        view = cluster.view(2, 4)
+        self.assertIsInstance(view, memoryview)
+        self.assertEqual(bytes(view), bytes([2, 3, 4, 5]))
+        cluster.write(b'\xAA', offset=3)
+        self.assertEqual(bytes(view), bytes([2, 0xAA, 4, 5]))    # No copy
+        view.release()
+        self.assertEqual(bytes(cluster.data_view), bytes([0, 1, 2, 0xAA, 4, 5, 6, 7, 8, 9]))
+
+        with self.assertRaises(IndexError):
+            cluster.view(8, 4)
+
+        cluster = Cluster(start_addr=0x1000, size=10, has_data=False)
+        self.assertEqual(bytes(cluster.view(2, 4)), b'\x00' * 4)
+
+    def test_merge(self):
+        cluster = Cluster(start_addr=0x1000, size=4, data=b'\x01' * 4, has_data=True)
+        internal_data = cluster.internal_data
+        cluster.merge(Cluster(start_addr=0x1004, size=2, data=b'\x02' * 2, has_data=True))
+        cluster += Cluster(start_addr=0x1006, size=2, has_data=False)
+        self.assertIs(cluster.internal_data, internal_data)  # In place
+        self.assertEqual(len(cluster), 8)
+        self.assertEqual(bytes(cluster.data), b'\x01' * 4 + b'\x02' * 2 + b'\x00' * 2)
+
+        cluster = Cluster(start_addr=0x1000, size=4, has_data=False)
+        cluster.merge(Cluster(start_addr=0x1004, size=2, data=b'\x02' * 2, has_data=True))
+        self.assertEqual(len(cluster), 6)
+        self.assertIsNone(cluster.internal_data)
+
 
 class TestMemoryContent(unittest.TestCase):
+    memory_content_class = MemoryContent
+
     def assert_clusters(self, clusters, args):
         self.assertEqual(len(clusters), len(args), str(clusters))
 
@@ -88,8 +121,23 @@ class TestMemoryContent(unittest.TestCase):
             self.assertEqual(clusters[i].start_addr, args[i][0], 'Cluster #%d' % i)
             self.assertEqual(clusters[i].size, args[i][1], 'Cluster #%d' % i)
 
+    def test_read_view(self):
+        memcontent = self.memory_content_class()
+        memcontent.write(0x1000, bytes(range(10)))
+        view = memcontent.read_view(0x1002, 4)
+        self.assertIsInstance(view, memoryview)
+        self.assertEqual(bytes(view), bytes([2, 3, 4, 5]))
+        view.release()
+
+        with self.assertRaises(Exception):
+            memcontent.read_view(0x1008, 4)
+
+        memcontent = self.memory_content_class(retain_data=False)
+        memcontent.add_empty(0x1000, 10)
+        self.assertEqual(bytes(memcontent.read_view(0x1000, 4)), b'\x00' * 4)
+
     def test_read_write_basic(self):
-        memcontent = MemoryContent()
+        memcontent = self.memory_content_class()
         addr = 0x1234
         data = bytes(range(10))
         memcontent.write(addr, data)
@@ -98,7 +146,7 @@ class TestMemoryContent(unittest.TestCase):
         self.assertEqual(data, data2)
 
     def test_read_overflow(self):
-        memcontent = MemoryContent()
+        memcontent = self.memory_content_class()
         addr = 0x1234
         data = bytes(range(10))
         memcontent.write(addr, data)
@@ -110,7 +158,7 @@ class TestMemoryContent(unittest.TestCase):
             memcontent.read(addr + 1, len(data))
 
     def test_merge_write(self):
-        memcontent = MemoryContent()
+        memcontent = self.memory_content_class()
         data = bytes(range(10))
         memcontent.write(0x1000, data)
         memcontent.write(0x1005, data)
@@ -118,7 +166,7 @@ class TestMemoryContent(unittest.TestCase):
         self.assertEqual(data[0:5] + data, data2)
 
     def test_merge_write_limit_low_left(self):
-        memcontent = MemoryContent()
+        memcontent = self.memory_content_class()
         data = bytes(range(10))
         memcontent.write(1000, data)
         memcontent.write(990, data)
@@ -126,7 +174,7 @@ class TestMemoryContent(unittest.TestCase):
         self.assertEqual(data + data, data2)
 
     def test_merge_write_limit_high(self):
-        memcontent = MemoryContent()
+        memcontent = self.memory_content_class()
         data = bytes(range(10))
         memcontent.write(990, data)
         memcontent.write(1000, data)
@@ -134,7 +182,7 @@ class TestMemoryContent(unittest.TestCase):
         self.assertEqual(data + data, data2)
 
     def test_merge_write_middle(self):
-        memcontent = MemoryContent()
+        memcontent = self.memory_content_class()
         data1 = bytes(range(30))
         data2 = bytes(range(10))
         memcontent.write(1000, data1)
@@ -143,7 +191,7 @@ class TestMemoryContent(unittest.TestCase):
         self.assertEqual(data1[0:10] + data2 + data1[20:30], data3)
 
     def test_write_mutiple_overlap(self):
-        memcontent = MemoryContent()
+        memcontent = self.memory_content_class()
         data = bytes(range(10))
         memcontent.write(990, data)
         memcontent.write(1000, data)
@@ -157,7 +205,7 @@ class TestMemoryContent(unittest.TestCase):
         self.assertEqual(data[0:5] + data + data, data2)
 
     def test_cluster_definition(self):
-        memcontent = MemoryContent()
+        memcontent = self.memory_content_class()
         data = bytes(range(10))
         memcontent.write(990, data)
         memcontent.write(1000, data)
@@ -173,7 +221,7 @@ class TestMemoryContent(unittest.TestCase):
     # ==== Deletion Test =======
 
     def delete_test_make_mem(self):
-        memcontent = MemoryContent()
+        memcontent = self.memory_content_class()
         data = bytes(range(0x100))
         memcontent.write(0x1000, data)
         memcontent.write(0x2000, data)
@@ -352,7 +400,7 @@ class TestMemoryContent(unittest.TestCase):
         self.assert_clusters(clusters, [(0x1000, 0x100), (0x2000, 0x100), (0x3000, 0x100)])
 
     def test_write_delete_agglomerate_simple(self):
-        m = MemoryContent()
+        m = self.memory_content_class()
         m.add_empty(0x1000, 0x100)
         m.delete(0x1080, 1)
         self.assert_clusters(m.get_cluster_list_no_data_by_address(), [(0x1000, 0x80), (0x1081, 0x7F)])
@@ -360,7 +408,7 @@ class TestMemoryContent(unittest.TestCase):
         self.assert_clusters(m.get_cluster_list_no_data_by_address(), [(0x1000, 0x100)])
 
     def test_write_delete_agglomerate_complex(self):
-        m = MemoryContent()
+        m = self.memory_content_class()
         m.add_empty(0x1000, 0x100)
         m.add_empty(0x1200, 0x100)
         m.add_empty(0x1400, 0x100)  # Will be deleted
@@ -386,7 +434,7 @@ class TestMemoryContent(unittest.TestCase):
                 f.write('0x00100010: 101112131415161718191a1b1c1d1e\n')
                 f.write('0x00200000: 00112233445566778899')
 
-            memcontent = MemoryContent(filename=filename)
+            memcontent = self.memory_content_class(filename=filename)
             self.assert_clusters(memcontent.get_cluster_list_no_data_by_address(), [(0x00100000, 31), (0x00200000, 10)])
 
             # ====
@@ -396,7 +444,7 @@ class TestMemoryContent(unittest.TestCase):
                 f.write('0x00100010: 101112131415161718191a1b1c1d1e\n')
                 f.write('0x00200000: 00112233445566778899\n')   # Added a line feed here
 
-            memcontent = MemoryContent(filename=filename)
+            memcontent = self.memory_content_class(filename=filename)
             self.assert_clusters(memcontent.get_cluster_list_no_data_by_address(), [(0x00100000, 31), (0x00200000, 10)])
 
     def test_load_memdump_not_in_order(self):
@@ -407,5 +455,83 @@ class TestMemoryContent(unittest.TestCase):
                 f.write('0x00100000: 000102030405060708090a0b0c0d0e0f\n')
                 f.write('0x00200000: 00112233445566778899')
 
-            memcontent = MemoryContent(filename=filename)
+            memcontent = self.memory_content_class(filename=filename)
             self.assert_clusters(memcontent.get_cluster_list_no_data_by_address(), [(0x00100000, 31), (0x00200000, 10)])
+
+    def test_load_memdump_batch_contiguous_lines(self):
+        with tempfile.TemporaryDirectory() as tempdirname:
+            filename = os.path.join(tempdirname, 'temp')
+            with open(filename, 'w') as f:
+                for i in range(100):
+                    f.write('0x%08X: %s\n' % (0x1000 + i * 4, bytes([i] * 4).hex()))
+                f.write('0x00001008: FFFFFFFF\n')     # Overwrite after the batch
+
+            memcontent = self.memory_content_class(filename=filename)
+            self.assert_clusters(memcontent.get_cluster_list_no_data_by_address(), [(0x1000, 400)])
+            self.assertEqual(memcontent.read(0x1004, 12), b'\x01' * 4 + b'\xFF' * 4 + b'\x03' * 4)
+
+    def test_write_memdump(self):
+        memcontent = self.memory_content_class()
+        memcontent.write(0x1000, bytes(range(40)))
+        memcontent.write(0x12345678, b'\xAA\xBB\xCC')
+        memcontent.write(0x2000, b'\x55' * 16)
+
+        with tempfile.TemporaryDirectory() as tempdirname:
+            for binary in [False, True]:
+                filename = os.path.join(tempdirname, 'temp')
+                if binary:
+                    memcontent.write_binary_memdump(filename)
+                    with open(filename, 'rb') as f:
+                        self.assertEqual(f.read(len(BinaryMemdumpFormat.MAGIC)), BinaryMemdumpFormat.MAGIC)
+                else:
+                    memcontent.write_memdump(filename)
+
+                memcontent2 = self.memory_content_class(filename=filename)
+                self.assert_clusters(memcontent2.get_cluster_list_no_data_by_address(), [(0x1000, 40), (0x2000, 16), (0x12345678, 3)])
+                self.assertEqual(memcontent2.read(0x1000, 40), bytes(range(40)))
+                self.assertEqual(memcontent2.read(0x2000, 16), b'\x55' * 16)
+                self.assertEqual(memcontent2.read(0x12345678, 3), b'\xAA\xBB\xCC')
+
+                memcontent3 = self.memory_content_class(filename=filename, retain_data=False)
+                self.assert_clusters(memcontent3.get_cluster_list_no_data_by_address(), [(0x1000, 40), (0x2000, 16), (0x12345678, 3)])
+
+    def test_load_binary_memdump_truncated(self):
+        memcontent = self.memory_content_class()
+        memcontent.write(0x1000, bytes(range(40)))
+        with tempfile.TemporaryDirectory() as tempdirname:
+            filename = os.path.join(tempdirname, 'temp')
+            memcontent.write_binary_memdump(filename)
+            with open(filename, 'rb') as f:
+                data = f.read()
+            with open(filename, 'wb') as f:
+                f.write(data[:-1])
+
+            with self.assertRaises(ValueError):
+                self.memory_content_class(filename=filename)
+
+
+class TestSortedMemoryContent(TestMemoryContent):
+    memory_content_class = SortedMemoryContent
+
+    def test_same_as_memory_content(self):
+        # Random writes and deletes must give the same result as the reference implementation
+        rng = random.Random(1234)
+        for retain_data in [True, False]:
+            reference = MemoryContent(retain_data=retain_data)
+            memcontent = SortedMemoryContent(retain_data=retain_data)
+            for i in range(2000):
+                addr = rng.randint(0, 0x400)
+                size = rng.randint(1, 0x40)
+                if rng.random() < 0.7:
+                    data = bytes([rng.randint(0, 255) for x in range(size)])
+                    reference.write(addr, data)
+                    memcontent.write(addr, data)
+                else:
+                    reference.delete(addr, size)
+                    memcontent.delete(addr, size)
+
+                self.assertEqual(memcontent.sorted_keys, sorted(memcontent.clusters.keys()))
+                reference_clusters = reference.get_cluster_list_no_data_by_address()
+                self.assert_clusters(memcontent.get_cluster_list_no_data_by_address(), [(c.start_addr, c.size) for c in reference_clusters])
+                for cluster in reference_clusters:
+                    self.assertEqual(bytes(memcontent.read(cluster.start_addr, cluster.size)), bytes(reference.read(cluster.start_addr, cluster.size)))
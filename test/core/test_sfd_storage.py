@@ -0,0 +1,162 @@
+#    test_sfd_storage.py
+#        Test the SFD storage, its metadata index and its cache
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import unittest
+import os
+import json
+import shutil
+import threading
+
+from scrutiny.core.sfd_storage import SFDStorageManager
+from scrutiny.core.firmware_description import FirmwareDescription
+from test.artifacts import get_artifact
+
+
+class TestSFDStorage(unittest.TestCase):
+
+    def setUp(self):
+        self.storage = SFDStorageManager('.')   # Never used, replaced by a temp folder
+        self.temp_storage = self.storage.use_temp_folder()
+        self.sfd1 = self.storage.install(get_artifact('test_sfd_1.sfd'))
+        self.sfd2 = self.storage.install(get_artifact('test_sfd_2.sfd'))
+        self.firmware_id1 = self.sfd1.get_firmware_id()
+        self.firmware_id2 = self.sfd2.get_firmware_id()
+
+    def tearDown(self):
+        self.storage.restore_storage()
+
+    def test_list_metadata(self):
+        self.assertEqual(sorted(self.storage.list()), sorted([self.firmware_id1, self.firmware_id2]))
+        metadata_dict = self.storage.list_metadata()
+        self.assertEqual(metadata_dict[self.firmware_id1], self.sfd1.get_metadata())
+        self.assertEqual(metadata_dict[self.firmware_id2], self.sfd2.get_metadata())
+        self.assertEqual(self.storage.get_metadata(self.firmware_id1), self.sfd1.get_metadata())
+
+        # Index file is written in the storage folder and is not seen as an SFD
+        index_file = os.path.join(self.storage.get_storage_dir(), SFDStorageManager.INDEX_FILENAME)
+        self.assertTrue(os.path.isfile(index_file))
+        with open(index_file) as f:
+            index = json.loads(f.read())
+        self.assertEqual(index[self.firmware_id1]['metadata'], self.sfd1.get_metadata())
+
+        # A new manager on the same folder uses the index
+        storage2 = SFDStorageManager(self.storage.get_storage_dir())
+        self.assertEqual(storage2.list_metadata(), metadata_dict)
+
+        self.storage.uninstall(self.firmware_id1)
+        self.assertEqual(self.storage.list(), [self.firmware_id2])
+        with open(index_file) as f:
+            index = json.loads(f.read())
+        self.assertNotIn(self.firmware_id1, index)
+
+    def test_index_invalidated_by_file_change(self):
+        self.storage.list_metadata()
+        filename = os.path.join(self.storage.get_storage_dir(), self.firmware_id1)
+
+        # Replace the file behind the storage manager back with different metadata
+        sfd = FirmwareDescription(filename)
+        sfd.metadata['project_name'] = 'Modified project name'
+        sfd.write(filename)
+        stat = os.stat(filename)
+        os.utime(filename, ns=(stat.st_atime_ns, stat.st_mtime_ns + 1000000000))
+
+        self.assertEqual(self.storage.list_metadata()[self.firmware_id1]['project_name'], 'Modified project name')
+        self.assertEqual(self.storage.get_metadata(self.firmware_id1)['project_name'], 'Modified project name')
+
+        # File removed by someone else
+        os.remove(filename)
+        self.assertNotIn(self.firmware_id1, self.storage.list_metadata())
+
+    def test_corrupted_index(self):
+        index_file = os.path.join(self.storage.get_storage_dir(), SFDStorageManager.INDEX_FILENAME)
+        with open(index_file, 'w') as f:
+            f.write('not json')
+
+        storage2 = SFDStorageManager(self.storage.get_storage_dir())
+        self.assertEqual(sorted(storage2.list()), sorted([self.firmware_id1, self.firmware_id2]))
+
+    def test_sfd_cache(self):
+        sfd1 = self.storage.get(self.firmware_id1)
+        self.assertIs(self.storage.get(self.firmware_id1), sfd1)
+        self.assertIsNot(self.storage.get(self.firmware_id2), sfd1)
+        self.assertIs(self.storage.get(self.firmware_id1), sfd1)
+
+        # Modified file must be reloaded
+        filename = os.path.join(self.storage.get_storage_dir(), self.firmware_id1)
+        stat = os.stat(filename)
+        os.utime(filename, ns=(stat.st_atime_ns, stat.st_mtime_ns + 1000000000))
+        sfd1_reloaded = self.storage.get(self.firmware_id1)
+        self.assertIsNot(sfd1_reloaded, sfd1)
+        self.assertIs(self.storage.get(self.firmware_id1), sfd1_reloaded)
+
+        # Reinstall invalidates the cache
+        self.storage.install(get_artifact('test_sfd_1.sfd'), ignore_exist=True)
+        self.assertIsNot(self.storage.get(self.firmware_id1), sfd1_reloaded)
+
+        self.storage.uninstall(self.firmware_id1)
+        with self.assertRaises(Exception):
+            self.storage.get(self.firmware_id1)
+
+    def test_sfd_cache_eviction(self):
+        sfd1 = self.storage.get(self.firmware_id1)
+        # Fill the cache with other entries. Same file, another name is good enough.
+        for i in range(SFDStorageManager.SFD_CACHE_SIZE):
+            fake_id = ('%02x' % i) * (len(self.firmware_id1) // 2)
+            shutil.copyfile(os.path.join(self.storage.get_storage_dir(), self.firmware_id2), os.path.join(self.storage.get_storage_dir(), fake_id))
+            self.storage.get(fake_id)
+        self.assertEqual(len(self.storage.sfd_cache), SFDStorageManager.SFD_CACHE_SIZE)
+        self.assertIsNot(self.storage.get(self.firmware_id1), sfd1)
+
+    def test_sfd_released_on_eviction_and_uninstall(self):
+        binary_sfd = FirmwareDescription(get_artifact('test_sfd_1.sfd'))
+        binary_sfd.set_binary_varmap(True)
+        filename = os.path.join(self.storage.get_storage_dir(), self.firmware_id1)
+        binary_sfd.write(filename)
+
+        sfd1 = self.storage.get(self.firmware_id1)
+        self.assertIsNotNone(sfd1.mapping)
+        for i in range(SFDStorageManager.SFD_CACHE_SIZE):
+            fake_id = ('%02x' % i) * (len(self.firmware_id1) // 2)
+            shutil.copyfile(filename, os.path.join(self.storage.get_storage_dir(), fake_id))
+            self.storage.get(fake_id)
+        self.assertIsNone(sfd1.mapping)     # Evicted
+        self.assertEqual(sfd1.get_varmap().get_var_def('/path1/path2/some_int32'), binary_sfd.get_varmap().get_var_def('/path1/path2/some_int32'))
+
+        fake_id = ('%02x' % (SFDStorageManager.SFD_CACHE_SIZE - 1)) * (len(self.firmware_id1) // 2)
+        sfd = self.storage.get(fake_id)
+        self.assertIsNotNone(sfd.mapping)
+        self.storage.uninstall(fake_id)
+        self.assertIsNone(sfd.mapping)
+
+    def test_concurrent_access(self):
+        errors = []
+
+        def worker():
+            try:
+                for i in range(20):
+                    self.storage.get(self.firmware_id1 if i % 2 == 0 else self.firmware_id2)
+                    self.storage.list_metadata()
+                    self.storage.update_index_entry(self.firmware_id1, self.sfd1.get_metadata())
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=worker) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        self.assertEqual(errors, [])
+        self.assertLessEqual(len(self.storage.sfd_cache), SFDStorageManager.SFD_CACHE_SIZE)
+        # Temporary index files are all replaced
+        self.assertEqual(sorted(os.listdir(self.storage.get_storage_dir())),
+                         sorted([self.firmware_id1, self.firmware_id2, SFDStorageManager.INDEX_FILENAME]))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -134,3 +134,44 @@ class TestVariables(unittest.TestCase):
         self.assertEqual(uint8_be.decode(struct.pack('>B', 1)), True)
         self.assertEqual(uint8_le.decode(struct.pack('<B', 0)), False)
         self.assertEqual(uint8_be.decode(struct.pack('>B', 0)), False)
+
+    def test_variable_decode_bitfield(self):
+        uint16_le = Variable('uint16_le', vartype=VariableType.uint16, path_segments=[], location=0,
+                             endianness=Endianness.Little, bitoffset=3, bitsize=5)
+        int16_be = Variable('int16_be', vartype=VariableType.sint16, path_segments=[], location=0,
+                            endianness=Endianness.Big, bitoffset=4, bitsize=8)
+        uint64_le = Variable('uint64_le', vartype=VariableType.uint64, path_segments=[], location=0,
+                             endianness=Endianness.Little, bitoffset=60, bitsize=4)
+
+        self.assertEqual(uint16_le.decode(struct.pack('<H', 0xB758)), (0xB758 >> 3) & 0x1F)
+        self.assertEqual(int16_be.decode(struct.pack('>H', 0x0FF0)), 0xFF)
+        self.assertEqual(uint64_le.decode(struct.pack('<Q', 0xA000000000000000)), 0xA)
+
+        # Decoding from a view must not need a copy of the data
+        data = bytearray(b'\x00' + struct.pack('<H', 0xB758) + b'\x00')
+        self.assertEqual(uint16_le.decode(memoryview(data)[1:3]), (0xB758 >> 3) & 0x1F)
+
+    def test_variable_encode_bitfield(self):
+        uint16_le = Variable('uint16_le', vartype=VariableType.uint16, path_segments=[], location=0,
+                             endianness=Endianness.Little, bitoffset=3, bitsize=5)
+        int16_be = Variable('int16_be', vartype=VariableType.sint16, path_segments=[], location=0,
+                            endianness=Endianness.Big, bitoffset=4, bitsize=8)
+        bool_le = Variable('bool_le', vartype=VariableType.boolean, path_segments=[], location=0,
+                           endianness=Endianness.Little, bitoffset=7, bitsize=1)
+        float_le = Variable('float_le', vartype=VariableType.float32, path_segments=[], location=0,
+                            endianness=Endianness.Little, bitoffset=7, bitsize=1)
+
+        self.assertEqual(uint16_le.encode(0x15), (struct.pack('<H', 0x15 << 3), struct.pack('<H', 0x1F << 3)))
+        self.assertEqual(uint16_le.encode(0xFF), (struct.pack('<H', 0x1F << 3), struct.pack('<H', 0x1F << 3)))    # Extra bits are dropped
+        self.assertEqual(int16_be.encode(-1), (struct.pack('>H', 0x0FF0), struct.pack('>H', 0x0FF0)))
+        self.assertEqual(bool_le.encode(True), (b'\x80', b'\x80'))
+
+        # Decoding what was encoded gives the value back
+        data, mask = uint16_le.encode(0x12)
+        self.assertEqual(uint16_le.decode(data), 0x12)
+
+        with self.assertRaises(NotImplementedError):
+            float_le.encode(1.0)
+
+        # Not a bitfield: No mask
+        self.assertIsNone(Variable('x', vartype=VariableType.uint16, path_segments=[], location=0, endianness=Endianness.Little).encode(1)[1])
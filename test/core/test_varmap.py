@@ -0,0 +1,57 @@
+#    test_varmap.py
+#        Test the VarMap manipulations
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import unittest
+
+from scrutiny.core import *
+
+
+class TestVarMap(unittest.TestCase):
+
+    def test_merge(self):
+        enum1 = VariableEnum('enum1')
+        enum1.add_value(0, 'a')
+        enum2 = VariableEnum('enum2')
+        enum2.add_value(1, 'b')
+
+        varmap1 = VarMap()
+        varmap1.register_base_type('int', VariableType.sint32)
+        varmap1.add_variable(['global'], 'var1', VariableLocation(0x1000), 'int', enum=enum1)
+
+        varmap2 = VarMap()
+        varmap2.register_base_type('float', VariableType.float32)
+        varmap2.register_base_type('int', VariableType.sint32)
+        varmap2.register_base_type('char', VariableType.sint8)     # Not used by a variable. Must be merged anyway
+        varmap2.add_variable(['static', 'file.c'], 'var2', VariableLocation(0x2000), 'float', bitoffset=2, bitsize=3)
+        varmap2.add_variable(['global'], 'var3', VariableLocation(0x3000), 'int', enum=enum2)
+        varmap2.add_variable(['global'], 'var4', VariableLocation(0x3004), 'int', enum=enum2)
+
+        varmap1.merge(varmap2)
+
+        # Same result as if everything had been added to a single VarMap
+        expected = VarMap()
+        expected.register_base_type('int', VariableType.sint32)
+        expected.add_variable(['global'], 'var1', VariableLocation(0x1000), 'int', enum=enum1)
+        expected.register_base_type('float', VariableType.float32)
+        expected.register_base_type('char', VariableType.sint8)
+        expected.add_variable(['static', 'file.c'], 'var2', VariableLocation(0x2000), 'float', bitoffset=2, bitsize=3)
+        expected.add_variable(['global'], 'var3', VariableLocation(0x3000), 'int', enum=enum2)
+        expected.add_variable(['global'], 'var4', VariableLocation(0x3004), 'int', enum=enum2)
+
+        self.assertEqual(varmap1.get_json(), expected.get_json())
+        self.assertEqual(len(varmap1.enums), 2)
+        self.assertIs(varmap1.get_var('/global/var3').get_enum(), varmap1.get_var('/global/var4').get_enum())
+
+        varmap3 = VarMap()
+        varmap3.set_endianness(Endianness.Big)
+        with self.assertRaises(ValueError):
+            varmap1.merge(varmap3)
+
+
+if __name__ == '__main__':
+    unittest.main()
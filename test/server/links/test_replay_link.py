@@ -0,0 +1,165 @@
+#    test_replay_link.py
+#        Make sure that a recorded session can be played back with the replay link
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import unittest
+import tempfile
+import os
+import time
+
+from scrutiny.server.device.links.replay_link import ReplayLink
+from scrutiny.server.tools.session_file import SessionFileWriter, SessionFileFormat, read_session_file
+from scrutiny.server.device.emulated_device import EmulatedDevice
+from scrutiny.server.device.device_handler import DeviceHandler
+from scrutiny.server.datastore import Datastore
+
+Direction = SessionFileFormat.Direction
+
+
+class TestReplayLink(unittest.TestCase):
+    def setUp(self):
+        self.tempdir = tempfile.TemporaryDirectory()
+        self.filename = os.path.join(self.tempdir.name, 'session.srpl')
+
+    def tearDown(self):
+        self.tempdir.cleanup()
+
+    def write_session(self, records):
+        writer = SessionFileWriter(self.filename)
+        for record in records:
+            writer.add(*record)
+        writer.close()
+
+    def read_until(self, link, timeout):
+        data = bytearray()
+        t1 = time.perf_counter()
+        while time.perf_counter() - t1 < timeout:
+            data += link.read()
+        return bytes(data)
+
+    def test_file_format(self):
+        records = [(0.0, Direction.ToDevice, b'abc'), (0.5, Direction.FromDevice, b'defg'), (1.0, Direction.ToDevice, b'')]
+        self.write_session(records)
+        self.assertEqual(read_session_file(self.filename), records)
+
+        with open(self.filename, 'ab') as f:
+            f.write(SessionFileFormat.RECORD.pack(2, 0, 100) + b'x')  # Truncated
+        self.assertEqual(read_session_file(self.filename), records)
+
+        with open(self.filename, 'wb') as f:
+            f.write(b'potato')
+        with self.assertRaises(ValueError):
+            read_session_file(self.filename)
+
+    def test_bad_config(self):
+        self.write_session([])
+        with self.assertRaises(ValueError):
+            ReplayLink.make({})
+        with self.assertRaises(ValueError):
+            ReplayLink.make({'filename': os.path.join(self.tempdir.name, 'not_a_file')})
+        with self.assertRaises(ValueError):
+            ReplayLink.make({'filename': self.filename, 'speed': 0})
+        ReplayLink.validate_config({'filename': self.filename, 'speed': 10})
+
+    def test_playback_follows_session(self):
+        self.write_session([
+            (100.0, Direction.ToDevice, b'read'),
+            (100.1, Direction.FromDevice, b'val'),
+            (100.1, Direction.FromDevice, b'1'),
+            (101.0, Direction.ToDevice, b'read'),
+            (101.1, Direction.FromDevice, b'val2'),
+            (102.0, Direction.ToDevice, b'read'),
+            (102.1, Direction.FromDevice, b'val3'),
+            (103.0, Direction.ToDevice, b'write'),
+            (103.1, Direction.FromDevice, b'ok'),
+        ])
+
+        link = ReplayLink.make({'filename': self.filename, 'speed': 10})
+        link.initialize()
+        self.assertTrue(link.operational())
+        self.assertEqual(len(link.exchanges), 4)
+
+        link.write(b'read')
+        self.assertEqual(link.read(), b'')     # Recorded latency is 0.1s, played at 10x
+        self.assertEqual(self.read_until(link, 0.05), b'val1')
+
+        # Session moved to t=2s (0.2s at 10x). First exchanges are skipped
+        time.sleep(max(0, 0.2 - (time.perf_counter() - link.start_time)))
+        link.write(b'read')
+        self.assertEqual(self.read_until(link, 0.05), b'val3')
+
+        # End of the session. Latest response is repeated
+        link.write(b'read')
+        self.assertEqual(self.read_until(link, 0.05), b'val3')
+
+        link.write(b'unknown')
+        self.assertEqual(self.read_until(link, 0.05), b'')
+
+        link.destroy()
+        self.assertFalse(link.operational())
+
+    def test_replay_emulated_device_session(self):
+        datastore = Datastore()
+        config = {
+            'link_type': 'thread_safe_dummy',
+            'link_config': {},
+            'response_timeout': 0.25,
+            'heartbeat_timeout': 2
+        }
+
+        # Record the traffic between a device handler and the emulated device
+        writer = SessionFileWriter(self.filename)
+        device_handler = DeviceHandler(config, datastore)
+        link = device_handler.get_comm_link()
+        original_write = link.write
+        original_read = link.read
+
+        def recording_write(data):
+            writer.add(time.perf_counter(), Direction.ToDevice, data)
+            original_write(data)
+
+        def recording_read():
+            data = original_read()
+            if data:
+                writer.add(time.perf_counter(), Direction.FromDevice, data)
+            return data
+
+        link.write = recording_write
+        link.read = recording_read
+
+        emulated_device = EmulatedDevice(link)
+        emulated_device.start()
+        try:
+            t1 = time.time()
+            while time.time() - t1 < 3:
+                device_handler.process()
+                time.sleep(0.01)
+                if device_handler.get_connection_status() == DeviceHandler.ConnectionStatus.CONNECTED_READY:
+                    break
+            self.assertEqual(device_handler.get_connection_status(), DeviceHandler.ConnectionStatus.CONNECTED_READY)
+            device_handler.stop_comm()
+        finally:
+            emulated_device.stop()
+            writer.close()
+
+        # Play it back without any device
+        config['link_type'] = 'replay'
+        config['link_config'] = {'filename': self.filename, 'speed': 10}
+        device_handler = DeviceHandler(config, Datastore())
+        t1 = time.time()
+        while time.time() - t1 < 3:
+            device_handler.process()
+            time.sleep(0.01)
+            if device_handler.get_connection_status() == DeviceHandler.ConnectionStatus.CONNECTED_READY:
+                break
+        self.assertEqual(device_handler.get_connection_status(), DeviceHandler.ConnectionStatus.CONNECTED_READY)
+        self.assertEqual(device_handler.get_comm_error_count(), 0)
+        device_handler.stop_comm()
+
+
+if __name__ == '__main__':
+    unittest.main()
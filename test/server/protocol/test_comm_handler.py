@@ -9,11 +9,16 @@
 
 import unittest
 import time
+import tempfile
+import os
 
 from scrutiny.server.protocol.comm_handler import CommHandler
 from scrutiny.server.protocol import Request, Response
 from scrutiny.server.protocol.commands import DummyCommand
 from scrutiny.server.device.links.dummy_link import DummyLink
+from scrutiny.server.device.links.replay_link import ReplayLink
+from scrutiny.server.tools.session_file import SessionFileFormat, read_session_file
+from scrutiny.server.protocol.wire_trace import WireTrace
 
 
 class TestCommHandler(unittest.TestCase):
@@ -172,3 +177,50 @@ class TestCommHandler(unittest.TestCase):
         self.assertTrue(self.comm_handler.response_available())
         response1_ = self.comm_handler.get_response()
         self.compare_responses(response1_, response1)
+
+    def test_wire_trace(self):
+        req = Request(DummyCommand, DummyCommand.Subfunction.SubFn1, payload=bytes([1, 2, 3]))
+        response = Response(DummyCommand, DummyCommand.Subfunction.SubFn1, Response.ResponseCode.OK, payload=bytes([4, 5, 6]))
+        response_data = response.to_bytes()
+        self.comm_handler.send_request(req)
+        self.link.emulate_device_read()
+        self.link.emulate_device_write(response_data[0:4])
+        self.comm_handler.process()
+        self.link.emulate_device_write(response_data[4:])
+        self.comm_handler.process()
+        self.assertTrue(self.comm_handler.response_available())
+
+        trace = self.comm_handler.get_wire_trace()
+        self.assertEqual([(record[1], record[2]) for record in trace], [
+            (SessionFileFormat.Direction.ToDevice, req.to_bytes()),
+            (SessionFileFormat.Direction.FromDevice, response_data[0:4]),
+            (SessionFileFormat.Direction.FromDevice, response_data[4:])
+        ])
+
+        # The dump can be played back
+        with tempfile.TemporaryDirectory() as tempdir:
+            filename = os.path.join(tempdir, 'trace.srpl')
+            self.assertEqual(self.comm_handler.dump_wire_trace(filename), 3)
+            self.assertEqual(read_session_file(filename), trace)
+            link = ReplayLink.make({'filename': filename})
+            link.initialize()
+            link.write(req.to_bytes())
+            t1 = time.perf_counter()
+            data = bytes()
+            while len(data) < len(response_data) and time.perf_counter() - t1 < 0.5:
+                data += link.read()
+            self.assertEqual(data, response_data)
+
+    def test_wire_trace_ring(self):
+        trace = WireTrace(4)
+        for i in range(10):
+            trace.add(SessionFileFormat.Direction.ToDevice, bytes([i]))
+        self.assertEqual([record[2] for record in trace.get_records()], [bytes([i]) for i in range(6, 10)])
+
+        trace.clear()
+        self.assertEqual(trace.get_records(), [])
+
+        disabled_trace = WireTrace(0)
+        self.assertFalse(disabled_trace.is_enabled())
+        disabled_trace.add(SessionFileFormat.Direction.ToDevice, b'abc')
+        self.assertEqual(disabled_trace.get_records(), [])
@@ -521,8 +521,17 @@ class TestProtocolV1_0(unittest.TestCase):
         self.assert_req_response_bytes(req, [5, 6, 0, 2, 0x12, 0x34])
         data = self.proto.parse_request(req)
         self.assertEqual(data['record_id'], 0x1234)
+        self.assertNotIn('offset', data)
         # todo : Response size
 
+        req = self.proto.datalog_read_recording(record_id=0x1234, offset=0x10203040, length=0x100)
+        self.assert_req_response_bytes(req, [5, 6, 0, 8, 0x12, 0x34, 0x10, 0x20, 0x30, 0x40, 0x01, 0x00])
+        data = self.proto.parse_request(req)
+        self.assertEqual(data['record_id'], 0x1234)
+        self.assertEqual(data['offset'], 0x10203040)
+        self.assertEqual(data['length'], 0x100)
+        self.assertEqual(req.get_expected_response_size(), Response.OVERHEAD_SIZE + 2 + 0x100)
+
     def test_req_datalog_arm_log(self):
         req = self.proto.datalog_arm()
         self.assert_req_response_bytes(req, [5, 7, 0, 0])
@@ -573,12 +582,13 @@ class TestProtocolV1_0(unittest.TestCase):
         self.assertEqual(data['software_id'], 'hello'.encode('ascii'))
 
     def test_response_get_supported_features(self):
-        response = self.proto.respond_supported_features(memory_write=True, datalog_acquire=False, user_command=True)
-        self.assert_req_response_bytes(response, [0x81, 3, 0, 0, 1, 0xA0])
+        response = self.proto.respond_supported_features(memory_write=True, datalog_acquire=False, user_command=True, datalog_partial_read=True)
+        self.assert_req_response_bytes(response, [0x81, 3, 0, 0, 1, 0xB0])
         data = self.proto.parse_response(response)
         self.assertEqual(data['memory_write'], True)
         self.assertEqual(data['datalog_acquire'], False)
         self.assertEqual(data['user_command'], True)
+        self.assertEqual(data['datalog_partial_read'], True)
 
     def test_response_get_special_memory_range_count(self):
         response = self.proto.respond_special_memory_region_count(readonly=0xAA, forbidden=0x55)
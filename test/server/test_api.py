@@ -14,15 +14,22 @@ import string
 import json
 import uuid
 import math
+import struct
+import tempfile
+import threading
+import os
 
-from scrutiny.server.api.API import API
+from scrutiny.server.api.API import API, InvalidRequestException
 from scrutiny.server.datastore import Datastore, DatastoreEntry
 from scrutiny.core.sfd_storage import SFDStorage
 from scrutiny.server.api.dummy_client_handler import DummyConnection, DummyClientHandler
 from scrutiny.server.device.device_handler import DeviceHandler
 from scrutiny.server.device.device_info import DeviceInfo
 from scrutiny.server.active_sfd_handler import ActiveSFDHandler
+from scrutiny.server.device_instance import DeviceInstance
 from scrutiny.server.device.links.dummy_link import DummyLink
+from scrutiny.server.protocol.datalog import DatalogConfiguration
+from scrutiny.server.value_recorder import CaptureFileReader
 from scrutiny.core.variable import *
 from scrutiny.core import FirmwareDescription
 from test.artifacts import get_artifact
@@ -44,6 +51,8 @@ class StubbedDeviceHandler:
         self.link_type = 'none'
         self.link_config = {}
         self.reject_link_config = False
+        self.datalog_acquisitions = []
+        self.cancelled_datalog_acquisitions = []
 
     def get_connection_status(self):
         return self.connection_status
@@ -57,6 +66,15 @@ class StubbedDeviceHandler:
     def get_link_type(self):
         return 'dummy'
 
+    def get_tx_wait_time(self):
+        return None
+
+    def request_datalog_acquisition(self, acquisition):
+        self.datalog_acquisitions.append(acquisition)
+
+    def cancel_datalog_acquisition(self, acquisition):
+        self.cancelled_datalog_acquisitions.append(acquisition)
+
     def get_comm_link(self):
         return DummyLink()
 
@@ -76,7 +94,8 @@ class StubbedDeviceHandler:
             'memory_read': True,
             'memory_write': True,
             'datalog_acquire': False,
-            'user_command': False}
+            'user_command': False,
+            'datalog_partial_read': False}
         info.forbidden_memory_regions = [{'start': 0x1000, 'end': 0x2000}]
         info.readonly_memory_regions = [{'start': 0x2000, 'end': 0x3000}, {'start': 0x3000, 'end': 0x4000}]
         return info
@@ -489,6 +508,71 @@ class TestAPI(unittest.TestCase):
         self.datastore.set_value(subscribed_entry.get_id(), 1111)
         self.assertIsNone(self.wait_for_response(0, timeout=0.1))
 
+    def test_subscribe_decimated(self):
+        entries = self.make_dummy_entries(10, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+        subscribed_entry = entries[2]
+        req = {
+            'cmd': 'subscribe_watchable',
+            'watchables': [subscribed_entry.get_id()],
+            'decimation': {'mode': 'minmax', 'max_rate': 10}
+        }
+
+        self.send_request(req, 0)
+        response = self.wait_and_load_response(0)
+        self.assert_no_error(response)
+
+        self.api.streamer.freeze_connection(self.connections[0].get_id())
+        for value in [5, -3, 8, 1]:
+            self.datastore.set_value(subscribed_entry.get_id(), value)
+        self.assertIsNone(self.wait_for_response(0, timeout=0.3))   # Bucket is closed with time
+        self.api.streamer.unfreeze_connection(self.connections[0].get_id())
+
+        var_update_msg = self.wait_and_load_response(timeout=0.5)
+        self.assert_valid_value_update_message(var_update_msg)
+        self.assertEqual([update['value'] for update in var_update_msg['updates']], [-3, 8])
+        for update in var_update_msg['updates']:
+            self.assertEqual(update['id'], subscribed_entry.get_id())
+            self.assertIn('timestamp', update)
+        self.assertLessEqual(var_update_msg['updates'][0]['timestamp'], var_update_msg['updates'][1]['timestamp'])
+
+        for decimation in [{'mode': 'potato', 'max_rate': 10}, {'mode': 'lttb', 'max_rate': 0}, {'mode': 'lttb'}, 'minmax']:
+            req['decimation'] = decimation
+            self.send_request(req, 0)
+            response = self.wait_and_load_response(0)
+            self.assert_is_error(response)
+
+    def test_subscribe_publish_policy(self):
+        entries = self.make_dummy_entries(10, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+        subscribed_entry = entries[2]
+        req = {
+            'cmd': 'subscribe_watchable',
+            'watchables': [subscribed_entry.get_id()],
+            'publish_policy': {'on_change': True}
+        }
+
+        self.send_request(req, 0)
+        response = self.wait_and_load_response(0)
+        self.assert_no_error(response)
+
+        self.datastore.set_value(subscribed_entry.get_id(), 1234)
+        var_update_msg = self.wait_and_load_response(timeout=0.5)
+        self.assertEqual(var_update_msg['updates'][0]['value'], 1234)
+
+        self.datastore.set_value(subscribed_entry.get_id(), 1234)   # Unchanged. Not published
+        self.assertIsNone(self.wait_for_response(0, timeout=0.1))
+
+        self.datastore.set_value(subscribed_entry.get_id(), 1235)
+        var_update_msg = self.wait_and_load_response(timeout=0.5)
+        self.assertEqual(var_update_msg['updates'][0]['value'], 1235)
+
+        for policy in [{'potato': True}, {'deadband': -1}, {'min_interval': 'abc'}, {'on_change': 1}, 'on_change']:
+            req['publish_policy'] = policy
+            self.send_request(req, 0)
+            response = self.wait_and_load_response(0)
+            self.assert_is_error(response)
+
     # Make sure that the streamer send the value update once if many update happens before the value is outputted to the client.
     def test_do_not_send_duplicate_changes(self):
         entries = self.make_dummy_entries(10, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
@@ -724,3 +808,326 @@ class TestAPI(unittest.TestCase):
         self.send_request(req, 0)
         response = self.wait_and_load_response(timeout=0.5)
         self.assert_is_error(response)
+
+    def test_find_watchables_device_locks_once(self):
+        datastore2 = Datastore()
+        device_handler2 = StubbedDeviceHandler('1' * 64, DeviceHandler.ConnectionStatus.CONNECTED_READY)
+        sfd_handler2 = ActiveSFDHandler(device_handler=device_handler2, datastore=datastore2, autoload=False)
+        device2 = DeviceInstance('device2', datastore=datastore2, device_handler=device_handler2, sfd_handler=sfd_handler2)
+        self.api.add_device(device2)
+
+        entries1 = self.make_dummy_entries(5, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        entries2 = self.make_dummy_entries(5, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries1)
+        datastore2.add_entries(entries2)
+
+        class CountingLock:
+            def __init__(self, lock):
+                self.lock = lock
+                self.count = 0
+
+            def __enter__(self):
+                self.count += 1
+                return self.lock.__enter__()
+
+            def __exit__(self, *args):
+                return self.lock.__exit__(*args)
+
+        for device in self.api.get_devices():
+            device.lock = CountingLock(device.lock)
+
+        watchables = [entry.get_id() for entry in entries2 + entries1]
+        devices = self.api.find_watchables_device({'watchables': watchables})
+        self.assertEqual(devices, dict([(entry.get_id(), self.api.default_device) for entry in entries1]
+                                       + [(entry.get_id(), device2) for entry in entries2]))
+        for device in self.api.get_devices():
+            self.assertEqual(device.lock.count, 1)
+
+        with self.assertRaises(InvalidRequestException):
+            self.api.find_watchables_device({'watchables': watchables + ['potato']})
+
+    def test_multiple_devices(self):
+        datastore2 = Datastore()
+        device_handler2 = StubbedDeviceHandler('1' * 64, DeviceHandler.ConnectionStatus.CONNECTED_READY)
+        device_handler2.process = lambda: None
+        sfd_handler2 = ActiveSFDHandler(device_handler=device_handler2, datastore=datastore2, autoload=False)
+        device2 = DeviceInstance('device2', datastore=datastore2, device_handler=device_handler2, sfd_handler=sfd_handler2)
+        self.api.add_device(device2)
+        with self.assertRaises(ValueError):
+            self.api.add_device(DeviceInstance('device2', datastore=datastore2, device_handler=device_handler2, sfd_handler=sfd_handler2))
+
+        self.datastore.add_entries(self.make_dummy_entries(3, entry_type=DatastoreEntry.EntryType.Var, prefix='var'))
+        entries2 = self.make_dummy_entries(7, entry_type=DatastoreEntry.EntryType.Var, prefix='var')  # Same names, other device
+        datastore2.add_entries(entries2)
+
+        device2.start_thread()
+        try:
+            self.send_request({'cmd': 'get_device_list'})
+            response = self.wait_and_load_response()
+            self.assert_no_error(response)
+            self.assertEqual(response['cmd'], API.Command.Api2Client.GET_DEVICE_LIST_RESPONSE)
+            self.assertEqual(response['default'], DeviceInstance.DEFAULT_NAME)
+            self.assertEqual([x['name'] for x in response['devices']], [DeviceInstance.DEFAULT_NAME, 'device2'])
+            self.assertEqual(response['devices'][1]['device_status'], 'connected_ready')
+
+            self.send_request({'cmd': 'get_watchable_count'})
+            response = self.wait_and_load_response()
+            self.assertEqual(response['qty']['var'], 3)
+
+            self.send_request({'cmd': 'get_watchable_count', 'device': 'device2'})
+            response = self.wait_and_load_response()
+            self.assertEqual(response['qty']['var'], 7)
+
+            self.send_request({'cmd': 'get_watchable_list', 'device': 'device2'})
+            response = self.wait_and_load_response()
+            self.assertEqual(sorted([x['id'] for x in response['content']['var']]), sorted([x.get_id() for x in entries2]))
+
+            self.send_request({'cmd': 'get_watchable_count', 'device': 'potato'})
+            self.assert_is_error(self.wait_and_load_response())
+
+            self.send_request({'cmd': 'get_server_status', 'device': 'device2'})
+            response = self.wait_and_load_response()
+            self.assertEqual(response['device'], 'device2')
+            self.assertEqual(response['device_status'], 'connected_ready')
+
+            # Watchable IDs are unique across devices. The device is found from the ID
+            self.send_request({'cmd': 'subscribe_watchable', 'watchables': [entries2[1].get_id()]})
+            response = self.wait_and_load_response()
+            self.assert_no_error(response)
+
+            # Executed by the device thread after the subscription. Only the last value of the cycle gets through the value snapshot
+            def set_values():
+                datastore2.set_value(entries2[1].get_id(), 554)
+                datastore2.set_value(entries2[1].get_id(), 555)
+            device2.run_command(set_values)
+            var_update_msg = self.wait_and_load_response(timeout=0.5)
+            self.assert_valid_value_update_message(var_update_msg)
+            self.assertEqual(len(var_update_msg['updates']), 1)
+            self.assertEqual(var_update_msg['updates'][0]['id'], entries2[1].get_id())
+            self.assertEqual(var_update_msg['updates'][0]['value'], 555)
+        finally:
+            device2.stop_thread()
+        self.assertFalse(device2.is_thread_running())
+
+    def test_write_watchable(self):
+        entries = self.make_dummy_entries(4, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+
+        req = {
+            'cmd': 'write_watchable',
+            'reqid': 123,
+            'updates': [
+                {'watchable': entries[0].get_id(), 'value': 1.5},
+                {'watchable': entries[1].get_id(), 'value': 2},
+                {'watchable': entries[2].get_id(), 'value': True}
+            ]
+        }
+        self.send_request(req)
+        self.assertIsNone(self.wait_for_response(timeout=0.1))  # Response is sent when all writes are completed
+
+        for entry in entries[0:3]:
+            self.assertTrue(entry.has_pending_target_update())
+        self.assertFalse(entries[3].has_pending_target_update())
+        self.assertEqual(entries[0].get_pending_target_update_val(), 1.5)
+
+        # Emulate the MemoryWriter
+        entries[0].mark_target_update_request_complete()
+        entries[1].mark_target_update_request_failed()
+        self.assertIsNone(self.wait_for_response(timeout=0.1))
+        entries[2].update_target_value(False)   # Another value requested by someone else
+
+        response = self.wait_and_load_response()
+        self.assert_no_error(response)
+        self.assertEqual(response['cmd'], API.Command.Api2Client.WRITE_WATCHABLE_RESPONSE)
+        self.assertEqual(response['reqid'], 123)
+        results = response['results']
+        self.assertEqual([x['watchable'] for x in results], [entry.get_id() for entry in entries[0:3]])
+        self.assertEqual([x['status'] for x in results], ['success', 'failed', 'superseded'])
+        self.assertEqual([x['success'] for x in results], [True, False, False])
+        self.assertIsNotNone(results[0]['timestamp'])
+        self.assertGreaterEqual(results[0]['duration'], 0)
+        self.assertIsNone(results[2]['timestamp'])
+
+        self.assertIsNone(self.wait_for_response(timeout=0.1))  # Only one response per batch
+
+    def test_write_watchable_timeout(self):
+        entries = self.make_dummy_entries(1, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+        self.api.WRITE_TIMEOUT = 0.2
+        self.send_request({'cmd': 'write_watchable', 'updates': [{'watchable': entries[0].get_id(), 'value': 10}]})
+        response = self.wait_and_load_response(timeout=1)
+        self.assertEqual(response['cmd'], API.Command.Api2Client.WRITE_WATCHABLE_RESPONSE)
+        self.assertEqual(response['results'][0]['status'], 'timeout')
+        self.assertFalse(entries[0].has_pending_target_update())   # Will not be written later
+
+    def test_write_watchable_timeout_before_device_thread(self):
+        entries = self.make_dummy_entries(1, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+        self.api.WRITE_TIMEOUT = 0.2
+        device = self.api.default_device
+        device.publish_snapshot()   # Last cycle completed by the device thread
+        device.thread = threading.Thread(target=lambda: None)     # As if the device thread was busy. Commands stay queued
+        try:
+            self.send_request({'cmd': 'write_watchable', 'updates': [{'watchable': entries[0].get_id(), 'value': 10}]})
+            response = self.wait_and_load_response(timeout=1)
+            self.assertEqual(response['results'][0]['status'], 'timeout')
+            self.assertFalse(entries[0].has_pending_target_update())
+        finally:
+            device.thread = None
+        device.process_commands()   # Device thread catches up
+        self.assertFalse(entries[0].has_pending_target_update())   # Cancelled write is not requested
+
+    def test_write_watchable_bad_request(self):
+        entries = self.make_dummy_entries(2, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+
+        bad_updates_list = [
+            None,
+            [],
+            [{'watchable': entries[0].get_id()}],
+            [{'watchable': entries[0].get_id(), 'value': 'asd'}],
+            [{'watchable': entries[0].get_id(), 'value': 1}, {'watchable': entries[0].get_id(), 'value': 2}],
+            [{'watchable': entries[0].get_id(), 'value': 1}, {'watchable': 'potato', 'value': 2}]
+        ]
+
+        for updates in bad_updates_list:
+            self.send_request({'cmd': 'write_watchable', 'updates': updates})
+            self.assert_is_error(self.wait_and_load_response())
+
+        # Nothing written if a single item is bad
+        for entry in entries:
+            self.assertFalse(entry.has_pending_target_update())
+
+    def test_datalog_acquire(self):
+        entries = self.make_dummy_entries(3, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+
+        req = {
+            'cmd': 'datalog_acquire',
+            'reqid': 555,
+            'watchables': [entries[0].get_id(), entries[1].get_id()],
+            'sample_rate': 1000,
+            'decimation': 2,
+            'trigger': {
+                'condition': 'gt',
+                'operands': [{'watchable': entries[2].get_id()}, {'value': 10}]
+            }
+        }
+        self.send_request(req)
+        self.assertIsNone(self.wait_for_response(timeout=0.1))  # Response is sent when the acquisition is completed
+
+        self.assertEqual(len(self.device_handler.datalog_acquisitions), 1)
+        acquisition = self.device_handler.datalog_acquisitions[0]
+        self.assertEqual(acquisition.entries, entries[0:2])
+        self.assertEqual(acquisition.decimation, 2)
+        self.assertEqual(acquisition.trigger.condition, DatalogConfiguration.TriggerCondition.GREATER_THAN)
+        self.assertEqual(acquisition.trigger.operand1.address, entries[2].get_address())
+        self.assertEqual(acquisition.trigger.operand2.value, 10)
+        self.assertEqual(acquisition.timeout, API.DATALOG_DEFAULT_TIMEOUT)
+
+        # Emulate the DatalogManager
+        acquisition.decode(struct.pack('<ffff', 1, 2, 3, 4))
+        acquisition.complete(success=True)
+
+        response = self.wait_and_load_response()
+        self.assert_no_error(response)
+        self.assertEqual(response['cmd'], API.Command.Api2Client.DATALOG_ACQUIRE_RESPONSE)
+        self.assertEqual(response['reqid'], 555)
+        self.assertTrue(response['success'])
+        self.assertEqual(response['data'][entries[0].get_id()], [1, 3])
+        self.assertEqual(response['data'][entries[1].get_id()], [2, 4])
+
+    def test_datalog_cancel(self):
+        entries = self.make_dummy_entries(1, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+        req = {
+            'cmd': 'datalog_acquire',
+            'reqid': 10,
+            'watchables': [entries[0].get_id()],
+            'sample_rate': 1000,
+            'timeout': 2.5,
+            'trigger': {'condition': 'eq', 'operands': [{'value': 1}, {'value': 2}]}
+        }
+        self.send_request(req)
+        self.assertIsNone(self.wait_for_response(timeout=0.1))
+        acquisition = self.device_handler.datalog_acquisitions[0]
+        self.assertEqual(acquisition.timeout, 2.5)
+
+        self.send_request({'cmd': 'datalog_cancel', 'reqid': 11, 'acquire_reqid': 999})
+        self.assert_is_error(self.wait_and_load_response())
+
+        self.send_request({'cmd': 'datalog_cancel', 'reqid': 11, 'acquire_reqid': 10})
+        response = self.wait_and_load_response()
+        self.assert_no_error(response)
+        self.assertEqual(response['cmd'], API.Command.Api2Client.DATALOG_CANCEL_RESPONSE)
+        self.assertEqual(self.device_handler.cancelled_datalog_acquisitions, [acquisition])
+
+        # Emulate the DatalogManager
+        acquisition.complete(success=False, error='Cancelled')
+        response = self.wait_and_load_response()
+        self.assertEqual(response['cmd'], API.Command.Api2Client.DATALOG_ACQUIRE_RESPONSE)
+        self.assertEqual(response['reqid'], 10)
+        self.assertFalse(response['success'])
+        self.assertEqual(len(self.api.datalog_acquisitions), 0)
+
+        # Closing the connection cancels what is left
+        req['reqid'] = 12
+        self.send_request(req)
+        self.assertIsNone(self.wait_for_response(timeout=0.1))
+        self.api.close_connection(self.connections[0].get_id())
+        self.assertIs(self.device_handler.cancelled_datalog_acquisitions[1], self.device_handler.datalog_acquisitions[1])
+
+    def test_datalog_acquire_bad_request(self):
+        entries = self.make_dummy_entries(1, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+        good_trigger = {'condition': 'eq', 'operands': [{'value': 1}, {'value': 2}]}
+        bad_requests = [
+            {'watchables': [], 'sample_rate': 100, 'trigger': good_trigger},
+            {'watchables': ['potato'], 'sample_rate': 100, 'trigger': good_trigger},
+            {'watchables': [entries[0].get_id()], 'sample_rate': -1, 'trigger': good_trigger},
+            {'watchables': [entries[0].get_id()], 'sample_rate': 100, 'decimation': 0, 'trigger': good_trigger},
+            {'watchables': [entries[0].get_id()], 'sample_rate': 100, 'timeout': 0, 'trigger': good_trigger},
+            {'watchables': [entries[0].get_id()], 'sample_rate': 100},
+            {'watchables': [entries[0].get_id()], 'sample_rate': 100, 'trigger': {'condition': 'xx', 'operands': good_trigger['operands']}},
+            {'watchables': [entries[0].get_id()], 'sample_rate': 100, 'trigger': {'condition': 'eq', 'operands': [{'value': 1}]}},
+            {'watchables': [entries[0].get_id()], 'sample_rate': 100, 'trigger': {'condition': 'eq', 'operands': [{'value': 1}, {}]}}
+        ]
+
+        for req in bad_requests:
+            req['cmd'] = 'datalog_acquire'
+            self.send_request(req)
+            self.assert_is_error(self.wait_and_load_response())
+        self.assertEqual(len(self.device_handler.datalog_acquisitions), 0)
+
+    def test_start_stop_recording(self):
+        entries = self.make_dummy_entries(2, entry_type=DatastoreEntry.EntryType.Var, prefix='var')
+        self.datastore.add_entries(entries)
+
+        with tempfile.TemporaryDirectory() as tempdir:
+            self.api.recording_dir = tempdir
+            self.send_request({'cmd': 'start_recording', 'reqid': 1, 'watchables': [entries[0].get_id(), entries[1].get_id()]})
+            response = self.wait_and_load_response()
+            self.assert_no_error(response)
+            self.assertEqual(response['cmd'], API.Command.Api2Client.START_RECORDING_RESPONSE)
+            self.assertEqual(response['reqid'], 1)
+            recording_id = response['recording_id']
+            filename = response['filename']
+            self.assertEqual(os.path.dirname(filename), tempdir)
+
+            for i in range(10):
+                entries[0].set_value(i)
+                entries[1].set_value(-i)
+
+            self.send_request({'cmd': 'stop_recording', 'reqid': 2, 'recording_id': recording_id})
+            response = self.wait_and_load_response()
+            self.assert_no_error(response)
+            self.assertEqual(response['cmd'], API.Command.Api2Client.STOP_RECORDING_RESPONSE)
+            self.assertEqual(response['sample_count'], 20)
+
+            reader = CaptureFileReader(filename)
+            self.assertEqual(list(reader.read_signal(entries[1].get_id())[1]), [-i for i in range(10)])
+
+            self.send_request({'cmd': 'stop_recording', 'recording_id': recording_id})     # Already stopped
+            self.assert_is_error(self.wait_and_load_response())
+            self.send_request({'cmd': 'start_recording', 'watchables': ['potato']})
+            self.assert_is_error(self.wait_and_load_response())
@@ -0,0 +1,278 @@
+#    test_datalog_manager.py
+#        Test the datalogging acquisition manager and the decoding of the recordings
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import unittest
+import struct
+
+from scrutiny.server.datastore import DatastoreEntry
+from scrutiny.server.device.request_generator.datalog_manager import DatalogManager, DatalogAcquisition, AcquisitionCompletedCallback, decode_recording
+from scrutiny.server.device.request_dispatcher import RequestDispatcher
+from scrutiny.server.protocol import Protocol, ResponseCode
+from scrutiny.server.protocol.commands import *
+from scrutiny.server.protocol.datalog import DatalogConfiguration, LogStatus, RecordInfo, DatalogLocation
+from scrutiny.core.variable import *
+
+
+def make_entry(name, address, vartype, endianness=Endianness.Little, **kwargs):
+    var = Variable(name, vartype=vartype, path_segments=['a', 'b'], location=address, endianness=endianness, **kwargs)
+    return DatastoreEntry(DatastoreEntry.EntryType.Var, name, variable_def=var)
+
+
+def make_trigger():
+    trigger = DatalogConfiguration.Trigger()
+    trigger.condition = DatalogConfiguration.TriggerCondition.GREATER_THAN
+    trigger.operand1 = DatalogConfiguration.WatchOperand(address=0x1000, length=4, interpret_as=VariableType.float32)
+    trigger.operand2 = DatalogConfiguration.ConstOperand(10)
+    return trigger
+
+
+class TestDecodeRecording(unittest.TestCase):
+
+    def test_decode_columns(self):
+        v1 = Variable('v1', vartype=VariableType.float32, path_segments=[], location=0, endianness=Endianness.Little)
+        v2 = Variable('v2', vartype=VariableType.sint16, path_segments=[], location=4, endianness=Endianness.Big)
+        v3 = Variable('v3', vartype=VariableType.boolean, path_segments=[], location=6, endianness=Endianness.Little)
+        v4 = Variable('v4', vartype=VariableType.uint8, path_segments=[], location=7, endianness=Endianness.Little, bitoffset=2, bitsize=3)
+        data = b''
+        for i in range(10):
+            data += struct.pack('<f', i * 1.5) + struct.pack('>h', -i) + struct.pack('B', i % 2) + struct.pack('B', (i & 0x7) << 2)
+
+        columns = decode_recording([v1, v2, v3, v4], data)
+        self.assertEqual(len(columns), 4)
+        self.assertEqual(list(columns[0]), [i * 1.5 for i in range(10)])
+        self.assertEqual(list(columns[1]), [-i for i in range(10)])
+        self.assertEqual(list(columns[2]), [i % 2 == 1 for i in range(10)])
+        self.assertEqual(list(columns[3]), [i & 0x7 for i in range(10)])
+
+    def test_bad_size(self):
+        v1 = Variable('v1', vartype=VariableType.uint32, path_segments=[], location=0, endianness=Endianness.Little)
+        with self.assertRaises(ValueError):
+            decode_recording([v1], b'\x00' * 7)
+
+
+class TestDatalogManager(unittest.TestCase):
+
+    def setUp(self):
+        self.dispatcher = RequestDispatcher()
+        self.protocol = Protocol(1, 0)
+        self.protocol.set_address_size_bits(32)
+        self.manager = DatalogManager(self.protocol, self.dispatcher, priority=0)
+        self.manager.status_poll_timer.set_timeout(0)
+        self.manager.set_size_limits(max_request_size=128, max_response_size=32)
+        self.manager.set_partial_read_supported(True)
+        self.manager.start()
+        self.completed = []
+
+        self.entries = [make_entry('e1', 0x1000, VariableType.float32), make_entry('e2', 0x2000, VariableType.uint16)]
+        self.acquisition = DatalogAcquisition(self.entries, sample_rate=1000, trigger=make_trigger(),
+                                              completion_callback=AcquisitionCompletedCallback(lambda acq: self.completed.append(acq)))
+
+    def next_record(self):
+        self.manager.process()
+        self.dispatcher.process()
+        record = self.dispatcher.pop_next()
+        self.assertIsNotNone(record)
+        return record
+
+    def test_acquisition(self):
+        nsamples = 20
+        recording = b''
+        for i in range(nsamples):
+            recording += struct.pack('<fH', float(i), i * 3)
+
+        self.manager.request_acquisition(self.acquisition)
+
+        record = self.next_record()
+        self.assertEqual(record.request.command, DatalogControl)
+        self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.ConfigureDatalog)
+        request_data = self.protocol.parse_request(record.request)
+        self.assertTrue(request_data['valid'])
+        self.assertEqual(len(request_data['configuration'].watches), 2)
+        record.complete(success=True, response=self.protocol.respond_configure_log(0))
+
+        record = self.next_record()
+        self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.ArmLog)
+        record.complete(success=True, response=self.protocol.respond_datalog_arm(record_id=5))
+
+        # Not triggered yet. Manager keeps polling
+        for i in range(2):
+            record = self.next_record()
+            self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.GetLogStatus)
+            record.complete(success=True, response=self.protocol.respond_datalog_status(LogStatus.WaitForTrigger))
+
+        record = self.next_record()
+        record.complete(success=True, response=self.protocol.respond_datalog_status(LogStatus.Triggered))
+
+        record = self.next_record()
+        self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.ListRecordings)
+        recordings = [RecordInfo(4, DatalogLocation.LocationType.RAM, 10), RecordInfo(5, DatalogLocation.LocationType.RAM, len(recording))]
+        record.complete(success=True, response=self.protocol.respond_datalog_list_recordings(recordings))
+
+        # Downloaded in chunks that fit in the response size limit.
+        chunk_count = 0
+        while len(self.completed) == 0:
+            record = self.next_record()
+            self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.ReadRecordings)
+            request_data = self.protocol.parse_request(record.request)
+            self.assertTrue(request_data['valid'])
+            self.assertEqual(request_data['record_id'], 5)
+            offset = request_data['offset']
+            length = request_data['length']
+            response = self.protocol.respond_read_recording(5, recording[offset:offset + length])
+            self.assertLessEqual(response.size(), 32)
+            record.complete(success=True, response=response)
+            chunk_count += 1
+
+        self.assertGreater(chunk_count, 1)
+        self.assertIs(self.completed[0], self.acquisition)
+        self.assertTrue(self.acquisition.success)
+        self.assertEqual(list(self.acquisition.data[self.entries[0].get_id()]), [float(i) for i in range(nsamples)])
+        self.assertEqual(list(self.acquisition.data[self.entries[1].get_id()]), [i * 3 for i in range(nsamples)])
+        self.assertFalse(self.manager.is_busy())
+
+    def test_refused_request(self):
+        second_acquisition = DatalogAcquisition(self.entries, sample_rate=1000, trigger=make_trigger())
+        self.manager.request_acquisition(self.acquisition)
+        self.manager.request_acquisition(second_acquisition)
+
+        record = self.next_record()
+        record.complete(success=True, response=self.protocol.respond_configure_log(0))
+        record = self.next_record()
+        record.complete(success=True, response=self.protocol.respond_not_ok(record.request, ResponseCode.FailureToProceed))
+
+        self.assertEqual(len(self.completed), 1)
+        self.assertFalse(self.acquisition.success)
+        self.assertNotEqual(self.acquisition.error, '')
+
+        # Next acquisition starts
+        record = self.next_record()
+        self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.ConfigureDatalog)
+
+    def test_stop_fails_acquisitions(self):
+        self.manager.request_acquisition(self.acquisition)
+        record = self.next_record()
+        self.manager.stop()
+        self.manager.process()
+        self.assertEqual(len(self.completed), 0)    # Waits for the pending request
+
+        record.complete(success=False)
+        self.manager.process()
+        self.assertEqual(len(self.completed), 1)
+        self.assertFalse(self.acquisition.success)
+        self.assertFalse(self.manager.is_busy())
+
+    def arm(self):
+        record = self.next_record()
+        record.complete(success=True, response=self.protocol.respond_configure_log(0))
+        record = self.next_record()
+        record.complete(success=True, response=self.protocol.respond_datalog_arm(record_id=5))
+
+    def test_trigger_timeout_disarms(self):
+        self.acquisition.timeout = 10
+        second_acquisition = DatalogAcquisition(self.entries, sample_rate=1000, trigger=make_trigger())
+        self.manager.request_acquisition(self.acquisition)
+        self.manager.request_acquisition(second_acquisition)
+        self.arm()
+
+        record = self.next_record()
+        record.complete(success=True, response=self.protocol.respond_datalog_status(LogStatus.WaitForTrigger))
+
+        self.acquisition.request_timestamp -= 11    # Trigger never came
+        record = self.next_record()
+        self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.DisarmLog)
+        self.assertEqual(len(self.completed), 0)
+        record.complete(success=True, response=self.protocol.respond_datalog_disarm())
+
+        self.assertEqual(len(self.completed), 1)
+        self.assertFalse(self.acquisition.success)
+        self.assertIn('Timed out', self.acquisition.error)
+
+        # Next acquisition is not blocked
+        record = self.next_record()
+        self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.ConfigureDatalog)
+
+    def test_cancel(self):
+        queued_acquisition = DatalogAcquisition(self.entries, sample_rate=1000, trigger=make_trigger())
+        self.manager.request_acquisition(self.acquisition)
+        self.manager.request_acquisition(queued_acquisition)
+
+        # Still in the queue. Nothing to send to the device
+        self.manager.cancel_acquisition(queued_acquisition)
+        self.assertFalse(queued_acquisition.success)
+        self.assertEqual(queued_acquisition.error, 'Cancelled')
+
+        # Cancelled while configuring. Disarmed once armed.
+        record = self.next_record()
+        self.manager.cancel_acquisition(self.acquisition)
+        record.complete(success=True, response=self.protocol.respond_configure_log(0))
+        record = self.next_record()
+        self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.ArmLog)
+        record.complete(success=True, response=self.protocol.respond_datalog_arm(record_id=5))
+
+        record = self.next_record()
+        self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.DisarmLog)
+        record.complete(success=False)  # Failed anyway, even if the device does not answer
+
+        self.assertEqual(len(self.completed), 1)
+        self.assertFalse(self.acquisition.success)
+        self.assertEqual(self.acquisition.error, 'Cancelled')
+        self.assertFalse(self.manager.is_busy())
+
+    def test_queued_acquisition_timeout(self):
+        self.manager.stop()
+        self.manager.process()
+        self.acquisition.timeout = 10
+        self.manager.request_acquisition(self.acquisition)
+        self.manager.process()
+        self.assertEqual(len(self.completed), 0)
+
+        self.acquisition.request_timestamp -= 11    # Device never became ready
+        self.manager.process()
+        self.assertEqual(len(self.completed), 1)
+        self.assertIn('Timed out', self.acquisition.error)
+
+    def wait_for_recording(self, recording_size):
+        self.arm()
+        record = self.next_record()
+        record.complete(success=True, response=self.protocol.respond_datalog_status(LogStatus.Triggered))
+        record = self.next_record()
+        recordings = [RecordInfo(5, DatalogLocation.LocationType.RAM, recording_size)]
+        record.complete(success=True, response=self.protocol.respond_datalog_list_recordings(recordings))
+
+    def test_read_without_partial_read_feature(self):
+        recording = b''
+        for i in range(20):
+            recording += struct.pack('<fH', float(i), i * 3)
+        self.manager.set_partial_read_supported(False)
+
+        # Cannot be read in a single response
+        self.manager.request_acquisition(self.acquisition)
+        self.wait_for_recording(len(recording))
+        self.assertEqual(len(self.completed), 1)
+        self.assertFalse(self.acquisition.success)
+        self.assertIn('partial read', self.acquisition.error)
+        self.assertFalse(self.manager.is_busy())
+
+        # Whole recording in one request, with the original payload format.
+        self.manager.set_size_limits(max_request_size=128, max_response_size=256)
+        second_acquisition = DatalogAcquisition(self.entries, sample_rate=1000, trigger=make_trigger(),
+                                                completion_callback=AcquisitionCompletedCallback(lambda acq: self.completed.append(acq)))
+        self.manager.request_acquisition(second_acquisition)
+        self.wait_for_recording(len(recording))
+        record = self.next_record()
+        self.assertEqual(DatalogControl.Subfunction(record.request.subfn), DatalogControl.Subfunction.ReadRecordings)
+        self.assertEqual(record.request.payload, struct.pack('>H', 5))
+        record.complete(success=True, response=self.protocol.respond_read_recording(5, recording))
+
+        self.assertEqual(len(self.completed), 2)
+        self.assertTrue(second_acquisition.success)
+        self.assertEqual(list(second_acquisition.data[self.entries[1].get_id()]), [i * 3 for i in range(20)])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -7,9 +7,11 @@
 #   Copyright (c) 2021-2022 Scrutiny Debugger
 
 import unittest
+import threading
 
 from scrutiny.server.datastore import Datastore, DatastoreEntry
 from scrutiny.core.variable import *
+from scrutiny.core.varmap import VarMap
 
 
 class TestDataStore(unittest.TestCase):
@@ -163,3 +165,69 @@ class TestDataStore(unittest.TestCase):
 
         watched_entries_id = ds.get_watched_entries_id()
         self.assertEqual(len(watched_entries_id), 0)
+
+    # Make sure entries created from a VarMap only build the Variable object when needed and that enums are shared.
+    def test_lazy_variable_from_varmap(self):
+        varmap = VarMap()
+        varmap.register_base_type('uint32_t', VariableType.uint32)
+        enum = VariableEnum('SomeEnum')
+        enum.add_value(0, 'aaa')
+        enum.add_value(1, 'bbb')
+        varmap.add_variable(['a', 'b'], 'var1', VariableLocation(0x1000), 'uint32_t', enum=enum)
+        varmap.add_variable(['a', 'b'], 'var2', VariableLocation(0x1004), 'uint32_t', enum=enum)
+        varmap = VarMap(varmap.get_json())  # Reload like it is done from a SFD file
+
+        ds = Datastore()
+        entries = [DatastoreEntry(DatastoreEntry.EntryType.Var, fullname, varmap=varmap) for fullname in varmap.iterate_vars_fullname()]
+        ds.add_entries(entries)
+        self.assertEqual(ds.get_entries_count(), 2)
+
+        for entry in entries:
+            self.assertFalse(entry.is_variable_loaded())
+
+        entry1 = [entry for entry in entries if entry.get_display_path() == '/a/b/var1'][0]
+        entry2 = [entry for entry in entries if entry.get_display_path() == '/a/b/var2'][0]
+        self.assertEqual(entry1.get_address(), 0x1000)
+        self.assertTrue(entry1.is_variable_loaded())
+        self.assertFalse(entry2.is_variable_loaded())
+        self.assertEqual(entry2.get_data_type(), VariableType.uint32)
+        self.assertTrue(entry2.is_variable_loaded())
+
+        enum1 = entry1.get_core_variable().get_enum()
+        enum2 = entry2.get_core_variable().get_enum()
+        self.assertIsNotNone(enum1)
+        self.assertIs(enum1, enum2)
+        self.assertEqual(enum1.get_name(1), 'bbb')
+
+        with self.assertRaises(ValueError):
+            DatastoreEntry(DatastoreEntry.EntryType.Var, '/a/b/var1')
+
+    # The API thread and the device thread can both be the first to read the variable of an entry
+    def test_lazy_variable_concurrent_access(self):
+        varmap = VarMap()
+        varmap.register_base_type('uint32_t', VariableType.uint32)
+        for i in range(50):
+            varmap.add_variable(['a'], 'var%d' % i, VariableLocation(0x1000 + i * 4), 'uint32_t')
+        entries = [DatastoreEntry(DatastoreEntry.EntryType.Var, fullname, varmap=varmap) for fullname in varmap.iterate_vars_fullname()]
+
+        results = []
+        errors = []
+        barrier = threading.Barrier(4)
+
+        def read_all():
+            try:
+                barrier.wait()
+                results.append([entry.variable_def for entry in entries])
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=read_all) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        self.assertEqual(errors, [])
+        for result in results[1:]:
+            for var1, var2 in zip(results[0], result):
+                self.assertIs(var1, var2)
@@ -15,7 +15,9 @@ from scrutiny.server.device.emulated_device import EmulatedDevice
 from scrutiny.server.device.device_handler import DeviceHandler
 from scrutiny.server.device.links.dummy_link import ThreadSafeDummyLink
 from scrutiny.server.datastore import Datastore, DatastoreEntry
-from scrutiny.server.protocol.commands import DummyCommand
+from scrutiny.server.protocol.commands import DummyCommand, DatalogControl
+from scrutiny.server.protocol.datalog import DatalogConfiguration
+from scrutiny.server.device.request_generator.datalog_manager import DatalogAcquisition, AcquisitionCompletedCallback
 from scrutiny.server.protocol import Request, Response
 from scrutiny.core import *
 
@@ -137,6 +139,7 @@ class TestDeviceHandler(unittest.TestCase):
         self.assertEqual(info.supported_feature_map['memory_write'], self.emulated_device.supported_features['memory_write'])
         self.assertEqual(info.supported_feature_map['datalog_acquire'], self.emulated_device.supported_features['datalog_acquire'])
         self.assertEqual(info.supported_feature_map['user_command'], self.emulated_device.supported_features['user_command'])
+        self.assertEqual(info.supported_feature_map['datalog_partial_read'], self.emulated_device.supported_features['datalog_partial_read'])
 
         for region in self.emulated_device.forbidden_regions:
             found = False
@@ -357,6 +360,42 @@ class TestDeviceHandler(unittest.TestCase):
         self.assertTrue(connection_successful)
         self.assertEqual(round_completed, test_round_to_do)  # Check that we made 5 cycles of value
 
+    def test_datalog_acquisition(self):
+        vfloat32 = DatastoreEntry(DatastoreEntry.EntryType.Var, 'dummy_float32', variable_def=Variable(
+            'dummy_float32', vartype=VariableType.float32, path_segments=[], location=0x10000, endianness=Endianness.Little))
+        vuint16 = DatastoreEntry(DatastoreEntry.EntryType.Var, 'dummy_uint16', variable_def=Variable(
+            'dummy_uint16', vartype=VariableType.uint16, path_segments=[], location=0x10004, endianness=Endianness.Little))
+        self.emulated_device.write_memory(0x10000, struct.pack('<fH', 3.5, 1234))
+        self.emulated_device.datalogger.buffer_size = 600   # 100 samples. Downloaded in many chunks
+
+        trigger = DatalogConfiguration.Trigger()
+        trigger.condition = DatalogConfiguration.TriggerCondition.EQUAL
+        trigger.operand1 = DatalogConfiguration.WatchOperand(address=0x10004, length=2, interpret_as=VariableType.uint16)
+        trigger.operand2 = DatalogConfiguration.ConstOperand(1234)
+
+        completed = []
+        acquisition = DatalogAcquisition([vfloat32, vuint16], sample_rate=1000, trigger=trigger,
+                                         completion_callback=AcquisitionCompletedCallback(lambda acq: completed.append(acq)))
+        self.device_handler.request_datalog_acquisition(acquisition)
+
+        t1 = time()
+        while time() - t1 < 3 and len(completed) == 0:
+            self.device_handler.process()
+            sleep(0.005)
+            self.assertEqual(self.device_handler.get_comm_error_count(), 0)
+
+        self.assertEqual(len(completed), 1)
+        self.assertTrue(acquisition.success, acquisition.error)
+        # Triggered on the first sample. Only the post-trigger half of the buffer is filled
+        self.assertEqual(list(acquisition.data[vfloat32.get_id()]), [3.5] * 50)
+        self.assertEqual(list(acquisition.data[vuint16.get_id()]), [1234] * 50)
+
+        # Recording was bigger than a response. Must have been read in chunks
+        read_requests = [record for record in self.emulated_device.get_request_history() if record.request.command == DatalogControl and
+                         DatalogControl.Subfunction(record.request.subfn) == DatalogControl.Subfunction.ReadRecordings]
+        self.assertGreater(len(read_requests), 1)
+
+
 
 class TestDeviceHandlerMultipleLink(unittest.TestCase):
 
@@ -0,0 +1,160 @@
+#    test_device_instance.py
+#        Test the DeviceInstance and the publish policies applied to the values it forwards
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import unittest
+
+from scrutiny.server.device_instance import DeviceInstance, PublishPolicy, ValueUpdateCallback
+from scrutiny.server.datastore import Datastore, DatastoreEntry
+from scrutiny.server.device.device_handler import DeviceHandler
+from scrutiny.core.variable import *
+
+
+class StubbedSFDHandler:
+    def get_loaded_sfd(self):
+        return None
+
+
+class StubbedLink:
+    def get_config(self):
+        return {'port': 'COM1'}
+
+
+class StubbedDeviceHandler:
+    def get_connection_status(self):
+        return DeviceHandler.ConnectionStatus.CONNECTED_READY
+
+    def get_link_type(self):
+        return 'serial'
+
+    def get_comm_link(self):
+        return StubbedLink()
+
+    def get_device_info(self):
+        return None
+
+
+class TestPublishPolicy(unittest.TestCase):
+
+    def publish_all(self, policy, samples):
+        return [value for timestamp, value in samples if policy.should_publish(value, timestamp)]
+
+    def test_no_filter(self):
+        policy = PublishPolicy({})
+        self.assertEqual(self.publish_all(policy, [(0, 1), (1, 1), (2, 1)]), [1, 1, 1])
+
+    def test_on_change(self):
+        policy = PublishPolicy({'on_change': True})
+        self.assertEqual(self.publish_all(policy, [(0, 1), (1, 1), (2, 2), (3, 2), (4, 1)]), [1, 2, 1])
+
+    def test_absolute_deadband(self):
+        policy = PublishPolicy({'deadband': 0.5})
+        samples = [(0, 10), (1, 10.3), (2, 10.6), (3, 11.0), (4, 10.2), (5, 10.0)]
+        self.assertEqual(self.publish_all(policy, samples), [10, 10.6, 10.0])     # Compared with the last published value
+
+    def test_relative_deadband(self):
+        policy = PublishPolicy({'relative_deadband': 0.1})
+        samples = [(0, 100), (1, 105), (2, 111), (3, 115), (4, 123)]
+        self.assertEqual(self.publish_all(policy, samples), [100, 111, 123])
+
+    def test_non_numeric_deadband(self):
+        policy = PublishPolicy({'deadband': 10})
+        self.assertEqual(self.publish_all(policy, [(0, 'a'), (1, 'a'), (2, 'b')]), ['a', 'b'])
+
+    def test_min_interval(self):
+        policy = PublishPolicy({'min_interval': 1})
+        samples = [(0, 1), (0.5, 2), (0.9, 3), (1.0, 3), (1.5, 4), (2.1, 5)]
+        self.assertEqual(self.publish_all(policy, samples), [1, 3, 5])
+
+        # Change held back is published on the next poll
+        policy = PublishPolicy({'min_interval': 1, 'on_change': True})
+        samples = [(0, 1), (0.5, 2), (1.1, 2), (1.5, 2)]
+        self.assertEqual(self.publish_all(policy, samples), [1, 2])
+
+    def test_max_interval(self):
+        policy = PublishPolicy({'on_change': True, 'max_interval': 1})
+        samples = [(0, 1), (0.5, 1), (1.0, 1), (1.5, 1), (1.8, 2), (2.5, 2), (2.9, 2)]
+        self.assertEqual(self.publish_all(policy, samples), [1, 1, 2, 2])
+
+    def test_bad_config(self):
+        for config in [{'potato': 1}, {'on_change': 'yes'}, {'deadband': -1}, {'relative_deadband': True}, {'max_interval': None}, []]:
+            with self.assertRaises(ValueError):
+                PublishPolicy(config)
+
+
+class TestDeviceInstance(unittest.TestCase):
+    def setUp(self):
+        self.datastore = Datastore()
+        self.device = DeviceInstance('device', datastore=self.datastore, device_handler=None, sfd_handler=StubbedSFDHandler())
+        self.updates = []
+        self.device.set_value_update_callback(ValueUpdateCallback(lambda *args: self.updates.append(args)))
+        var = Variable('var', vartype=VariableType.float32, path_segments=[], location=0x1000, endianness=Endianness.Little)
+        self.entry = DatastoreEntry(DatastoreEntry.EntryType.Var, 'var', variable_def=var)
+        self.datastore.add_entry(self.entry)
+
+    def test_publish_policy_per_watcher(self):
+        self.device.start_watching(self.entry.get_id(), 'watcher1', publish_policy=PublishPolicy({'on_change': True}))
+        self.device.start_watching(self.entry.get_id(), 'watcher2')
+        for value in [1, 1, 2, 2]:
+            self.entry.set_value(value)
+
+        self.assertEqual([update[2] for update in self.updates if update[0] == 'watcher1'], [1, 2])
+        self.assertEqual(len([update for update in self.updates if update[0] == 'watcher2']), 4)
+
+        # Subscribing again without a policy removes it
+        self.updates = []
+        self.device.start_watching(self.entry.get_id(), 'watcher1')
+        self.entry.set_value(2)
+        self.assertEqual(len([update for update in self.updates if update[0] == 'watcher1']), 1)
+
+        self.device.stop_watching(self.entry.get_id(), 'watcher1')
+        self.assertEqual(len(self.device.publish_policies), 0)
+
+    def test_threaded_updates_are_filtered(self):
+        self.device.start_watching(self.entry.get_id(), 'watcher1', publish_policy=PublishPolicy({'on_change': True}))
+        self.device.is_device_thread = lambda: True     # As if called by the device thread
+        for value in [1, 1, 1]:
+            self.entry.set_value(value)
+            self.device.swap_value_buffer()
+        self.assertEqual([update[2] for update in self.device.pop_value_updates()], [1])
+
+    def test_snapshot(self):
+        self.device.device_handler = StubbedDeviceHandler()
+        self.device.publish_snapshot()
+        snapshot = self.device.get_snapshot()
+        self.assertEqual(snapshot.connection_status, DeviceHandler.ConnectionStatus.CONNECTED_READY)
+        self.assertEqual(snapshot.link_config, {'port': 'COM1'})
+        self.assertIs(snapshot.get_entry(self.entry.get_id()), self.entry)
+        self.assertEqual(snapshot.get_entries_count(DatastoreEntry.EntryType.Var), 1)
+
+        class NoLock:
+            def __enter__(self):
+                raise RuntimeError('API side must not take the lock')
+
+            def __exit__(self, *args):
+                pass
+
+        # Device thread running. The API gets the snapshot of the last cycle without locking
+        self.device.thread = object()
+        self.device.lock = NoLock()
+        var2 = Variable('var2', vartype=VariableType.float32, path_segments=[], location=0x1004, endianness=Endianness.Little)
+        entry2 = DatastoreEntry(DatastoreEntry.EntryType.Var, 'var2', variable_def=var2)
+        self.datastore.add_entry(entry2)
+        self.assertIs(self.device.get_snapshot(), snapshot)
+        self.assertFalse(self.device.get_snapshot().has_entry(entry2.get_id()))
+
+        self.device.publish_snapshot()  # End of a cycle
+        self.assertTrue(self.device.get_snapshot().has_entry(entry2.get_id()))
+        self.assertFalse(snapshot.has_entry(entry2.get_id()))    # Published snapshots never change
+
+        entries = self.device.get_snapshot().entries
+        self.device.publish_snapshot()
+        self.assertIs(self.device.get_snapshot().entries, entries)  # Not copied when the datastore did not change
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,208 @@
+#    test_emulated_device.py
+#        Test the EmulatedDevice performance mode used for load testing and its datalogger
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import unittest
+import struct
+import time
+
+from scrutiny.server.device.emulated_device import EmulatedDevice, Waveform
+from scrutiny.server.device.links.dummy_link import ThreadSafeDummyLink
+from scrutiny.server.protocol import Protocol, Request, Response, ResponseCode
+from scrutiny.server.protocol.commands import DummyCommand, MemoryControl
+from scrutiny.server.protocol.datalog import DatalogConfiguration, LogStatus
+from scrutiny.core import *
+
+
+class TestEmulatedDevicePerformanceMode(unittest.TestCase):
+    def setUp(self):
+        self.link = ThreadSafeDummyLink()
+        self.link.initialize()
+        self.emulated_device = EmulatedDevice(self.link)
+        self.protocol = Protocol(1, 0)
+
+    def tearDown(self):
+        self.emulated_device.stop()
+
+    def test_flat_memory(self):
+        self.emulated_device.enable_performance_mode(memory_start=0x10000, memory_size=0x1000)
+        self.emulated_device.force_connect()
+        self.emulated_device.write_memory(0x10100, b'\x01\x02\x03\x04')
+
+        response = self.emulated_device.process_request(self.protocol.read_memory_blocks([(0x100FE, 8)]))
+        self.assertEqual(response.code, ResponseCode.OK)
+        response_data = self.protocol.parse_response(response)
+        self.assertTrue(response_data['valid'])
+        self.assertEqual(response_data['read_blocks'][0]['data'], b'\x00\x00\x01\x02\x03\x04\x00\x00')
+
+        with self.assertRaises(IndexError):
+            self.emulated_device.read_memory(0x10FFE, 4)
+
+        with self.assertRaises(IndexError):
+            self.emulated_device.write_memory(0xFFFF, b'\x00')
+
+    def test_write_masked(self):
+        self.emulated_device.force_connect()
+        self.emulated_device.write_memory(0x1000, b'\xF0\x0F')
+        request = self.protocol.write_memory_blocks_masked([(0x1000, b'\x0A\xA0', b'\x0F\xF0'), (0x1001, b'\x01', b'\x01')])
+        response = self.emulated_device.process_request(request)
+        self.assertEqual(response.code, ResponseCode.OK)
+        self.assertEqual(MemoryControl.Subfunction(response.subfn), MemoryControl.Subfunction.WriteMasked)
+        response_data = self.protocol.parse_response(response)
+        self.assertTrue(response_data['valid'])
+        self.assertEqual(response_data['written_blocks'], [dict(address=0x1000, length=2), dict(address=0x1001, length=1)])
+        self.assertEqual(self.emulated_device.read_memory(0x1000, 2), b'\xFA\xAF')
+
+    def test_waveforms(self):
+        self.emulated_device.enable_performance_mode(memory_start=0x10000, memory_size=0x100)
+        self.emulated_device.add_waveform(Waveform(0x10000, VariableType.float32, Waveform.sine(amplitude=10, frequency=1)))
+        self.emulated_device.add_waveform(Waveform(0x10004, VariableType.uint16, lambda t: 1234, endianness=Endianness.Big))
+        self.emulated_device.add_waveform(Waveform(0x10006, VariableType.sint8, Waveform.square(amplitude=5)))
+        self.emulated_device.update_waveforms()
+
+        value = struct.unpack('<f', self.emulated_device.read_memory(0x10000, 4))[0]
+        self.assertGreaterEqual(value, -10)
+        self.assertLessEqual(value, 10)
+        self.assertEqual(self.emulated_device.read_memory(0x10004, 2), struct.pack('>H', 1234))
+        self.assertIn(struct.unpack('<b', self.emulated_device.read_memory(0x10006, 1))[0], [-5, 5])
+
+        sawtooth = Waveform.sawtooth(amplitude=2, frequency=1)
+        self.assertAlmostEqual(sawtooth(0.25), -1)
+        self.assertAlmostEqual(sawtooth(0.75), 1)
+
+    def test_latency_bandwidth_and_history(self):
+        latency = 0.01
+        bandwidth_bps = 100000
+        self.emulated_device.enable_performance_mode(memory_start=0, memory_size=0x100, latency=latency, bandwidth_bps=bandwidth_bps, history_size=3)
+        self.emulated_device.force_connect()
+        self.emulated_device.start()
+
+        request = Request(DummyCommand, subfn=1)
+        nb_request = 5
+        t1 = time.perf_counter()
+        for i in range(nb_request):
+            self.link.write(request.to_bytes())
+            data = bytes()
+            timeout = time.perf_counter() + 2
+            while len(data) < 9 + 32 and time.perf_counter() < timeout:
+                data += self.link.read()
+                time.sleep(0.0005)
+            response = Response.from_bytes(data)
+            self.assertEqual(response.code, ResponseCode.OK)
+        elapsed = time.perf_counter() - t1
+
+        expected_delay = latency + (request.size() + response.size()) * 8 / bandwidth_bps
+        self.assertGreaterEqual(elapsed, nb_request * expected_delay)
+        self.assertEqual(len(self.emulated_device.get_request_history()), 3)
+
+
+class TestEmulatedDatalogger(unittest.TestCase):
+    def setUp(self):
+        self.link = ThreadSafeDummyLink()
+        self.link.initialize()
+        self.emulated_device = EmulatedDevice(self.link)
+        self.emulated_device.enable_performance_mode(memory_start=0x10000, memory_size=0x100)
+        self.emulated_device.force_connect()
+        self.protocol = Protocol(1, 0)
+        self.protocol.set_address_size_bits(32)
+
+    def request(self, request):
+        response = self.emulated_device.process_request(request)
+        self.assertIsNotNone(response)
+        return response
+
+    def request_ok(self, request):
+        response = self.request(request)
+        self.assertEqual(response.code, ResponseCode.OK)
+        response_data = self.protocol.parse_response(response)
+        self.assertTrue(response_data['valid'])
+        return response_data
+
+    def make_config(self, condition, operand1, operand2, sample_rate=1000):
+        config = DatalogConfiguration()
+        config.destination = 0
+        config.sample_rate = sample_rate
+        config.decimation = 1
+        config.add_watch(0x10000, 4)
+        config.trigger.condition = condition
+        config.trigger.operand1 = operand1
+        config.trigger.operand2 = operand2
+        return config
+
+    def test_info(self):
+        self.assertEqual(self.request_ok(self.protocol.datalog_get_bufsize())['size'], self.emulated_device.datalogger.buffer_size)
+        self.assertEqual(self.request_ok(self.protocol.datalog_get_sampling_rates())['sampling_rates'], self.emulated_device.datalogger.sampling_rates)
+        self.assertEqual(self.request_ok(self.protocol.datalog_status())['status'], LogStatus.Disabled)
+        self.assertEqual(self.request(self.protocol.datalog_arm()).code, ResponseCode.FailureToProceed)     # Not configured
+
+        config = self.make_config(DatalogConfiguration.TriggerCondition.EQUAL, DatalogConfiguration.ConstOperand(0), DatalogConfiguration.ConstOperand(0),
+                                  sample_rate=100000)
+        self.assertEqual(self.request(self.protocol.datalog_configure_log(config)).code, ResponseCode.InvalidRequest)  # Too fast
+
+        self.emulated_device.supported_features['datalog_acquire'] = False
+        self.assertEqual(self.request(self.protocol.datalog_status()).code, ResponseCode.UnsupportedFeature)
+
+    def test_acquisition(self):
+        datalogger = self.emulated_device.datalogger
+        datalogger.buffer_size = 400    # 100 samples
+        # Sawtooth drops from +1 to -1 every 100ms
+        self.emulated_device.add_waveform(Waveform(0x10000, VariableType.float32, Waveform.sawtooth(amplitude=1, frequency=10)))
+        operand1 = DatalogConfiguration.WatchOperand(address=0x10000, length=4, interpret_as=VariableType.float32)
+        config = self.make_config(DatalogConfiguration.TriggerCondition.CHANGE_LESS, operand1, DatalogConfiguration.ConstOperand(-1))
+
+        record_id = self.request_ok(self.protocol.datalog_configure_log(config))['record_id']
+        self.assertEqual(self.request_ok(self.protocol.datalog_arm())['record_id'], record_id)
+        self.assertEqual(self.request_ok(self.protocol.datalog_status())['status'], LogStatus.WaitForTrigger)
+
+        timeout = time.perf_counter() + 2
+        while datalogger.status != LogStatus.Triggered and time.perf_counter() < timeout:
+            datalogger.process()
+            time.sleep(0.005)
+
+        self.assertEqual(self.request_ok(self.protocol.datalog_status())['status'], LogStatus.Triggered)
+        recordings = self.request_ok(self.protocol.datalog_get_list_recordings())['recordings']
+        self.assertEqual(len(recordings), 1)
+        self.assertEqual(recordings[0].record_id, record_id)
+        self.assertEqual(recordings[0].size, 400)
+
+        # Too big for a single response. Must be read in chunks
+        self.assertEqual(self.request(self.protocol.datalog_read_recording(record_id)).code, ResponseCode.Overflow)
+        self.assertEqual(self.request(self.protocol.datalog_read_recording(record_id + 1, offset=0, length=16)).code, ResponseCode.InvalidRequest)
+        data = b''
+        while len(data) < 400:
+            response_data = self.request_ok(self.protocol.datalog_read_recording(record_id, offset=len(data), length=min(100, 400 - len(data))))
+            self.assertEqual(response_data['record_id'], record_id)
+            data += response_data['data']
+
+        values = [x[0] for x in struct.iter_unpack('<f', data)]
+        # The trigger sample is followed by the post-trigger half of the buffer
+        trigger_index = len(values) - 50
+        self.assertLess(values[trigger_index] - values[trigger_index - 1], -1)
+        for i in range(trigger_index + 1, len(values)):
+            self.assertGreaterEqual(values[i] - values[i - 1], -1)
+
+    def test_late_samples_do_not_write_memory(self):
+        datalogger = self.emulated_device.datalogger
+        self.emulated_device.add_waveform(Waveform(0x10000, VariableType.float32, lambda t: t))
+        config = self.make_config(DatalogConfiguration.TriggerCondition.EQUAL, DatalogConfiguration.ConstOperand(0), DatalogConfiguration.ConstOperand(1))
+        self.request_ok(self.protocol.datalog_configure_log(config))
+        self.request_ok(self.protocol.datalog_arm())
+
+        self.emulated_device.write_memory(0x10000, struct.pack('<f', -1))
+        datalogger.next_sample_time -= 0.05    # Thread was late. 50 samples to catch up
+        datalogger.process()
+        self.assertEqual(self.emulated_device.read_memory(0x10000, 4), struct.pack('<f', -1))
+
+        # Samples have the waveform value at their own time, partial overlap included
+        times = [struct.unpack('<f', sample)[0] for sample in datalogger.samples]
+        self.assertGreater(len(times), 40)
+        self.assertEqual(times, sorted(times))
+        self.assertEqual(self.emulated_device.read_memory_at_time(0x10002, 4, 2.0)[0:2], struct.pack('<f', 2.0)[2:4])
+
+
+if __name__ == '__main__':
+    unittest.main()
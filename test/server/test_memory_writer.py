@@ -121,32 +121,206 @@ class TestMemoryWriterBasicReadOperation(unittest.TestCase):
 
         time_start = time.time()
 
-        # Memory writer writes one entry per request. it's a choice
-        for i in range(ndouble):
+        # Memory writer packs as many entries as possible in each request.
+        request_count = 0
+        written_count = 0
+        while True:
             writer.process()
             dispatcher.process()
 
             record = dispatcher.pop_next()
-            self.assertIsNotNone(record, 'i=%d' % i)  # Make sure there is something to send
+            if record is None:
+                break
+            request_count += 1
 
-            self.assertEqual(record.request.command, MemoryControl, 'i=%d' % i)
-            self.assertEqual(MemoryControl.Subfunction(record.request.subfn), MemoryControl.Subfunction.Write, 'i=%d' % i)
+            self.assertEqual(record.request.command, MemoryControl)
+            self.assertEqual(MemoryControl.Subfunction(record.request.subfn), MemoryControl.Subfunction.Write)
+            self.assertLessEqual(record.request.size(), 1024)
 
             request_data = protocol.parse_request(record.request)
-            self.assertTrue(request_data['valid'], 'i=%d' % i)
+            self.assertTrue(request_data['valid'])
 
             # Emulate the device response
             block_in_response = []
             for block in request_data['blocks_to_write']:
                 block_in_response.append((block['address'], len(block['data'])))
                 self.assertEqual(len(block['data']), 8)     # float64 = 8 bytes
+            written_count += len(block_in_response)
 
             response = protocol.respond_write_memory_blocks(block_in_response)
             record.complete(success=True, response=response)    # This should trigger the datastore write callback
 
+        self.assertEqual(written_count, ndouble)
+        self.assertEqual(request_count, 2)  # 100 x (4 bytes address + 2 bytes length + 8 bytes data) = 1400 bytes
+
         # Make sure all entries has been updated. We check the update timestamp and the data itself
         for i in range(ndouble):
             self.assertFalse(entries[i].has_pending_target_update(), 'i=%d' % i)
             update_time = entries[i].get_last_update_timestamp()
             self.assertIsNotNone(update_time, 'i=%d' % i)
             self.assertGreaterEqual(update_time, time_start, 'i=%d' % i)
+
+    # Many updates of the same entries before they are written. Only the latest value is written, once.
+    def test_latest_value_wins(self):
+        address = 0x1000
+        ds = Datastore()
+        entries = list(make_dummy_entries(address=address, n=3, vartype=VariableType.uint32))
+        ds.add_entries(entries)
+        dispatcher = RequestDispatcher()
+
+        protocol = Protocol(1, 0)
+        protocol.set_address_size_bits(32)
+        writer = MemoryWriter(protocol, dispatcher=dispatcher, datastore=ds, request_priority=0)
+        writer.start()
+
+        # No need to watch the entries. Writes are queued when requested.
+        for i in range(10):
+            entries[2].update_target_value(i)
+            entries[0].update_target_value(100 + i)
+
+        writer.process()
+        dispatcher.process()
+        record = dispatcher.pop_next()
+        self.assertIsNotNone(record)
+        request_data = protocol.parse_request(record.request)
+        self.assertTrue(request_data['valid'])
+        self.assertEqual(len(request_data['blocks_to_write']), 2)
+        self.assertEqual(request_data['blocks_to_write'][0]['address'], address + 8)
+        self.assertEqual(request_data['blocks_to_write'][0]['data'], struct.pack('<L', 9))
+        self.assertEqual(request_data['blocks_to_write'][1]['address'], address)
+        self.assertEqual(request_data['blocks_to_write'][1]['data'], struct.pack('<L', 109))
+
+        # New value requested while the request is in flight. Must be written after.
+        entries[0].update_target_value(200)
+        writer.process()
+        dispatcher.process()
+        self.assertIsNone(dispatcher.pop_next())    # One request at a time
+
+        response = protocol.respond_write_memory_blocks([(address + 8, 4), (address, 4)])
+        record.complete(success=True, response=response)
+        self.assertFalse(entries[2].has_pending_target_update())
+        self.assertEqual(entries[2].get_value(), 9)
+        self.assertTrue(entries[0].has_pending_target_update())
+
+        writer.process()
+        dispatcher.process()
+        record = dispatcher.pop_next()
+        self.assertIsNotNone(record)
+        request_data = protocol.parse_request(record.request)
+        self.assertEqual(len(request_data['blocks_to_write']), 1)
+        self.assertEqual(request_data['blocks_to_write'][0]['data'], struct.pack('<L', 200))
+        record.complete(success=True, response=protocol.respond_write_memory_blocks([(address, 4)]))
+        self.assertFalse(entries[0].has_pending_target_update())
+        self.assertEqual(entries[0].get_value(), 200)
+
+        writer.process()
+        dispatcher.process()
+        self.assertIsNone(dispatcher.pop_next())
+
+    def test_write_failure(self):
+        ds = Datastore()
+        entries = list(make_dummy_entries(address=0x1000, n=2, vartype=VariableType.uint32))
+        ds.add_entries(entries)
+        dispatcher = RequestDispatcher()
+        protocol = Protocol(1, 0)
+        protocol.set_address_size_bits(32)
+        writer = MemoryWriter(protocol, dispatcher=dispatcher, datastore=ds, request_priority=0)
+        writer.start()
+
+        entries[0].update_target_value(1)
+        entries[1].update_target_value(2)
+        writer.process()
+        dispatcher.process()
+        record = dispatcher.pop_next()
+        record.complete(success=False)
+        for entry in entries:
+            self.assertFalse(entry.has_pending_target_update())
+            self.assertTrue(entry.pending_target_update.is_failed())
+
+    # Writes queued for a firmware must never be applied to the next one.
+    def test_no_write_after_datastore_clear(self):
+        ds = Datastore()
+        entries = list(make_dummy_entries(address=0x1000, n=2, vartype=VariableType.uint32))
+        ds.add_entries(entries)
+        dispatcher = RequestDispatcher()
+        protocol = Protocol(1, 0)
+        protocol.set_address_size_bits(32)
+        writer = MemoryWriter(protocol, dispatcher=dispatcher, datastore=ds, request_priority=0)
+
+        # Requested while disconnected. Then the SFD is unloaded and another firmware connects
+        entries[0].update_target_value(1)
+        writer.process()
+        ds.clear()
+        ds.add_entries(list(make_dummy_entries(address=0x1000, n=2, vartype=VariableType.uint32)))
+        writer.start()
+        writer.process()
+        dispatcher.process()
+        self.assertIsNone(dispatcher.pop_next())
+        self.assertTrue(entries[0].pending_target_update.is_failed())
+
+        # Requested while connected, but the datastore is cleared before the write goes out
+        ds.clear()
+        ds.add_entries(entries)
+        entries[1].update_target_value(2)
+        ds.clear()
+        writer.process()
+        dispatcher.process()
+        self.assertIsNone(dispatcher.pop_next())
+
+        # Disconnection drops the queued writes
+        ds.add_entries(entries)
+        entries[1].update_target_value(3)
+        writer.stop()
+        writer.process()
+        writer.start()
+        writer.process()
+        dispatcher.process()
+        self.assertIsNone(dispatcher.pop_next())
+        self.assertTrue(entries[1].pending_target_update.is_failed())
+
+    # Many bitfields in the same word are written in a single masked request. No read needed.
+    def test_bitfields_masked_write(self):
+        ds = Datastore()
+        entries = []
+        for i in range(4):
+            var = Variable('bitfield%d' % i, vartype=VariableType.uint16, path_segments=[], location=0x1000,
+                           endianness=Endianness.Little, bitoffset=i * 4, bitsize=4)
+            entries.append(DatastoreEntry(DatastoreEntry.EntryType.Var, 'bitfield%d' % i, variable_def=var))
+        ds.add_entries(entries)
+        plain_entry = list(make_dummy_entries(address=0x2000, n=1, vartype=VariableType.uint16))[0]
+        ds.add_entry(plain_entry)
+
+        dispatcher = RequestDispatcher()
+        protocol = Protocol(1, 0)
+        protocol.set_address_size_bits(32)
+        writer = MemoryWriter(protocol, dispatcher=dispatcher, datastore=ds, request_priority=0)
+        writer.start()
+
+        for i in range(4):
+            entries[i].update_target_value(i + 1)
+        plain_entry.update_target_value(0x1234)
+
+        writer.process()
+        dispatcher.process()
+        record = dispatcher.pop_next()
+        self.assertEqual(MemoryControl.Subfunction(record.request.subfn), MemoryControl.Subfunction.WriteMasked)
+        request_data = protocol.parse_request(record.request)
+        self.assertTrue(request_data['valid'])
+        self.assertEqual(len(request_data['blocks_to_write']), 4)
+        for i in range(4):
+            block = request_data['blocks_to_write'][i]
+            self.assertEqual(block['address'], 0x1000)
+            self.assertEqual(block['data'], struct.pack('<H', (i + 1) << (i * 4)))
+            self.assertEqual(block['write_mask'], struct.pack('<H', 0xF << (i * 4)))
+
+        response = protocol.respond_write_memory_blocks_masked([(0x1000, 2)] * 4)
+        record.complete(success=True, response=response)
+        for i in range(4):
+            self.assertFalse(entries[i].has_pending_target_update())
+            self.assertEqual(entries[i].get_value(), i + 1)
+
+        # The entry without a mask goes in its own request
+        writer.process()
+        dispatcher.process()
+        record = dispatcher.pop_next()
+        self.assertEqual(MemoryControl.Subfunction(record.request.subfn), MemoryControl.Subfunction.Write)
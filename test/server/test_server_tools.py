@@ -58,3 +58,55 @@ class TestThrottler(unittest.TestCase):
                 buffer_peak = max(buffer_peak, buffer_estimation[-1])
 
         logger.info('Maximum buffer peak = %dbits' % (math.ceil(buffer_peak)))
+
+    def test_token_bucket_burst(self):
+        bitrate = 10000
+        throttler = Throttler(mode=Throttler.Mode.TokenBucket, burst_size=1000)
+        throttler.set_bitrate(bitrate)
+        throttler.enable()
+
+        # Bucket starts full. Burst is allowed, not more.
+        self.assertTrue(throttler.allowed(1000))
+        self.assertEqual(throttler.time_until_allowed(1000), 0)
+        throttler.consume_bandwidth(600)
+        self.assertTrue(throttler.allowed(400))
+        throttler.consume_bandwidth(400)
+        self.assertFalse(throttler.allowed(500))
+        wait_time = throttler.time_until_allowed(500)
+        self.assertGreater(wait_time, 0.04)
+        self.assertLessEqual(wait_time, 0.05)
+
+        time.sleep(wait_time + 0.005)
+        self.assertTrue(throttler.allowed(500))
+
+        # Bigger than the burst size : sent when the bucket is full, then the debt must be paid.
+        self.assertTrue(throttler.possible(5000))
+        time.sleep(0.1)
+        self.assertTrue(throttler.allowed(5000))
+        throttler.consume_bandwidth(5000)
+        self.assertGreater(throttler.time_until_allowed(100), 0.4)
+
+        throttler.disable()
+        self.assertTrue(throttler.allowed(100000))
+        self.assertEqual(throttler.time_until_allowed(100000), 0)
+
+    def test_token_bucket_measurement(self):
+        bitrate = 5000
+        throttler = Throttler(mode=Throttler.Mode.TokenBucket)
+        throttler.set_bitrate(bitrate)
+        throttler.enable()
+
+        runtime = 2
+        chunk = bitrate / 20
+        total = 0
+        tstart = time.monotonic()
+        while time.monotonic() - tstart < runtime:
+            throttler.process()
+            if throttler.allowed(chunk):
+                throttler.consume_bandwidth(chunk)
+                total += chunk
+            time.sleep(throttler.time_until_allowed(chunk))
+
+        # Maximum is the burst + what is accumulated during the test
+        self.assertLessEqual(total, throttler.get_burst_size() + bitrate * runtime + chunk)
+        self.assertGreater(total, bitrate * runtime * 0.9)
@@ -0,0 +1,184 @@
+#    test_value_recorder.py
+#        Test the capture file format and the recorder that writes it
+#
+#   - License : MIT - See LICENSE file.
+#   - Project :  Scrutiny Debugger (github.com/scrutinydebugger/scrutiny-python)
+#
+#   Copyright (c) 2021-2022 Scrutiny Debugger
+
+import unittest
+import tempfile
+import os
+import time
+
+from scrutiny.server.value_recorder import CaptureFileWriter, CaptureFileReader, CaptureFileFormat, ValueRecorder
+from scrutiny.server.datastore import Datastore, DatastoreEntry
+from scrutiny.server.device_instance import DeviceInstance
+from scrutiny.server.device.device_handler import DeviceHandler
+from scrutiny.core.variable import *
+
+
+class StubbedSFDHandler:
+    def get_loaded_sfd(self):
+        return None
+
+
+class StubbedDeviceHandler:
+    def get_connection_status(self):
+        return DeviceHandler.ConnectionStatus.DISCONNECTED
+
+    def get_link_type(self):
+        return 'none'
+
+    def get_comm_link(self):
+        return None
+
+    def get_device_info(self):
+        return None
+
+
+def make_signals(n):
+    return [{'id': 'id%d' % i, 'display_path': '/a/b/var%d' % i, 'datatype': 'float32'} for i in range(n)]
+
+
+class TestCaptureFile(unittest.TestCase):
+    def setUp(self):
+        self.tempdir = tempfile.TemporaryDirectory()
+        self.filename = os.path.join(self.tempdir.name, 'capture.scap')
+
+    def tearDown(self):
+        self.tempdir.cleanup()
+
+    def write_capture(self, nsamples, chunk_size):
+        writer = CaptureFileWriter(self.filename, make_signals(2), firmware_id='00112233445566778899aabbccddeeff', chunk_size=chunk_size)
+        for i in range(nsamples):
+            writer.add_sample(0, 1000 + i, i * 1.5)
+            if i % 2 == 0:
+                writer.add_sample(1, 1000 + i, -i)
+        return writer
+
+    def test_write_read(self):
+        writer = self.write_capture(1000, chunk_size=100)
+        writer.close()
+        self.assertGreater(len(writer.index), 10)
+
+        reader = CaptureFileReader(self.filename)
+        self.assertEqual(reader.get_firmware_id(), '00112233445566778899aabbccddeeff')
+        self.assertEqual(reader.get_signals(), [dict(signal, typecode='d') for signal in make_signals(2)])
+        self.assertEqual(reader.get_sample_count(), 1500)
+        self.assertEqual(reader.get_time_range(), (1000, 1999))
+
+        timestamps, values = reader.read_signal('id0')
+        self.assertEqual(list(timestamps), [1000 + i for i in range(1000)])
+        self.assertEqual(list(values), [i * 1.5 for i in range(1000)])
+
+        timestamps, values = reader.read_signal('id1')
+        self.assertEqual(list(timestamps), [1000 + i for i in range(0, 1000, 2)])
+        self.assertEqual(list(values), [-i for i in range(0, 1000, 2)])
+
+        with self.assertRaises(KeyError):
+            reader.read_signal('id2')
+
+    def test_time_range(self):
+        self.write_capture(1000, chunk_size=100).close()
+        reader = CaptureFileReader(self.filename)
+        timestamps, values = reader.read_signal('id0', start=1500, end=1549.5)
+        self.assertEqual(list(timestamps), [1500 + i for i in range(50)])
+        self.assertEqual(list(values), [(500 + i) * 1.5 for i in range(50)])
+
+        timestamps, values = reader.read_signal('id0', start=3000)
+        self.assertEqual(len(timestamps), 0)
+
+    def test_compression(self):
+        writer = CaptureFileWriter(self.filename, make_signals(1), chunk_size=1000)
+        for i in range(10000):
+            writer.add_sample(0, 1000 + i * 0.01, 1.0)
+        writer.close()
+        self.assertLess(os.path.getsize(self.filename), 10000 * 16 / 4)
+
+    def test_file_not_closed(self):
+        writer = self.write_capture(1000, chunk_size=100)
+        writer.flush()
+        writer.file.close()     # No index written, like after a crash
+        with open(self.filename, 'ab') as f:
+            f.write(CaptureFileFormat.CHUNK_MAGIC + b'\x00' * 5)     # Incomplete chunk
+
+        reader = CaptureFileReader(self.filename)
+        self.assertEqual(reader.get_sample_count(), 1500)
+        timestamps, values = reader.read_signal('id0')
+        self.assertEqual(list(values), [i * 1.5 for i in range(1000)])
+
+    def test_integer_values_are_exact(self):
+        datatypes = ['sint64', 'uint64', 'boolean', 'float32']
+        signals = [{'id': 'id%d' % i, 'display_path': '/a/b/var%d' % i, 'datatype': datatype} for i, datatype in enumerate(datatypes)]
+        samples = [
+            [-2**63, 2**53 + 1, -(2**53 + 1), 2**63 - 1],
+            [0, 2**53 + 1, 2**64 - 1, 2**64 - 3],
+            [True, False, True, True],
+            [0.5, -1.25, 3.0, 1e30]
+        ]
+        writer = CaptureFileWriter(self.filename, signals, chunk_size=6)    # Chunks do not end on a signal boundary
+        for i in range(4):
+            for signal_index in range(len(signals)):
+                writer.add_sample(signal_index, 1000 + i, samples[signal_index][i])
+        writer.close()
+
+        reader = CaptureFileReader(self.filename)
+        self.assertEqual([signal['typecode'] for signal in reader.get_signals()], ['q', 'Q', 'B', 'd'])
+        for signal_index in range(len(signals)):
+            timestamps, values = reader.read_signal('id%d' % signal_index)
+            self.assertEqual(list(timestamps), [1000, 1001, 1002, 1003])
+            self.assertEqual(list(values), samples[signal_index])
+
+    def test_bad_file(self):
+        with open(self.filename, 'wb') as f:
+            f.write(b'potato' * 100)
+        with self.assertRaises(ValueError):
+            CaptureFileReader(self.filename)
+
+
+class TestValueRecorder(unittest.TestCase):
+    def setUp(self):
+        self.tempdir = tempfile.TemporaryDirectory()
+        self.filename = os.path.join(self.tempdir.name, 'capture.scap')
+        self.datastore = Datastore()
+        self.device = DeviceInstance('device', datastore=self.datastore, device_handler=StubbedDeviceHandler(), sfd_handler=StubbedSFDHandler())
+
+    def tearDown(self):
+        self.tempdir.cleanup()
+
+    def test_record(self):
+        entries = []
+        for i in range(3):
+            var = Variable('var%d' % i, vartype=VariableType.float32, path_segments=[], location=0x1000 + 4 * i, endianness=Endianness.Little)
+            entries.append(DatastoreEntry(DatastoreEntry.EntryType.Var, 'var%d' % i, variable_def=var))
+        self.datastore.add_entries(entries)
+
+        recorder = ValueRecorder('test', self.device, entries[0:2], self.filename, chunk_size=10)
+        recorder.start()
+        self.assertTrue(recorder.is_running())
+        for i in range(25):
+            entries[0].set_value(i)
+            entries[1].set_value(i * 2)
+            entries[2].set_value(i * 3)     # Not recorded
+        recorder.stop()
+        self.assertFalse(recorder.is_running())
+        self.assertEqual(recorder.get_sample_count(), 50)
+
+        # Stopped. Not recorded anymore
+        self.assertFalse(entries[0].has_value_change_callback(recorder.get_watcher_name()))
+        entries[0].set_value(100)
+
+        reader = CaptureFileReader(self.filename)
+        self.assertIsNone(reader.get_firmware_id())
+        self.assertEqual([signal['id'] for signal in reader.get_signals()], [entries[0].get_id(), entries[1].get_id()])
+        timestamps, values = reader.read_signal(entries[0].get_id())
+        self.assertEqual(list(values), list(range(25)))
+        self.assertEqual(list(timestamps), sorted(timestamps))
+        self.assertLessEqual(timestamps[-1], time.time())
+        timestamps, values = reader.read_signal(entries[1].get_id())
+        self.assertEqual(list(values), [i * 2 for i in range(25)])
+
+
+if __name__ == '__main__':
+    unittest.main()
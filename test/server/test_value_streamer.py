@@ -8,7 +8,149 @@
 #   Copyright (c) 2021-2022 Scrutiny Debugger
 
 import unittest
+import math
 
+from scrutiny.server.api.value_streamer import ValueStreamer, MinMaxDecimator, LttbDecimator
+from scrutiny.server.datastore import DatastoreEntry
+from scrutiny.core.variable import *
+
+
+def make_entry(name):
+    var = Variable(name, vartype=VariableType.float32, path_segments=[], location=0x1000, endianness=Endianness.Little)
+    return DatastoreEntry(DatastoreEntry.EntryType.Var, name, variable_def=var)
+
+
+class TestDecimators(unittest.TestCase):
+
+    def test_minmax(self):
+        decimator = MinMaxDecimator(max_rate=10)     # Buckets of 0.2 sec
+        samples = [(i * 0.05, value) for i, value in enumerate([3, 7, -2, 5, 4, 4, 9, 1, 0, 6])]
+        for timestamp, value in samples:
+            decimator.add(timestamp, value)
+        self.assertEqual(decimator.pop(), [samples[1], samples[2], samples[6], samples[7]])   # 2 buckets completed
+
+        decimator.flush(0.45)
+        self.assertEqual(decimator.pop(), [])     # Bucket still open
+        decimator.flush(0.65)
+        self.assertEqual(decimator.pop(), [samples[8], samples[9]])
+
+        decimator.add(1.0, 5)
+        decimator.flush(1.2)
+        self.assertEqual(decimator.pop(), [(1.0, 5)])    # Single sample gives a single point
+
+    def test_minmax_keeps_peaks(self):
+        decimator = MinMaxDecimator(max_rate=60)
+        samples = [(i * 0.001, math.sin(i * 0.01)) for i in range(10000)]
+        samples[5555] = (samples[5555][0], 100)     # Glitch
+        for timestamp, value in samples:
+            decimator.add(timestamp, value)
+        decimator.flush(100)
+        output = decimator.pop()
+
+        self.assertLessEqual(len(output), 10 * 60 + 2)
+        self.assertIn(samples[5555], output)
+        self.assertEqual(max(value for timestamp, value in output), 100)
+        self.assertEqual(min(value for timestamp, value in output), min(value for timestamp, value in samples))
+        self.assertEqual(output, sorted(output, key=lambda sample: sample[0]))
+
+    def test_lttb(self):
+        decimator = LttbDecimator(max_rate=10)       # Buckets of 0.1 sec
+        samples = [(i * 0.01, 0) for i in range(100)]
+        samples[33] = (samples[33][0], 50)      # Spike in the 4th bucket
+        for timestamp, value in samples:
+            decimator.add(timestamp, value)
+        decimator.flush(100)
+        output = decimator.pop()
+
+        self.assertEqual(output[0], samples[0])     # First point is kept
+        self.assertIn(samples[33], output)
+        self.assertLessEqual(len(output), 11)
+        self.assertEqual(output, sorted(output, key=lambda sample: sample[0]))
+
+    def test_lttb_one_bucket_late(self):
+        decimator = LttbDecimator(max_rate=10)
+        samples = [(i * 0.01, 0) for i in range(25)]
+        samples[4] = (samples[4][0], 50)
+        for timestamp, value in samples:
+            decimator.add(timestamp, value)
+        # Bucket 0 gives its first point. Bucket 1 waits for bucket 2 to end.
+        self.assertEqual(decimator.pop(), [samples[0]])
+        decimator.flush(0.35)
+        self.assertEqual(len(decimator.pop()), 1)
+        decimator.flush(0.6)
+        self.assertEqual(len(decimator.pop()), 1)
+
+    def test_output_rate(self):
+        # Sampling period and buckets are exact in floating point. Samples cover exactly [0, duration[
+        max_rate = 4
+        duration = 60
+        for decimator_class in [LttbDecimator, MinMaxDecimator]:
+            decimator = decimator_class(max_rate=max_rate)
+            output = []
+            for i in range(duration * 64):
+                decimator.add(i / 64, math.sin(i * 0.37) * (i % 7))
+                if i % 100 == 0:
+                    output += decimator.pop()
+            decimator.flush(duration + 10)
+            output += decimator.pop()
+
+            self.assertLessEqual(len(output), duration * max_rate, decimator_class.__name__)
+            self.assertGreaterEqual(len(output), duration * max_rate * 0.9, decimator_class.__name__)
+            self.assertEqual(output, sorted(output, key=lambda sample: sample[0]), decimator_class.__name__)
 
 class TestValueStreamer(unittest.TestCase):
-    pass
+
+    def setUp(self):
+        self.streamer = ValueStreamer()
+        self.streamer.new_connection('conn1')
+        self.streamer.new_connection('conn2')
+        self.entry1 = make_entry('entry1')
+        self.entry2 = make_entry('entry2')
+
+    def test_latest_value(self):
+        self.streamer.publish(self.entry1, 'conn1', 10)
+        self.streamer.publish(self.entry1, 'conn1', 20)
+        self.streamer.publish(self.entry2, 'conn2', 30)
+        self.assertTrue(self.streamer.is_still_waiting_stream(self.entry1))
+        self.assertEqual(self.streamer.get_stream_chunk('conn1'), [(self.entry1, 20, None)])
+        self.assertEqual(self.streamer.get_stream_chunk('conn1'), [])
+        self.assertEqual(self.streamer.get_stream_chunk('conn2'), [(self.entry2, 30, None)])
+        self.assertFalse(self.streamer.is_still_waiting_stream(self.entry1))
+
+    def test_decimated_subscription(self):
+        self.streamer.set_decimation('conn1', self.entry1.get_id(), 'minmax', max_rate=10)
+        for i, value in enumerate([1, 5, 3, 2, 4]):
+            self.streamer.publish(self.entry1, 'conn1', value, timestamp=100 + i * 0.05)
+            self.streamer.publish(self.entry1, 'conn2', value, timestamp=100 + i * 0.05)
+
+        # Other connection is not decimated
+        self.assertEqual(self.streamer.get_stream_chunk('conn2'), [(self.entry1, 4, None)])
+
+        self.assertEqual(self.streamer.get_stream_chunk('conn1'), [(self.entry1, 1, 100), (self.entry1, 5, 100.05)])
+        self.streamer.process()     # Real time is far after. Last bucket gets closed
+        self.assertEqual(self.streamer.get_stream_chunk('conn1'), [(self.entry1, 4, 100.2)])
+
+        self.streamer.clear_decimation('conn1', self.entry1.get_id())
+        self.streamer.publish(self.entry1, 'conn1', 8, timestamp=200)
+        self.assertEqual(self.streamer.get_stream_chunk('conn1'), [(self.entry1, 8, None)])
+
+        with self.assertRaises(ValueError):
+            self.streamer.set_decimation('conn1', self.entry1.get_id(), 'potato', max_rate=10)
+        with self.assertRaises(ValueError):
+            self.streamer.set_decimation('conn1', self.entry1.get_id(), 'lttb', max_rate=0)
+
+    def test_frozen_connection(self):
+        self.streamer.set_decimation('conn1', self.entry1.get_id(), 'lttb', max_rate=10)
+        self.streamer.freeze_connection('conn1')
+        for i in range(30):
+            self.streamer.publish(self.entry1, 'conn1', i, timestamp=100 + i * 0.01)
+        self.assertEqual(self.streamer.get_stream_chunk('conn1'), [])
+        self.streamer.unfreeze_connection('conn1')
+        self.assertGreater(len(self.streamer.get_stream_chunk('conn1')), 0)
+
+        self.streamer.clear_connection('conn1')
+        self.assertEqual(self.streamer.get_stream_chunk('conn1'), [])
+
+
+if __name__ == '__main__':
+    unittest.main()